@@ -0,0 +1,252 @@
+/* broker/bench/backend_bench.c
+   End-to-end comparison of the epoll and io_uring reactor backends.
+   Starts ./brokerd once per backend, connects P publishers and S
+   subscribers (all on bench/+) over loopback and runs lockstep rounds:
+   every publisher sends a burst, then the bench waits until every
+   subscriber has the whole round. Reports delivered messages per second
+   and broker CPU time (summed per-thread schedstat) per delivered message.
+
+   usage: backend_bench [threads] [publishers] [subscribers] [rounds]
+   BENCH_PROTO=v2 makes the publishers use the binary protocol.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PAYLOAD_LEN 32
+#define BURST 64                 /* messages per publisher per round */
+#define WINDOW 2                 /* rounds in flight; keeps a publisher's backlog under the broker inbuf */
+#define FRAME_LEN (4 + PAYLOAD_LEN)
+#define BASE_PORT 5900
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* broker CPU seconds: on-CPU time of every thread from schedstat
+ * (nanoseconds, unlike the tick-sampled utime/stime in /proc/pid/stat) */
+static double proc_cpu(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    double total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char spath[300];
+        snprintf(spath, sizeof(spath), "/proc/%d/task/%s/schedstat", (int)pid, e->d_name);
+        FILE *f = fopen(spath, "r");
+        if (!f) continue;
+        unsigned long long ns = 0;
+        if (fscanf(f, "%llu", &ns) == 1) total += ns / 1e9;
+        fclose(f);
+    }
+    closedir(d);
+    return total;
+}
+
+static int connect_port(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < 100; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+/* send a command line and wait for the one-line reply */
+static int command(int fd, const char *line) {
+    if (write_all(fd, line, strlen(line)) < 0) return -1;
+    char c, reply[64];
+    size_t n = 0;
+    while (read(fd, &c, 1) == 1) {
+        if (c == '\n') {
+            reply[n] = '\0';
+            return strncmp(reply, "OK", 2) == 0 ? 0 : -1;
+        }
+        if (n < sizeof(reply) - 1) reply[n++] = c;
+    }
+    return -1;
+}
+
+static int v2;
+
+static int run(const char *backend, int port, int threads, int npub, int nsub, int rounds) {
+    char port_s[16], threads_s[16];
+    snprintf(port_s, sizeof(port_s), "%d", port);
+    snprintf(threads_s, sizeof(threads_s), "%d", threads);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+        /* BROKERD_ARGS adds options, e.g. "--journal /tmp/j" */
+        char *argv[32] = { "brokerd", "--backend", (char *)backend, "--threads", threads_s };
+        int argc = 5;
+        char *extra = getenv("BROKERD_ARGS");
+        char *save = NULL;
+        for (char *a = extra ? strtok_r(extra, " ", &save) : NULL; a && argc < 30; a = strtok_r(NULL, " ", &save))
+            argv[argc++] = a;
+        argv[argc++] = port_s;
+        argv[argc] = NULL;
+        execv("./brokerd", argv);
+        _exit(127);
+    }
+
+    int ret = -1;
+    int *pubs = calloc((size_t)npub, sizeof(int));
+    int *subs = calloc((size_t)nsub, sizeof(int));
+    long *got = calloc((size_t)nsub, sizeof(long));
+    char *burst = NULL;
+    size_t burst_len = 0;
+    for (int i = 0; i < npub; ++i) pubs[i] = -1;
+    for (int i = 0; i < nsub; ++i) subs[i] = -1;
+
+    for (int i = 0; i < nsub; ++i) {
+        subs[i] = connect_port(port);
+        if (subs[i] < 0 || command(subs[i], "HELLO SUBSCRIBER bench\n") < 0 ||
+            command(subs[i], "SUB bench/+\n") < 0) {
+            fprintf(stderr, "subscriber %d setup failed\n", i);
+            goto out;
+        }
+        fcntl(subs[i], F_SETFL, O_NONBLOCK);
+    }
+    /* v2: alias 1 = bench/p, then 8-byte frame headers */
+    static const unsigned char alias[] = { 1, 0, 0, 1, 0, 0, 0, 7, 'b', 'e', 'n', 'c', 'h', '/', 'p' };
+    for (int i = 0; i < npub; ++i) {
+        pubs[i] = connect_port(port);
+        if (pubs[i] < 0 || command(pubs[i], v2 ? "HELLO PUBLISHER bench V2\n" : "HELLO PUBLISHER bench\n") < 0 ||
+            (v2 && write_all(pubs[i], (const char *)alias, sizeof(alias)) < 0)) {
+            fprintf(stderr, "publisher %d setup failed\n", i);
+            goto out;
+        }
+    }
+
+    /* one burst: BURST frames on the publisher's own topic */
+    char frame[128];
+    char payload[PAYLOAD_LEN];
+    memset(payload, 'x', sizeof(payload));
+    uint32_t be = htonl(PAYLOAD_LEN);
+    int hdr;
+    if (v2) {
+        static const unsigned char pub[] = { 2, 0, 0, 1 };
+        memcpy(frame, pub, sizeof(pub));
+        hdr = (int)sizeof(pub);
+    } else {
+        hdr = snprintf(frame, sizeof(frame), "PUB bench/p %d\n", PAYLOAD_LEN);
+    }
+    memcpy(frame + hdr, &be, 4);
+    memcpy(frame + hdr + 4, payload, PAYLOAD_LEN);
+    size_t flen = (size_t)hdr + 4 + PAYLOAD_LEN;
+    burst_len = flen * BURST;
+    burst = malloc(burst_len);
+    for (int k = 0; k < BURST; ++k) memcpy(burst + k * flen, frame, flen);
+
+    struct pollfd *pfd = calloc((size_t)nsub, sizeof(*pfd));
+    char rbuf[65536];
+    long per_round = (long)npub * BURST * FRAME_LEN;
+    double cpu0 = proc_cpu(pid), t0 = now_s();
+    for (int r = 0; r < rounds + WINDOW; ++r) {
+        if (r < rounds) {
+            for (int i = 0; i < npub; ++i) {
+                if (write_all(pubs[i], burst, burst_len) < 0) { perror("publish"); free(pfd); goto out; }
+            }
+        }
+        int done = r - WINDOW + 1;
+        if (done <= 0) continue;
+        long target = per_round * (done < rounds ? done : rounds);
+        for (;;) {
+            int n = 0;
+            for (int i = 0; i < nsub; ++i) {
+                if (got[i] >= target) continue;
+                pfd[n].fd = subs[i];
+                pfd[n].events = POLLIN;
+                n++;
+            }
+            if (n == 0) break;
+            if (poll(pfd, (nfds_t)n, 5000) <= 0) { fprintf(stderr, "%s: stalled\n", backend); free(pfd); goto out; }
+            for (int i = 0; i < nsub; ++i) {
+                ssize_t k;
+                while ((k = read(subs[i], rbuf, sizeof(rbuf))) > 0) got[i] += k;
+                if (k == 0) { fprintf(stderr, "%s: subscriber closed\n", backend); free(pfd); goto out; }
+            }
+        }
+    }
+    double secs = now_s() - t0;
+    double cpu = proc_cpu(pid) - cpu0;
+    free(pfd);
+
+    double delivered = (double)npub * BURST * rounds * nsub;
+    printf("%-6s %10.0f msg/s %8.2f us cpu/msg %8.2f s cpu\n",
+           backend, delivered / secs, cpu * 1e6 / delivered, cpu);
+    ret = 0;
+
+out:
+    for (int i = 0; i < npub; ++i) if (pubs[i] >= 0) close(pubs[i]);
+    for (int i = 0; i < nsub; ++i) if (subs[i] >= 0) close(subs[i]);
+    free(pubs); free(subs); free(got); free(burst);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 1;
+    int npub = argc > 2 ? atoi(argv[2]) : 4;
+    int nsub = argc > 3 ? atoi(argv[3]) : 16;
+    int rounds = argc > 4 ? atoi(argv[4]) : 2000;
+    if (threads < 1 || npub < 1 || nsub < 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [threads] [publishers] [subscribers] [rounds]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    const char *proto = getenv("BENCH_PROTO");
+    v2 = proto && strcmp(proto, "v2") == 0;
+    printf("%d thread(s), %d publishers, %d subscribers, %d messages each%s\n",
+           threads, npub, nsub, BURST * rounds, v2 ? ", protocol v2" : "");
+    int rc = 0;
+    if (run("epoll", BASE_PORT, threads, npub, nsub, rounds) < 0) rc = 1;
+    if (run("uring", BASE_PORT + 1, threads, npub, nsub, rounds) < 0) rc = 1;
+    return rc;
+}
@@ -0,0 +1,163 @@
+/* broker/bench/idle_bench.c
+   Resident memory of idle connections. Starts ./brokerd (or, with
+   "gateway", ./brokerd plus ../gateway/gatewayd), opens N connections
+   that each send HELLO and then stay silent, and reports the daemon's
+   RSS before and after, per connection.
+
+   usage: idle_bench [connections] [broker|gateway]
+
+   Both ends need an fd per connection: the soft RLIMIT_NOFILE is raised
+   to the hard one and inherited by the daemons. Connections spread over
+   source addresses 127.0.0.x so 100k fit in the ephemeral port range.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BROKER_PORT 5000             /* gatewayd connects here */
+#define GATEWAY_PORT 6000
+#define CONNS_PER_ADDR 20000         /* per source address, under the ephemeral range */
+#define STEP 500                     /* connections opened before waiting for their OKs */
+
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+static pid_t spawn(const char *path, char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+        execv(path, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_from(int port, uint32_t src) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(src);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { close(fd); return -1; }
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+/* wait for the daemon to listen on port */
+static int wait_port(int port) {
+    for (int i = 0; i < 100; ++i) {
+        int fd = connect_from(port, INADDR_LOOPBACK);
+        if (fd >= 0) { close(fd); return 0; }
+        usleep(20000);
+    }
+    return -1;
+}
+
+/* read the "OK" line of every fd in [from, to) */
+static int wait_ok(int *fds, int from, int to) {
+    for (int i = from; i < to; ++i) {
+        struct pollfd p = { .fd = fds[i], .events = POLLIN };
+        char buf[16];
+        if (poll(&p, 1, 5000) <= 0) return -1;
+        ssize_t n = read(fds[i], buf, sizeof(buf));
+        if (n < 3 || memcmp(buf, "OK", 2) != 0) return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int gateway = argc > 2 && strcmp(argv[2], "gateway") == 0;
+    if (n < 1 || (argc > 2 && !gateway && strcmp(argv[2], "broker") != 0)) {
+        fprintf(stderr, "usage: %s [connections] [broker|gateway]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)n + 64 > rl.rlim_cur) {
+        n = (int)rl.rlim_cur - 64;
+        fprintf(stderr, "RLIMIT_NOFILE is %llu: opening %d connections\n", (unsigned long long)rl.rlim_cur, n);
+    }
+
+    char port_s[16];
+    snprintf(port_s, sizeof(port_s), "%d", BROKER_PORT);
+    char *bargv[] = { "brokerd", port_s, NULL };
+    char *gargv[] = { "gatewayd", NULL };
+    pid_t broker = spawn("./brokerd", bargv), gw = -1, target = broker;
+    int port = BROKER_PORT, rc = 1;
+    int *fds = calloc((size_t)n, sizeof(int));
+    int opened = 0;
+    if (wait_port(BROKER_PORT) < 0) { fprintf(stderr, "brokerd did not start\n"); goto out; }
+    if (gateway) {
+        gw = spawn("../gateway/gatewayd", gargv);
+        target = gw;
+        port = GATEWAY_PORT;
+        if (wait_port(GATEWAY_PORT) < 0) { fprintf(stderr, "gatewayd did not start\n"); goto out; }
+    }
+    usleep(200000);
+    long before = rss_kb(target);
+
+    char hello[64];
+    while (opened < n) {
+        int first = opened, step = opened + STEP < n ? opened + STEP : n;
+        for (int i = first; i < step; ++i) {
+            uint32_t src = INADDR_LOOPBACK + 1 + (uint32_t)(i / CONNS_PER_ADDR);
+            fds[i] = connect_from(port, src);
+            int len = snprintf(hello, sizeof(hello), "HELLO PUBLISHER idle-%d\n", i);
+            if (fds[i] < 0 || write(fds[i], hello, (size_t)len) != len) {
+                fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+                if (fds[i] >= 0) close(fds[i]);
+                goto out;
+            }
+            opened = i + 1;
+        }
+        if (wait_ok(fds, first, step) < 0) {
+            fprintf(stderr, "no OK by connection %d\n", step);
+            goto out;
+        }
+    }
+    sleep(1);
+    long after = rss_kb(target);
+    printf("%s: %d idle connections, RSS %ld kB -> %ld kB, %.0f bytes per connection\n",
+           gateway ? "gatewayd" : "brokerd", n, before, after, (after - before) * 1024.0 / n);
+    rc = 0;
+
+out:
+    for (int i = 0; i < opened; ++i) close(fds[i]);
+    free(fds);
+    if (gw > 0) { kill(gw, SIGINT); waitpid(gw, NULL, 0); }
+    kill(broker, SIGTERM);
+    waitpid(broker, NULL, 0);
+    return rc;
+}
@@ -0,0 +1,435 @@
+/* broker/bench/shm_bench.c
+   Shared-memory ring readers against TCP subscribers, same broker.
+   Starts ./brokerd --shm and measures:
+   - latency: a publisher sends one PUB at a time over TCP; reports p50/p99
+     from the PUB to a TCP subscriber and to a ring reader, the reader
+     either spinning (next PUB right after the previous arrived) or asleep
+     on the futex (PUBs 1 ms apart). For the ring, also from the broker's
+     write to the reader's copy.
+   - fan-out cost: one publisher, 1 and N consumers of each kind, lockstep
+     rounds like backend_bench; reports delivered messages per second and
+     broker CPU time per published message.
+
+   usage: shm_bench [readers] [rounds] [pings]
+*/
+#define _GNU_SOURCE
+#include "../src/shmring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PAYLOAD_LEN 32
+#define BURST 64                 /* messages per round */
+#define WINDOW 2                 /* rounds in flight */
+#define FRAME_LEN (4 + PAYLOAD_LEN)
+#define PORT 5911
+
+static char shm_name[64];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double now_s(void) {
+    return now_ns() / 1e9;
+}
+
+/* broker CPU seconds summed over its threads (schedstat, nanoseconds) */
+static double proc_cpu(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    double total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char spath[300];
+        snprintf(spath, sizeof(spath), "/proc/%d/task/%s/schedstat", (int)pid, e->d_name);
+        FILE *f = fopen(spath, "r");
+        if (!f) continue;
+        unsigned long long ns = 0;
+        if (fscanf(f, "%llu", &ns) == 1) total += ns / 1e9;
+        fclose(f);
+    }
+    closedir(d);
+    return total;
+}
+
+/* retried while the broker starts */
+static int connect_broker(void) {
+    for (int i = 0; i < 100; ++i) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+static struct shm_reader *open_reader(void) {
+    for (int i = 0; i < 100; ++i) {
+        struct shm_reader *r = shm_reader_open(shm_name);
+        if (r) return r;
+        usleep(20000);
+    }
+    return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t r = read(fd, buf, len);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+/* send a command line and wait for the one-line reply */
+static int command(int fd, const char *line) {
+    if (write_all(fd, line, strlen(line)) < 0) return -1;
+    char c, reply[64];
+    size_t n = 0;
+    while (read(fd, &c, 1) == 1) {
+        if (c == '\n') {
+            reply[n] = '\0';
+            return strncmp(reply, "OK", 2) == 0 ? 0 : -1;
+        }
+        if (n < sizeof(reply) - 1) reply[n++] = c;
+    }
+    return -1;
+}
+
+static int subscriber(void) {
+    int fd = connect_broker();
+    if (fd < 0 || command(fd, "HELLO SUBSCRIBER bench\n") < 0 || command(fd, "SUB bench/+\n") < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int publisher(void) {
+    int fd = connect_broker();
+    if (fd < 0 || command(fd, "HELLO PUBLISHER bench\n") < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* "PUB bench/p 32\n" + frame; returns its length */
+static size_t build_frame(char *frame, size_t cap) {
+    int hdr = snprintf(frame, cap, "PUB bench/p %d\n", PAYLOAD_LEN);
+    uint32_t be = htonl(PAYLOAD_LEN);
+    memcpy(frame + hdr, &be, 4);
+    memset(frame + hdr + 4, 'x', PAYLOAD_LEN);
+    return (size_t)hdr + 4 + PAYLOAD_LEN;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, const char *what, uint64_t *v, int n) {
+    qsort(v, (size_t)n, sizeof(*v), cmp_u64);
+    printf("%-12s %-10s p50 %7.2f us   p99 %7.2f us\n", name, what,
+           v[n / 2] / 1e3, v[(size_t)n * 99 / 100] / 1e3);
+}
+
+static int latency_tcp(int pings) {
+    int ret = -1;
+    int sub = subscriber(), pub = publisher();
+    uint64_t *rtt = calloc((size_t)pings, sizeof(*rtt));
+    if (sub < 0 || pub < 0 || !rtt) { fprintf(stderr, "tcp: latency setup failed\n"); goto out; }
+    char frame[128], in[FRAME_LEN];
+    size_t flen = build_frame(frame, sizeof(frame));
+    for (int i = 0; i < pings; ++i) {
+        uint64_t t0 = now_ns();
+        if (write_all(pub, frame, flen) < 0 || read_all(sub, in, FRAME_LEN) < 0) {
+            fprintf(stderr, "tcp: latency run broke off\n");
+            goto out;
+        }
+        rtt[i] = now_ns() - t0;
+    }
+    report("tcp", "pub->recv", rtt, pings);
+    ret = 0;
+out:
+    if (sub >= 0) close(sub);
+    if (pub >= 0) close(pub);
+    free(rtt);
+    return ret;
+}
+
+/* the reader runs on its own thread so that, with gap_us, it is asleep
+ * on the futex when the next message lands */
+struct lat_reader {
+    struct shm_reader *r;
+    int pings;
+    uint64_t sent_ns;            /* when the current PUB was written */
+    uint64_t *e2e, *ring;
+    int got;
+};
+
+static void *lat_reader_loop(void *p) {
+    struct lat_reader *lr = p;
+    struct shm_msg m;
+    while (lr->got < lr->pings) {
+        int k = shm_reader_next(lr->r, &m, 5000);
+        if (k <= 0) break;
+        uint64_t t = now_ns();
+        lr->e2e[lr->got] = t - __atomic_load_n(&lr->sent_ns, __ATOMIC_ACQUIRE);
+        lr->ring[lr->got] = t - m.ts_ns;
+        __atomic_store_n(&lr->got, lr->got + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int latency_shm(const char *name, int pings, int gap_us) {
+    int ret = -1;
+    struct lat_reader lr = { .pings = pings };
+    int pub = publisher();
+    lr.r = open_reader();
+    lr.e2e = calloc((size_t)pings, sizeof(uint64_t));
+    lr.ring = calloc((size_t)pings, sizeof(uint64_t));
+    pthread_t tid;
+    int started = 0;
+    if (pub < 0 || !lr.r || !lr.e2e || !lr.ring) { fprintf(stderr, "%s: latency setup failed\n", name); goto out; }
+    if (pthread_create(&tid, NULL, lat_reader_loop, &lr) != 0) goto out;
+    started = 1;
+    char frame[128];
+    size_t flen = build_frame(frame, sizeof(frame));
+    for (int i = 0; i < pings; ++i) {
+        __atomic_store_n(&lr.sent_ns, now_ns(), __ATOMIC_RELEASE);
+        if (write_all(pub, frame, flen) < 0) { fprintf(stderr, "%s: publish failed\n", name); goto out; }
+        uint64_t t0 = now_ns();
+        while (__atomic_load_n(&lr.got, __ATOMIC_ACQUIRE) <= i) {
+            if (now_ns() - t0 > 5000000000ull) { fprintf(stderr, "%s: reader stalled\n", name); goto out; }
+            sched_yield();
+        }
+        if (gap_us) usleep((useconds_t)gap_us);
+    }
+    report(name, "pub->recv", lr.e2e, pings);
+    report(name, "ring->recv", lr.ring, pings);
+    ret = 0;
+out:
+    if (pub >= 0) close(pub);
+    if (started) pthread_join(tid, NULL);
+    shm_reader_close(lr.r);
+    free(lr.e2e);
+    free(lr.ring);
+    return ret;
+}
+
+struct count_reader {
+    struct shm_reader *r;
+    long seen;                   /* messages read plus messages lost */
+    int stop;
+    pthread_t tid;
+};
+
+static void *count_reader_loop(void *p) {
+    struct count_reader *cr = p;
+    struct shm_msg m;
+    long got = 0;
+    while (!__atomic_load_n(&cr->stop, __ATOMIC_RELAXED)) {
+        int k = shm_reader_next(cr->r, &m, 100);
+        if (k < 0) break;
+        if (k == 0) continue;
+        got++;
+        __atomic_store_n(&cr->seen, got + (long)shm_reader_lost(cr->r), __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void print_fanout(const char *name, int n, int rounds, double secs, double cpu) {
+    double published = (double)BURST * rounds;
+    printf("%-5s x%-4d %10.0f msg/s delivered %8.3f us broker cpu/published msg\n", name, n,
+           published * n / secs, cpu * 1e6 / published);
+}
+
+static int fanout_shm(pid_t pid, int n, int rounds) {
+    int ret = -1, started = 0;
+    struct count_reader *cr = calloc((size_t)n, sizeof(*cr));
+    int pub = publisher();
+    char *burst = NULL;
+    if (!cr || pub < 0) { fprintf(stderr, "shm: fan-out setup failed\n"); goto out; }
+    for (; started < n; ++started) {
+        if (!(cr[started].r = open_reader())) { fprintf(stderr, "shm: reader %d: %s\n", started, strerror(errno)); goto out; }
+        if (pthread_create(&cr[started].tid, NULL, count_reader_loop, &cr[started]) != 0) {
+            shm_reader_close(cr[started].r);
+            goto out;
+        }
+    }
+    char frame[128];
+    size_t flen = build_frame(frame, sizeof(frame));
+    size_t burst_len = flen * BURST;
+    burst = malloc(burst_len);
+    for (int k = 0; k < BURST; ++k) memcpy(burst + k * flen, frame, flen);
+
+    double cpu0 = proc_cpu(pid), t0 = now_s();
+    for (int r = 0; r < rounds + WINDOW; ++r) {
+        if (r < rounds && write_all(pub, burst, burst_len) < 0) { perror("publish"); goto out; }
+        int done = r - WINDOW + 1;
+        if (done <= 0) continue;
+        long target = (long)BURST * (done < rounds ? done : rounds);
+        double t_wait = now_s();
+        for (int i = 0; i < n; ++i) {
+            while (__atomic_load_n(&cr[i].seen, __ATOMIC_ACQUIRE) < target) {
+                if (now_s() - t_wait > 5) { fprintf(stderr, "shm: stalled\n"); goto out; }
+                sched_yield();
+            }
+        }
+    }
+    double secs = now_s() - t0;
+    double cpu = proc_cpu(pid) - cpu0;
+    uint64_t lost = 0;
+    for (int i = 0; i < n; ++i) lost += shm_reader_lost(cr[i].r);
+    print_fanout("shm", n, rounds, secs, cpu);
+    if (lost) printf("      %llu messages lost to overruns\n", (unsigned long long)lost);
+    ret = 0;
+out:
+    for (int i = 0; i < started; ++i) {
+        __atomic_store_n(&cr[i].stop, 1, __ATOMIC_RELAXED);
+        pthread_join(cr[i].tid, NULL);
+        shm_reader_close(cr[i].r);
+    }
+    if (pub >= 0) close(pub);
+    free(cr);
+    free(burst);
+    return ret;
+}
+
+static int fanout_tcp(pid_t pid, int n, int rounds) {
+    int ret = -1;
+    int *subs = calloc((size_t)n, sizeof(int));
+    long *got = calloc((size_t)n, sizeof(long));
+    struct pollfd *pfd = calloc((size_t)n, sizeof(*pfd));
+    int pub = -1;
+    char *burst = NULL;
+    for (int i = 0; i < n; ++i) subs[i] = -1;
+    for (int i = 0; i < n; ++i) {
+        if ((subs[i] = subscriber()) < 0) { fprintf(stderr, "tcp: subscriber %d setup failed\n", i); goto out; }
+        fcntl(subs[i], F_SETFL, O_NONBLOCK);
+    }
+    if ((pub = publisher()) < 0) { fprintf(stderr, "tcp: publisher setup failed\n"); goto out; }
+    char frame[128];
+    size_t flen = build_frame(frame, sizeof(frame));
+    size_t burst_len = flen * BURST;
+    burst = malloc(burst_len);
+    for (int k = 0; k < BURST; ++k) memcpy(burst + k * flen, frame, flen);
+
+    char rbuf[65536];
+    double cpu0 = proc_cpu(pid), t0 = now_s();
+    for (int r = 0; r < rounds + WINDOW; ++r) {
+        if (r < rounds && write_all(pub, burst, burst_len) < 0) { perror("publish"); goto out; }
+        int done = r - WINDOW + 1;
+        if (done <= 0) continue;
+        long target = (long)BURST * FRAME_LEN * (done < rounds ? done : rounds);
+        for (;;) {
+            int k = 0;
+            for (int i = 0; i < n; ++i) {
+                if (got[i] >= target) continue;
+                pfd[k].fd = subs[i];
+                pfd[k].events = POLLIN;
+                k++;
+            }
+            if (k == 0) break;
+            if (poll(pfd, (nfds_t)k, 5000) <= 0) { fprintf(stderr, "tcp: stalled\n"); goto out; }
+            for (int i = 0; i < n; ++i) {
+                ssize_t m;
+                while ((m = read(subs[i], rbuf, sizeof(rbuf))) > 0) got[i] += m;
+                if (m == 0) { fprintf(stderr, "tcp: subscriber closed\n"); goto out; }
+            }
+        }
+    }
+    double secs = now_s() - t0;
+    print_fanout("tcp", n, rounds, secs, proc_cpu(pid) - cpu0);
+    ret = 0;
+out:
+    for (int i = 0; i < n; ++i) if (subs[i] >= 0) close(subs[i]);
+    if (pub >= 0) close(pub);
+    free(subs); free(got); free(pfd); free(burst);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int readers = argc > 1 ? atoi(argv[1]) : 16;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    int pings = argc > 3 ? atoi(argv[3]) : 20000;
+    if (readers < 1 || rounds < 1 || pings < 1) {
+        fprintf(stderr, "usage: %s [readers] [rounds] [pings]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(shm_name, sizeof(shm_name), "tinyiot-bench-%d", (int)getpid());
+
+    char port_s[16];
+    snprintf(port_s, sizeof(port_s), "%d", PORT);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 1; }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+        execl("./brokerd", "brokerd", "--shm", shm_name, port_s, (char *)NULL);
+        _exit(127);
+    }
+
+    printf("1 thread, %d consumers, %d messages, %d pings\n", readers, BURST * rounds, pings);
+    int rc = 0;
+    if (latency_tcp(pings) < 0) rc = 1;
+    if (latency_shm("shm spinning", pings, 0) < 0) rc = 1;
+    if (latency_shm("shm asleep", pings / 10 ? pings / 10 : 1, 1000) < 0) rc = 1;
+    if (fanout_tcp(pid, 1, rounds) < 0) rc = 1;
+    if (fanout_tcp(pid, readers, rounds) < 0) rc = 1;
+    if (fanout_shm(pid, 1, rounds) < 0) rc = 1;
+    if (fanout_shm(pid, readers, rounds) < 0) rc = 1;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return rc;
+}
@@ -0,0 +1,77 @@
+/* broker/bench/topic_bench.c
+   Micro-benchmark for the topic index: publish lookup and disconnect cost
+   as the number of distinct topics grows. Each simulated device owns one
+   topic; a dashboard connection holds a fixed number of subscriptions.
+   Both columns should stay flat as the topic count increases.
+*/
+#define _GNU_SOURCE
+#include "../src/topics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOOKUPS 1000000
+#define DISCONNECTS 10000
+#define DASH_SUBS 16
+
+/* stand-in connection handles: the index only stores and compares them */
+static struct conn *fake_conn(intptr_t id) {
+    return (struct conn *)(id + 1);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void topic_name(char *buf, size_t len, int i) {
+    snprintf(buf, len, "sensors/site%d/node%d/environment", i % 97, i);
+}
+
+static void run(int ntopics) {
+    struct sub_node **devs = calloc((size_t)ntopics, sizeof(*devs));
+    char name[128];
+    for (int i = 0; i < ntopics; ++i) {
+        topic_name(name, sizeof(name), i);
+        topic_subscribe(name, NULL, fake_conn(i), 0, &devs[i]);
+    }
+
+    /* publish path: topic lookup + walk of its subscriber list */
+    unsigned int seed = 12345;
+    volatile unsigned long sink = 0;
+    double t0 = now_ns();
+    for (int i = 0; i < LOOKUPS; ++i) {
+        topic_name(name, sizeof(name), rand_r(&seed) % ntopics);
+        struct topic_entry *t = topic_find(name);
+        for (struct sub_node *n = t->subs; n; n = n->tnext) sink += (unsigned long)(uintptr_t)n->c;
+    }
+    double pub_ns = (now_ns() - t0) / LOOKUPS;
+
+    /* disconnect path: a dashboard subscribes to DASH_SUBS topics and leaves */
+    double dis_ns = 0;
+    for (int i = 0; i < DISCONNECTS; ++i) {
+        struct sub_node *dash = NULL;
+        for (int k = 0; k < DASH_SUBS; ++k) {
+            topic_name(name, sizeof(name), rand_r(&seed) % ntopics);
+            topic_subscribe(name, NULL, fake_conn(-2), 0, &dash);
+        }
+        double d0 = now_ns();
+        topic_unsubscribe_all(&dash);
+        dis_ns += now_ns() - d0;
+    }
+    dis_ns /= DISCONNECTS;
+
+    printf("%10d %14.1f %18.1f\n", ntopics, pub_ns, dis_ns);
+    for (int i = 0; i < ntopics; ++i) topic_unsubscribe_all(&devs[i]);
+    free(devs);
+}
+
+int main(void) {
+    printf("%10s %14s %18s\n", "topics", "publish ns/op", "disconnect ns/op");
+    int sizes[] = { 1000, 10000, 50000, 100000, 200000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) run(sizes[i]);
+    return 0;
+}
@@ -0,0 +1,296 @@
+/* broker/bench/transport_bench.c
+   Loopback TCP against the --unix socket, same broker, same protocol.
+   Starts ./brokerd listening on both and measures, once per transport:
+   - latency: one publisher and one subscriber in lockstep, a PUB is sent
+     only after the previous one arrived; reports p50/p99 round trip.
+   - throughput: P publishers and S subscribers (all on bench/+) running
+     lockstep rounds like backend_bench; reports delivered messages per
+     second and broker CPU time per delivered message.
+
+   usage: transport_bench [threads] [publishers] [subscribers] [rounds] [pings]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PAYLOAD_LEN 32
+#define BURST 64                 /* messages per publisher per round */
+#define WINDOW 2                 /* rounds in flight */
+#define FRAME_LEN (4 + PAYLOAD_LEN)
+#define PORT 5910
+
+static char sock_path[108];
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* broker CPU seconds summed over its threads (schedstat, nanoseconds) */
+static double proc_cpu(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    double total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char spath[300];
+        snprintf(spath, sizeof(spath), "/proc/%d/task/%s/schedstat", (int)pid, e->d_name);
+        FILE *f = fopen(spath, "r");
+        if (!f) continue;
+        unsigned long long ns = 0;
+        if (fscanf(f, "%llu", &ns) == 1) total += ns / 1e9;
+        fclose(f);
+    }
+    closedir(d);
+    return total;
+}
+
+/* a connection over the transport under test, retried while the broker starts */
+static int connect_to(int use_unix) {
+    for (int i = 0; i < 100; ++i) {
+        int fd;
+        int r;
+        if (use_unix) {
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, sock_path);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) return -1;
+            r = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        } else {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(PORT);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0) return -1;
+            r = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+            int one = 1;
+            if (r == 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (r == 0) return fd;
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t r = read(fd, buf, len);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+/* send a command line and wait for the one-line reply */
+static int command(int fd, const char *line) {
+    if (write_all(fd, line, strlen(line)) < 0) return -1;
+    char c, reply[64];
+    size_t n = 0;
+    while (read(fd, &c, 1) == 1) {
+        if (c == '\n') {
+            reply[n] = '\0';
+            return strncmp(reply, "OK", 2) == 0 ? 0 : -1;
+        }
+        if (n < sizeof(reply) - 1) reply[n++] = c;
+    }
+    return -1;
+}
+
+static int subscriber(int use_unix) {
+    int fd = connect_to(use_unix);
+    if (fd < 0 || command(fd, "HELLO SUBSCRIBER bench\n") < 0 || command(fd, "SUB bench/+\n") < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int publisher(int use_unix) {
+    int fd = connect_to(use_unix);
+    if (fd < 0 || command(fd, "HELLO PUBLISHER bench\n") < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* "PUB bench/p 32\n" + frame; returns its length */
+static size_t build_frame(char *frame, size_t cap) {
+    int hdr = snprintf(frame, cap, "PUB bench/p %d\n", PAYLOAD_LEN);
+    uint32_t be = htonl(PAYLOAD_LEN);
+    memcpy(frame + hdr, &be, 4);
+    memset(frame + hdr + 4, 'x', PAYLOAD_LEN);
+    return (size_t)hdr + 4 + PAYLOAD_LEN;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run_latency(const char *name, int use_unix, int pings) {
+    int ret = -1;
+    int sub = subscriber(use_unix), pub = publisher(use_unix);
+    double *rtt = calloc((size_t)pings, sizeof(double));
+    if (sub < 0 || pub < 0 || !rtt) { fprintf(stderr, "%s: latency setup failed\n", name); goto out; }
+    char frame[128], in[FRAME_LEN];
+    size_t flen = build_frame(frame, sizeof(frame));
+    for (int i = 0; i < pings; ++i) {
+        double t0 = now_s();
+        if (write_all(pub, frame, flen) < 0 || read_all(sub, in, FRAME_LEN) < 0) {
+            fprintf(stderr, "%s: latency run broke off\n", name);
+            goto out;
+        }
+        rtt[i] = now_s() - t0;
+    }
+    qsort(rtt, (size_t)pings, sizeof(double), cmp_double);
+    printf("%-5s latency    p50 %7.1f us   p99 %7.1f us\n", name,
+           rtt[pings / 2] * 1e6, rtt[(size_t)pings * 99 / 100] * 1e6);
+    ret = 0;
+out:
+    if (sub >= 0) close(sub);
+    if (pub >= 0) close(pub);
+    free(rtt);
+    return ret;
+}
+
+static int run_throughput(const char *name, int use_unix, pid_t pid, int npub, int nsub, int rounds) {
+    int ret = -1;
+    int *pubs = calloc((size_t)npub, sizeof(int));
+    int *subs = calloc((size_t)nsub, sizeof(int));
+    long *got = calloc((size_t)nsub, sizeof(long));
+    struct pollfd *pfd = calloc((size_t)nsub, sizeof(*pfd));
+    char *burst = NULL;
+    for (int i = 0; i < npub; ++i) pubs[i] = -1;
+    for (int i = 0; i < nsub; ++i) subs[i] = -1;
+    for (int i = 0; i < nsub; ++i) {
+        if ((subs[i] = subscriber(use_unix)) < 0) { fprintf(stderr, "%s: subscriber %d setup failed\n", name, i); goto out; }
+        fcntl(subs[i], F_SETFL, O_NONBLOCK);
+    }
+    for (int i = 0; i < npub; ++i) {
+        if ((pubs[i] = publisher(use_unix)) < 0) { fprintf(stderr, "%s: publisher %d setup failed\n", name, i); goto out; }
+    }
+    char frame[128];
+    size_t flen = build_frame(frame, sizeof(frame));
+    size_t burst_len = flen * BURST;
+    burst = malloc(burst_len);
+    for (int k = 0; k < BURST; ++k) memcpy(burst + k * flen, frame, flen);
+
+    char rbuf[65536];
+    long per_round = (long)npub * BURST * FRAME_LEN;
+    double cpu0 = proc_cpu(pid), t0 = now_s();
+    for (int r = 0; r < rounds + WINDOW; ++r) {
+        if (r < rounds) {
+            for (int i = 0; i < npub; ++i) {
+                if (write_all(pubs[i], burst, burst_len) < 0) { perror("publish"); goto out; }
+            }
+        }
+        int done = r - WINDOW + 1;
+        if (done <= 0) continue;
+        long target = per_round * (done < rounds ? done : rounds);
+        for (;;) {
+            int n = 0;
+            for (int i = 0; i < nsub; ++i) {
+                if (got[i] >= target) continue;
+                pfd[n].fd = subs[i];
+                pfd[n].events = POLLIN;
+                n++;
+            }
+            if (n == 0) break;
+            if (poll(pfd, (nfds_t)n, 5000) <= 0) { fprintf(stderr, "%s: stalled\n", name); goto out; }
+            for (int i = 0; i < nsub; ++i) {
+                ssize_t k;
+                while ((k = read(subs[i], rbuf, sizeof(rbuf))) > 0) got[i] += k;
+                if (k == 0) { fprintf(stderr, "%s: subscriber closed\n", name); goto out; }
+            }
+        }
+    }
+    double secs = now_s() - t0;
+    double cpu = proc_cpu(pid) - cpu0;
+    double delivered = (double)npub * BURST * rounds * nsub;
+    printf("%-5s throughput %10.0f msg/s %8.2f us cpu/msg\n", name, delivered / secs, cpu * 1e6 / delivered);
+    ret = 0;
+out:
+    for (int i = 0; i < npub; ++i) if (pubs[i] >= 0) close(pubs[i]);
+    for (int i = 0; i < nsub; ++i) if (subs[i] >= 0) close(subs[i]);
+    free(pubs); free(subs); free(got); free(pfd); free(burst);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 1;
+    int npub = argc > 2 ? atoi(argv[2]) : 4;
+    int nsub = argc > 3 ? atoi(argv[3]) : 16;
+    int rounds = argc > 4 ? atoi(argv[4]) : 2000;
+    int pings = argc > 5 ? atoi(argv[5]) : 20000;
+    if (threads < 1 || npub < 1 || nsub < 1 || rounds < 1 || pings < 1) {
+        fprintf(stderr, "usage: %s [threads] [publishers] [subscribers] [rounds] [pings]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(sock_path, sizeof(sock_path), "/tmp/tinyiot-bench-%d.sock", (int)getpid());
+
+    char port_s[16], threads_s[16];
+    snprintf(port_s, sizeof(port_s), "%d", PORT);
+    snprintf(threads_s, sizeof(threads_s), "%d", threads);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 1; }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+        execl("./brokerd", "brokerd", "--threads", threads_s, "--unix", sock_path, port_s, (char *)NULL);
+        _exit(127);
+    }
+
+    printf("%d thread(s), %d publishers, %d subscribers, %d messages each, %d pings\n",
+           threads, npub, nsub, BURST * rounds, pings);
+    int rc = 0;
+    if (run_latency("tcp", 0, pings) < 0) rc = 1;
+    if (run_latency("unix", 1, pings) < 0) rc = 1;
+    if (run_throughput("tcp", 0, pid, npub, nsub, rounds) < 0) rc = 1;
+    if (run_throughput("unix", 1, pid, npub, nsub, rounds) < 0) rc = 1;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return rc;
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "bridge.h"
+#include "proto.h"
+#include "conn.h"
+#include "reactor.h"
+#include "topics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+char bridge_node[64];
+
+/* CONNECTING: the dialed conn exists but has not said HELLO PEER yet;
+ * the reactor backend drives its connect like any other write */
+enum peer_state { PEER_IDLE = 0, PEER_CONNECTING, PEER_LINKED };
+
+/* a --peer entry; only reactor 0 touches these */
+struct peer {
+    char spec[128];              /* as given, for logs */
+    struct sockaddr_in addr;
+    enum peer_state state;
+    int off;                     /* it is ourselves: never dial again */
+    int fd;                      /* dialed conn, -1 while idle */
+    uint64_t gen;                /* its generation */
+    uint64_t at_ms;              /* IDLE: next dial; else when this state began */
+    unsigned int backoff_ms;
+    char node[64];               /* its node id once known, "" before */
+};
+
+static struct peer peers[BRIDGE_MAX_PEERS];
+static int npeers;
+
+/* established links in both directions; the SUB/UNSUB path of every
+ * reactor reads them to advertise interest changes */
+struct link {
+    char node[64];
+    struct reactor *owner;
+    int fd;
+    uint64_t gen;
+};
+
+static struct link links[BRIDGE_MAX_LINKS];
+static size_t nlinks;
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bridge_set_node(const char *name, int port) {
+    if (name) {
+        snprintf(bridge_node, sizeof(bridge_node), "%s", name);
+        return;
+    }
+    char host[48];
+    if (gethostname(host, sizeof(host)) < 0) strcpy(host, "brokerd");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(bridge_node, sizeof(bridge_node), "%s:%d", host, port);
+}
+
+int bridge_add_peer(const char *spec) {
+    if (npeers == BRIDGE_MAX_PEERS) return -1;
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || !colon[1] || strlen(spec) >= sizeof(peers[0].spec)) return -1;
+    char host[128];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || !res) return -1;
+    struct peer *p = &peers[npeers++];
+    memset(p, 0, sizeof(*p));
+    strcpy(p->spec, spec);
+    memcpy(&p->addr, res->ai_addr, sizeof(p->addr));
+    freeaddrinfo(res);
+    p->fd = -1;
+    p->backoff_ms = BRIDGE_RETRY_MS;
+    return 0;
+}
+
+struct msg *bridge_interest_msg(const char *filter, int on) {
+    const char *verb = on ? "SUB " : "UNSUB ";
+    size_t vl = strlen(verb), fl = strlen(filter);
+    struct msg *m = msg_new((uint32_t)(vl + fl + 1));
+    if (!m) return NULL;
+    memcpy(m->data, verb, vl);
+    memcpy(m->data + vl, filter, fl);
+    m->data[vl + fl] = '\n';
+    m->reply = 1;
+    return m;
+}
+
+struct msg *bridge_frame(const char *topic, const char *payload, uint32_t len) {
+    char hdr[TINY_MAX_LINE];
+    int hn = snprintf(hdr, sizeof(hdr), "PUB %s %u\n", topic, len);
+    if (hn < 0 || (size_t)hn >= sizeof(hdr)) return NULL;
+    struct msg *m = msg_new((uint32_t)hn + (uint32_t)sizeof(uint32_t) + len);
+    if (!m) return NULL;
+    uint32_t be = htonl(len);
+    memcpy(m->data, hdr, (size_t)hn);
+    memcpy(m->data + hn, &be, sizeof(be));
+    memcpy(m->data + hn + sizeof(be), payload, len);
+    return m;
+}
+
+/* topic_interest hook: tell every link, in the order changes happen
+ * (the caller holds the index write lock) */
+static void interest_changed(const struct topic_entry *t, int on) {
+    pthread_mutex_lock(&link_lock);
+    if (nlinks) {
+        struct msg *m = bridge_interest_msg(t->topic, on);
+        if (m) {
+            for (size_t i = 0; i < nlinks; ++i) conn_send_ctl(links[i].owner, links[i].fd, links[i].gen, m);
+            msg_unref(m);
+        } else {
+            log_warn("bridge: OOM advertising %s", t->topic);
+        }
+    }
+    pthread_mutex_unlock(&link_lock);
+}
+
+void bridge_init(void) {
+    topic_interest = interest_changed;
+}
+
+size_t bridge_links(void) {
+    pthread_mutex_lock(&link_lock);
+    size_t n = nlinks;
+    pthread_mutex_unlock(&link_lock);
+    return n;
+}
+
+static int node_linked(const char *node) {
+    int found = 0;
+    pthread_mutex_lock(&link_lock);
+    for (size_t i = 0; i < nlinks && !found; ++i) found = strcmp(links[i].node, node) == 0;
+    pthread_mutex_unlock(&link_lock);
+    return found;
+}
+
+/* the --peer entry c was dialed for, NULL for a link it accepted */
+static struct peer *peer_of(const struct conn *c) {
+    if (c->owner != &reactors[0]) return NULL;
+    for (int i = 0; i < npeers; ++i) {
+        struct peer *p = &peers[i];
+        if (p->state != PEER_IDLE && p->fd == c->fd && p->gen == c->gen) return p;
+    }
+    return NULL;
+}
+
+int bridge_link_up(struct conn *c, const char *node, char *err, size_t errlen) {
+    if (strcmp(node, bridge_node) == 0) {
+        snprintf(err, errlen, "LOOP");
+        return -1;
+    }
+    pthread_mutex_lock(&link_lock);
+    for (size_t i = 0; i < nlinks; ++i) {
+        if (strcmp(links[i].node, node) == 0) {
+            pthread_mutex_unlock(&link_lock);
+            snprintf(err, errlen, "DUPLICATE %s", bridge_node);
+            return -1;
+        }
+    }
+    if (nlinks == BRIDGE_MAX_LINKS) {
+        pthread_mutex_unlock(&link_lock);
+        snprintf(err, errlen, "FULL");
+        return -1;
+    }
+    struct link *l = &links[nlinks++];
+    snprintf(l->node, sizeof(l->node), "%s", node);
+    l->owner = c->owner;
+    l->fd = c->fd;
+    l->gen = c->gen;
+    pthread_mutex_unlock(&link_lock);
+    struct peer *p = peer_of(c);
+    if (p) {
+        snprintf(p->node, sizeof(p->node), "%s", node);
+        p->backoff_ms = BRIDGE_RETRY_MS;
+        p->state = PEER_LINKED;
+        p->at_ms = wheel_clock_ms();
+    }
+    log_info("bridge: linked with %s on fd=%d (%s)", node, c->fd, p ? "dialed" : "accepted");
+    return 0;
+}
+
+void bridge_link_down(struct conn *c) {
+    pthread_mutex_lock(&link_lock);
+    for (size_t i = 0; i < nlinks; ++i) {
+        struct link *l = &links[i];
+        if (l->owner != c->owner || l->fd != c->fd || l->gen != c->gen) continue;
+        log_info("bridge: link with %s down", l->node);
+        *l = links[--nlinks];
+        break;
+    }
+    pthread_mutex_unlock(&link_lock);
+}
+
+void bridge_refused(struct conn *c, const char *why, const char *node) {
+    struct peer *p = peer_of(c);
+    log_warn("bridge: %s refused the link: %s", p ? p->spec : "peer", why);
+    if (!p) return;
+    if (strcmp(why, "LOOP") == 0) {
+        log_error("bridge: --peer %s is this broker, not dialing it again", p->spec);
+        p->off = 1;
+    } else if (strcmp(why, "DUPLICATE") == 0 && node) {
+        /* it dialed us first: wait while that link lasts */
+        snprintf(p->node, sizeof(p->node), "%s", node);
+    }
+}
+
+static void peer_retry(struct peer *p, uint64_t now) {
+    p->state = PEER_IDLE;
+    p->fd = -1;
+    p->at_ms = now + p->backoff_ms;
+    p->backoff_ms = p->backoff_ms * 2 > BRIDGE_RETRY_MAX_MS ? BRIDGE_RETRY_MAX_MS : p->backoff_ms * 2;
+}
+
+static void peer_dial(struct peer *p, uint64_t now) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_warn("bridge: socket: %s", strerror(errno));
+        peer_retry(p, now);
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&p->addr, sizeof(p->addr)) < 0 && errno != EINPROGRESS) {
+        log_warn("bridge: connect %s: %s", p->spec, strerror(errno));
+        close(fd);
+        peer_retry(p, now);
+        return;
+    }
+    /* our HELLO PEER is queued at once and goes out when the connect
+     * completes; a failed connect closes the conn like any error */
+    struct conn *c = conn_dialed(fd, p->spec);
+    if (!c) {
+        peer_retry(p, now);
+        return;
+    }
+    p->fd = fd;
+    p->gen = c->gen;
+    p->state = PEER_CONNECTING;
+    p->at_ms = now;
+}
+
+void bridge_tick(void) {
+    if (!npeers) return;
+    uint64_t now = wheel_clock_ms();
+    for (int i = 0; i < npeers; ++i) {
+        struct peer *p = &peers[i];
+        switch (p->state) {
+        case PEER_IDLE:
+            if (p->off || now < p->at_ms) break;
+            if (p->node[0] && node_linked(p->node)) {
+                p->at_ms = now + BRIDGE_RETRY_MAX_MS;
+                break;
+            }
+            peer_dial(p, now);
+            break;
+        case PEER_CONNECTING: {
+            struct conn *c = conn_lookup(p->fd);
+            if (!c || c->gen != p->gen) {
+                log_warn("bridge: dialing %s failed, retrying in %u ms", p->spec, p->backoff_ms);
+                peer_retry(p, now);
+            } else if (now - p->at_ms >= BRIDGE_CONNECT_MS) {
+                log_warn("bridge: dialing %s: timed out", p->spec);
+                close_connection(p->fd);
+                peer_retry(p, now);
+            }
+            break;
+        }
+        case PEER_LINKED: {
+            struct conn *c = conn_lookup(p->fd);
+            if (c && c->gen == p->gen) break;
+            /* a link that held for a while starts over with short waits */
+            if (now - p->at_ms > BRIDGE_RETRY_MAX_MS) p->backoff_ms = BRIDGE_RETRY_MS;
+            log_info("bridge: connection to %s closed, redialing in %u ms", p->spec, p->backoff_ms);
+            peer_retry(p, now);
+            break;
+        }
+        }
+    }
+}
+
+int bridge_timeout_ms(int max_ms) {
+    if (!npeers) return max_ms;
+    uint64_t now = wheel_clock_ms();
+    int ms = max_ms;
+    for (int i = 0; i < npeers; ++i) {
+        const struct peer *p = &peers[i];
+        uint64_t due;
+        if (p->state == PEER_IDLE && !p->off) due = p->at_ms;
+        else if (p->state == PEER_CONNECTING) due = p->at_ms + BRIDGE_CONNECT_MS;
+        else continue;
+        uint64_t wait = due > now ? due - now : 0;
+        if (wait < (uint64_t)ms) ms = (int)wait;
+    }
+    return ms;
+}
@@ -0,0 +1,78 @@
+#ifndef TINYIOT_BRIDGE_H
+#define TINYIOT_BRIDGE_H
+
+#include "msg.h"
+#include <stdint.h>
+
+struct conn;
+struct topic_entry;
+
+/* Broker-to-broker bridging.
+ *
+ * brokerd started with --peer HOST:PORT dials that broker (from reactor
+ * 0, redialing with backoff) and both sides say "HELLO PEER <node>". A
+ * link is one ordinary connection carrying, in both directions, plain
+ * text commands: "SUB <filter>" / "UNSUB <filter>" when a broker gets
+ * its first local subscriber to a topic or filter or loses its last one
+ * (the whole set is sent when the link comes up), and "PUB <topic> <len>"
+ * for every message published locally that the other side has interest
+ * in. The peer's subscriptions sit in the topic index like any other, so
+ * forwarding is one more target of the fan-out, framed once per message
+ * and written with the rest of the link's queue in one writev.
+ *
+ * Loops are impossible by construction (split horizon): only local
+ * subscriptions are advertised, and a message that arrived over a link
+ * is delivered to local subscribers only, never to another link. Every
+ * message crosses at most one link, so brokers that need each other's
+ * traffic must peer directly (full mesh, or a star around the broker
+ * that aggregates). A node may link to another only once and never to
+ * itself; both ends send keepalive PINGs.
+ */
+
+#define BRIDGE_MAX_PEERS 32          /* --peer entries */
+#define BRIDGE_MAX_LINKS 256         /* established links, both directions */
+#define BRIDGE_KEEPALIVE 15          /* seconds of silence before a PING */
+#define BRIDGE_RETRY_MS 500          /* first redial delay, doubled up to ... */
+#define BRIDGE_RETRY_MAX_MS 30000
+#define BRIDGE_CONNECT_MS 5000       /* give up on a dial not linked by then */
+
+/* this broker's node id, "<hostname>:<port>" unless --node sets it */
+extern char bridge_node[64];
+
+void bridge_set_node(const char *name, int port);
+
+/* add a peer to dial, "host:port". Before the reactors start.
+ * 0 ok, -1 unresolvable or too many peers */
+int bridge_add_peer(const char *spec);
+
+/* install the interest hook; peers or not, other brokers may dial us */
+void bridge_init(void);
+
+/* reactor 0: start due dials, time out stuck ones, notice lost links */
+void bridge_tick(void);
+
+/* reactor 0: time until the next dial or dial timeout, at most max_ms */
+int bridge_timeout_ms(int max_ms);
+
+/* c said HELLO PEER node. Registers the link; the caller holds the topic
+ * index read lock so no interest change slips between this and the
+ * snapshot it sends. 0 ok, -1 refused with the reason in err (for
+ * "ERR <reason>") */
+int bridge_link_up(struct conn *c, const char *node, char *err, size_t errlen);
+
+/* c, a registered link, is going away */
+void bridge_link_down(struct conn *c);
+
+/* the other side of c refused the link ("ERR <why> [<node>]") */
+void bridge_refused(struct conn *c, const char *why, const char *node);
+
+/* "PUB <topic> <len>\n" + 4-byte BE len + payload, the frame a link
+ * carries; refcnt 1 */
+struct msg *bridge_frame(const char *topic, const char *payload, uint32_t len);
+
+/* "SUB <filter>\n" or "UNSUB <filter>\n", a control message never shed */
+struct msg *bridge_interest_msg(const char *filter, int on);
+
+size_t bridge_links(void);
+
+#endif
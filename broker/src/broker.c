@@ -1,7 +1,22 @@
 /* broker/src/broker.c  -- versión con buffers de salida y EPOLLOUT handling */
 #define _GNU_SOURCE
 #include "proto.h"
+#include "msg.h"
+#include "topics.h"
+#include "jfilter.h"
+#include "retain.h"
+#include "journal.h"
+#include "qos.h"
+#include "bridge.h"
+#include "shmring.h"
+#include "conn.h"
+#include "inbuf.h"
+#include "reactor.h"
+#include "uring.h"
+#include "log.h"
+#include "stats.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,54 +25,90 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
 
-/* epoll_fd definido en main.c */
-extern int epoll_fd;
+/* topic index is shared by all reactors: PUB matching takes the read
+ * lock, SUB/UNSUB/disconnect take the write lock */
+static pthread_rwlock_t topic_lock;
 
-/* Roles */
-typedef enum { ROLE_UNKNOWN=0, ROLE_PUBLISHER, ROLE_GATEWAY, ROLE_SUBSCRIBER } role_t;
+static uint64_t next_conn_gen = 0;
 
-/* Connection state machine */
-typedef enum { S_AWAIT_LINE = 0, S_AWAIT_LEN, S_AWAIT_PAYLOAD } conn_state_t;
+/* a batch of deliveries of one message to connections of one reactor */
+struct delivery {
+    struct mb_node node;
+    struct msg *m;
+    unsigned int count;
+    struct { int fd; uint64_t gen; } to[];
+};
 
-struct conn {
-    int fd;
-    role_t role;
-    int authenticated;
-    char node_id[64];
-
-    /* input buffer */
-    char inbuf[16384];
-    size_t inbuf_len;
-
-    /* state for incoming PUB */
-    conn_state_t state;
-    uint32_t expected_len;       /* payload length */
-    char *payload_buf;           /* allocated expected_len+1 */
-    uint32_t payload_received;   /* bytes received so far into payload_buf */
-    char current_topic[256];
-
-    /* OUTPUT buffer: queue pending data to send to this conn */
-    char *outbuf;                /* allocated buffer */
-    size_t outbuf_len;           /* total bytes in outbuf */
-    size_t outbuf_sent;          /* bytes already sent */
+int broker_init(void) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    /* a steady PUB stream must not starve SUB/UNSUB */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int r = pthread_rwlock_init(&topic_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (r != 0) { log_error("pthread_rwlock_init failed"); return -1; }
+    bridge_init();
+    return 0;
+}
+
+static void conn_unmark_dirty(struct conn *c);
+static void conn_qos_detach(struct conn *c);
+static void conn_timer_want(struct conn *c, uint32_t tick);
+
+struct conn_timeouts timeouts = {
+    .idle = 0,
+    .frame = 30,
+    .send = 60,
 };
 
-/* fd_map global (visible to main.c as extern) */
-struct conn *fd_map[MAX_FD_LIMIT];
+struct flow_limits flow = {
+    .high = 1024 * 1024,
+    .low = 512 * 1024,
+    .budget = 256 * 1024 * 1024,
+    .policy = SLOW_DROP_OLDEST,
+};
 
-/* Simple topic -> subscribers list (exact match) */
-struct sub_node { int fd; struct sub_node *next; };
-struct topic_entry { char *topic; struct sub_node *subs; struct topic_entry *next; };
-static struct topic_entry *topics = NULL;
+static const char *const policy_names[] = {
+    [SLOW_DISCONNECT] = "disconnect",
+    [SLOW_DROP_NEWEST] = "drop-newest",
+    [SLOW_DROP_OLDEST] = "drop-oldest",
+};
+
+int slow_policy_parse(const char *s) {
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); ++i)
+        if (strcmp(s, policy_names[i]) == 0) return i;
+    return -1;
+}
+
+const char *slow_policy_name(enum slow_policy p) {
+    return policy_names[p];
+}
+
+enum share_policy share_policy = SHARE_ROUND_ROBIN;
+
+int share_policy_parse(const char *s) {
+    if (strcmp(s, "round-robin") == 0) return SHARE_ROUND_ROBIN;
+    if (strcmp(s, "least-queued") == 0) return SHARE_LEAST_QUEUED;
+    return -1;
+}
 
 /* helpers */
 struct conn *conn_create(int fd) {
-    struct conn *c = calloc(1, sizeof(*c));
+    struct conn *c = slab_alloc(&cur_reactor->conn_slab);
     if (!c) return NULL;
+    if (fdtab_set(&cur_reactor->conns, fd, c) < 0) {
+        slab_free(&cur_reactor->conn_slab, c);
+        return NULL;
+    }
     c->fd = fd;
+    c->owner = cur_reactor;
+    c->gen = __atomic_add_fetch(&next_conn_gen, 1, __ATOMIC_RELAXED);
     c->role = ROLE_UNKNOWN;
     c->authenticated = 0;
     c->inbuf_len = 0;
@@ -65,309 +116,1277 @@ struct conn *conn_create(int fd) {
     c->expected_len = 0;
     c->payload_buf = NULL;
     c->payload_received = 0;
-    c->current_topic[0] = '\0';
-    c->outbuf = NULL;
-    c->outbuf_len = 0;
-    c->outbuf_sent = 0;
-    if (fd >= 0 && fd < MAX_FD_LIMIT) fd_map[fd] = c;
+    c->current_topic = NULL;
+    c->subs = NULL;
+    c->policy = flow.policy;
+    c->outq.acct = &cur_reactor->queued_bytes;
+    c->last_in = cur_reactor->wheel.now;
+    if (timeouts.idle) conn_timer_want(c, c->last_in + wheel_ticks_s(timeouts.idle));
+    metric_gauge_add(stats.connections, 1);
     return c;
 }
 
 void conn_destroy(struct conn *c) {
     if (!c) return;
+    conn_unmark_dirty(c);
+    timer_del(&c->owner->wheel, &c->timer);
+    if (c->dropped) log_info("fd=%d dropped %llu messages as a slow consumer", c->fd, (unsigned long long)c->dropped);
     if (c->payload_buf) free(c->payload_buf);
-    if (c->outbuf) free(c->outbuf);
-    int fd = c->fd;
-    if (fd >= 0 && fd < MAX_FD_LIMIT) fd_map[fd] = NULL;
-    free(c);
+    if (c->inbuf) inbuf_put(c->inbuf);
+    free(c->node_id);
+    free(c->replay);
+    for (unsigned int i = 0; i < c->nalias; ++i) free(c->alias[i]);
+    free(c->alias);
+    if (c->qos) conn_qos_detach(c);
+    outq_clear(&c->outq);
+    struct reactor *r = c->owner;
+    fdtab_set(&r->conns, c->fd, NULL);
+    metric_gauge_add(stats.connections, -1);
+    slab_free(&r->conn_slab, c);
 }
 
-/* epoll modify helper: set/unset EPOLLOUT on a given fd based on want_out */
-static int epoll_modify_events(int fd, int want_out) {
+/* every epoll_ctl on a client fd goes through here so the per-message
+ * cost can be checked (epoll_ctl / messages_out stays near 0 when
+ * subscribers keep up) */
+static int conn_epoll_ctl(int op, int fd, uint32_t events) {
     struct epoll_event ev;
     ev.data.fd = fd;
-    ev.events = EPOLLIN;
-    if (want_out) ev.events |= EPOLLOUT;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-        if (errno == ENOENT) {
-            /* maybe fd not previously registered: add it */
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-                perror("epoll_ctl ADD in epoll_modify_events");
-                return -1;
-            }
-            return 0;
-        }
-        perror("epoll_ctl MOD in epoll_modify_events");
+    ev.events = events;
+    metric_inc(stats.epoll_ctl);
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+/* add/remove EPOLLOUT only when the interest actually changes */
+static int conn_set_out(struct conn *c, int want_out) {
+    if (c->out_armed == want_out) return 0;
+    if (conn_epoll_ctl(EPOLL_CTL_MOD, c->fd, want_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN) == -1) {
+        log_error("epoll_ctl MOD fd=%d: %s", c->fd, strerror(errno));
         return -1;
     }
+    c->out_armed = want_out;
     return 0;
 }
 
-/* Queue data to connection's outbuf. Returns 0 success, -1 error (close connection) */
-static int conn_queue_out(struct conn *c, const char *data, size_t len) {
-    if (!c || len == 0) return 0;
-    size_t need = c->outbuf_len - c->outbuf_sent + len;
-    /* We store only the remaining bytes (not the already-sent prefix) */
-    size_t remaining = c->outbuf_len - c->outbuf_sent;
-    char *newbuf = malloc(remaining + len);
-    if (!newbuf) return -1;
-    /* copy remaining unsent data */
-    if (remaining > 0) memcpy(newbuf, c->outbuf + c->outbuf_sent, remaining);
-    /* append new data */
-    memcpy(newbuf + remaining, data, len);
-    /* free old buffer and replace */
-    if (c->outbuf) free(c->outbuf);
-    c->outbuf = newbuf;
-    c->outbuf_len = remaining + len;
-    c->outbuf_sent = 0;
-    /* ensure EPOLLOUT is enabled for this fd */
-    if (epoll_modify_events(c->fd, 1) < 0) {
-        return -1;
+void conn_mark_dirty(struct conn *c) {
+    /* with EPOLLOUT armed the writable event flushes it anyway; an
+     * evicted conn still needs the flush pass to be closed */
+    if (c->dirty || c->closing || (c->out_armed && !c->evicted)) return;
+    struct reactor *r = c->owner;
+    c->dirty = 1;
+    c->dirty_prev = NULL;
+    c->dirty_next = r->dirty;
+    if (r->dirty) r->dirty->dirty_prev = c;
+    r->dirty = c;
+}
+
+static void conn_unmark_dirty(struct conn *c) {
+    if (!c->dirty) return;
+    if (c->dirty_prev) c->dirty_prev->dirty_next = c->dirty_next;
+    else c->owner->dirty = c->dirty_next;
+    if (c->dirty_next) c->dirty_next->dirty_prev = c->dirty_prev;
+    c->dirty = 0;
+    c->dirty_prev = c->dirty_next = NULL;
+}
+
+struct conn *conn_next_dirty(struct reactor *r) {
+    struct conn *c = r->dirty;
+    if (c) conn_unmark_dirty(c);
+    return c;
+}
+
+static size_t queued_bytes_total(void) {
+    size_t total = 0;
+    for (int i = 0; i < nreactors; ++i)
+        total += __atomic_load_n(&reactors[i].queued_bytes, __ATOMIC_RELAXED);
+    return total;
+}
+
+/* bytes held for c: its outq, or every unacked message under QoS 1 */
+static size_t conn_held(const struct conn *c) {
+    return c->qos ? c->qos->bytes : c->outq.bytes;
+}
+
+/* Byte limit c is held to right now, 0 when add more bytes simply fit.
+ * The global sum is only read once c is past its fair share, so conns
+ * that keep up never touch the other reactors' counters. */
+static size_t conn_limit(struct conn *c, size_t add) {
+    size_t held = conn_held(c);
+    size_t need = held + add;
+    if (c->congested && held <= flow.low) c->congested = 0;
+    if (!c->congested && need > flow.high) {
+        c->congested = 1;
+        log_warn("fd=%d slow consumer: %zu bytes queued, %s", c->fd, held, slow_policy_name(c->policy));
+    }
+    if (c->congested) return flow.high;
+    if (flow.budget) {
+        int64_t n = (int64_t)metric_value(stats.connections);
+        size_t share = flow.budget / (size_t)(n > 0 ? n : 1);
+        if (need > share && queued_bytes_total() + add > flow.budget) return share;
+    }
+    return 0;
+}
+
+static void conn_count_drop(struct conn *c, size_t len) {
+    c->dropped++;
+    metric_inc(stats.dropped_msgs);
+    metric_add(stats.dropped_bytes, len);
+}
+
+/* apply c's slow-consumer policy so that m fits in limit bytes.
+ * Returns 1 when m must not be queued. */
+static int conn_shed(struct conn *c, struct msg *m, size_t limit) {
+    switch (c->policy) {
+    case SLOW_DISCONNECT:
+        /* closed from the flush pass: c may be the publisher itself */
+        c->evicted = 1;
+        metric_inc(stats.slow_disconnects);
+        conn_mark_dirty(c);
+        return 1;
+    case SLOW_DROP_OLDEST:
+        while (conn_held(c) + m->len > limit) {
+            size_t n = c->qos ? qos_drop_oldest(c->qos) : outq_drop_oldest(&c->outq);
+            if (!n) break;
+            conn_count_drop(c, n);
+        }
+        if (conn_held(c) + m->len <= limit) return 0;
+        /* what is left is already being written */
+        /* fall through */
+    case SLOW_DROP_NEWEST:
+    default:
+        conn_count_drop(c, m->len);
+        return 1;
+    }
+}
+
+/* Queue a message reference on the connection. Returns 0 success, -1 error (close connection) */
+static int conn_queue_msg(struct conn *c, struct msg *m) {
+    if (!c || !m) return 0;
+    if (outq_push(&c->outq, m) < 0) return -1;
+    metric_inc(stats.msgs_out);
+    /* written at the end of this loop iteration, together with anything
+     * else queued for c meanwhile */
+    conn_mark_dirty(c);
+    return 0;
+}
+
+/* Control replies (OK, ERR, PONG, PUBACK) take the same path as data:
+ * queued behind what is pending, written by the loop's flush, and packed
+ * together, so a client pipelining 500 SUBs gets its OKs in one writev.
+ * A client that keeps asking without reading is cut off once its queue
+ * passes twice flow.high. */
+static void conn_reply(struct conn *c, const char *fmt, ...) {
+    char text[TINY_MAX_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n < 0 || c->evicted) return;
+    if ((size_t)n >= sizeof(text)) n = (int)sizeof(text) - 1;
+    if (outq_push_reply(&c->outq, text, (size_t)n) < 0 || c->outq.bytes > 2 * flow.high) {
+        log_warn("fd=%d not reading its replies (%zu bytes queued)", c->fd, c->outq.bytes);
+        c->evicted = 1;
+    }
+    conn_mark_dirty(c);
+}
+
+/* QoS 1: write unacked entries until the window is full. Each goes out
+ * as a 4-byte BE packet id followed by the shared frame. */
+static void qos_send_more(struct conn *c) {
+    struct qos_session *s = c->qos;
+    unsigned int n = 0;
+    while (s->sent < s->count && s->sent < qos_limits.window) {
+        struct qos_entry *e = qos_at(s, s->sent);
+        struct msg *h = msg_new(sizeof(uint32_t));
+        if (!h) break;
+        uint32_t be = htonl(e->id);
+        memcpy(h->data, &be, sizeof(be));
+        int r = outq_push(&c->outq, h);
+        msg_unref(h);
+        if (r == 0) r = outq_push(&c->outq, e->m);
+        if (r < 0) {
+            /* half a packet may be queued: the stream is unusable */
+            c->evicted = 1;
+            conn_mark_dirty(c);
+            return;
+        }
+        if (s->sent == 0) s->sent_us = metrics_now_us();
+        s->sent++;
+        n++;
+    }
+    if (n) {
+        metric_add(stats.msgs_out, n);
+        conn_mark_dirty(c);
+    }
+}
+
+/* QOS 1: pick up the node's parked session, if any, and resend what it
+ * still holds */
+static int conn_qos_attach(struct conn *c) {
+    struct qos_session *s = qos_claim(c->node_id);
+    if (!s && !(s = qos_session_new(c->node_id))) return -1;
+    struct reactor *r = cur_reactor;
+    s->c = c;
+    s->prev = NULL;
+    s->next = r->qos_list;
+    if (r->qos_list) r->qos_list->prev = s;
+    r->qos_list = s;
+    __atomic_store_n(&c->qos, s, __ATOMIC_RELEASE);
+    if (s->count) {
+        log_info("fd=%d QoS 1 session of %s resumed, %u unacked", c->fd, c->node_id, s->count);
+        metric_add(stats.qos_redelivered, s->sent);
+        s->sent = 0;
+        qos_send_more(c);
+    }
+    return 0;
+}
+
+static void conn_qos_detach(struct conn *c) {
+    struct qos_session *s = c->qos;
+    struct reactor *r = c->owner;
+    if (s->prev) s->prev->next = s->next; else r->qos_list = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+    __atomic_store_n(&c->qos, NULL, __ATOMIC_RELEASE);
+    if (s->count) qos_park(s);
+    else qos_session_free(s);
+}
+
+/* arm c's timer to fire by tick at the latest */
+static void conn_timer_want(struct conn *c, uint32_t tick) {
+    struct timer *t = &c->timer;
+    if (c->closing) return;
+    if (!timer_pending(t) || tick_before(tick, t->expires))
+        timer_set(&c->owner->wheel, t, tick);
+}
+
+static uint32_t earliest(uint32_t best, uint32_t at) {
+    return (!best || tick_before(at, best)) ? at : best;
+}
+
+/* c's timer fired: enforce the deadline that passed, if any, and re-arm
+ * for the earliest one left. Activity only moves stamps, so the timer
+ * often fires early and just goes back on the wheel. */
+static void conn_timer_fire(struct wheel *w, struct timer *t) {
+    struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+    uint32_t now = w->now, next = 0, at;
+    const char *why = NULL;
+    if (c->closing) return;
+    if (timeouts.frame && c->frame_since) {
+        at = c->frame_since + wheel_ticks_s(timeouts.frame);
+        if (!tick_before(now, at)) why = "frame incomplete";
+        next = earliest(next, at);
+    }
+    if (timeouts.send && c->stall_since && !outq_empty(&c->outq)) {
+        at = c->stall_since + wheel_ticks_s(timeouts.send);
+        if (!tick_before(now, at)) why = "output stalled";
+        next = earliest(next, at);
+    }
+    if (timeouts.idle) {
+        at = c->last_in + wheel_ticks_s(timeouts.idle);
+        if (!tick_before(now, at)) why = "idle";
+        next = earliest(next, at);
+    }
+    if (c->keepalive) {
+        uint32_t k = wheel_ticks_s(c->keepalive);
+        if (!tick_before(now, c->last_in + 2 * k)) {
+            why = "no answer to PING";
+        } else if (!tick_before(now, c->last_in + k)) {
+            if (!c->pinged) {
+                c->pinged = 1;
+                metric_inc(stats.pings);
+                conn_reply(c, "PING\n");
+            }
+            next = earliest(next, c->last_in + 2 * k);
+        } else {
+            next = earliest(next, c->last_in + k);
+        }
+    }
+    if (why) {
+        log_info("fd=%d timed out: %s", c->fd, why);
+        metric_inc(stats.timeouts);
+        close_connection(c->fd);
+        return;
     }
+    if (next) timer_set(w, t, next);
+}
+
+void conn_timers_init(struct wheel *w) {
+    wheel_init(w, conn_timer_fire);
+}
+
+void conn_output_blocked(struct conn *c, int progress) {
+    if (c->stall_since && !progress) return;
+    c->stall_since = c->owner->wheel.now;
+    if (timeouts.send) conn_timer_want(c, c->stall_since + wheel_ticks_s(timeouts.send));
+}
+
+int broker_timeout_ms(void) {
+    struct reactor *r = cur_reactor;
+    /* QoS 1 resends are looked at every 100 ms */
+    int ms = wheel_timeout_ms(&r->wheel, r->qos_list ? 100 : 1000);
+    /* peers are dialed from reactor 0 */
+    return r == &reactors[0] ? bridge_timeout_ms(ms) : ms;
+}
+
+void broker_tick(void) {
+    struct reactor *r = cur_reactor;
+    wheel_advance(&r->wheel);
+    if (r == &reactors[0]) {
+        bridge_tick();
+        /* without it a session nobody parks or claims after never expires */
+        qos_expire();
+    }
+    if (!r->qos_list) return;
+    uint64_t now = metrics_now_us();
+    if (now - r->tick_us < 100000) return;
+    r->tick_us = now;
+    uint64_t timeout = (uint64_t)qos_limits.timeout_ms * 1000u;
+    for (struct qos_session *s = r->qos_list; s; s = s->next) {
+        struct conn *c = s->c;
+        /* only once every copy reached the socket: no duplicate bursts
+         * behind a slow reader */
+        if (!s->sent || !outq_empty(&c->outq) || now - s->sent_us < timeout) continue;
+        log_debug("fd=%d QoS 1 resending %u unacked", c->fd, s->sent);
+        metric_add(stats.qos_redelivered, s->sent);
+        s->sent = 0;
+        qos_send_more(c);
+    }
+}
+
+/* queue concatenated frames (retained snapshot, replay batch); a QoS 1
+ * subscriber needs each frame as its own message to give it an id */
+static int conn_queue_batch(struct conn *c, struct msg *m) {
+    if (!c->qos) return conn_queue_msg(c, m);
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= m->len) {
+        uint32_t be;
+        memcpy(&be, m->data + pos, sizeof(be));
+        uint32_t flen = (uint32_t)sizeof(be) + ntohl(be);
+        struct msg *f = msg_new(flen);
+        if (!f) return -1;
+        memcpy(f->data, m->data + pos, flen);
+        int r = qos_push(c->qos, f);
+        msg_unref(f);
+        if (r < 0) return -1;
+        pos += flen;
+    }
+    qos_send_more(c);
     return 0;
 }
 
-/* Try to flush outbuf to socket. Returns:
+/* SUB <filter> FROM <offset>: journal records matching filter are streamed
+ * from cur, a batch whenever the conn's queue runs low. Live copies of
+ * matching messages are skipped while active (the cursor will reach
+ * them) and, once it caught up at live_from, for anything older. */
+struct replay {
+    struct journal_cursor cur;
+    int active;
+    uint64_t live_from;
+    char filter[];
+};
+
+#define REPLAY_BATCH (64 * 1024)         /* frame bytes per queued batch */
+#define REPLAY_SCAN (4 * 1024 * 1024)    /* records walked per refill */
+
+/* 1 when m reaches c through its replay rather than live */
+static int replay_covers(const struct conn *c, const struct msg *m) {
+    const struct replay *rp = c->replay;
+    if (!rp || !m->topic || m->seq == JOURNAL_NONE) return 0;
+    if (!rp->active && m->seq >= rp->live_from) return 0;
+    return topic_filter_match(rp->filter, m->topic);
+}
+
+/* queue the next batch of history for c; the whole batch is one message */
+static void replay_pump(struct conn *c) {
+    struct replay *rp = c->replay;
+    if (!rp || !rp->active || c->closing || c->evicted || conn_held(c) >= flow.low) return;
+    uint64_t end = journal_end();
+    struct msg *m = msg_new(REPLAY_BATCH + sizeof(uint32_t) + TINY_MAX_PAYLOAD);
+    if (!m) return;
+    size_t used = 0, scanned = 0;
+    unsigned int n = 0;
+    struct journal_rec r;
+    char topic[TINY_MAX_LINE];
+    journal_read_begin();
+    while (used < REPLAY_BATCH && scanned < REPLAY_SCAN && journal_next(&rp->cur, end, &r)) {
+        scanned += r.len + r.topic_len;
+        if (r.topic_len >= sizeof(topic)) continue;
+        memcpy(topic, r.topic, r.topic_len);
+        topic[r.topic_len] = '\0';
+        if (!topic_filter_match(rp->filter, topic)) continue;
+        uint32_t be = htonl(r.len);
+        memcpy(m->data + used, &be, sizeof(be));
+        memcpy(m->data + used + sizeof(be), r.payload, r.len);
+        used += sizeof(be) + r.len;
+        n++;
+    }
+    journal_read_end();
+    if (rp->cur.offset >= end) {
+        rp->active = 0;
+        rp->live_from = end;
+        log_info("fd=%d replay caught up at offset %llu", c->fd, (unsigned long long)end);
+    }
+    if (used) {
+        m->len = (uint32_t)used;
+        metric_add(stats.replayed, n);
+        if (conn_queue_batch(c, m) < 0) log_warn("fd=%d replay batch dropped (queue failed)", c->fd);
+    } else if (rp->active) {
+        /* nothing matched in this stretch, keep walking next iteration */
+        conn_mark_dirty(c);
+    }
+    msg_unref(m);
+}
+
+void conn_output_drained(struct conn *c) {
+    c->stall_since = 0;
+    if (c->replay && c->replay->active) replay_pump(c);
+}
+
+/* Try to flush the output queue to socket. Returns:
  *   0 -> flushed fully (no pending)
  *   1 -> still pending (would block)
  *  -1 -> fatal error (close)
  */
 int flush_outbuf(int fd) {
-    if (fd < 0 || fd >= MAX_FD_LIMIT) return -1;
-    struct conn *c = fd_map[fd];
+    struct conn *c = conn_lookup(fd);
     if (!c) return -1;
-    if (!c->outbuf || c->outbuf_sent >= c->outbuf_len) {
-        /* nothing to send: ensure EPOLLOUT cleared */
-        c->outbuf_len = 0;
-        c->outbuf_sent = 0;
-        if (c->outbuf) { free(c->outbuf); c->outbuf = NULL; }
-        epoll_modify_events(fd, 0);
-        return 0;
+    size_t before = c->outq.bytes;
+    if (before) metric_observe(stats.outq_bytes, before);
+    int r = outq_flush(&c->outq, fd);
+    if (r < 0) {
+        log_error("write fd=%d: %s", fd, strerror(errno));
+        return -1;
     }
-    size_t to_send = c->outbuf_len - c->outbuf_sent;
-    ssize_t w = write(fd, c->outbuf + c->outbuf_sent, to_send);
-    if (w < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* socket not ready now */
-            epoll_modify_events(fd, 1);
-            return 1;
+    /* EPOLLOUT stays armed only while the socket is full */
+    if (conn_set_out(c, r == 1) < 0) return -1;
+    if (r == 0) conn_output_drained(c);
+    else conn_output_blocked(c, c->outq.bytes < before);
+    return r;
+}
+
+/* write out every conn that got output this iteration; EPOLLOUT is armed
+ * only for the ones whose socket filled up */
+void flush_dirty(void) {
+    struct conn *c;
+    while ((c = conn_next_dirty(cur_reactor)) != NULL) {
+        if (c->evicted) {
+            log_warn("fd=%d disconnected as a slow consumer", c->fd);
+            close_connection(c->fd);
+        } else if (flush_outbuf(c->fd) < 0) {
+            close_connection(c->fd);
         }
-        if (errno == EINTR) return 1;
-        perror("write in flush_outbuf");
-        return -1;
     }
-    c->outbuf_sent += (size_t)w;
-    if (c->outbuf_sent >= c->outbuf_len) {
-        /* all sent */
-        free(c->outbuf);
-        c->outbuf = NULL;
-        c->outbuf_len = 0;
-        c->outbuf_sent = 0;
-        /* remove EPOLLOUT interest */
-        epoll_modify_events(fd, 0);
+}
+
+/* subscriber collected while holding topic_lock */
+struct target {
+    struct conn *c;
+    struct reactor *owner;
+    int fd;
+    int peer;                    /* a bridge link: gets the PUB frame */
+    uint64_t gen;
+};
+
+/* per-thread scratch for publish_to_topic */
+struct publish_ctx {
+    struct target *v;
+    size_t n, cap;
+    int entries;                 /* matching topic/filter entries */
+    int from_peer;               /* routing a PUB that came over a link */
+    const char *payload;         /* of the PUB being routed, for WHERE */
+    uint32_t len;
+    int oom;
+};
+static __thread struct publish_ctx pub_scratch;
+
+static int collect_node(struct publish_ctx *pc, const struct sub_node *n) {
+    if (pc->n == pc->cap) {
+        size_t ncap = pc->cap ? pc->cap * 2 : 64;
+        struct target *nv = realloc(pc->v, ncap * sizeof(*nv));
+        if (!nv) { pc->oom = 1; return -1; }
+        pc->v = nv;
+        pc->cap = ncap;
+    }
+    /* owner/fd/gen never change after conn_create, and the conn cannot
+     * be destroyed while its subscription is visible under the lock */
+    struct target *tg = &pc->v[pc->n++];
+    tg->c = n->c;
+    tg->owner = n->c->owner;
+    tg->fd = n->c->fd;
+    tg->peer = n->remote;
+    tg->gen = n->c->gen;
+    return 0;
+}
+
+/* conn_held for a member owned by another reactor; topic_lock held, so
+ * its QoS session is not freed under us (see the QOS 0 command) */
+static size_t conn_held_shared(const struct conn *c) {
+    const struct qos_session *s = __atomic_load_n(&c->qos, __ATOMIC_ACQUIRE);
+    if (s) return __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    return __atomic_load_n(&c->outq.bytes, __ATOMIC_RELAXED);
+}
+
+/* the member of g that gets the next message. Runs under the read lock
+ * on several reactors at once: the cursor is atomic and queue sizes of
+ * other reactors' conns are a racy but harmless hint. */
+static const struct sub_node *share_pick(struct share_group *g) {
+    uint32_t start = __atomic_fetch_add(&g->rr, 1, __ATOMIC_RELAXED) % g->n;
+    if (share_policy == SHARE_ROUND_ROBIN) return g->members[start];
+    const struct sub_node *best = NULL;
+    size_t least = 0;
+    for (uint32_t k = 0; k < g->n; ++k) {
+        const struct sub_node *n = g->members[(start + k) % g->n];
+        size_t q = conn_held_shared(n->c);
+        if (!best || q < least) {
+            best = n;
+            least = q;
+            if (!q) break;
+        }
+    }
+    return best;
+}
+
+static void collect_entry(struct topic_entry *t, void *arg) {
+    struct publish_ctx *pc = arg;
+    pc->entries++;
+    for (struct sub_node *n = t->subs; n; n = n->tnext) {
+        /* split horizon: what a peer sent never goes to another peer */
+        if (n->remote && pc->from_peer) continue;
+        if (collect_node(pc, n) < 0) return;
+    }
+    /* one member of every group sharing this filter; counted as entries
+     * of their own so a member also subscribed plainly gets one copy */
+    for (struct share_group *g = t->groups; g; g = g->next) {
+        pc->entries++;
+        if (collect_node(pc, share_pick(g)) < 0) return;
+    }
+    /* a WHERE is evaluated once for all the connections that gave it;
+     * also its own entry, since they may hold the filter plainly too */
+    for (struct content_filter *w = t->wheres; w; w = w->next) {
+        if (!jfilter_match(w->pred, pc->payload, pc->len)) {
+            metric_inc(stats.where_skipped);
+            continue;
+        }
+        pc->entries++;
+        for (struct sub_node *n = w->subs; n; n = n->tnext)
+            if (collect_node(pc, n) < 0) return;
+    }
+}
+
+static int target_cmp(const void *a, const void *b) {
+    const struct target *x = a, *y = b;
+    if (x->c != y->c) return x->c < y->c ? -1 : 1;
+    return 0;
+}
+
+static int deliver_local(struct conn *c, struct msg *m) {
+    if (c->evicted || replay_covers(c, m)) return 0;
+    size_t limit = conn_limit(c, m->len);
+    if (limit && conn_shed(c, m, limit)) return 0;
+    int r;
+    if (c->qos) {
+        r = qos_push(c->qos, m);
+        if (r == 0) qos_send_more(c);
+    } else {
+        r = conn_queue_msg(c, m);
+    }
+    if (r < 0) {
+        log_warn("dropping message for fd=%d (queue failed)", c->fd);
         return 0;
     }
-    /* still pending */
-    epoll_modify_events(fd, 1);
     return 1;
 }
 
-/* topic management (same as before) */
-static struct topic_entry *find_topic(const char *topic) {
-    for (struct topic_entry *t = topics; t; t = t->next)
-        if (strcmp(t->topic, topic) == 0) return t;
-    return NULL;
+/* Publish: frame 4-byte BE len + payload once and queue the same
+ * message on each subscriber of the topic and of every matching wildcard
+ * filter; it is freed after the last one sends it. Subscribers owned by
+ * other reactors get one mailbox batch per reactor. The frame also
+ * becomes the topic's retained message, swapped in under the same read
+ * lock so a SUB (write lock) sees either this PUB live or as retained,
+ * never both. With a journal the PUB is appended first, so it is on the
+ * log before any subscriber can see it. Peer brokers subscribed to the
+ * topic get it as a PUB frame of their own (bridge.h). */
+struct pub_rec {
+    const char *topic;           /* NUL terminated */
+    const char *payload;
+    uint32_t len;
+};
+
+/* hand m to conn fd/gen of reactor k through its mailbox */
+static int post_delivery(struct reactor *k, struct msg *m, int fd, uint64_t gen) {
+    struct delivery *d = malloc(sizeof(*d) + sizeof(d->to[0]));
+    if (!d) { log_warn("OOM posting to reactor %d", k->id); return -1; }
+    d->m = msg_ref(m);
+    d->count = 1;
+    d->to[0].fd = fd;
+    d->to[0].gen = gen;
+    reactor_post(k, &d->node);
+    return 0;
 }
 
-static struct topic_entry *create_topic(const char *topic) {
-    struct topic_entry *t = malloc(sizeof(*t));
-    if (!t) return NULL;
-    t->topic = strdup(topic);
-    t->subs = NULL;
-    t->next = topics;
-    topics = t;
-    return t;
+/* the message framed once for every bridge link among the targets */
+static int publish_forward(const struct pub_rec *r, uint64_t ts_us, struct target *v, size_t n) {
+    struct msg *f = bridge_frame(r->topic, r->payload, r->len);
+    if (!f) { log_warn("OOM forwarding %s to peers", r->topic); return 0; }
+    f->ts_us = ts_us;
+    int sent = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct target *tg = &v[i];
+        if (!tg->peer) continue;
+        if (tg->owner == cur_reactor) sent += deliver_local(tg->c, f);
+        else if (post_delivery(tg->owner, f, tg->fd, tg->gen) == 0) sent++;
+    }
+    metric_add(stats.bridge_forwarded, (uint64_t)sent);
+    msg_unref(f);
+    return sent;
 }
 
-static int add_subscription(const char *topic, int fd) {
-    struct topic_entry *t = find_topic(topic);
-    if (!t) t = create_topic(topic);
-    if (!t) return -1;
-    for (struct sub_node *s = t->subs; s; s = s->next) if (s->fd == fd) return 0;
-    struct sub_node *n = malloc(sizeof(*n));
-    if (!n) return -1;
-    n->fd = fd; n->next = t->subs; t->subs = n;
-    return 0;
+/* fan one message out to the targets matched for it */
+static void publish_deliver(const struct pub_rec *r, struct msg *m, struct target *v, size_t n, int entries) {
+    if (!n) {
+        metric_observe(stats.fanout, 0);
+        log_debug("publish: no subscribers for %s", r->topic);
+        msg_unref(m);
+        return;
+    }
+    /* a client holding overlapping filters gets a single copy */
+    if (entries > 1) {
+        qsort(v, n, sizeof(*v), target_cmp);
+        size_t w = 1;
+        for (size_t i = 1; i < n; ++i)
+            if (v[i].c != v[w - 1].c) v[w++] = v[i];
+        n = w;
+    }
+
+    if (!m && !(m = msg_frame_payload(r->payload, r->len))) { log_warn("OOM when publishing"); return; }
+    m->ts_us = metrics_now_us();
+    metric_observe(stats.fanout, n);
+    int delivered = 0;
+    unsigned int remote[MAX_REACTORS] = {0};
+    size_t links = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct target *tg = &v[i];
+        if (tg->peer) links++;
+        else if (tg->owner == cur_reactor) delivered += deliver_local(tg->c, m);
+        else remote[tg->owner->id]++;
+    }
+    for (int k = 0; k < nreactors; ++k) {
+        if (!remote[k]) continue;
+        struct delivery *d = malloc(sizeof(*d) + remote[k] * sizeof(d->to[0]));
+        if (!d) { log_warn("OOM posting to reactor %d", k); continue; }
+        d->m = msg_ref(m);
+        d->count = 0;
+        for (size_t i = 0; i < n; ++i) {
+            struct target *tg = &v[i];
+            if (tg->owner != &reactors[k] || tg->peer) continue;
+            d->to[d->count].fd = tg->fd;
+            d->to[d->count].gen = tg->gen;
+            d->count++;
+        }
+        delivered += (int)d->count;
+        reactor_post(&reactors[k], &d->node);
+    }
+    if (links) delivered += publish_forward(r, m->ts_us, v, n);
+    /* drop the creation reference; subscriber queues hold their own */
+    msg_unref(m);
+    log_debug("published topic=%s -> %d subscribers", r->topic, delivered);
+}
+
+/* route n messages with one pass over the topic index: every match is
+ * collected under a single read lock, then each message is delivered.
+ * from_peer: they came over a bridge link, so local subscribers only. */
+static void publish_batch(const struct pub_rec *recs, unsigned int n, int from_peer) {
+    struct publish_ctx *pc = &pub_scratch;
+    struct msg *pre[TINY_MAX_BATCH];
+    size_t end[TINY_MAX_BATCH];
+    int entries[TINY_MAX_BATCH];
+    pc->n = 0;
+    pc->oom = 0;
+    pc->from_peer = from_peer;
+    metric_add(stats.msgs_in, n);
+    int framed = retain_enabled() || journal_enabled();
+    for (unsigned int i = 0; i < n; ++i) {
+        const struct pub_rec *r = &recs[i];
+        pre[i] = NULL;
+        if (!framed) continue;
+        pre[i] = msg_frame_topic(r->topic, r->payload, r->len);
+        if (!pre[i]) { log_warn("OOM when publishing"); continue; }
+        if (journal_enabled()) pre[i]->seq = journal_append(r->topic, strlen(r->topic), r->payload, r->len);
+    }
+    pthread_rwlock_rdlock(&topic_lock);
+    for (unsigned int i = 0; i < n; ++i) {
+        pc->entries = 0;
+        pc->payload = recs[i].payload;
+        pc->len = recs[i].len;
+        if (!framed || pre[i]) topic_match(recs[i].topic, collect_entry, pc);
+        if (pre[i]) retain_store(recs[i].topic, pre[i]);
+        end[i] = pc->n;
+        entries[i] = pc->entries;
+    }
+    pthread_rwlock_unlock(&topic_lock);
+    if (pc->oom) log_warn("OOM collecting subscribers");
+    size_t start = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        if (framed && !pre[i]) continue;
+        if (shmring_write(cur_reactor->id, recs[i].topic, strlen(recs[i].topic), recs[i].payload, recs[i].len))
+            metric_inc(stats.shm_records);
+        publish_deliver(&recs[i], pre[i], pc->v + start, end[i] - start, entries[i]);
+        start = end[i];
+    }
+    shmring_flush();
+}
+
+static void publish_to_topic(const char *topic, const char *payload, uint32_t len, int from_peer) {
+    struct pub_rec r = { topic, payload, len };
+    publish_batch(&r, 1, from_peer);
 }
 
-static void remove_fd_from_all(int fd) {
-    struct topic_entry *t = topics;
-    while (t) {
-        struct sub_node **pp = &t->subs;
-        while (*pp) {
-            if ((*pp)->fd == fd) {
-                struct sub_node *rem = *pp;
-                *pp = rem->next;
-                free(rem);
-                continue;
+void conn_send_ctl(struct reactor *owner, int fd, uint64_t gen, struct msg *m) {
+    if (owner != cur_reactor) {
+        post_delivery(owner, m, fd, gen);
+        return;
+    }
+    struct conn *c = conn_lookup(fd);
+    if (c && c->gen == gen && conn_queue_msg(c, m) < 0) {
+        c->evicted = 1;
+        conn_mark_dirty(c);
+    }
+}
+
+/* Deliver batches posted by other reactors. A target is skipped when its
+ * fd was closed (or closed and reused) since the publisher saw it. */
+void drain_mailbox(void) {
+    struct mb_node *node;
+    while ((node = mailbox_pop(&cur_reactor->mbox)) != NULL) {
+        struct delivery *d = (struct delivery *)node;
+        for (unsigned int i = 0; i < d->count; ++i) {
+            int fd = d->to[i].fd;
+            struct conn *c = conn_lookup(fd);
+            if (!c || c->gen != d->to[i].gen) continue;
+            /* control messages for links are never shed */
+            if (d->m->reply) {
+                if (conn_queue_msg(c, d->m) < 0) { c->evicted = 1; conn_mark_dirty(c); }
+            } else {
+                deliver_local(c, d->m);
             }
-            pp = &(*pp)->next;
         }
-        t = t->next;
+        msg_unref(d->m);
+        free(d);
     }
 }
 
-static void cleanup_empty_topics(void) {
-    struct topic_entry **pt = &topics;
-    while (*pt) {
-        if ((*pt)->subs == NULL) {
-            struct topic_entry *rem = *pt;
-            *pt = rem->next;
-            free(rem->topic);
-            free(rem);
-            continue;
-        }
-        pt = &(*pt)->next;
+/* STATS: "STATS <len>\n" followed by len bytes of Prometheus text,
+ * queued behind any pending output */
+static int reply_stats(struct conn *c) {
+    size_t cap = metrics_render(NULL, 0) + 4096;
+    char *text = malloc(cap);
+    if (!text) { conn_reply(c, "ERR INTERNAL\n"); return 0; }
+    size_t len = metrics_render(text, cap);
+    if (len >= cap) len = cap - 1;   /* grew meanwhile: cut at the last full line */
+    while (len > 0 && text[len - 1] != '\n') len--;
+    char hdr[32];
+    int hn = snprintf(hdr, sizeof(hdr), "STATS %zu\n", len);
+    struct msg *m = msg_new((uint32_t)((size_t)hn + len));
+    if (!m) { free(text); conn_reply(c, "ERR INTERNAL\n"); return 0; }
+    memcpy(m->data, hdr, (size_t)hn);
+    memcpy(m->data + hn, text, len);
+    free(text);
+    int r = conn_queue_msg(c, m);
+    msg_unref(m);
+    return r;
+}
+
+/* PUB/MPUB: the body follows as "<4-byte len><bytes>". topic (NULL for
+ * MPUB) points into the command line; process_input keeps that alive
+ * until the body is routed in place or staged by stage_body(). */
+static int expect_body(struct conn *c, long len, const char *idstr, const char *topic) {
+    c->pub_ack = 0;
+    if (idstr) {
+        /* ... <id>: confirm with PUBACK <id> once routed */
+        char *end = NULL;
+        unsigned long id = strtoul(idstr, &end, 10);
+        if (*end || id > UINT32_MAX) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        c->pub_id = (uint32_t)id;
+        c->pub_ack = 1;
     }
+    c->state = S_AWAIT_LEN;
+    c->expected_len = (uint32_t)len;
+    c->current_topic = (char *)topic;
+    c->payload_received = 0;
+    return 0;
 }
 
-/* Publish: enqueue 4-byte BE len + payload to each subscriber */
-static void publish_to_topic(const char *topic, const char *payload, uint32_t len) {
-    struct topic_entry *t = find_topic(topic);
-    if (!t) {
-        fprintf(stderr, "[INFO] publish: no subscribers for %s\n", topic);
-        return;
+/* the body is split across reads: copy what arrives into payload_buf,
+ * with the PUB topic kept after it in the same allocation */
+static int stage_body(struct conn *c) {
+    const char *topic = c->current_topic;
+    size_t tlen = topic ? strnlen(topic, TINY_MAX_TOPIC - 1) : 0;
+    /* payload (at least the 4 length bytes), NUL, topic, NUL */
+    size_t off = (c->expected_len > sizeof(uint32_t) ? c->expected_len : sizeof(uint32_t)) + 1;
+    c->payload_buf = malloc(off + tlen + 1);
+    if (!c->payload_buf) { conn_reply(c, "ERR INTERNAL\n"); return -1; }
+    c->current_topic = NULL;
+    if (topic) {
+        c->current_topic = c->payload_buf + off;
+        memcpy(c->current_topic, topic, tlen);
+        c->current_topic[tlen] = '\0';
     }
-    int delivered = 0;
-    struct sub_node **pp = &t->subs;
-    while (*pp) {
-        int fd = (*pp)->fd;
-        if (fd < 0 || fd >= MAX_FD_LIMIT) {
-            struct sub_node *rem = *pp; *pp = rem->next; free(rem); continue;
+    return 0;
+}
+
+static int parse_records(struct conn *c, char *p, uint32_t len, int aliased, struct pub_rec *out);
+
+/* route a complete PUB/MPUB body (expected_len bytes, writable) and go
+ * back to reading lines. 0 ok, -1 malformed MPUB */
+static int finish_body(struct conn *c, char *body) {
+    if (c->batch) {
+        struct pub_rec recs[TINY_MAX_BATCH];
+        int n = parse_records(c, body, c->expected_len, 0, recs);
+        if (n != (int)c->batch) {
+            log_error("fd=%d: MPUB body does not hold %u records", c->fd, c->batch);
+            conn_reply(c, "ERR PROTO\n");
+            return -1;
         }
-        struct conn *c = fd_map[fd];
-        if (!c) { struct sub_node *rem = *pp; *pp = rem->next; free(rem); continue; }
-        /* prepare buffer 4-byte BE len + payload */
-        size_t tot = sizeof(uint32_t) + len;
-        char *buf = malloc(tot);
-        if (!buf) { fprintf(stderr, "[WARN] OOM when publishing\n"); break; }
-        uint32_t be = htonl(len);
-        memcpy(buf, &be, sizeof(uint32_t));
-        memcpy(buf + sizeof(uint32_t), payload, len);
-        if (conn_queue_out(c, buf, tot) < 0) {
-            fprintf(stderr, "[WARN] removing subscriber fd=%d (queue failed)\n", fd);
-            free(buf);
-            struct sub_node *rem = *pp; *pp = rem->next; free(rem);
-            continue;
+        publish_batch(recs, (unsigned int)n, c->role == ROLE_PEER);
+        c->batch = 0;
+    } else {
+        publish_to_topic(c->current_topic, body, c->expected_len, c->role == ROLE_PEER);
+    }
+    if (c->pub_ack) conn_reply(c, "PUBACK %u\n", c->pub_id);
+    c->pub_ack = 0;
+    c->frame_since = 0;
+    free(c->payload_buf);
+    c->payload_buf = NULL;
+    c->expected_len = 0;
+    c->payload_received = 0;
+    c->current_topic = NULL;
+    c->state = S_AWAIT_LINE;
+    return 0;
+}
+
+/* split an MPUB body into records. Text records carry the topic inline:
+ * each is NUL terminated in place over the first byte of the length that
+ * follows it, once that length has been read. v2 records name an alias.
+ * Returns the record count, -1 if the body is malformed. */
+static int parse_records(struct conn *c, char *p, uint32_t len, int aliased, struct pub_rec *out) {
+    unsigned int n = 0;
+    uint32_t pos = 0;
+    while (pos < len) {
+        if (n == TINY_MAX_BATCH || len - pos < sizeof(uint16_t)) return -1;
+        uint16_t key;
+        memcpy(&key, p + pos, sizeof(key));
+        key = ntohs(key);
+        pos += sizeof(key);
+        struct pub_rec *r = &out[n];
+        if (aliased) {
+            r->topic = key < c->nalias ? c->alias[key] : NULL;
+            if (!r->topic) return -1;
+        } else {
+            if (key == 0 || key >= TINY_MAX_TOPIC || len - pos < key) return -1;
+            r->topic = p + pos;
+            pos += key;
+        }
+        uint32_t be;
+        if (len - pos < sizeof(be)) return -1;
+        memcpy(&be, p + pos, sizeof(be));
+        r->len = ntohl(be);
+        if (!aliased) {
+            p[pos] = '\0';
+            if (memchr(r->topic, '\0', key) || topic_is_filter(r->topic)) return -1;
         }
-        free(buf);
-        delivered++;
-        pp = &(*pp)->next;
+        pos += sizeof(be);
+        if (r->len == 0 || r->len > TINY_MAX_PAYLOAD || len - pos < r->len) return -1;
+        r->payload = p + pos;
+        pos += r->len;
+        n++;
     }
-    fprintf(stderr, "[INFO] published topic=%s -> %d subscribers\n", topic, delivered);
+    return (int)n;
+}
+
+/* link handshake: queue "SUB <filter>" for what we hold locally */
+static void advertise_entry(struct topic_entry *t, void *arg) {
+    if (t->nlocal) conn_reply(arg, "SUB %s\n", t->topic);
+}
+
+/* HELLO PEER <node>: a broker dialing us, or the answer of the one we
+ * dialed (c is ROLE_PEER from conn_dialed). The link is registered and
+ * our interest queued under the index read lock, so every later change
+ * reaches it through the topic_interest hook, in order. */
+static int peer_hello(struct conn *c, const char *node) {
+    int dialed = c->role == ROLE_PEER;
+    if (c->authenticated || c->v2) { conn_reply(c, "ERR PROTO\n"); return -1; }
+    c->role = ROLE_PEER;
+    free(c->node_id);
+    c->node_id = strndup(node, 63);
+    if (!c->node_id) { conn_reply(c, "ERR INTERNAL\n"); return -1; }
+    char err[96];
+    pthread_rwlock_rdlock(&topic_lock);
+    int r = bridge_link_up(c, c->node_id, err, sizeof(err));
+    if (r == 0) {
+        if (!dialed) conn_reply(c, "HELLO PEER %s\n", bridge_node);
+        topic_foreach(advertise_entry, c);
+    }
+    pthread_rwlock_unlock(&topic_lock);
+    if (r < 0) {
+        log_warn("fd=%d HELLO PEER %s refused: %s", c->fd, c->node_id, err);
+        conn_reply(c, "ERR %s\n", err);
+        return -1;
+    }
+    c->authenticated = 1;
+    if (!dialed) {
+        c->keepalive = BRIDGE_KEEPALIVE;
+        conn_timer_want(c, c->last_in + wheel_ticks_s(BRIDGE_KEEPALIVE));
+    }
+    return 0;
 }
 
 /* Handle a parsed command line (no newline). Returns:
  *  0 success, 1 -> BYE (close), -1 error
  */
-static int handle_command_line(struct conn *c, const char *line) {
+static int handle_command_line(struct conn *c, char *line) {
     if (!c || !line) return -1;
-    char cmd[TINY_MAX_LINE];
-    strncpy(cmd, line, sizeof(cmd)-1); cmd[sizeof(cmd)-1] = '\0';
+    /* tokenized in place: a PUB topic stays in line for the caller */
     char *save = NULL;
-    char *tok = strtok_r(cmd, " ", &save);
+    char *tok = strtok_r(line, " ", &save);
     if (!tok) return -1;
     if (strcmp(tok, "HELLO") == 0) {
         char *role = strtok_r(NULL, " ", &save);
         char *node = strtok_r(NULL, " ", &save);
-        if (!role || !node) { dprintf(c->fd, "ERR PROTO\n"); return -1; }
+        if (!role || !node) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        if (strcmp(role, "PEER") == 0) return peer_hello(c, node);
+        /* a link stays one */
+        if (c->role == ROLE_PEER) { conn_reply(c, "ERR PROTO\n"); return -1; }
         if (strcmp(role, "PUBLISHER") == 0) c->role = ROLE_PUBLISHER;
         else if (strcmp(role, "GATEWAY") == 0) c->role = ROLE_GATEWAY;
         else if (strcmp(role, "SUBSCRIBER") == 0) c->role = ROLE_SUBSCRIBER;
         else c->role = ROLE_UNKNOWN;
-        strncpy(c->node_id, node, sizeof(c->node_id)-1);
+        free(c->node_id);
+        c->node_id = strndup(node, 63);
+        if (!c->node_id) { conn_reply(c, "ERR INTERNAL\n"); return -1; }
         c->authenticated = 1;
-        dprintf(c->fd, "OK\n");
-        fprintf(stderr, "[INFO] fd=%d HELLO role=%d node=%s\n", c->fd, c->role, c->node_id);
+        char *version = strtok_r(NULL, " ", &save);
+        if (version && strcmp(version, "V2") == 0) {
+            /* frames from the next byte on */
+            c->v2 = 1;
+            c->state = S_AWAIT_FRAME;
+            conn_reply(c, "OK V2\n");
+            log_info("fd=%d HELLO role=%d node=%s (v2)", c->fd, c->role, c->node_id);
+            return 0;
+        }
+        conn_reply(c, "OK\n");
+        log_info("fd=%d HELLO role=%d node=%s", c->fd, c->role, c->node_id);
         return 0;
     } else if (strcmp(tok, "SUB") == 0) {
         char *topic = strtok_r(NULL, " ", &save);
-        if (!topic) { dprintf(c->fd, "ERR PROTO\n"); return -1; }
-        add_subscription(topic, c->fd);
-        dprintf(c->fd, "OK\n");
-        fprintf(stderr, "[INFO] fd=%d SUB %s\n", c->fd, topic);
+        if (!topic || topic_filter_valid(topic) < 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        int shared = topic_is_shared(topic);
+        char *opt = strtok_r(NULL, " ", &save);
+        /* SUB <filter> WHERE <expr>: the rest of the line is the expression */
+        struct jfilter *where = NULL;
+        const char *expr = NULL;
+        if (opt && strcmp(opt, "WHERE") == 0) {
+            expr = save ? save : "";
+            where = jfilter_compile(expr);
+            if (!where || shared || c->role == ROLE_PEER) {
+                jfilter_free(where);
+                conn_reply(c, "ERR PROTO\n");
+                return -1;
+            }
+            opt = NULL;
+        }
+        /* SUB <filter> FROM <offset>: journal history first, then live */
+        char *from = opt;
+        struct replay *rp = NULL;
+        if (from) {
+            char *offstr = strtok_r(NULL, " ", &save);
+            char *end = NULL;
+            unsigned long long off = offstr ? strtoull(offstr, &end, 10) : 0;
+            if (strcmp(from, "FROM") != 0 || !offstr || *end || !journal_enabled() ||
+                (c->replay && c->replay->active)) {
+                conn_reply(c, "ERR PROTO\n");
+                return -1;
+            }
+            size_t flen = strlen(topic);
+            rp = malloc(sizeof(*rp) + flen + 1);
+            if (!rp) { conn_reply(c, "ERR INTERNAL\n"); return -1; }
+            memcpy(rp->filter, topic, flen + 1);
+            journal_seek(&rp->cur, off);
+            rp->active = 1;
+            rp->live_from = 0;
+        }
+        int peer = c->role == ROLE_PEER;
+        /* a group member gets live messages only: no history, no retained */
+        if ((peer || shared) && rp) { free(rp); conn_reply(c, "ERR PROTO\n"); return -1; }
+        if (peer && shared) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        /* every matching retained frame in one message, one write; a
+         * replay sends the history instead. A peer's SUB is interest
+         * only: no snapshot, no OK. The index takes where, so the
+         * snapshot, built once the lock is dropped, matches a copy */
+        int snapshot = !rp && !peer && !shared && retain_enabled();
+        struct jfilter *snap_where = snapshot && where ? jfilter_compile(expr) : NULL;
+        if (snapshot && where && !snap_where) { jfilter_free(where); conn_reply(c, "ERR INTERNAL\n"); return -1; }
+        pthread_rwlock_wrlock(&topic_lock);
+        uint64_t mark = snapshot ? retain_mark() : 0;
+        int sr = topic_subscribe(topic, where, c, peer, &c->subs);
+        pthread_rwlock_unlock(&topic_lock);
+        struct msg *snap = snapshot && sr == 0 ? retain_snapshot(topic, snap_where, mark) : NULL;
+        jfilter_free(snap_where);
+        if (sr < 0) { free(rp); conn_reply(c, "ERR INTERNAL\n"); return -1; }
+        if (peer) {
+            log_info("fd=%d peer %s SUB %s", c->fd, c->node_id ? c->node_id : "?", topic);
+            return 0;
+        }
+        conn_reply(c, "OK\n");
+        if (rp) {
+            free(c->replay);
+            c->replay = rp;
+            log_info("fd=%d SUB %s FROM %llu", c->fd, topic, (unsigned long long)rp->cur.offset);
+            replay_pump(c);
+            return 0;
+        }
+        log_info("fd=%d SUB %s%s%s", c->fd, topic, expr ? " WHERE " : "", expr ? expr : "");
+        if (snap) {
+            int qr = conn_queue_batch(c, snap);
+            msg_unref(snap);
+            if (qr < 0) return -1;
+        }
         return 0;
     } else if (strcmp(tok, "UNSUB") == 0) {
         char *topic = strtok_r(NULL, " ", &save);
-        if (!topic) { dprintf(c->fd, "ERR PROTO\n"); return -1; }
-        struct topic_entry *t = find_topic(topic);
-        if (t) {
-            struct sub_node **ps = &t->subs;
-            while (*ps) {
-                if ((*ps)->fd == c->fd) { struct sub_node *rem = *ps; *ps = rem->next; free(rem); break; }
-                ps = &(*ps)->next;
-            }
+        if (!topic) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        /* UNSUB <filter> WHERE <expr> drops that one, matched canonically */
+        char *opt = strtok_r(NULL, " ", &save);
+        struct jfilter *where = NULL;
+        if (opt && (strcmp(opt, "WHERE") != 0 || !(where = jfilter_compile(save ? save : "")))) {
+            conn_reply(c, "ERR PROTO\n");
+            return -1;
+        }
+        pthread_rwlock_wrlock(&topic_lock);
+        topic_unsubscribe(topic, where ? jfilter_text(where) : NULL, c, &c->subs);
+        pthread_rwlock_unlock(&topic_lock);
+        jfilter_free(where);
+        if (c->role != ROLE_PEER) conn_reply(c, "OK\n");
+        log_info("fd=%d UNSUB %s", c->fd, topic);
+        return 0;
+    } else if (strcmp(tok, "POLICY") == 0) {
+        char *name = strtok_r(NULL, " ", &save);
+        int p = name ? slow_policy_parse(name) : -1;
+        if (p < 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        c->policy = (enum slow_policy)p;
+        conn_reply(c, "OK\n");
+        log_info("fd=%d POLICY %s", c->fd, name);
+        return 0;
+    } else if (strcmp(tok, "QOS") == 0) {
+        char *level = strtok_r(NULL, " ", &save);
+        if (!level || (strcmp(level, "0") != 0 && strcmp(level, "1") != 0)) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        if (level[0] == '1' && !c->qos) {
+            /* the session is keyed by node id, so it needs a HELLO first */
+            if (!c->authenticated || !c->node_id) { conn_reply(c, "ERR PROTO\n"); return -1; }
+            conn_reply(c, "OK\n");
+            if (conn_qos_attach(c) < 0) return -1;
+            log_info("fd=%d QOS 1 node=%s", c->fd, c->node_id);
+        } else if (level[0] == '0' && c->qos) {
+            /* unacked ones are parked as if the node had disconnected;
+             * under topic_lock since share_pick may be reading the session */
+            if (c->subs) pthread_rwlock_wrlock(&topic_lock);
+            conn_qos_detach(c);
+            if (c->subs) pthread_rwlock_unlock(&topic_lock);
+            conn_reply(c, "OK\n");
+            log_info("fd=%d QOS 0", c->fd);
+        } else {
+            conn_reply(c, "OK\n");
+        }
+        return 0;
+    } else if (strcmp(tok, "ACK") == 0) {
+        char *idstr = strtok_r(NULL, " ", &save);
+        char *end = NULL;
+        unsigned long id = idstr ? strtoul(idstr, &end, 10) : 0;
+        if (!c->qos || !idstr || *end || id > UINT32_MAX) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        unsigned int n = qos_ack(c->qos, (uint32_t)id);
+        if (n) {
+            metric_add(stats.qos_acked, n);
+            qos_send_more(c);
+            replay_pump(c);
         }
-        dprintf(c->fd, "OK\n");
-        fprintf(stderr, "[INFO] fd=%d UNSUB %s\n", c->fd, topic);
         return 0;
     } else if (strcmp(tok, "PUB") == 0) {
+        /* v2 publishes with V2_PUB frames only */
+        if (c->v2) { conn_reply(c, "ERR PROTO\n"); return -1; }
         char *topic = strtok_r(NULL, " ", &save);
         char *lenstr = strtok_r(NULL, " ", &save);
-        if (!topic || !lenstr) { dprintf(c->fd, "ERR PROTO\n"); return -1; }
+        if (!topic || !lenstr || topic_is_filter(topic)) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        long len = strtol(lenstr, NULL, 10);
+        if (len <= 0 || len > TINY_MAX_PAYLOAD) { conn_reply(c, "ERR OVERFLOW\n"); return -1; }
+        if (expect_body(c, len, strtok_r(NULL, " ", &save), topic) < 0) return -1;
+        c->batch = 0;
+        log_debug("fd=%d PUB header topic=%s expected_len=%u", c->fd, c->current_topic, c->expected_len);
+        return 0;
+    } else if (strcmp(tok, "MPUB") == 0) {
+        /* MPUB <n> <bytes> [<id>]: n records, routed and acked together */
+        if (c->v2) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        char *nstr = strtok_r(NULL, " ", &save);
+        char *lenstr = strtok_r(NULL, " ", &save);
+        if (!nstr || !lenstr) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        long n = strtol(nstr, NULL, 10);
         long len = strtol(lenstr, NULL, 10);
-        if (len <= 0 || len > TINY_MAX_PAYLOAD) { dprintf(c->fd, "ERR OVERFLOW\n"); return -1; }
-        c->state = S_AWAIT_LEN;
-        c->expected_len = (uint32_t)len;
-        if (c->payload_buf) { free(c->payload_buf); c->payload_buf = NULL; }
-        c->payload_buf = malloc(c->expected_len + 1 + sizeof(uint32_t));
-        if (!c->payload_buf) { dprintf(c->fd, "ERR INTERNAL\n"); return -1; }
-        c->payload_received = 0;
-        strncpy(c->current_topic, topic, sizeof(c->current_topic)-1);
-        c->current_topic[sizeof(c->current_topic)-1] = '\0';
-        fprintf(stderr, "[INFO] fd=%d PUB header topic=%s expected_len=%u\n", c->fd, c->current_topic, c->expected_len);
+        if (n <= 0 || len <= 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        if (n > TINY_MAX_BATCH || len > TINY_MAX_BATCH_BYTES) { conn_reply(c, "ERR OVERFLOW\n"); return -1; }
+        if (expect_body(c, len, strtok_r(NULL, " ", &save), NULL) < 0) return -1;
+        c->batch = (unsigned int)n;
+        log_debug("fd=%d MPUB header n=%u expected_len=%u", c->fd, c->batch, c->expected_len);
         return 0;
+    } else if (strcmp(tok, "STATS") == 0) {
+        return reply_stats(c);
     } else if (strcmp(tok, "PING") == 0) {
-        dprintf(c->fd, "PONG\n"); return 0;
+        conn_reply(c, "PONG\n"); return 0;
+    } else if (strcmp(tok, "PONG") == 0) {
+        /* answer to a keepalive PING: receiving it was the point */
+        return 0;
+    } else if (strcmp(tok, "KEEPALIVE") == 0) {
+        char *secs = strtok_r(NULL, " ", &save);
+        char *end = NULL;
+        unsigned long s = secs ? strtoul(secs, &end, 10) : 0;
+        if (!secs || *end || s > UINT16_MAX) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        c->keepalive = (uint16_t)s;
+        if (s) conn_timer_want(c, c->last_in + wheel_ticks_s((unsigned int)s));
+        conn_reply(c, "OK\n");
+        return 0;
     } else if (strcmp(tok, "BYE") == 0) {
-        dprintf(c->fd, "OK\n"); return 1;
+        conn_reply(c, "OK\n"); return 1;
+    } else if (strcmp(tok, "ERR") == 0 && c->role == ROLE_PEER) {
+        /* the other broker refused the link: ERR <why> [<node>] */
+        char *why = strtok_r(NULL, " ", &save);
+        bridge_refused(c, why ? why : "?", strtok_r(NULL, " ", &save));
+        return -1;
     }
-    dprintf(c->fd, "ERR PROTO\n");
+    conn_reply(c, "ERR PROTO\n");
     return -1;
 }
 
-/* Consume bytes from inbuf and process lines / payloads.
+static int v2_alias(struct conn *c, uint16_t id, const char *body, uint32_t len) {
+    if (id == 0 || id > V2_MAX_ALIAS || len == 0 || len >= TINY_MAX_TOPIC) return -1;
+    char *topic = malloc(len + 1);
+    if (!topic) return -1;
+    memcpy(topic, body, len);
+    topic[len] = '\0';
+    if (memchr(topic, '\0', len) || topic_is_filter(topic)) { free(topic); return -1; }
+    if (id >= c->nalias) {
+        unsigned int n = c->nalias ? c->nalias : 16;
+        while (n <= id) n *= 2;
+        if (n > V2_MAX_ALIAS + 1) n = V2_MAX_ALIAS + 1;
+        char **na = realloc(c->alias, n * sizeof(*na));
+        if (!na) { free(topic); return -1; }
+        memset(na + c->nalias, 0, (n - c->nalias) * sizeof(*na));
+        c->alias = na;
+        c->nalias = n;
+    }
+    free(c->alias[id]);
+    c->alias[id] = topic;
+    log_debug("fd=%d alias %u = %s", c->fd, id, topic);
+    return 0;
+}
+
+/* one complete v2 frame, body still in inbuf. Returns like
+ * handle_command_line: 0 ok, 1 close after reply, -1 error */
+static int handle_frame(struct conn *c, uint8_t op, uint8_t flags, uint16_t id,
+                        const char *body, uint32_t len) {
+    switch (op) {
+    case V2_ALIAS:
+        if (v2_alias(c, id, body, len) < 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        return 0;
+    case V2_PUB: {
+        const char *topic = id < c->nalias ? c->alias[id] : NULL;
+        uint32_t pid = 0;
+        if (flags & V2_F_ACK) {
+            if (len < sizeof(pid)) { conn_reply(c, "ERR PROTO\n"); return -1; }
+            memcpy(&pid, body, sizeof(pid));
+            body += sizeof(pid);
+            len -= (uint32_t)sizeof(pid);
+        }
+        if (!topic || len == 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        if (len > TINY_MAX_PAYLOAD) { conn_reply(c, "ERR OVERFLOW\n"); return -1; }
+        /* straight from inbuf, no payload_buf round trip */
+        publish_to_topic(topic, body, len, c->role == ROLE_PEER);
+        if (flags & V2_F_ACK) conn_reply(c, "PUBACK %u\n", ntohl(pid));
+        return 0;
+    }
+    case V2_MPUB: {
+        uint32_t pid = 0;
+        if (flags & V2_F_ACK) {
+            if (len < sizeof(pid)) { conn_reply(c, "ERR PROTO\n"); return -1; }
+            memcpy(&pid, body, sizeof(pid));
+            body += sizeof(pid);
+            len -= (uint32_t)sizeof(pid);
+        }
+        struct pub_rec recs[TINY_MAX_BATCH];
+        int n = parse_records(c, (char *)body, len, 1, recs);
+        if (n <= 0) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        publish_batch(recs, (unsigned int)n, c->role == ROLE_PEER);
+        if (flags & V2_F_ACK) conn_reply(c, "PUBACK %u\n", ntohl(pid));
+        return 0;
+    }
+    case V2_CMD: {
+        if (len >= TINY_MAX_LINE) { conn_reply(c, "ERR PROTO\n"); return -1; }
+        char line[TINY_MAX_LINE];
+        memcpy(line, body, len);
+        line[len] = '\0';
+        return handle_command_line(c, line);
+    }
+    }
+    conn_reply(c, "ERR PROTO\n");
+    return -1;
+}
+
+/* Process lines / payloads in buf; *used gets the bytes consumed.
  * Return 0 ok, -1 error, -2 peer closed (request close)
  */
-static int process_conn_incoming(struct conn *c) {
-    if (!c) return -1;
+static int process_input(struct conn *c, char *buf, size_t buflen, size_t *used) {
     size_t pos = 0;
-    while (pos < c->inbuf_len) {
+    char line[TINY_MAX_LINE];        /* holds the PUB topic until its body is routed or staged */
+    *used = 0;
+    while (pos < buflen) {
         if (c->state == S_AWAIT_LINE) {
-            char *nl = memchr(c->inbuf + pos, '\n', c->inbuf_len - pos);
+            char *nl = memchr(buf + pos, '\n', buflen - pos);
             if (!nl) break;
-            size_t linelen = (size_t)(nl - (c->inbuf + pos));
-            if (linelen >= TINY_MAX_LINE) { fprintf(stderr, "[ERROR] line too long\n"); return -1; }
-            char line[TINY_MAX_LINE];
-            memcpy(line, c->inbuf + pos, linelen);
+            size_t linelen = (size_t)(nl - (buf + pos));
+            if (linelen >= TINY_MAX_LINE) { log_error("fd=%d: line too long", c->fd); return -1; }
+            memcpy(line, buf + pos, linelen);
             line[linelen] = '\0';
             pos += linelen + 1;
             int h = handle_command_line(c, line);
             if (h == 1) return -2;
             if (h < 0) return -1;
+            c->frame_since = 0;
             continue;
         } else if (c->state == S_AWAIT_LEN) {
+            if (!c->payload_buf) {
+                /* the whole body is here (the common case for small
+                 * readings): route it straight from buf */
+                uint32_t len = c->expected_len;
+                if (buflen - pos >= sizeof(uint32_t) + len) {
+                    uint32_t be;
+                    memcpy(&be, buf + pos, sizeof(be));
+                    if (ntohl(be) != len) {
+                        log_error("fd=%d: declared len %u != expected %u", c->fd, ntohl(be), len);
+                        return -1;
+                    }
+                    if (finish_body(c, buf + pos + sizeof(be)) < 0) return -1;
+                    pos += sizeof(be) + len;
+                    continue;
+                }
+                if (stage_body(c) < 0) return -1;
+            }
             size_t need = sizeof(uint32_t) - c->payload_received;
-            size_t avail = c->inbuf_len - pos;
+            size_t avail = buflen - pos;
             size_t to_copy = (avail < need) ? avail : need;
-            memcpy(c->payload_buf + c->payload_received, c->inbuf + pos, to_copy);
+            memcpy(c->payload_buf + c->payload_received, buf + pos, to_copy);
             c->payload_received += to_copy;
             pos += to_copy;
             if (c->payload_received < sizeof(uint32_t)) break;
             uint32_t be = 0; memcpy(&be, c->payload_buf, sizeof(uint32_t));
             uint32_t declared = ntohl(be);
             if (declared != c->expected_len) {
-                fprintf(stderr, "[ERROR] declared len %u != expected %u\n", declared, c->expected_len);
+                log_error("fd=%d: declared len %u != expected %u", c->fd, declared, c->expected_len);
                 return -1;
             }
             c->payload_received = 0;
@@ -375,125 +1394,256 @@ static int process_conn_incoming(struct conn *c) {
             continue;
         } else if (c->state == S_AWAIT_PAYLOAD) {
             size_t need = c->expected_len - c->payload_received;
-            size_t avail = c->inbuf_len - pos;
+            size_t avail = buflen - pos;
             size_t to_copy = (avail < need) ? avail : need;
-            memcpy(c->payload_buf + c->payload_received, c->inbuf + pos, to_copy);
+            memcpy(c->payload_buf + c->payload_received, buf + pos, to_copy);
             c->payload_received += to_copy;
             pos += to_copy;
             if (c->payload_received < c->expected_len) break;
             c->payload_buf[c->expected_len] = '\0';
-            publish_to_topic(c->current_topic, c->payload_buf, c->expected_len);
-            free(c->payload_buf);
-            c->payload_buf = NULL;
-            c->expected_len = 0;
-            c->payload_received = 0;
-            c->current_topic[0] = '\0';
-            c->state = S_AWAIT_LINE;
+            if (finish_body(c, c->payload_buf) < 0) return -1;
+            continue;
+        } else if (c->state == S_AWAIT_FRAME) {
+            /* the largest frame fits in INBUF_SIZE: wait until it is all there */
+            if (buflen - pos < V2_HDR_LEN) break;
+            const unsigned char *h = (const unsigned char *)buf + pos;
+            uint16_t id = (uint16_t)(h[2] << 8 | h[3]);
+            uint32_t be;
+            memcpy(&be, h + 4, sizeof(be));
+            uint32_t len = ntohl(be);
+            if (len > TINY_MAX_PAYLOAD + sizeof(uint32_t)) {
+                log_error("fd=%d: v2 frame of %u bytes", c->fd, len);
+                conn_reply(c, "ERR OVERFLOW\n");
+                return -1;
+            }
+            if (buflen - pos - V2_HDR_LEN < len) break;
+            int r = handle_frame(c, h[0], h[1], id, buf + pos + V2_HDR_LEN, len);
+            pos += V2_HDR_LEN + len;
+            if (r == 1) return -2;
+            if (r < 0) return -1;
+            c->frame_since = 0;
             continue;
         } else {
-            fprintf(stderr, "[ERROR] unknown state\n");
+            log_error("fd=%d: unknown state", c->fd);
             return -1;
         }
     }
-    if (pos > 0) {
-        if (pos < c->inbuf_len) memmove(c->inbuf, c->inbuf + pos, c->inbuf_len - pos);
-        c->inbuf_len -= pos;
+    /* a PUB line ended the input: its topic must outlive line */
+    if (c->state == S_AWAIT_LEN && !c->payload_buf && stage_body(c) < 0) return -1;
+    *used = pos;
+    return 0;
+}
+
+/* keep the unparsed tail of an incomplete frame: inline when it is
+ * short, else in a pooled buffer; none at all when nothing is left */
+static int conn_keep_input(struct conn *c, const char *rest, size_t n) {
+    if (n > INBUF_INLINE) {
+        if (!c->inbuf && !(c->inbuf = inbuf_get())) return -1;
+        if (rest != c->inbuf) memmove(c->inbuf, rest, n);
+    } else {
+        if (n) memmove(c->inbuf_inline, rest, n);
+        if (c->inbuf) { inbuf_put(c->inbuf); c->inbuf = NULL; }
     }
+    c->inbuf_len = (uint16_t)n;
     return 0;
 }
 
-/* Read available data into connection inbuf */
-static int read_into_conn(struct conn *c) {
-    if (!c) return -1;
-    char tmp[4096];
-    while (1) {
-        ssize_t r = read(c->fd, tmp, sizeof(tmp));
-        if (r == 0) return -2;
+/* parse buf[0..len) and keep what is left. buf is either c's pooled
+ * inbuf (pending input at its start) or transient memory holding none
+ * of it. Returns like process_input. */
+static int conn_feed(struct conn *c, char *buf, size_t len) {
+    size_t used;
+    uint32_t now = c->owner->wheel.now;
+    c->last_in = now;
+    if (c->pinged) c->pinged = 0;
+    int r = process_input(c, buf, len, &used);
+    if (r < 0) return r;
+    if (conn_keep_input(c, buf + used, len - used) < 0) {
+        log_error("fd=%d: no input buffer", c->fd);
+        return -1;
+    }
+    /* a frame left incomplete has timeouts.frame to finish, counted
+     * from the read that began it */
+    if (c->inbuf_len || c->state == S_AWAIT_LEN || c->state == S_AWAIT_PAYLOAD) {
+        if (!c->frame_since && timeouts.frame) {
+            c->frame_since = now;
+            conn_timer_want(c, now + wheel_ticks_s(timeouts.frame));
+        }
+    } else {
+        c->frame_since = 0;
+    }
+    return 0;
+}
+
+/* buffer to read into: the pooled inbuf when input is pending (the
+ * inline bytes moved into it), else the reactor's scratch */
+static char *conn_read_buf(struct conn *c) {
+    if (!c->inbuf_len) return inbuf_scratch();
+    if (!c->inbuf) {
+        if (!(c->inbuf = inbuf_get())) return NULL;
+        memcpy(c->inbuf, c->inbuf_inline, c->inbuf_len);
+    }
+    return c->inbuf;
+}
+
+/* Read available data after the pending input in buf, up to
+ * INBUF_SIZE in all. Stops once full; epoll is level-triggered, so the
+ * rest is read after processing. Returns the bytes now in buf, -1 on
+ * error; *eof is set when the peer closed. */
+static ssize_t read_into_conn(struct conn *c, char *buf, int *eof) {
+    size_t len = c->inbuf_len;
+    *eof = 0;
+    if (len == INBUF_SIZE) {
+        log_error("inbuf overflow for fd=%d", c->fd);
+        return -1;
+    }
+    while (len < INBUF_SIZE) {
+        ssize_t r = read(c->fd, buf + len, INBUF_SIZE - len);
+        if (r == 0) { *eof = 1; break; }
         if (r < 0) {
             if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("read");
-            return -1;
-        }
-        if (c->inbuf_len + (size_t)r > sizeof(c->inbuf)) {
-            fprintf(stderr, "[ERROR] inbuf overflow for fd=%d\n", c->fd);
+            log_error("read fd=%d: %s", c->fd, strerror(errno));
             return -1;
         }
-        memcpy(c->inbuf + c->inbuf_len, tmp, (size_t)r);
-        c->inbuf_len += (size_t)r;
+        len += (size_t)r;
     }
-    return 0;
+    return (ssize_t)len;
+}
+
+int conn_input(struct conn *c, char *data, size_t len) {
+    /* nothing pending: parse straight from the receive buffer */
+    if (!c->inbuf_len) return conn_feed(c, data, len);
+    if (c->inbuf_len + len > INBUF_SIZE) {
+        log_error("inbuf overflow for fd=%d", c->fd);
+        return -1;
+    }
+    char *buf = conn_read_buf(c);
+    if (!buf) return -1;
+    memcpy(buf + c->inbuf_len, data, len);
+    return conn_feed(c, buf, c->inbuf_len + len);
 }
 
 /* Close and cleanup connection */
 void close_connection(int fd) {
-    if (fd < 0 || fd >= MAX_FD_LIMIT) return;
-    struct conn *c = fd_map[fd];
-    if (!c) return;
-    fprintf(stderr, "[INFO] closing fd=%d\n", fd);
-    remove_fd_from_all(fd);
-    cleanup_empty_topics();
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-        perror("epoll_ctl DEL");
+    struct conn *c = conn_lookup(fd);
+    if (!c || c->closing) return;
+    log_info("closing fd=%d", fd);
+    /* the last replies (ERR ..., OK to BYE) are still in the queue: one
+     * non-blocking attempt to get them out */
+    if (!c->evicted && !c->send_iov && !outq_empty(&c->outq)) outq_flush(&c->outq, fd);
+    if (c->role == ROLE_PEER && c->authenticated) bridge_link_down(c);
+    if (c->subs) {
+        pthread_rwlock_wrlock(&topic_lock);
+        topic_unsubscribe_all(&c->subs);
+        pthread_rwlock_unlock(&topic_lock);
     }
-    close(fd);
+    if (c->owner->ring) {
+        /* destroyed once the kernel hands back its requests */
+        uring_close(c);
+        return;
+    }
+    if (conn_epoll_ctl(EPOLL_CTL_DEL, fd, 0) == -1) {
+        log_error("epoll_ctl DEL fd=%d: %s", fd, strerror(errno));
+    }
+    /* release the slot before close(): another reactor may get this fd
+     * number from accept() as soon as it is closed */
     conn_destroy(c);
+    close(fd);
+}
+
+/* output already leaves in one writev per flush: Nagle would only hold
+ * it back waiting for ACKs. Fails harmlessly on AF_UNIX. */
+static void conn_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+struct conn *conn_accepted(int fd, const struct sockaddr *addr) {
+    if (set_nonblocking(fd) == -1) { log_error("set_nonblocking fd=%d: %s", fd, strerror(errno)); close(fd); return NULL; }
+    conn_nodelay(fd);
+    struct conn *c = conn_create(fd);
+    if (!c) {
+        log_warn("fd=%d refused: no memory for the connection", fd);
+        close(fd);
+        return NULL;
+    }
+    if (addr && addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        char addrbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, addrbuf, sizeof(addrbuf));
+        log_info("accepted fd=%d from %s:%d", fd, addrbuf, ntohs(in->sin_port));
+    } else if (addr && addr->sa_family == AF_UNIX) {
+        log_info("accepted fd=%d on the unix socket", fd);
+    } else {
+        log_info("accepted fd=%d", fd);
+    }
+    return c;
+}
+
+struct conn *conn_dialed(int fd, const char *to) {
+    conn_nodelay(fd);
+    struct conn *c = conn_create(fd);
+    if (!c) {
+        log_warn("fd=%d to %s: no memory for the connection", fd, to);
+        close(fd);
+        return NULL;
+    }
+    int r = cur_reactor->ring ? uring_add(c) : conn_epoll_ctl(EPOLL_CTL_ADD, fd, EPOLLIN);
+    if (r < 0) {
+        log_error("fd=%d to %s: cannot watch it", fd, to);
+        conn_destroy(c);
+        close(fd);
+        return NULL;
+    }
+    c->role = ROLE_PEER;
+    c->keepalive = BRIDGE_KEEPALIVE;
+    conn_timer_want(c, c->last_in + wheel_ticks_s(BRIDGE_KEEPALIVE));
+    conn_reply(c, "HELLO PEER %s\n", bridge_node);
+    log_info("dialing peer %s on fd=%d", to, fd);
+    return c;
 }
 
 /* Accept loop */
 int accept_new(int listen_fd) {
     while (1) {
-        struct sockaddr_in addr;
+        struct sockaddr_storage addr;
         socklen_t alen = sizeof(addr);
         int client = accept(listen_fd, (struct sockaddr *)&addr, &alen);
         if (client < 0) {
+            /* the unix listener wakes every reactor: others may win */
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             if (errno == EINTR) continue;
-            perror("accept");
+            log_error("accept: %s", strerror(errno));
             return -1;
         }
-        if (client >= MAX_FD_LIMIT) { close(client); continue; }
-        if (set_nonblocking(client) == -1) { perror("set_nonblocking"); close(client); continue; }
-        struct conn *c = conn_create(client);
-        if (!c) { close(client); continue; }
-        struct epoll_event ev;
-        ev.events = EPOLLIN; /* level-triggered for robustness */
-        ev.data.fd = client;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev) == -1) {
-            perror("epoll_ctl add client");
-            close(client);
+        struct conn *c = conn_accepted(client, (struct sockaddr *)&addr);
+        if (!c) continue;
+        /* level-triggered for robustness */
+        if (conn_epoll_ctl(EPOLL_CTL_ADD, client, EPOLLIN) == -1) {
+            log_error("epoll_ctl add fd=%d: %s", client, strerror(errno));
             conn_destroy(c);
+            close(client);
             continue;
         }
-        char addrbuf[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &addr.sin_addr, addrbuf, sizeof(addrbuf));
-        fprintf(stderr, "[INFO] accepted fd=%d from %s:%d\n", client, addrbuf, ntohs(addr.sin_port));
     }
     return 0;
 }
 
 /* This function is called by main loop upon EPOLLIN for a fd */
 int process_fd_event(int fd) {
-    if (fd < 0 || fd >= MAX_FD_LIMIT) return -1;
-    struct conn *c = fd_map[fd];
+    struct conn *c = conn_lookup(fd);
     if (!c) {
-        fprintf(stderr, "[WARN] event for unknown fd=%d\n", fd);
-        return -1;
-    }
-    int r = read_into_conn(c);
-    if (r == -2) {
-        /* Peer closed. Process any buffered data before closing */
-        if (c->inbuf_len > 0) {
-            int p = process_conn_incoming(c);
-            if (p == -2) return -2;
-            if (p < 0) return -1;
-            return -2; /* peer closed after processing */
-        } else {
-            return -2;
-        }
-    } else if (r < 0) {
+        log_warn("event for unknown fd=%d", fd);
         return -1;
     }
-    int p = process_conn_incoming(c);
-    return p;
+    char *buf = conn_read_buf(c);
+    if (!buf) return -1;
+    int eof;
+    ssize_t n = read_into_conn(c, buf, &eof);
+    if (n < 0) return -1;
+    /* on EOF, process what was buffered before closing */
+    int p = conn_feed(c, buf, (size_t)n);
+    if (p < 0) return p;
+    return eof ? -2 : 0;
 }
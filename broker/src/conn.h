@@ -0,0 +1,175 @@
+#ifndef TINYIOT_CONN_H
+#define TINYIOT_CONN_H
+
+#include "proto.h"
+#include "msg.h"
+#include "topics.h"
+#include "inbuf.h"
+#include "wheel.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+struct reactor;
+struct replay;
+struct qos_session;
+
+/* Roles */
+typedef enum { ROLE_UNKNOWN=0, ROLE_PUBLISHER, ROLE_GATEWAY, ROLE_SUBSCRIBER, ROLE_PEER } role_t;
+
+/* What to do with a subscriber whose output queue hits its limit */
+enum slow_policy { SLOW_DISCONNECT = 0, SLOW_DROP_NEWEST, SLOW_DROP_OLDEST };
+
+/* Which member of a shared subscription group gets a message: the next
+ * one in turn, or the one with the fewest bytes queued (ties in turn) */
+enum share_policy { SHARE_ROUND_ROBIN = 0, SHARE_LEAST_QUEUED };
+
+extern enum share_policy share_policy;
+
+/* Output limits, set by main before the reactors start. A conn whose
+ * queue grows past `high` bytes is congested until it drains to `low`;
+ * while the sum of all queues is over `budget` (0 = unlimited) every
+ * conn holding more than budget / connections is capped at that share. */
+struct flow_limits {
+    size_t high;
+    size_t low;
+    size_t budget;
+    enum slow_policy policy;     /* default for new conns, POLICY overrides */
+};
+
+extern struct flow_limits flow;
+
+/* Connection deadlines in seconds, 0 = off, set by main. idle: nothing
+ * received; frame: a frame (line, PUB body, v2 frame) started but not
+ * complete; send: output pending and no byte written. A conn that sent
+ * KEEPALIVE <s> also gets PING after s quiet seconds and is closed after
+ * 2s. One timer per conn on the reactor's wheel, re-armed lazily. */
+struct conn_timeouts {
+    unsigned int idle;
+    unsigned int frame;
+    unsigned int send;
+};
+
+extern struct conn_timeouts timeouts;
+
+/* Connection state machine */
+typedef enum { S_AWAIT_LINE = 0, S_AWAIT_LEN, S_AWAIT_PAYLOAD, S_AWAIT_FRAME } conn_state_t;
+
+/* Kept small: an idle connection costs this struct plus its node id.
+ * Input is buffered per conn only while a frame is incomplete (inbuf.h),
+ * the PUB topic lives in the payload buffer, flags are bits. Conns come
+ * from the owner's slab, cache line aligned: what every delivery touches
+ * fills the first two lines, the parser's state the next ones, fields
+ * only used by SUB/HELLO, teardown or timers come last (296 bytes on
+ * 64-bit, five cache lines). */
+struct conn {
+    /* delivery */
+    int fd;
+    unsigned int role : 3;       /* role_t */
+    unsigned int policy : 2;     /* enum slow_policy */
+    unsigned int authenticated : 1;
+    unsigned int pub_ack : 1;
+    unsigned int v2 : 1;
+    unsigned int out_armed : 1;  /* EPOLLOUT is in the interest set */
+    unsigned int dirty : 1;      /* on the owner's dirty list */
+    unsigned int congested : 1;  /* went over flow.high, not yet back to flow.low */
+    unsigned int evicted : 1;    /* slow consumer, closed on the next flush */
+    unsigned int recv_armed : 1; /* io_uring: multishot recv outstanding */
+    unsigned int closing : 1;    /* io_uring: shut down, destroyed once io_inflight hits 0 */
+    unsigned int pinged : 1;     /* KEEPALIVE: PING sent, nothing received since */
+    uint64_t gen;                /* unique id; tells a reused fd apart */
+    struct reactor *owner;       /* reactor whose event loop holds fd */
+    struct replay *replay;       /* SUB ... FROM: journal history, NULL if none */
+    struct qos_session *qos;     /* QOS 1 subscriber state, NULL for QoS 0 */
+    struct conn *dirty_prev, *dirty_next;
+    /* OUTPUT queue: shared message references pending for this conn */
+    struct outq outq;
+    uint64_t dropped;            /* messages shed by policy */
+    uint32_t stall_since;        /* wheel tick output got stuck, 0 if flowing */
+
+    /* input */
+    conn_state_t state;
+    uint16_t inbuf_len;
+    uint16_t keepalive;          /* KEEPALIVE seconds, 0 = no server PINGs */
+    uint32_t last_in;            /* wheel tick of the last bytes received */
+    uint32_t frame_since;        /* wheel tick the pending frame began, 0 if none */
+    /* unparsed input: in inbuf (pooled) when set, else in inbuf_inline */
+    char *inbuf;
+    char inbuf_inline[INBUF_INLINE];
+
+    /* state for incoming PUB */
+    uint32_t expected_len;       /* payload length */
+    uint32_t payload_received;   /* bytes received so far into payload_buf */
+    char *payload_buf;           /* expected_len+1 bytes, then the topic */
+    char *current_topic;         /* PUB topic, inside payload_buf */
+    uint32_t pub_id;             /* PUB ... <id>: answered with PUBACK */
+    unsigned int batch;          /* MPUB: records in payload_buf, 0 for PUB */
+
+    /* cold */
+    char *node_id;               /* from HELLO, NULL before */
+    /* binary protocol v2 (HELLO ... V2): frames, topics by alias */
+    char **alias;                /* alias id -> topic, NULL if unused */
+    unsigned int nalias;         /* slots in alias */
+    /* io_uring backend: requests the kernel still owns for this conn */
+    unsigned int io_inflight;
+    /* reverse index: every subscription held by this conn */
+    struct sub_node *subs;
+    struct iovec *send_iov;      /* iovecs of the in-flight send */
+    struct timer timer;          /* next deadline, see struct conn_timeouts */
+};
+
+struct conn *conn_create(int fd);
+void conn_destroy(struct conn *c);
+
+/* set up a freshly accepted fd (non-blocking, conn object, log line).
+ * Returns NULL after closing fd on failure. */
+struct conn *conn_accepted(int fd, const struct sockaddr *addr);
+
+/* run the state machine over received bytes (parsed in place, so data
+ * must be writable); what is left of an incomplete frame is kept.
+ * 0 ok, -1 error, -2 BYE (close requested) */
+int conn_input(struct conn *c, char *data, size_t len);
+
+void close_connection(int fd);
+
+/* take over fd, connecting (or connected) to the peer broker at `to`, as
+ * a link conn of the calling reactor and queue our HELLO PEER; it is
+ * written once the connect completes. Returns NULL after closing fd on
+ * failure. */
+struct conn *conn_dialed(int fd, const char *to);
+
+/* queue control message m (see bridge.h) on conn fd/gen of owner, from
+ * any reactor; dropped if that conn is gone */
+void conn_send_ctl(struct reactor *owner, int fd, uint64_t gen, struct msg *m);
+
+/* "disconnect", "drop-newest", "drop-oldest" -> policy; -1 if unknown */
+int slow_policy_parse(const char *s);
+const char *slow_policy_name(enum slow_policy p);
+
+/* "round-robin", "least-queued" -> policy; -1 if unknown */
+int share_policy_parse(const char *s);
+
+/* output queued since the last flush: put c on its reactor's dirty list,
+ * which the loop flushes once per iteration */
+void conn_mark_dirty(struct conn *c);
+/* pop the next dirty conn of r, NULL when the list is empty */
+struct conn *conn_next_dirty(struct reactor *r);
+
+/* the backend wrote out everything queued for c: refill from a replay */
+void conn_output_drained(struct conn *c);
+
+/* c's output is waiting on a full socket; progress: some of it was just
+ * written. Starts (or restarts) the send deadline. */
+void conn_output_blocked(struct conn *c, int progress);
+
+/* set up w to run the connection deadlines of the calling reactor */
+void conn_timers_init(struct wheel *w);
+
+/* periodic work of the calling reactor (connection deadlines, QoS 1
+ * resends); called every loop iteration */
+void broker_tick(void);
+
+/* how long the calling reactor may wait for events, in ms */
+int broker_timeout_ms(void);
+
+#endif
@@ -0,0 +1,48 @@
+#include "inbuf.h"
+#include "reactor.h"
+#include <stdlib.h>
+
+static size_t in_use;
+
+char *inbuf_scratch(void) {
+    struct reactor *r = cur_reactor;
+    if (!r->scratch) r->scratch = malloc(INBUF_SIZE);
+    return r->scratch;
+}
+
+char *inbuf_get(void) {
+    struct reactor *r = cur_reactor;
+    char *b = r->inbuf_free;
+    if (b) {
+        r->inbuf_free = *(char **)b;
+        r->inbuf_nfree--;
+    } else if (!(b = malloc(INBUF_SIZE))) {
+        return NULL;
+    }
+    __atomic_add_fetch(&in_use, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+void inbuf_put(char *b) {
+    struct reactor *r = cur_reactor;
+    __atomic_sub_fetch(&in_use, 1, __ATOMIC_RELAXED);
+    if (r->inbuf_nfree >= INBUF_POOL_KEEP) { free(b); return; }
+    *(char **)b = r->inbuf_free;
+    r->inbuf_free = b;
+    r->inbuf_nfree++;
+}
+
+size_t inbuf_in_use(void) {
+    return __atomic_load_n(&in_use, __ATOMIC_RELAXED);
+}
+
+void inbuf_pool_free(struct reactor *r) {
+    while (r->inbuf_free) {
+        char *b = r->inbuf_free;
+        r->inbuf_free = *(char **)b;
+        free(b);
+    }
+    r->inbuf_nfree = 0;
+    free(r->scratch);
+    r->scratch = NULL;
+}
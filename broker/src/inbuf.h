@@ -0,0 +1,32 @@
+#ifndef TINYIOT_INBUF_H
+#define TINYIOT_INBUF_H
+
+#include <stddef.h>
+
+struct reactor;
+
+/* Input buffers. Reads land in the reactor's scratch buffer and are
+ * parsed from there; a connection only keeps what is left over, the
+ * tail of a frame that has not fully arrived. Up to INBUF_INLINE bytes
+ * stay in the conn itself (a split command line), more takes a pooled
+ * INBUF_SIZE buffer until the frame completes. Idle connections hold no
+ * buffer at all.
+ */
+#define INBUF_SIZE 16384
+#define INBUF_INLINE 48
+#define INBUF_POOL_KEEP 64           /* free buffers a reactor keeps around */
+
+/* scratch buffer of the calling reactor, INBUF_SIZE bytes */
+char *inbuf_scratch(void);
+
+/* take / return a pooled INBUF_SIZE buffer of the calling reactor */
+char *inbuf_get(void);
+void inbuf_put(char *b);
+
+/* buffers held by connections across all reactors */
+size_t inbuf_in_use(void);
+
+/* release r's scratch and free list; r's thread has stopped */
+void inbuf_pool_free(struct reactor *r);
+
+#endif
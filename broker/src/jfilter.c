@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include "jfilter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+enum jf_op { JF_LT, JF_LE, JF_GT, JF_GE, JF_EQ, JF_NE };
+enum jf_kind { JF_NUM, JF_STR, JF_TRUE, JF_FALSE, JF_NULL };
+
+struct jf_clause {
+    const char *seg[JF_MAX_SEGS];   /* into jfilter.buf, not terminated */
+    size_t seglen[JF_MAX_SEGS];
+    int nseg;
+    enum jf_op op;
+    enum jf_kind kind;
+    double num;
+    const char *str;                /* JF_STR: between the quotes */
+    size_t slen;
+};
+
+struct jfilter {
+    int n;
+    unsigned int all;               /* bit per clause */
+    unsigned int ends[JF_MAX_SEGS + 1]; /* clauses whose path ends at depth d */
+    struct jf_clause c[JF_MAX_CLAUSES];
+    char buf[JF_MAX_TEXT];          /* copy of the expression */
+    char text[JF_MAX_TEXT];         /* canonical form */
+};
+
+static const char *op_names[] = { "<", "<=", ">", ">=", "==", "!=" };
+
+static int is_space(char ch) { return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; }
+
+static int is_seg_char(char ch) {
+    return ch && !is_space(ch) && !strchr(".<>=!\"\\", ch);
+}
+
+static const char *skip_spaces(const char *p) {
+    while (is_space(*p)) p++;
+    return p;
+}
+
+static const char *parse_op(const char *p, enum jf_op *op) {
+    if (p[0] == '<') { *op = p[1] == '=' ? JF_LE : JF_LT; return p + 1 + (p[1] == '='); }
+    if (p[0] == '>') { *op = p[1] == '=' ? JF_GE : JF_GT; return p + 1 + (p[1] == '='); }
+    if (p[0] == '=') { *op = JF_EQ; return p + 1 + (p[1] == '='); }
+    if (p[0] == '!' && p[1] == '=') { *op = JF_NE; return p + 2; }
+    return NULL;
+}
+
+static int literal_at(const char *p, const char *word) {
+    size_t n = strlen(word);
+    return strncmp(p, word, n) == 0 && !is_seg_char(p[n]);
+}
+
+/* one "path op value" at p; returns past it, NULL if malformed */
+static const char *parse_clause(const char *p, struct jf_clause *c) {
+    for (;;) {
+        const char *s = p;
+        while (is_seg_char(*p)) p++;
+        if (p == s || c->nseg == JF_MAX_SEGS) return NULL;
+        c->seg[c->nseg] = s;
+        c->seglen[c->nseg++] = (size_t)(p - s);
+        if (*p != '.') break;
+        p++;
+    }
+    p = parse_op(skip_spaces(p), &c->op);
+    if (!p) return NULL;
+    p = skip_spaces(p);
+    if (*p == '"') {
+        const char *s = ++p;
+        while (*p && *p != '"' && *p != '\\') p++;
+        if (*p != '"') return NULL;
+        c->kind = JF_STR;
+        c->str = s;
+        c->slen = (size_t)(p - s);
+        p++;
+    } else if (literal_at(p, "true")) {
+        c->kind = JF_TRUE;
+        p += 4;
+    } else if (literal_at(p, "false")) {
+        c->kind = JF_FALSE;
+        p += 5;
+    } else if (literal_at(p, "null")) {
+        c->kind = JF_NULL;
+        p += 4;
+    } else {
+        char *end;
+        if (!strchr("-+.0123456789", *p) || !*p) return NULL;
+        c->num = strtod(p, &end);
+        if (end == p || !isfinite(c->num)) return NULL;
+        c->kind = JF_NUM;
+        p = end;
+    }
+    /* only numbers have an order */
+    if (c->kind != JF_NUM && c->op != JF_EQ && c->op != JF_NE) return NULL;
+    if (*p && !is_space(*p)) return NULL;
+    return p;
+}
+
+static int clause_text(const struct jf_clause *c, char *out, size_t cap) {
+    size_t off = 0;
+    int n;
+    for (int k = 0; k < c->nseg; ++k) {
+        n = snprintf(out + off, cap - off, "%s%.*s", k ? "." : "", (int)c->seglen[k], c->seg[k]);
+        if (n < 0 || (size_t)n >= cap - off) return -1;
+        off += (size_t)n;
+    }
+    const char *op = op_names[c->op];
+    switch (c->kind) {
+    case JF_NUM: n = snprintf(out + off, cap - off, " %s %.17g", op, c->num); break;
+    case JF_STR: n = snprintf(out + off, cap - off, " %s \"%.*s\"", op, (int)c->slen, c->str); break;
+    case JF_TRUE: n = snprintf(out + off, cap - off, " %s true", op); break;
+    case JF_FALSE: n = snprintf(out + off, cap - off, " %s false", op); break;
+    default: n = snprintf(out + off, cap - off, " %s null", op); break;
+    }
+    return n < 0 || (size_t)n >= cap - off ? -1 : 0;
+}
+
+static int text_cmp(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/* clauses in sorted order so "a > 1 AND b < 2" and "b<2 and a>1" are
+ * the same filter */
+static int canonical(struct jfilter *f) {
+    char parts[JF_MAX_CLAUSES][JF_MAX_TEXT];
+    for (int i = 0; i < f->n; ++i) {
+        if (clause_text(&f->c[i], parts[i], sizeof(parts[i])) < 0) return -1;
+    }
+    qsort(parts, (size_t)f->n, sizeof(parts[0]), text_cmp);
+    size_t off = 0;
+    for (int i = 0; i < f->n; ++i) {
+        int n = snprintf(f->text + off, sizeof(f->text) - off, "%s%s", i ? " AND " : "", parts[i]);
+        if (n < 0 || (size_t)n >= sizeof(f->text) - off) return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+struct jfilter *jfilter_compile(const char *expr) {
+    if (strlen(expr) >= JF_MAX_TEXT) return NULL;
+    struct jfilter *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    strcpy(f->buf, expr);
+    const char *p = skip_spaces(f->buf);
+    for (;;) {
+        if (f->n == JF_MAX_CLAUSES) goto bad;
+        struct jf_clause *c = &f->c[f->n];
+        p = parse_clause(p, c);
+        if (!p) goto bad;
+        f->all |= 1u << f->n;
+        f->ends[c->nseg] |= 1u << f->n;
+        f->n++;
+        p = skip_spaces(p);
+        if (!*p) break;
+        if (strncasecmp(p, "AND", 3) != 0 || !is_space(p[3])) goto bad;
+        p = skip_spaces(p + 3);
+    }
+    if (canonical(f) < 0) goto bad;
+    return f;
+bad:
+    free(f);
+    return NULL;
+}
+
+const char *jfilter_text(const struct jfilter *f) {
+    return f->text;
+}
+
+void jfilter_free(struct jfilter *f) {
+    free(f);
+}
+
+/* ---- matching ---- */
+
+struct jf_scan {
+    const struct jfilter *f;
+    const char *p, *end;
+    unsigned int held;           /* clauses seen true */
+    int match;                   /* the answer once decided */
+};
+
+/* the walk returns this to unwind once the answer is known, or on
+ * anything that is not JSON (match stays 0) */
+#define JF_STOP (-1)
+
+static void scan_spaces(struct jf_scan *s) {
+    while (s->p < s->end && is_space(*s->p)) s->p++;
+}
+
+/* s->p on an opening quote: move past the closing one */
+static int scan_string(struct jf_scan *s, const char **body, size_t *blen) {
+    const char *start = ++s->p;
+    for (;;) {
+        const char *q = memchr(s->p, '"', (size_t)(s->end - s->p));
+        if (!q) return JF_STOP;
+        s->p = q + 1;
+        /* escaped if an odd run of backslashes precedes it */
+        const char *b = q;
+        while (b > start && b[-1] == '\\') b--;
+        if (((q - b) & 1) == 0) {
+            *body = start;
+            *blen = (size_t)(q - start);
+            return 0;
+        }
+    }
+}
+
+/* past a value no clause looks into, without taking it apart */
+static int scan_skip(struct jf_scan *s) {
+    int nest = 0;
+    while (s->p < s->end) {
+        char ch = *s->p;
+        if (ch == '"') {
+            const char *body;
+            size_t blen;
+            if (scan_string(s, &body, &blen) < 0) return JF_STOP;
+            if (!nest) return 0;
+            continue;
+        }
+        if (ch == '{' || ch == '[') {
+            nest++;
+        } else if (ch == '}' || ch == ']') {
+            if (!nest) return 0;
+            if (--nest == 0) { s->p++; return 0; }
+        } else if (ch == ',' && !nest) {
+            return 0;
+        }
+        s->p++;
+    }
+    return nest ? JF_STOP : 0;
+}
+
+static int holds(const struct jf_clause *c, enum jf_kind kind, double num, const char *str, size_t slen) {
+    if (c->kind == JF_NUM) {
+        if (kind != JF_NUM) return 0;
+        switch (c->op) {
+        case JF_LT: return num < c->num;
+        case JF_LE: return num <= c->num;
+        case JF_GT: return num > c->num;
+        case JF_GE: return num >= c->num;
+        case JF_EQ: return num == c->num;
+        case JF_NE: return num != c->num;
+        }
+        return 0;
+    }
+    int eq;
+    if (c->kind == JF_STR) {
+        if (kind != JF_STR) return 0;
+        eq = slen == c->slen && memcmp(str, c->str, slen) == 0;
+    } else {
+        if (kind != JF_TRUE && kind != JF_FALSE && kind != JF_NULL) return 0;
+        eq = kind == c->kind;
+    }
+    return c->op == JF_EQ ? eq : !eq;
+}
+
+/* a scalar where the clauses in here end */
+static int scan_scalar(struct jf_scan *s, unsigned int here) {
+    enum jf_kind kind;
+    double num = 0;
+    const char *str = NULL;
+    size_t slen = 0;
+    char ch = *s->p;
+    if (ch == '"') {
+        if (scan_string(s, &str, &slen) < 0) return JF_STOP;
+        kind = JF_STR;
+    } else if (s->end - s->p >= 4 && memcmp(s->p, "true", 4) == 0) {
+        kind = JF_TRUE;
+        s->p += 4;
+    } else if (s->end - s->p >= 5 && memcmp(s->p, "false", 5) == 0) {
+        kind = JF_FALSE;
+        s->p += 5;
+    } else if (s->end - s->p >= 4 && memcmp(s->p, "null", 4) == 0) {
+        kind = JF_NULL;
+        s->p += 4;
+    } else {
+        /* the payload is not terminated: copy the number out */
+        char tmp[64];
+        size_t n = 0;
+        while (s->p + n < s->end && n < sizeof(tmp) - 1 && strchr("-+.eE0123456789", s->p[n]) && s->p[n]) n++;
+        if (!n) return JF_STOP;
+        memcpy(tmp, s->p, n);
+        tmp[n] = '\0';
+        char *end;
+        num = strtod(tmp, &end);
+        if (end != tmp + n) return JF_STOP;
+        kind = JF_NUM;
+        s->p += n;
+    }
+    for (int i = 0; i < s->f->n; ++i) {
+        if (!(here & (1u << i))) continue;
+        if (!holds(&s->f->c[i], kind, num, str, slen)) return JF_STOP;
+        s->held |= 1u << i;
+    }
+    if (s->held == s->f->all) {
+        s->match = 1;
+        return JF_STOP;
+    }
+    return 0;
+}
+
+static int scan_value(struct jf_scan *s, int depth, unsigned int mask);
+
+static int scan_object(struct jf_scan *s, int depth, unsigned int mask) {
+    s->p++;
+    scan_spaces(s);
+    if (s->p < s->end && *s->p == '}') { s->p++; return 0; }
+    for (;;) {
+        const char *key;
+        size_t klen;
+        scan_spaces(s);
+        if (s->p >= s->end || *s->p != '"' || scan_string(s, &key, &klen) < 0) return JF_STOP;
+        scan_spaces(s);
+        if (s->p >= s->end || *s->p != ':') return JF_STOP;
+        s->p++;
+        /* the clauses whose path goes on through this key */
+        unsigned int next = 0;
+        for (int i = 0; i < s->f->n; ++i) {
+            const struct jf_clause *c = &s->f->c[i];
+            if ((mask & (1u << i)) && c->seglen[depth] == klen && memcmp(c->seg[depth], key, klen) == 0) next |= 1u << i;
+        }
+        if (scan_value(s, depth + 1, next) < 0) return JF_STOP;
+        scan_spaces(s);
+        if (s->p >= s->end) return JF_STOP;
+        if (*s->p == '}') { s->p++; return 0; }
+        if (*s->p != ',') return JF_STOP;
+        s->p++;
+    }
+}
+
+static int scan_value(struct jf_scan *s, int depth, unsigned int mask) {
+    scan_spaces(s);
+    if (s->p >= s->end || depth > JF_MAX_DEPTH) return JF_STOP;
+    if (!mask) return scan_skip(s);
+    unsigned int here = mask & s->f->ends[depth];
+    char ch = *s->p;
+    if (ch == '{' || ch == '[') {
+        /* a clause wanted a scalar here */
+        if (here) return JF_STOP;
+        /* paths do not index into arrays */
+        if (ch == '[') return JF_STOP;
+        return scan_object(s, depth, mask);
+    }
+    /* a scalar ends every path still going deeper */
+    if (mask & ~here) return JF_STOP;
+    return scan_scalar(s, here);
+}
+
+int jfilter_match(const struct jfilter *f, const char *payload, size_t len) {
+    struct jf_scan s = { .f = f, .p = payload, .end = payload + len };
+    scan_value(&s, 0, f->all);
+    return s.match;
+}
@@ -0,0 +1,41 @@
+#ifndef TINYIOT_JFILTER_H
+#define TINYIOT_JFILTER_H
+
+#include <stddef.h>
+
+/* Content filters on JSON payloads (SUB <filter> WHERE <expr>).
+ *
+ * An expression is one or more clauses joined by AND:
+ *     data.temp > 35 AND site == "lab"
+ * A clause compares the value at a dotted object path with a number
+ * (< <= > >= == !=), a string, true, false or null (== !=). A missing
+ * field, a value of another type or a payload that is not JSON makes the
+ * clause, and so the expression, false.
+ *
+ * Compiled once at SUB time. Matching walks the payload once, descending
+ * only into the keys some clause's path goes through, skipping every
+ * other value with memchr over strings (glibc's vectorized scan), and
+ * stops as soon as a clause fails or all of them held. Strings compare
+ * byte for byte as they appear in the payload, escapes included.
+ */
+
+#define JF_MAX_CLAUSES 8
+#define JF_MAX_SEGS 8                /* path levels of one clause */
+#define JF_MAX_DEPTH 32              /* deeper payloads do not match */
+#define JF_MAX_TEXT 512              /* canonical expression, NUL included */
+
+struct jfilter;
+
+/* parse expr; NULL if it is malformed or too large */
+struct jfilter *jfilter_compile(const char *expr);
+
+/* canonical text: equal for expressions that differ only in spacing,
+ * clause order or how numbers are written */
+const char *jfilter_text(const struct jfilter *f);
+
+/* 1 if the payload satisfies every clause */
+int jfilter_match(const struct jfilter *f, const char *payload, size_t len);
+
+void jfilter_free(struct jfilter *f);
+
+#endif
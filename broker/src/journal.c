@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include "proto.h"
+#include "topics.h"
+#include "stats.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAX_SEGMENTS 4096
+#define JOURNAL_SEG_SLACK 64     /* free slots kept so rolls never find the table full */
+#define JREC_HDR 24
+
+struct jrec {
+    uint32_t size;
+    uint32_t sum;
+    uint64_t offset;
+    uint16_t topic_len;
+    uint16_t flags;
+    uint32_t len;
+    char data[];                 /* topic, then payload */
+};
+
+struct segment {
+    uint64_t base;               /* offset of its first record */
+    int fd;
+    char *map;
+    size_t cap;                  /* mapped bytes */
+    size_t limit;                /* bytes in use once sealed, 0 while active */
+};
+
+/* Segments are numbered from 0 in the order they were opened and live in
+ * slot n % JOURNAL_MAX_SEGMENTS. A slot is written once and published
+ * through nsegs, so readers on other threads never need the append lock.
+ * The sync thread deletes the oldest segments past the retention limit;
+ * it advances first_seg under the write side of prune_lock, and readers
+ * hold the read side while they touch a mapping. */
+static struct segment *segs[JOURNAL_MAX_SEGMENTS];
+#define SEG(n) segs[(n) % JOURNAL_MAX_SEGMENTS]
+static int nsegs;                /* segments ever opened */
+static int first_seg;            /* oldest one still on disk */
+static uint64_t first_offset;    /* its base */
+static pthread_rwlock_t prune_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int dir_fd = -1;
+static size_t seg_bytes;
+static size_t retain_bytes;      /* 0: keep everything */
+static int sync_ms;
+
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t append_pos;        /* in the last segment */
+static uint64_t end_offset;
+static uint64_t durable_offset;
+static int enabled;
+
+static pthread_t sync_tid;
+static int stop_sync;
+
+static size_t rec_size(size_t topic_len, uint32_t len) {
+    return (JREC_HDR + topic_len + len + 7) & ~(size_t)7;
+}
+
+static uint32_t rec_sum(const struct jrec *r) {
+    return topic_hash(r->data, (size_t)r->topic_len + r->len) ^ (uint32_t)r->offset;
+}
+
+static void segment_name(char *name, size_t cap, uint64_t base) {
+    snprintf(name, cap, "%020llu.log", (unsigned long long)base);
+}
+
+static struct segment *segment_map(uint64_t base, size_t cap, int create) {
+    char name[32];
+    segment_name(name, sizeof(name), base);
+    int fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (create ? ftruncate(fd, (off_t)cap) < 0 : fstat(fd, &st) < 0) goto fail;
+    if (!create) cap = (size_t)st.st_size;
+    struct segment *s = calloc(1, sizeof(*s));
+    if (!s) goto fail;
+    s->map = cap ? mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    if (s->map == MAP_FAILED) { free(s); goto fail; }
+    s->base = base;
+    s->fd = fd;
+    s->cap = cap;
+    return s;
+fail:
+    close(fd);
+    return NULL;
+}
+
+static void segment_unmap(struct segment *s) {
+    if (s->map) munmap(s->map, s->cap);
+    close(s->fd);
+    free(s);
+}
+
+/* walk valid records of s from the start; returns the end position and
+ * stores the offset after the last valid record in *next */
+static size_t segment_scan(const struct segment *s, uint64_t *next) {
+    size_t pos = 0;
+    uint64_t off = s->base;
+    while (pos + JREC_HDR <= s->cap) {
+        const struct jrec *r = (const struct jrec *)(s->map + pos);
+        if (r->size < JREC_HDR || r->size > s->cap - pos || r->offset != off ||
+            rec_size(r->topic_len, r->len) != r->size || rec_sum(r) != r->sum) break;
+        pos += r->size;
+        off++;
+    }
+    *next = off;
+    return pos;
+}
+
+static int seg_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* map existing segments; the last one stays active for appends */
+static int journal_recover(void) {
+    DIR *d = fdopendir(dup(dir_fd));
+    if (!d) return -1;
+    uint64_t *bases = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char *end;
+        unsigned long long b = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            uint64_t *nb = realloc(bases, cap * sizeof(*nb));
+            if (!nb) { free(bases); closedir(d); return -1; }
+            bases = nb;
+        }
+        bases[n++] = b;
+    }
+    closedir(d);
+    if (n > JOURNAL_MAX_SEGMENTS - JOURNAL_SEG_SLACK) { free(bases); errno = EMFILE; return -1; }
+    qsort(bases, n, sizeof(*bases), seg_cmp);
+    for (size_t i = 0; i < n; ++i) {
+        struct segment *s = segment_map(bases[i], 0, 0);
+        if (!s) { free(bases); return -1; }
+        segs[nsegs++] = s;
+        /* sealed segments were cut to their used size */
+        s->limit = s->cap;
+    }
+    free(bases);
+    if (nsegs) {
+        struct segment *s = segs[nsegs - 1];
+        append_pos = segment_scan(s, &end_offset);
+        s->limit = 0;
+        if (s->cap < seg_bytes) {
+            /* sealed (or mapped with a smaller segment size): append to a
+             * fresh successor, reusing the name if it holds nothing */
+            if (append_pos == 0) {
+                char name[32];
+                segment_name(name, sizeof(name), s->base);
+                segment_unmap(s);
+                unlinkat(dir_fd, name, 0);
+                nsegs--;
+            } else {
+                s->limit = append_pos;
+                append_pos = 0;
+            }
+        }
+    }
+    if (nsegs && segs[nsegs - 1]->limit) {
+        struct segment *s = segment_map(end_offset, seg_bytes, 1);
+        if (!s) return -1;
+        segs[nsegs++] = s;
+    }
+    if (!nsegs) {
+        struct segment *s = segment_map(end_offset, seg_bytes, 1);
+        if (!s) return -1;
+        segs[nsegs++] = s;
+    }
+    durable_offset = end_offset;
+    first_seg = 0;
+    first_offset = segs[0]->base;
+    return 0;
+}
+
+/* delete the oldest sealed segments while the log is over --journal-retain,
+ * or the segment table is close to full; sync thread only */
+static void journal_prune(int last) {
+    size_t total = seg_bytes;
+    for (int i = first_seg; i < last; ++i) total += SEG(i)->limit;
+    while (first_seg < last) {
+        struct segment *s = SEG(first_seg);
+        int full = last - first_seg >= JOURNAL_MAX_SEGMENTS - JOURNAL_SEG_SLACK;
+        if (!full && (!retain_bytes || total <= retain_bytes)) break;
+        if (full && (!retain_bytes || total <= retain_bytes))
+            log_warn("journal: %d segments, dropping the oldest", last - first_seg + 1);
+        pthread_rwlock_wrlock(&prune_lock);
+        __atomic_store_n(&first_seg, first_seg + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&first_offset, SEG(first_seg)->base, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&prune_lock);
+        char name[32];
+        segment_name(name, sizeof(name), s->base);
+        if (unlinkat(dir_fd, name, 0) < 0) log_warn("journal: removing %s: %s", name, strerror(errno));
+        total -= s->limit;
+        segment_unmap(s);
+    }
+}
+
+static void *sync_main(void *arg) {
+    (void)arg;
+    int synced_seg = 0;
+    for (;;) {
+        int stopping = __atomic_load_n(&stop_sync, __ATOMIC_ACQUIRE);
+        if (!stopping) {
+            struct timespec ts = { sync_ms / 1000, (long)(sync_ms % 1000) * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+        uint64_t end = __atomic_load_n(&end_offset, __ATOMIC_ACQUIRE);
+        /* every record below end lives in segments first_seg .. last */
+        int last = __atomic_load_n(&nsegs, __ATOMIC_ACQUIRE) - 1;
+        if (end != durable_offset) {
+            uint64_t t0 = metrics_now_us();
+            if (synced_seg < first_seg) synced_seg = first_seg;
+            for (int i = synced_seg; i <= last; ++i) {
+                if (fdatasync(SEG(i)->fd) < 0)
+                    log_error("journal fdatasync: %s", strerror(errno));
+            }
+            metric_observe(stats.journal_sync_us, metrics_now_us() - t0);
+            synced_seg = last;
+            __atomic_store_n(&durable_offset, end, __ATOMIC_RELEASE);
+        }
+        journal_prune(last);
+        if (stopping) break;
+    }
+    return NULL;
+}
+
+int journal_open(const char *dir, size_t segment_bytes, size_t retain, int sync_interval_ms) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    seg_bytes = segment_bytes;
+    retain_bytes = retain;
+    sync_ms = sync_interval_ms;
+    if (journal_recover() < 0) {
+        int e = errno;
+        journal_close();
+        errno = e;
+        return -1;
+    }
+    stop_sync = 0;
+    if (pthread_create(&sync_tid, NULL, sync_main, NULL) != 0) {
+        journal_close();
+        errno = EAGAIN;
+        return -1;
+    }
+    enabled = 1;
+    log_info("journal %s: offsets %llu..%llu in %d segments", dir,
+             (unsigned long long)first_offset, (unsigned long long)end_offset, nsegs);
+    return 0;
+}
+
+void journal_close(void) {
+    if (enabled) {
+        __atomic_store_n(&stop_sync, 1, __ATOMIC_RELEASE);
+        pthread_join(sync_tid, NULL);
+        enabled = 0;
+    }
+    for (int i = first_seg; i < nsegs; ++i) segment_unmap(SEG(i));
+    nsegs = first_seg = 0;
+    if (dir_fd >= 0) close(dir_fd);
+    dir_fd = -1;
+}
+
+int journal_enabled(void) {
+    return enabled;
+}
+
+/* seal the active segment and start the next one; append_lock held */
+static int journal_roll(void) {
+    if (nsegs - __atomic_load_n(&first_seg, __ATOMIC_ACQUIRE) >= JOURNAL_MAX_SEGMENTS) {
+        errno = EMFILE;
+        return -1;
+    }
+    struct segment *s = segment_map(end_offset, seg_bytes, 1);
+    if (!s) return -1;
+    /* readers acquire end_offset, which is only released after an append
+     * into the new segment, so they see the limit first. The mapping
+     * keeps its size; nothing past limit is ever read. */
+    struct segment *old = SEG(nsegs - 1);
+    old->limit = append_pos;
+    if (ftruncate(old->fd, (off_t)append_pos) < 0)
+        log_warn("journal: truncating sealed segment: %s", strerror(errno));
+    SEG(nsegs) = s;
+    __atomic_store_n(&nsegs, nsegs + 1, __ATOMIC_RELEASE);
+    append_pos = 0;
+    return 0;
+}
+
+uint64_t journal_append(const char *topic, size_t topic_len, const char *payload, uint32_t len) {
+    size_t need = rec_size(topic_len, len);
+    if (need > seg_bytes || topic_len > UINT16_MAX) return JOURNAL_NONE;
+    pthread_mutex_lock(&append_lock);
+    if (append_pos + need > SEG(nsegs - 1)->cap && journal_roll() < 0) {
+        pthread_mutex_unlock(&append_lock);
+        log_error("journal: cannot open a new segment: %s", strerror(errno));
+        return JOURNAL_NONE;
+    }
+    struct segment *s = SEG(nsegs - 1);
+    struct jrec *r = (struct jrec *)(s->map + append_pos);
+    uint64_t off = end_offset;
+    r->offset = off;
+    r->topic_len = (uint16_t)topic_len;
+    r->flags = 0;
+    r->len = len;
+    memcpy(r->data, topic, topic_len);
+    memcpy(r->data + topic_len, payload, len);
+    r->sum = rec_sum(r);
+    r->size = (uint32_t)need;
+    append_pos += need;
+    __atomic_store_n(&end_offset, off + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&append_lock);
+    metric_inc(stats.journal_records);
+    metric_add(stats.journal_bytes, need);
+    return off;
+}
+
+uint64_t journal_end(void) {
+    return __atomic_load_n(&end_offset, __ATOMIC_ACQUIRE);
+}
+
+uint64_t journal_durable(void) {
+    return __atomic_load_n(&durable_offset, __ATOMIC_ACQUIRE);
+}
+
+uint64_t journal_first(void) {
+    return __atomic_load_n(&first_offset, __ATOMIC_ACQUIRE);
+}
+
+void journal_read_begin(void) {
+    pthread_rwlock_rdlock(&prune_lock);
+}
+
+void journal_read_end(void) {
+    pthread_rwlock_unlock(&prune_lock);
+}
+
+void journal_seek(struct journal_cursor *c, uint64_t offset) {
+    journal_read_begin();
+    uint64_t end = journal_end();
+    int n = __atomic_load_n(&nsegs, __ATOMIC_ACQUIRE);
+    if (offset < SEG(first_seg)->base) offset = SEG(first_seg)->base;
+    if (offset > end) offset = end;
+    /* last segment whose base is <= offset */
+    int lo = first_seg, hi = n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (SEG(mid)->base <= offset) lo = mid; else hi = mid - 1;
+    }
+    c->seg = lo;
+    c->pos = 0;
+    c->offset = SEG(lo)->base;
+    struct journal_rec r;
+    while (c->offset < offset && journal_next(c, end, &r)) {}
+    journal_read_end();
+}
+
+int journal_next(struct journal_cursor *c, uint64_t end, struct journal_rec *out) {
+    if (c->seg < first_seg) {
+        /* its segment was deleted meanwhile: go on from the oldest */
+        c->seg = first_seg;
+        c->pos = 0;
+    }
+    if (c->offset >= end) return 0;
+    for (;;) {
+        struct segment *s = SEG(c->seg);
+        if ((s->limit && c->pos >= s->limit) || c->pos + JREC_HDR > s->cap) {
+            c->seg++;
+            c->pos = 0;
+            continue;
+        }
+        const struct jrec *r = (const struct jrec *)(s->map + c->pos);
+        if (!r->size) {
+            c->seg++;
+            c->pos = 0;
+            continue;
+        }
+        /* only the last segment is checked at startup, so a sealed one
+         * torn or damaged on disk shows up here: callers copy len bytes */
+        size_t avail = (s->limit ? s->limit : s->cap) - c->pos;
+        if (r->size < JREC_HDR || r->size > avail || r->len > TINY_MAX_PAYLOAD ||
+            (size_t)r->topic_len + r->len > r->size - JREC_HDR ||
+            r->offset < c->offset || r->offset >= end) {
+            log_warn("journal: bad record in segment %llu at %zu, skipping the rest of it",
+                     (unsigned long long)s->base, c->pos);
+            if (c->seg + 1 >= __atomic_load_n(&nsegs, __ATOMIC_ACQUIRE)) {
+                c->offset = end;
+                return 0;
+            }
+            c->seg++;
+            c->pos = 0;
+            continue;
+        }
+        out->offset = r->offset;
+        out->topic = r->data;
+        out->topic_len = r->topic_len;
+        out->payload = r->data + r->topic_len;
+        out->len = r->len;
+        c->pos += r->size;
+        c->offset = r->offset + 1;
+        return 1;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef TINYIOT_JOURNAL_H
+#define TINYIOT_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Durable message log (--journal DIR).
+ * Every PUB is appended to one global log and gets the next offset. The
+ * log is a series of segment files named after their first offset; the
+ * active one is mapped and records are copied straight into the mapping,
+ * so an append is a memcpy under a mutex. A background thread fdatasyncs
+ * whatever was appended every sync interval (group commit), and readers
+ * walk the same mappings. The same thread deletes the oldest segments once
+ * the log is over its retention limit; a reader that was still behind
+ * them goes on from the oldest record left.
+ *
+ * Record layout, 8-byte aligned:
+ *   u32 size (whole record, padded) | u32 sum | u64 offset |
+ *   u16 topic_len | u16 0 | u32 payload_len | topic | payload
+ * sum is FNV-1a over topic and payload, used to find the end of the last
+ * segment after a crash.
+ */
+
+#define JOURNAL_NONE UINT64_MAX          /* offset of a message not in the log */
+
+struct journal_rec {
+    uint64_t offset;
+    const char *topic;
+    uint16_t topic_len;
+    const char *payload;
+    uint32_t len;
+};
+
+/* read position; fill with journal_seek */
+struct journal_cursor {
+    uint64_t offset;
+    int seg;
+    size_t pos;
+};
+
+/* open or create the log in dir, recovering the end of the last segment.
+ * retain: bytes of sealed segments to keep, 0 for all. 0 ok, -1 error
+ * (errno set) */
+int journal_open(const char *dir, size_t segment_bytes, size_t retain, int sync_ms);
+void journal_close(void);
+int journal_enabled(void);
+
+/* append a record; returns its offset or JOURNAL_NONE on failure */
+uint64_t journal_append(const char *topic, size_t topic_len, const char *payload, uint32_t len);
+
+/* offset the next append will get; every record below it is readable */
+uint64_t journal_end(void);
+/* every record below this offset has been synced to disk */
+uint64_t journal_durable(void);
+
+/* offset of the oldest record still in the log */
+uint64_t journal_first(void);
+
+/* position c at offset (clamped to the oldest record) */
+void journal_seek(struct journal_cursor *c, uint64_t offset);
+
+/* journal_next must be called between these; the records it returns
+ * point into the log and stay valid until journal_read_end. Segments are
+ * only deleted outside such a section, so keep it short. */
+void journal_read_begin(void);
+void journal_read_end(void);
+
+/* read the record at c and advance; 0 once c reaches end */
+int journal_next(struct journal_cursor *c, uint64_t end, struct journal_rec *r);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef TINYIOT_MAILBOX_H
+#define TINYIOT_MAILBOX_H
+
+#include <stddef.h>
+
+/* Intrusive lock-free multi-producer / single-consumer queue (Vyukov).
+ * Any reactor thread may push; only the owning reactor pops.
+ */
+struct mb_node {
+    struct mb_node *next;
+};
+
+struct mailbox {
+    struct mb_node *head;        /* producers swap themselves in here */
+    struct mb_node *tail;        /* consumer side */
+    struct mb_node stub;
+};
+
+static inline void mailbox_init(struct mailbox *mb) {
+    mb->stub.next = NULL;
+    mb->head = &mb->stub;
+    mb->tail = &mb->stub;
+}
+
+static inline void mailbox_push_node(struct mailbox *mb, struct mb_node *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    struct mb_node *prev = __atomic_exchange_n(&mb->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* Returns the oldest node or NULL when empty (or when a producer is midway
+ * through a push; it becomes visible on a later call). */
+static inline struct mb_node *mailbox_pop(struct mailbox *mb) {
+    struct mb_node *tail = mb->tail;
+    struct mb_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &mb->stub) {
+        if (!next) return NULL;
+        mb->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+    struct mb_node *head = __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE);
+    if (tail != head) return NULL;
+    /* last element: re-insert the stub so tail can advance past it */
+    mailbox_push_node(mb, &mb->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+#endif
@@ -1,38 +1,70 @@
 #define _GNU_SOURCE
 #include "proto.h"
+#include "reactor.h"
+#include "inbuf.h"
+#include "conn.h"
+#include "uring.h"
+#include "retain.h"
+#include "journal.h"
+#include "qos.h"
+#include "bridge.h"
+#include "log.h"
+#include "stats.h"
+#include "unixsock.h"
+#include "shmring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <getopt.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-/* forward decls */
-struct conn;
-extern struct conn *fd_map[];
-
 /* prototypes implemented in broker.c */
 int accept_new(int listen_fd);
 int process_fd_event(int fd);
 void close_connection(int fd);
 /* new: flush_outbuf called when EPOLLOUT */
 int flush_outbuf(int fd);
+/* deliver messages posted by other reactors */
+void drain_mailbox(void);
+/* write out connections that got output this iteration */
+void flush_dirty(void);
+int broker_init(void);
+
+struct reactor reactors[MAX_REACTORS];
+int nreactors = 1;
+static int use_uring = 0;
+static int unix_fd = -1;         /* --unix listener, shared by the reactors */
 
-/* global epoll fd used by broker.c */
-int epoll_fd = -1;
+__thread struct reactor *cur_reactor = NULL;
+__thread int epoll_fd = -1;
+unsigned int fd_limit;
 
 static volatile int keep_running = 1;
-void int_handler(int sig) { (void)sig; keep_running = 0; }
+void int_handler(int sig) { (void)sig; __atomic_store_n(&keep_running, 0, __ATOMIC_RELAXED); }
+
+void reactor_post(struct reactor *r, struct mb_node *n) {
+    mailbox_push_node(&r->mbox, n);
+    /* only the first producer after the owner drained pays for the wakeup */
+    if (__atomic_exchange_n(&r->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) log_error("write eventfd: %s", strerror(errno));
+    }
+}
 
 int create_and_bind(int port) {
     int sfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sfd == -1) { perror("socket"); return -1; }
     int opt = 1;
     setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    /* every reactor binds its own listener; the kernel spreads accepts */
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) { perror("SO_REUSEPORT"); close(sfd); return -1; }
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET; addr.sin_port = htons(port); addr.sin_addr.s_addr = INADDR_ANY;
@@ -40,47 +72,98 @@ int create_and_bind(int port) {
     return sfd;
 }
 
-int main(int argc, char **argv) {
-    int port = DEFAULT_PORT;
-    if (argc >= 2) port = atoi(argv[1]);
+static int reactor_init(struct reactor *r, int id, int port) {
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->listen_fd = r->epoll_fd = r->wake_fd = -1;
+    r->unix_fd = unix_fd;
+    mailbox_init(&r->mbox);
+    if (fdtab_init(&r->conns, fd_limit) < 0) { perror("conn table"); return -1; }
+    slab_init(&r->conn_slab, sizeof(struct conn));
+    conn_timers_init(&r->wheel);
 
-    signal(SIGINT, int_handler); signal(SIGTERM, int_handler);
+    r->listen_fd = create_and_bind(port);
+    if (r->listen_fd < 0) return -1;
+    if (set_nonblocking(r->listen_fd) == -1) { perror("set_nonblocking listen"); return -1; }
+    if (listen(r->listen_fd, LISTEN_BACKLOG) == -1) { perror("listen"); return -1; }
 
-    int listen_fd = create_and_bind(port);
-    if (listen_fd < 0) return 1;
-    if (set_nonblocking(listen_fd) == -1) { perror("set_nonblocking listen"); close(listen_fd); return 1; }
-    if (listen(listen_fd, LISTEN_BACKLOG) == -1) { perror("listen"); close(listen_fd); return 1; }
+    r->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->wake_fd == -1) { perror("eventfd"); return -1; }
+    /* the io_uring backend sets up its ring on the reactor thread */
+    if (use_uring) return 0;
 
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) { perror("epoll_create1"); close(listen_fd); return 1; }
+    r->epoll_fd = epoll_create1(0);
+    if (r->epoll_fd == -1) { perror("epoll_create1"); return -1; }
 
     struct epoll_event ev;
     ev.events = EPOLLIN;
-    ev.data.fd = listen_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) { perror("epoll_ctl add listen"); close(listen_fd); close(epoll_fd); return 1; }
+    ev.data.fd = r->listen_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) == -1) { perror("epoll_ctl add listen"); return -1; }
+    if (r->unix_fd >= 0) {
+        /* one reactor woken per connection, not all of them */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = r->unix_fd;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->unix_fd, &ev) == -1) { perror("epoll_ctl add unix listen"); return -1; }
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = r->wake_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1) { perror("epoll_ctl add eventfd"); return -1; }
+    return 0;
+}
 
-    fprintf(stderr, "brokerd listening on port %d\n", port);
+static void reactor_close(struct reactor *r) {
+    if (r->listen_fd >= 0) close(r->listen_fd);
+    if (r->epoll_fd >= 0) close(r->epoll_fd);
+    if (r->wake_fd >= 0) close(r->wake_fd);
+    fdtab_free(&r->conns);
+    slab_destroy(&r->conn_slab);
+    inbuf_pool_free(r);
+}
+
+static void *reactor_loop(void *arg) {
+    struct reactor *r = arg;
+    cur_reactor = r;
+    metric_thread_init();
+    epoll_fd = r->epoll_fd;
+
+    if (use_uring) {
+        if (uring_reactor_loop(r, &keep_running) < 0) {
+            log_error("reactor %d: io_uring setup failed", r->id);
+            __atomic_store_n(&keep_running, 0, __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
 
     const int MAX_EVENTS = 64;
     struct epoll_event events[MAX_EVENTS];
 
-    while (keep_running) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+    while (__atomic_load_n(&keep_running, __ATOMIC_RELAXED)) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, broker_timeout_ms());
         if (n < 0) {
             if (errno == EINTR) continue;
-            perror("epoll_wait");
+            log_error("epoll_wait: %s", strerror(errno));
             break;
         }
+        /* deadlines first: the events below are stamped with this tick */
+        broker_tick();
         for (int i = 0; i < n; ++i) {
             int fd = events[i].data.fd;
             uint32_t evts = events[i].events;
-            fprintf(stderr, "[DBG] epoll event fd=%d ev=0x%x\n", fd, evts);
-            if (fd == listen_fd) {
-                accept_new(listen_fd);
+            log_debug("epoll event fd=%d ev=0x%x", fd, evts);
+            if (fd == r->listen_fd || fd == r->unix_fd) {
+                accept_new(fd);
+                continue;
+            }
+            if (fd == r->wake_fd) {
+                uint64_t cnt;
+                if (read(r->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) log_error("read eventfd: %s", strerror(errno));
+                /* clear before draining so a concurrent post re-arms us */
+                __atomic_store_n(&r->wake_pending, 0, __ATOMIC_RELEASE);
+                drain_mailbox();
                 continue;
             }
             if (evts & (EPOLLHUP | EPOLLERR)) {
-                fprintf(stderr, "[INFO] epoll hangup/err on fd=%d\n", fd);
+                log_info("epoll hangup/err on fd=%d", fd);
                 close_connection(fd);
                 continue;
             }
@@ -99,11 +182,315 @@ int main(int argc, char **argv) {
                 }
             }
         }
+        flush_dirty();
+    }
+
+    for (unsigned int i = 0; i < r->conns.size; ++i) if (r->conns.slot[i]) close_connection((int)i);
+    drain_mailbox();
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--threads N] [--backend epoll|uring] [--log-level L] [--metrics-port P]\n"
+                    "       [--outq-high BYTES] [--outq-low BYTES] [--mem-budget BYTES]\n"
+                    "       [--slow-policy disconnect|drop-newest|drop-oldest] [--retain-max BYTES]\n"
+                    "       [--share-policy round-robin|least-queued]\n"
+                    "       [--journal DIR] [--journal-segment BYTES] [--journal-sync-ms MS]\n"
+                    "       [--journal-retain BYTES]\n"
+                    "       [--qos-window N] [--qos-timeout-ms MS] [--qos-session-ttl S]\n"
+                    "       [--idle-timeout S] [--frame-timeout S] [--send-timeout S]\n"
+                    "       [--node NAME] [--peer HOST:PORT]... [--unix PATH]\n"
+                    "       [--shm NAME] [--shm-size BYTES] [port]\n", prog);
+}
+
+/* "512k", "4M", "1G" or plain bytes; -1 on garbage */
+static long long parse_bytes(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || v < 0) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return *end ? -1 : v;
+}
+
+int main(int argc, char **argv) {
+    int port = DEFAULT_PORT;
+    int log_level_arg = -1;
+    int metrics_port = 0;
+    long long low = -1;
+    size_t retain_max = 16 * 1024 * 1024;
+    const char *journal_dir = NULL;
+    size_t journal_segment = 64 * 1024 * 1024;
+    size_t journal_retain = 0;
+    int journal_sync_ms = 10;
+    const char *node = NULL;
+    const char *unix_path = NULL;
+    const char *shm_name = NULL;
+    size_t shm_size = 4 * 1024 * 1024;
+    static const struct option opts[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "backend", required_argument, NULL, 'b' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "metrics-port", required_argument, NULL, 'm' },
+        { "outq-high", required_argument, NULL, 'H' },
+        { "outq-low",  required_argument, NULL, 'L' },
+        { "mem-budget", required_argument, NULL, 'M' },
+        { "slow-policy", required_argument, NULL, 'p' },
+        { "retain-max", required_argument, NULL, 'r' },
+        { "share-policy", required_argument, NULL, 'g' },
+        { "journal", required_argument, NULL, 'j' },
+        { "journal-segment", required_argument, NULL, 'S' },
+        { "journal-sync-ms", required_argument, NULL, 'y' },
+        { "journal-retain", required_argument, NULL, 'R' },
+        { "qos-window", required_argument, NULL, 'w' },
+        { "qos-timeout-ms", required_argument, NULL, 'T' },
+        { "qos-session-ttl", required_argument, NULL, 'e' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "frame-timeout", required_argument, NULL, 'f' },
+        { "send-timeout", required_argument, NULL, 's' },
+        { "node", required_argument, NULL, 'n' },
+        { "peer", required_argument, NULL, 'P' },
+        { "unix", required_argument, NULL, 'u' },
+        { "shm", required_argument, NULL, 'x' },
+        { "shm-size", required_argument, NULL, 'X' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:b:l:m:H:L:M:p:r:g:j:S:y:R:w:T:e:i:f:s:n:P:u:x:X:h", opts, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            nreactors = atoi(optarg);
+            if (nreactors < 1 || nreactors > MAX_REACTORS) {
+                fprintf(stderr, "--threads must be between 1 and %d\n", MAX_REACTORS);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                fprintf(stderr, "--backend must be epoll or uring\n");
+                return 1;
+            }
+            break;
+        case 'l': {
+            int level = log_parse_level(optarg);
+            if (level < 0) {
+                fprintf(stderr, "--log-level must be error, warn, info or debug\n");
+                return 1;
+            }
+            log_level_arg = level;
+            break;
+        }
+        case 'm':
+            metrics_port = atoi(optarg);
+            if (metrics_port <= 0 || metrics_port > 65535) {
+                fprintf(stderr, "--metrics-port must be a TCP port\n");
+                return 1;
+            }
+            break;
+        case 'H': {
+            long long v = parse_bytes(optarg);
+            if (v <= 0) { fprintf(stderr, "--outq-high must be a positive size\n"); return 1; }
+            flow.high = (size_t)v;
+            break;
+        }
+        case 'L':
+            low = parse_bytes(optarg);
+            if (low < 0) { fprintf(stderr, "--outq-low must be a size\n"); return 1; }
+            break;
+        case 'M': {
+            long long v = parse_bytes(optarg);
+            if (v < 0) { fprintf(stderr, "--mem-budget must be a size (0 = unlimited)\n"); return 1; }
+            flow.budget = (size_t)v;
+            break;
+        }
+        case 'p': {
+            int p = slow_policy_parse(optarg);
+            if (p < 0) { fprintf(stderr, "--slow-policy must be disconnect, drop-newest or drop-oldest\n"); return 1; }
+            flow.policy = (enum slow_policy)p;
+            break;
+        }
+        case 'r': {
+            long long v = parse_bytes(optarg);
+            if (v < 0) { fprintf(stderr, "--retain-max must be a size (0 = no retained messages)\n"); return 1; }
+            retain_max = (size_t)v;
+            break;
+        }
+        case 'g': {
+            int p = share_policy_parse(optarg);
+            if (p < 0) { fprintf(stderr, "--share-policy must be round-robin or least-queued\n"); return 1; }
+            share_policy = (enum share_policy)p;
+            break;
+        }
+        case 'j':
+            journal_dir = optarg;
+            break;
+        case 'S': {
+            long long v = parse_bytes(optarg);
+            if (v < 64 * 1024) { fprintf(stderr, "--journal-segment must be at least 64k\n"); return 1; }
+            journal_segment = (size_t)v;
+            break;
+        }
+        case 'R': {
+            long long v = parse_bytes(optarg);
+            if (v < 0) { fprintf(stderr, "--journal-retain must be a size (0 = keep everything)\n"); return 1; }
+            journal_retain = (size_t)v;
+            break;
+        }
+        case 'y':
+            journal_sync_ms = atoi(optarg);
+            if (journal_sync_ms < 1) { fprintf(stderr, "--journal-sync-ms must be positive\n"); return 1; }
+            break;
+        case 'w': {
+            int v = atoi(optarg);
+            if (v < 1 || v > 65536) { fprintf(stderr, "--qos-window must be between 1 and 65536\n"); return 1; }
+            qos_limits.window = (unsigned int)v;
+            break;
+        }
+        case 'T': {
+            int v = atoi(optarg);
+            if (v < 100) { fprintf(stderr, "--qos-timeout-ms must be at least 100\n"); return 1; }
+            qos_limits.timeout_ms = (unsigned int)v;
+            break;
+        }
+        case 'e': {
+            int v = atoi(optarg);
+            if (v < 0) { fprintf(stderr, "--qos-session-ttl must not be negative\n"); return 1; }
+            qos_limits.ttl_s = (unsigned int)v;
+            break;
+        }
+        case 'i': case 'f': case 's': {
+            int v = atoi(optarg);
+            const char *name = opt == 'i' ? "idle" : opt == 'f' ? "frame" : "send";
+            if (v < 0) { fprintf(stderr, "--%s-timeout must not be negative (0 = off)\n", name); return 1; }
+            if (opt == 'i') timeouts.idle = (unsigned int)v;
+            else if (opt == 'f') timeouts.frame = (unsigned int)v;
+            else timeouts.send = (unsigned int)v;
+            break;
+        }
+        case 'n':
+            if (!*optarg || strchr(optarg, ' ') || strlen(optarg) > 63) {
+                fprintf(stderr, "--node must be 1 to 63 characters without spaces\n");
+                return 1;
+            }
+            node = optarg;
+            break;
+        case 'P':
+            if (bridge_add_peer(optarg) < 0) {
+                fprintf(stderr, "--peer %s: expected HOST:PORT (at most %d peers)\n", optarg, BRIDGE_MAX_PEERS);
+                return 1;
+            }
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'x':
+            if (!*optarg || strchr(optarg, '/') || strlen(optarg) > 200) {
+                fprintf(stderr, "--shm must be a name without slashes\n");
+                return 1;
+            }
+            shm_name = optarg;
+            break;
+        case 'X': {
+            long long v = parse_bytes(optarg);
+            if (v < SHM_RING_MIN || (v & (v - 1))) {
+                fprintf(stderr, "--shm-size must be a power of two, at least 64k\n");
+                return 1;
+            }
+            shm_size = (size_t)v;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) port = atoi(argv[optind]);
+    bridge_set_node(node, port);
+    flow.low = low >= 0 ? (size_t)low : flow.high / 2;
+    if (flow.low > flow.high) {
+        fprintf(stderr, "--outq-low must not exceed --outq-high\n");
+        return 1;
+    }
+
+    if (log_init(NULL) < 0) fprintf(stderr, "log thread unavailable, logging synchronously\n");
+    if (log_level_arg >= 0) log_set_level(log_level_arg);
+    signal(SIGINT, int_handler); signal(SIGTERM, int_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (use_uring && uring_probe() < 0) {
+        log_warn("io_uring unavailable (%s), falling back to epoll", strerror(errno));
+        use_uring = 0;
+    }
+    fd_limit = fd_limit_raise();
+    log_info("descriptor limit %u", fd_limit);
+    stats_init();
+    if (broker_init() < 0 || retain_init(retain_max) < 0) { log_shutdown(); return 1; }
+    if (journal_dir && journal_open(journal_dir, journal_segment, journal_retain, journal_sync_ms) < 0) {
+        log_error("journal %s: %s", journal_dir, strerror(errno));
+        log_shutdown();
+        return 1;
+    }
+    if (metrics_port && metrics_listen(metrics_port) < 0)
+        log_warn("metrics listener on port %d: %s", metrics_port, strerror(errno));
+    if (unix_path && (unix_fd = unix_listen(unix_path, LISTEN_BACKLOG)) < 0) {
+        log_error("--unix %s: %s", unix_path, strerror(errno));
+        journal_close();
+        log_shutdown();
+        return 1;
+    }
+    if (shm_name && shmring_open(shm_name, shm_size, nreactors) < 0) {
+        log_error("--shm %s: %s", shm_name, strerror(errno));
+        unix_unlisten(unix_fd, unix_path);
+        journal_close();
+        log_shutdown();
+        return 1;
+    }
+    for (int i = 0; i < nreactors; ++i) {
+        if (reactor_init(&reactors[i], i, port) < 0) {
+            for (int j = 0; j <= i; ++j) reactor_close(&reactors[j]);
+            unix_unlisten(unix_fd, unix_path);
+            shmring_close();
+            journal_close();
+            log_shutdown();
+            return 1;
+        }
+    }
+
+    log_info("brokerd %s listening on port %d%s%s (%d reactor%s, %s)", bridge_node, port,
+            unix_path ? " and " : "", unix_path ? unix_path : "", nreactors,
+            nreactors > 1 ? "s" : "", use_uring ? "io_uring" : "epoll");
+    if (shm_name) log_info("writing every message to /dev/shm/%s (%d ring%s of %zu bytes)", shm_name,
+                           nreactors, nreactors > 1 ? "s" : "", shm_size);
+
+    /* reactor 0 runs on the main thread */
+    for (int i = 1; i < nreactors; ++i) {
+        if (pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]) != 0) {
+            perror("pthread_create");
+            keep_running = 0;
+            nreactors = i;
+            break;
+        }
     }
+    reactor_loop(&reactors[0]);
+    for (int i = 1; i < nreactors; ++i) pthread_join(reactors[i].tid, NULL);
 
-    fprintf(stderr, "shutting down brokerd\n");
-    close(listen_fd);
-    close(epoll_fd);
-    for (int i = 0; i < MAX_FD_LIMIT; ++i) if (fd_map[i]) close_connection(i);
+    metrics_stop();
+    uint64_t ctl = metric_value(stats.epoll_ctl), queued = metric_value(stats.msgs_out);
+    log_info("%llu epoll_ctl calls for %llu queued messages (%.4f per message)",
+             (unsigned long long)ctl, (unsigned long long)queued, queued ? (double)ctl / queued : 0.0);
+    log_info("shutting down brokerd");
+    for (int i = 0; i < nreactors; ++i) reactor_close(&reactors[i]);
+    unix_unlisten(unix_fd, unix_path);
+    shmring_close();
+    qos_shutdown();
+    retain_shutdown();
+    journal_close();
+    log_shutdown();
     return 0;
 }
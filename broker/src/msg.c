@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include "msg.h"
+#include "stats.h"
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+struct msg *msg_new(uint32_t len) {
+    struct msg *m = malloc(sizeof(*m) + len);
+    if (!m) return NULL;
+    m->refcnt = 1;
+    m->len = len;
+    m->room = 0;
+    m->reply = 0;
+    m->ts_us = 0;
+    m->seq = JOURNAL_NONE;
+    m->topic = NULL;
+    return m;
+}
+
+struct msg *msg_frame_payload(const char *payload, uint32_t len) {
+    struct msg *m = msg_new((uint32_t)sizeof(uint32_t) + len);
+    if (!m) return NULL;
+    uint32_t be = htonl(len);
+    memcpy(m->data, &be, sizeof(uint32_t));
+    memcpy(m->data + sizeof(uint32_t), payload, len);
+    return m;
+}
+
+struct msg *msg_frame_topic(const char *topic, const char *payload, uint32_t len) {
+    size_t tlen = strlen(topic);
+    uint32_t flen = (uint32_t)sizeof(uint32_t) + len;
+    struct msg *m = malloc(sizeof(*m) + flen + tlen + 1);
+    if (!m) return NULL;
+    m->refcnt = 1;
+    m->len = flen;
+    m->room = 0;
+    m->reply = 0;
+    m->ts_us = 0;
+    m->seq = JOURNAL_NONE;
+    uint32_t be = htonl(len);
+    memcpy(m->data, &be, sizeof(uint32_t));
+    memcpy(m->data + sizeof(uint32_t), payload, len);
+    memcpy(m->data + flen, topic, tlen + 1);
+    m->topic = m->data + flen;
+    return m;
+}
+
+void msg_unref(struct msg *m) {
+    if (!m) return;
+    if (__atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL) == 0) free(m);
+}
+
+static int outq_grow(struct outq *q) {
+    unsigned int ncap = q->cap ? q->cap * 2 : 8;
+    struct msg **nr = malloc(ncap * sizeof(*nr));
+    if (!nr) return -1;
+    /* unroll the ring so head lands at index 0 */
+    for (unsigned int i = 0; i < q->count; ++i)
+        nr[i] = q->ring[(q->head + i) & (q->cap - 1)];
+    free(q->ring);
+    q->ring = nr;
+    q->cap = ncap;
+    q->head = 0;
+    return 0;
+}
+
+/* only the owning thread changes *acct; others just read it */
+static void outq_account(struct outq *q, long delta) {
+    if (q->acct) __atomic_store_n(q->acct, *q->acct + (size_t)delta, __ATOMIC_RELAXED);
+}
+
+int outq_push(struct outq *q, struct msg *m) {
+    if (q->count == q->cap && outq_grow(q) < 0) return -1;
+    q->ring[(q->head + q->count) & (q->cap - 1)] = msg_ref(m);
+    q->count++;
+    q->bytes += m->len;
+    outq_account(q, (long)m->len);
+    return 0;
+}
+
+int outq_push_reply(struct outq *q, const char *s, size_t len) {
+    if (q->count > q->pinned) {
+        struct msg *t = q->ring[(q->head + q->count - 1) & (q->cap - 1)];
+        if (t->reply && t->room >= len) {
+            memcpy(t->data + t->len, s, len);
+            t->len += (uint32_t)len;
+            t->room -= (uint32_t)len;
+            q->bytes += len;
+            outq_account(q, (long)len);
+            return 0;
+        }
+    }
+    size_t cap = len > REPLY_MSG_SIZE ? len : REPLY_MSG_SIZE;
+    struct msg *m = msg_new((uint32_t)cap);
+    if (!m) return -1;
+    memcpy(m->data, s, len);
+    m->len = (uint32_t)len;
+    m->room = (uint32_t)(cap - len);
+    m->reply = 1;
+    int r = outq_push(q, m);
+    msg_unref(m);
+    return r;
+}
+
+/* release the head message after it has been fully written */
+static void outq_pop(struct outq *q) {
+    msg_unref(q->ring[q->head]);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+    q->head_off = 0;
+}
+
+int outq_iov(const struct outq *q, struct iovec *iov, int max, size_t *bytes) {
+    int n = 0;
+    size_t want = 0;
+    for (unsigned int i = 0; i < q->count && n < max; ++i, ++n) {
+        struct msg *m = q->ring[(q->head + i) & (q->cap - 1)];
+        size_t off = (i == 0) ? q->head_off : 0;
+        iov[n].iov_base = m->data + off;
+        iov[n].iov_len = m->len - off;
+        want += iov[n].iov_len;
+    }
+    if (bytes) *bytes = want;
+    return n;
+}
+
+void outq_consume(struct outq *q, size_t n) {
+    uint64_t now = 0;
+    q->bytes -= n;
+    outq_account(q, -(long)n);
+    while (n > 0) {
+        struct msg *m = q->ring[q->head];
+        size_t rem = m->len - q->head_off;
+        if (n < rem) { q->head_off += n; break; }
+        n -= rem;
+        if (m->ts_us) {
+            if (!now) now = metrics_now_us();
+            metric_observe(stats.flush_latency, now - m->ts_us);
+        }
+        outq_pop(q);
+    }
+}
+
+int outq_flush(struct outq *q, int fd) {
+    struct iovec iov[OUTQ_IOV_MAX];
+    while (q->count > 0) {
+        /* gather as many queued messages as fit in one writev */
+        size_t want = 0;
+        int n = outq_iov(q, iov, OUTQ_IOV_MAX, &want);
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        outq_consume(q, (size_t)w);
+        /* short write: socket buffer is full */
+        if ((size_t)w < want) return 1;
+    }
+    return 0;
+}
+
+size_t outq_drop_oldest(struct outq *q) {
+    unsigned int keep = q->pinned;
+    if (!keep && q->head_off) keep = 1;
+    unsigned int mask = q->cap - 1;
+    /* replies are answers the client waits for: skip over them */
+    while (keep < q->count && q->ring[(q->head + keep) & mask]->reply) keep++;
+    if (keep >= q->count) return 0;
+    struct msg *victim = q->ring[(q->head + keep) & mask];
+    /* slide the messages before it over the victim's slot */
+    for (unsigned int j = keep; j > 0; --j)
+        q->ring[(q->head + j) & mask] = q->ring[(q->head + j - 1) & mask];
+    q->head = (q->head + 1) & mask;
+    q->count--;
+    size_t len = victim->len;
+    q->bytes -= len;
+    outq_account(q, -(long)len);
+    msg_unref(victim);
+    return len;
+}
+
+void outq_clear(struct outq *q) {
+    outq_account(q, -(long)q->bytes);
+    while (q->count > 0) outq_pop(q);
+    free(q->ring);
+    size_t *acct = q->acct;
+    memset(q, 0, sizeof(*q));
+    q->acct = acct;
+}
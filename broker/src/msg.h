@@ -0,0 +1,93 @@
+#ifndef TINYIOT_MSG_H
+#define TINYIOT_MSG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Reference-counted, already framed message.
+ * A PUB is framed once (4-byte BE len + payload) and the same object is
+ * queued on every subscriber; it is freed when the last queue drops it.
+ * Subscribers may live on different reactor threads, so the count is
+ * atomic.
+ */
+struct msg {
+    unsigned int refcnt;
+    uint32_t len;                /* bytes in data[] */
+    uint32_t room;               /* replies: bytes still free after len */
+    unsigned int reply : 1;      /* control replies, never shared or shed */
+    uint64_t ts_us;              /* publish time for latency metrics, 0 if unset */
+    uint64_t seq;                /* journal offset, JOURNAL_NONE if not logged */
+    const char *topic;           /* stored after the frame, NULL if unknown */
+    char data[];
+};
+
+/* build a frame "4-byte BE len + payload"; refcnt starts at 1 */
+struct msg *msg_frame_payload(const char *payload, uint32_t len);
+
+/* same frame, with topic kept after it (not sent) for msg->topic */
+struct msg *msg_frame_topic(const char *topic, const char *payload, uint32_t len);
+
+/* unframed message of len bytes for the caller to fill; refcnt 1 */
+struct msg *msg_new(uint32_t len);
+
+static inline struct msg *msg_ref(struct msg *m) {
+    __atomic_fetch_add(&m->refcnt, 1, __ATOMIC_RELAXED);
+    return m;
+}
+void msg_unref(struct msg *m);
+
+/* max messages gathered into a single writev */
+#define OUTQ_IOV_MAX 64
+
+/* Per-connection output queue: ring of message references.
+ * Appending is O(1) (amortized) and never copies message bytes.
+ */
+struct outq {
+    struct msg **ring;
+    unsigned int cap;            /* power of two, 0 when unallocated */
+    unsigned int head;
+    unsigned int count;
+    size_t head_off;             /* bytes of ring[head] already sent */
+    size_t bytes;                /* total unsent bytes */
+    unsigned int pinned;         /* head messages owned by an in-flight send */
+    size_t *acct;                /* owner's running total of queued bytes, or NULL */
+};
+
+/* take a new reference to m and append it. 0 ok, -1 OOM */
+int outq_push(struct outq *q, struct msg *m);
+
+/* bytes allocated for a reply message; consecutive replies share one */
+#define REPLY_MSG_SIZE 1024
+
+/* append control reply text (OK, ERR, PONG, PUBACK): into the reply
+ * message at the tail while it has room and no send owns it, else into
+ * a new one. 0 ok, -1 OOM */
+int outq_push_reply(struct outq *q, const char *s, size_t len);
+
+/* write pending data to fd, many messages per writev. Returns:
+ *   0 -> queue empty
+ *   1 -> still pending (would block)
+ *  -1 -> fatal error
+ */
+int outq_flush(struct outq *q, int fd);
+
+/* describe up to max pending messages as iovecs (head offset applied);
+ * *bytes receives their total length. Returns the iovec count. */
+int outq_iov(const struct outq *q, struct iovec *iov, int max, size_t *bytes);
+
+/* mark n bytes as written, releasing fully sent messages (and timing
+ * the ones that carry a publish timestamp) */
+void outq_consume(struct outq *q, size_t n);
+
+/* drop the oldest message that is not being written (not partially sent,
+ * not pinned) and not a reply. Returns its size, 0 if there is none. */
+size_t outq_drop_oldest(struct outq *q);
+
+/* drop every queued reference and release the ring */
+void outq_clear(struct outq *q);
+
+static inline int outq_empty(const struct outq *q) { return q->count == 0; }
+
+#endif
@@ -5,10 +5,33 @@
 #include <sys/types.h>
 
 #define TINY_MAX_PAYLOAD 8192
+/* MPUB <n> <bytes>: at most this many records and record bytes */
+#define TINY_MAX_BATCH 256
+#define TINY_MAX_BATCH_BYTES (64 * 1024)
 #define TINY_MAX_LINE 1024
-#define LISTEN_BACKLOG 128
+#define TINY_MAX_TOPIC 256           /* topic bytes, NUL included */
+#define LISTEN_BACKLOG 4096         /* capped by net.core.somaxconn */
 #define DEFAULT_PORT 5000
-#define MAX_FD_LIMIT 10000
+
+/* Binary protocol v2, chosen with "HELLO <ROLE> <NODE_ID> V2" (the reply
+ * is "OK V2"; older brokers answer plain "OK"). From then on the client
+ * sends frames instead of text lines, all fields big endian:
+ *   u8 op | u8 flags | u16 id | u32 len | body[len]
+ * V2_ALIAS registers topic alias id (1..V2_MAX_ALIAS) with the topic as
+ * body; V2_PUB publishes body on alias id, and with V2_F_ACK the body
+ * starts with a u32 packet id answered by "PUBACK <id>"; V2_MPUB carries
+ * records "u16 alias | u32 len | payload" (same V2_F_ACK rule); V2_CMD
+ * carries any other text command without its newline. Replies and
+ * deliveries keep the text protocol format.
+ *
+ * Text MPUB records are "u16 topic_len | topic | u32 len | payload". */
+#define V2_HDR_LEN 8
+#define V2_MAX_ALIAS 1024
+#define V2_ALIAS 1
+#define V2_PUB 2
+#define V2_CMD 3
+#define V2_MPUB 4
+#define V2_F_ACK 0x01
 
 int set_nonblocking(int fd);
 
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "qos.h"
+#include "topics.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PARKED_BUCKETS 1024
+
+struct qos_limits qos_limits = {
+    .window = 64,
+    .timeout_ms = 5000,
+    .ttl_s = 300,
+};
+
+/* parked sessions: hash by node id plus a FIFO by park time for expiry.
+ * Reconnects may land on any reactor, hence the lock. */
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct qos_session *parked_hash[PARKED_BUCKETS];
+static struct qos_session *parked_head, *parked_tail;
+static size_t parked_count;
+
+struct qos_session *qos_session_new(const char *node_id) {
+    struct qos_session *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    strncpy(s->node_id, node_id, sizeof(s->node_id) - 1);
+    s->next_id = 1;
+    return s;
+}
+
+void qos_session_free(struct qos_session *s) {
+    if (!s) return;
+    for (unsigned int i = 0; i < s->count; ++i) msg_unref(qos_at(s, i)->m);
+    free(s->ring);
+    free(s);
+}
+
+static int qos_grow(struct qos_session *s) {
+    unsigned int ncap = s->cap ? s->cap * 2 : 16;
+    struct qos_entry *nr = malloc(ncap * sizeof(*nr));
+    if (!nr) return -1;
+    for (unsigned int i = 0; i < s->count; ++i) nr[i] = *qos_at(s, i);
+    free(s->ring);
+    s->ring = nr;
+    s->cap = ncap;
+    s->head = 0;
+    return 0;
+}
+
+int qos_push(struct qos_session *s, struct msg *m) {
+    if (s->count == s->cap && qos_grow(s) < 0) return -1;
+    struct qos_entry *e = &s->ring[(s->head + s->count) & (s->cap - 1)];
+    e->id = s->next_id++;
+    if (!s->next_id) s->next_id = 1;   /* 0 is never a packet id */
+    e->m = msg_ref(m);
+    s->count++;
+    s->bytes += m->len;
+    return 0;
+}
+
+unsigned int qos_ack(struct qos_session *s, uint32_t id) {
+    unsigned int n = 0;
+    /* ids wrap: compare in serial number arithmetic */
+    while (s->sent > 0 && (int32_t)(s->ring[s->head].id - id) <= 0) {
+        struct qos_entry *e = &s->ring[s->head];
+        s->bytes -= e->m->len;
+        msg_unref(e->m);
+        s->head = (s->head + 1) & (s->cap - 1);
+        s->count--;
+        s->sent--;
+        n++;
+    }
+    if (n) s->sent_us = metrics_now_us();
+    return n;
+}
+
+size_t qos_drop_oldest(struct qos_session *s) {
+    if (s->sent >= s->count) return 0;
+    unsigned int mask = s->cap - 1;
+    struct qos_entry victim = s->ring[(s->head + s->sent) & mask];
+    /* slide the written entries over the victim's slot */
+    for (unsigned int j = s->sent; j > 0; --j)
+        s->ring[(s->head + j) & mask] = s->ring[(s->head + j - 1) & mask];
+    s->head = (s->head + 1) & mask;
+    s->count--;
+    size_t len = victim.m->len;
+    s->bytes -= len;
+    msg_unref(victim.m);
+    return len;
+}
+
+static struct qos_session **parked_slot(const char *node_id) {
+    uint32_t h = topic_hash(node_id, strlen(node_id));
+    struct qos_session **pp = &parked_hash[h & (PARKED_BUCKETS - 1)];
+    while (*pp && strcmp((*pp)->node_id, node_id) != 0) pp = &(*pp)->hnext;
+    return pp;
+}
+
+static void parked_unlink(struct qos_session *s) {
+    struct qos_session **pp = parked_slot(s->node_id);
+    *pp = s->hnext;
+    if (s->prev) s->prev->next = s->next; else parked_head = s->next;
+    if (s->next) s->next->prev = s->prev; else parked_tail = s->prev;
+    s->prev = s->next = s->hnext = NULL;
+    parked_count--;
+}
+
+/* drop sessions parked longer than ttl; parked_lock held */
+static void parked_expire(uint64_t now) {
+    uint64_t ttl = (uint64_t)qos_limits.ttl_s * 1000000u;
+    while (parked_head && now - parked_head->parked_us > ttl) {
+        struct qos_session *s = parked_head;
+        parked_unlink(s);
+        qos_session_free(s);
+    }
+}
+
+void qos_park(struct qos_session *s) {
+    uint64_t now = metrics_now_us();
+    s->c = NULL;
+    s->parked_us = now;
+    pthread_mutex_lock(&parked_lock);
+    parked_expire(now);
+    struct qos_session **pp = parked_slot(s->node_id);
+    struct qos_session *old = *pp;
+    if (old) {
+        /* a newer disconnect of the same node replaces what was parked */
+        parked_unlink(old);
+        qos_session_free(old);
+        pp = parked_slot(s->node_id);
+    }
+    s->hnext = NULL;
+    *pp = s;
+    s->next = NULL;
+    s->prev = parked_tail;
+    if (parked_tail) parked_tail->next = s; else parked_head = s;
+    parked_tail = s;
+    parked_count++;
+    pthread_mutex_unlock(&parked_lock);
+}
+
+struct qos_session *qos_claim(const char *node_id) {
+    pthread_mutex_lock(&parked_lock);
+    parked_expire(metrics_now_us());
+    struct qos_session *s = *parked_slot(node_id);
+    if (s) parked_unlink(s);
+    pthread_mutex_unlock(&parked_lock);
+    return s;
+}
+
+void qos_expire(void) {
+    static uint64_t last_us;
+    uint64_t now = metrics_now_us();
+    if (now - last_us < 1000000) return;
+    last_us = now;
+    pthread_mutex_lock(&parked_lock);
+    parked_expire(now);
+    pthread_mutex_unlock(&parked_lock);
+}
+
+size_t qos_parked(void) {
+    pthread_mutex_lock(&parked_lock);
+    size_t n = parked_count;
+    pthread_mutex_unlock(&parked_lock);
+    return n;
+}
+
+void qos_shutdown(void) {
+    pthread_mutex_lock(&parked_lock);
+    while (parked_head) {
+        struct qos_session *s = parked_head;
+        parked_unlink(s);
+        qos_session_free(s);
+    }
+    pthread_mutex_unlock(&parked_lock);
+}
@@ -0,0 +1,78 @@
+#ifndef TINYIOT_QOS_H
+#define TINYIOT_QOS_H
+
+#include "msg.h"
+#include <stdint.h>
+#include <stddef.h>
+
+struct conn;
+
+/* At-least-once delivery state of one subscriber (QOS 1).
+ * Every message for the subscriber gets the next packet id and stays in
+ * the ring until an ACK covers it. The first `sent` entries have been
+ * written and await their ACK; at most qos_limits.window of them at a
+ * time, so acks overlap with delivery instead of gating each message.
+ *
+ * When the connection goes away with messages still unacked the session
+ * is parked under its node id and the next QOS 1 from that node picks it
+ * up and sends everything again. Parked sessions expire after ttl_s.
+ */
+
+struct qos_limits {
+    unsigned int window;         /* unacked messages written at once */
+    unsigned int timeout_ms;     /* resend unacked after this long */
+    unsigned int ttl_s;          /* parked session lifetime */
+};
+
+extern struct qos_limits qos_limits;
+
+struct qos_entry {
+    uint32_t id;
+    struct msg *m;
+};
+
+struct qos_session {
+    char node_id[64];
+    uint32_t next_id;
+    struct qos_entry *ring;
+    unsigned int cap;            /* power of two */
+    unsigned int head;
+    unsigned int count;
+    unsigned int sent;           /* entries from head written, awaiting ACK */
+    size_t bytes;                /* frame bytes of every entry held */
+    uint64_t sent_us;            /* last time the oldest unacked one was written or acked */
+    uint64_t parked_us;
+    struct conn *c;              /* attached connection, NULL while parked */
+    struct qos_session *prev, *next;   /* owner reactor's list, or the parked FIFO */
+    struct qos_session *hnext;         /* parked hash chain */
+};
+
+struct qos_session *qos_session_new(const char *node_id);
+void qos_session_free(struct qos_session *s);
+
+/* append m under the next packet id. 0 ok, -1 OOM */
+int qos_push(struct qos_session *s, struct msg *m);
+
+/* cumulative ACK: release every written entry up to and including id.
+ * Returns how many were released. */
+unsigned int qos_ack(struct qos_session *s, uint32_t id);
+
+static inline struct qos_entry *qos_at(struct qos_session *s, unsigned int i) {
+    return &s->ring[(s->head + i) & (s->cap - 1)];
+}
+
+/* drop the oldest entry not written yet; its size, 0 if there is none */
+size_t qos_drop_oldest(struct qos_session *s);
+
+/* park s (detached, with unacked messages) until its node comes back;
+ * sent keeps how many of them were already written once */
+void qos_park(struct qos_session *s);
+/* take the parked session of node_id, NULL if none */
+struct qos_session *qos_claim(const char *node_id);
+/* free parked sessions past ttl_s; reactor 0's tick, which calls it every
+ * pass, so it looks at most once a second */
+void qos_expire(void);
+size_t qos_parked(void);
+void qos_shutdown(void);
+
+#endif
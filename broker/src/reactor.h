@@ -0,0 +1,63 @@
+#ifndef TINYIOT_REACTOR_H
+#define TINYIOT_REACTOR_H
+
+#include "mailbox.h"
+#include "fdtab.h"
+#include "slab.h"
+#include "wheel.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define MAX_REACTORS 64
+
+struct conn;
+struct uring;
+
+/* One event loop thread. Each reactor owns its listen socket
+ * (SO_REUSEPORT), its epoll set (or io_uring instance) and every
+ * connection it accepted; other threads reach those connections only
+ * through its mailbox. The --unix listener is one socket every reactor
+ * accepts from (AF_UNIX has no SO_REUSEPORT).
+ */
+struct reactor {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int unix_fd;                 /* shared --unix listener, -1 without */
+    int wake_fd;                 /* eventfd, readable when mailbox has work */
+    int wake_pending;            /* set by producers, cleared by owner */
+    struct mailbox mbox;
+    struct fdtab conns;          /* fd -> conn owned by this reactor */
+    struct slab conn_slab;       /* struct conn objects of this reactor */
+    struct uring *ring;          /* io_uring backend, NULL when using epoll */
+    struct conn *dirty;          /* conns with output queued this iteration */
+    size_t queued_bytes;         /* sum of the outqs of conns owned here */
+    struct qos_session *qos_list; /* QoS 1 sessions of conns owned here */
+    uint64_t tick_us;            /* last broker_tick pass */
+    struct wheel wheel;          /* connection deadlines */
+    char *scratch;               /* read buffer, see inbuf.h */
+    char *inbuf_free;            /* pooled input buffers not in use */
+    unsigned int inbuf_nfree;
+    pthread_t tid;
+};
+
+extern struct reactor reactors[MAX_REACTORS];
+extern int nreactors;
+
+/* reactor running on the calling thread; epoll_fd aliases its epoll set
+ * so single-reactor code reads as before */
+extern __thread struct reactor *cur_reactor;
+extern __thread int epoll_fd;
+
+/* descriptor limit of the process, the most any conn table grows to */
+extern unsigned int fd_limit;
+
+/* conn of the calling reactor on fd, NULL if none */
+static inline struct conn *conn_lookup(int fd) {
+    return fdtab_get(&cur_reactor->conns, fd);
+}
+
+/* push a node to r's mailbox and wake it if it is not already woken */
+void reactor_post(struct reactor *r, struct mb_node *n);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "retain.h"
+#include "topics.h"
+#include "jfilter.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define RETAIN_TABLE_MIN 64
+
+struct retained {
+    uint32_t hash;
+    uint32_t len;
+    struct msg *m;
+    uint64_t mark;                          /* retain_mark when m was stored */
+    struct retained *lru_prev, *lru_next;   /* oldest update first */
+    char topic[];                           /* NUL terminated */
+};
+
+struct retain_shard {
+    pthread_mutex_t lock;
+    struct retained **table;
+    size_t cap;                  /* power of two */
+    size_t used;
+    size_t bytes;
+    struct retained *lru_head, *lru_tail;
+} __attribute__((aligned(64)));
+
+static struct retain_shard shards[RETAIN_SHARDS];
+static size_t shard_max;         /* 0: retention off */
+static uint64_t mark_seq;        /* bumped by every SUB, see retain_mark */
+
+/* the entry with its topic, and the message: header, frame and the copy
+ * of the topic msg_frame_topic keeps after the frame */
+static size_t entry_cost(const struct retained *e) {
+    return sizeof(*e) + e->len + 1 + sizeof(struct msg) + e->m->len + e->len + 1;
+}
+
+int retain_init(size_t max_bytes) {
+    shard_max = max_bytes / RETAIN_SHARDS;
+    if (max_bytes && !shard_max) shard_max = 1;
+    for (int i = 0; i < RETAIN_SHARDS; ++i) {
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+int retain_enabled(void) {
+    return shard_max != 0;
+}
+
+static size_t slot_of(struct retain_shard *s, const char *topic, size_t len, uint32_t h) {
+    size_t mask = s->cap - 1;
+    size_t i = (h >> 4) & mask;
+    while (s->table[i]) {
+        struct retained *e = s->table[i];
+        if (e->hash == h && e->len == len && memcmp(e->topic, topic, len) == 0) return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int shard_resize(struct retain_shard *s, size_t ncap) {
+    struct retained **nt = calloc(ncap, sizeof(*nt));
+    if (!nt) return -1;
+    for (size_t i = 0; i < s->cap; ++i) {
+        struct retained *e = s->table[i];
+        if (!e) continue;
+        size_t j = (e->hash >> 4) & (ncap - 1);
+        while (nt[j]) j = (j + 1) & (ncap - 1);
+        nt[j] = e;
+    }
+    free(s->table);
+    s->table = nt;
+    s->cap = ncap;
+    return 0;
+}
+
+static void lru_unlink(struct retain_shard *s, struct retained *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else s->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else s->lru_tail = e->lru_prev;
+}
+
+static void lru_append(struct retain_shard *s, struct retained *e) {
+    e->lru_next = NULL;
+    e->lru_prev = s->lru_tail;
+    if (s->lru_tail) s->lru_tail->lru_next = e; else s->lru_head = e;
+    s->lru_tail = e;
+}
+
+/* backward shift delete, as in the topic table */
+static void shard_delete(struct retain_shard *s, struct retained *e) {
+    size_t mask = s->cap - 1;
+    size_t i = (e->hash >> 4) & mask;
+    while (s->table[i] != e) i = (i + 1) & mask;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!s->table[j]) break;
+        size_t home = (s->table[j]->hash >> 4) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            s->table[i] = s->table[j];
+            i = j;
+        }
+    }
+    s->table[i] = NULL;
+    s->used--;
+    lru_unlink(s, e);
+    s->bytes -= entry_cost(e);
+    msg_unref(e->m);
+    free(e);
+}
+
+void retain_store(const char *topic, struct msg *m) {
+    if (!shard_max) return;
+    size_t len = strlen(topic);
+    uint32_t h = topic_hash(topic, len);
+    /* low bits pick the shard, the rest the slot */
+    struct retain_shard *s = &shards[h & (RETAIN_SHARDS - 1)];
+    pthread_mutex_lock(&s->lock);
+    if ((s->used + 1) * 10 > s->cap * 7 &&
+        shard_resize(s, s->cap ? s->cap * 2 : RETAIN_TABLE_MIN) < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    size_t i = slot_of(s, topic, len, h);
+    struct retained *e = s->table[i];
+    if (e) {
+        s->bytes -= entry_cost(e);
+        msg_unref(e->m);
+        lru_unlink(s, e);
+    } else {
+        e = malloc(sizeof(*e) + len + 1);
+        if (!e) { pthread_mutex_unlock(&s->lock); return; }
+        e->hash = h;
+        e->len = (uint32_t)len;
+        memcpy(e->topic, topic, len + 1);
+        s->table[i] = e;
+        s->used++;
+    }
+    e->m = msg_ref(m);
+    e->mark = __atomic_load_n(&mark_seq, __ATOMIC_RELAXED);
+    s->bytes += entry_cost(e);
+    lru_append(s, e);
+    /* the newest entry stays even when it alone exceeds the slice */
+    while (s->bytes > shard_max && s->lru_head != e) {
+        shard_delete(s, s->lru_head);
+        metric_inc(stats.retained_evicted);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static struct retained *shard_lookup(struct retain_shard *s, const char *topic, size_t len, uint32_t h) {
+    if (!s->used) return NULL;
+    return s->table[slot_of(s, topic, len, h)];
+}
+
+static int frame_wanted(const struct msg *m, const struct jfilter *where) {
+    return !where || jfilter_match(where, m->data + sizeof(uint32_t), m->len - (uint32_t)sizeof(uint32_t));
+}
+
+uint64_t retain_mark(void) {
+    return __atomic_add_fetch(&mark_seq, 1, __ATOMIC_RELAXED);
+}
+
+struct snap_refs {
+    struct msg **v;
+    size_t n, cap;
+};
+
+static int snap_add(struct snap_refs *r, const struct retained *e, uint64_t mark) {
+    /* stored after the SUB: it reaches the subscriber live */
+    if (e->mark >= mark) return 0;
+    if (r->n == r->cap) {
+        size_t ncap = r->cap ? r->cap * 2 : 16;
+        struct msg **nv = realloc(r->v, ncap * sizeof(*nv));
+        if (!nv) return -1;
+        r->v = nv;
+        r->cap = ncap;
+    }
+    r->v[r->n++] = msg_ref(e->m);
+    return 0;
+}
+
+/* references to the frames a snapshot may hold, one shard lock at a
+ * time; -1 on OOM */
+static int snap_collect(const char *filter, uint64_t mark, struct snap_refs *r) {
+    int rc = 0;
+    if (!topic_is_filter(filter)) {
+        size_t len = strlen(filter);
+        uint32_t h = topic_hash(filter, len);
+        struct retain_shard *s = &shards[h & (RETAIN_SHARDS - 1)];
+        pthread_mutex_lock(&s->lock);
+        struct retained *e = shard_lookup(s, filter, len, h);
+        if (e) rc = snap_add(r, e, mark);
+        pthread_mutex_unlock(&s->lock);
+        return rc;
+    }
+    for (int k = 0; k < RETAIN_SHARDS && rc == 0; ++k) {
+        struct retain_shard *s = &shards[k];
+        pthread_mutex_lock(&s->lock);
+        for (struct retained *e = s->lru_head; e && rc == 0; e = e->lru_next)
+            if (topic_filter_match(filter, e->topic)) rc = snap_add(r, e, mark);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return rc;
+}
+
+struct msg *retain_snapshot(const char *filter, const struct jfilter *where, uint64_t mark) {
+    if (!shard_max) return NULL;
+    struct snap_refs r = { NULL, 0, 0 };
+    struct msg *m = NULL;
+    if (snap_collect(filter, mark, &r) == 0) {
+        /* WHERE and copying run on our references, with no lock held */
+        size_t total = 0, w = 0;
+        for (size_t i = 0; i < r.n; ++i) {
+            if (!frame_wanted(r.v[i], where)) { msg_unref(r.v[i]); continue; }
+            total += r.v[i]->len;
+            r.v[w++] = r.v[i];
+        }
+        r.n = w;
+        if (total && total <= UINT32_MAX && (m = msg_new((uint32_t)total)) != NULL) {
+            size_t pos = 0;
+            for (size_t i = 0; i < r.n; ++i) {
+                memcpy(m->data + pos, r.v[i]->data, r.v[i]->len);
+                pos += r.v[i]->len;
+            }
+        }
+    }
+    for (size_t i = 0; i < r.n; ++i) msg_unref(r.v[i]);
+    free(r.v);
+    return m;
+}
+
+/* metrics readers, rare enough to take each lock */
+size_t retain_count(void) {
+    size_t n = 0;
+    for (int k = 0; k < RETAIN_SHARDS; ++k) {
+        pthread_mutex_lock(&shards[k].lock);
+        n += shards[k].used;
+        pthread_mutex_unlock(&shards[k].lock);
+    }
+    return n;
+}
+
+size_t retain_bytes(void) {
+    size_t n = 0;
+    for (int k = 0; k < RETAIN_SHARDS; ++k) {
+        pthread_mutex_lock(&shards[k].lock);
+        n += shards[k].bytes;
+        pthread_mutex_unlock(&shards[k].lock);
+    }
+    return n;
+}
+
+void retain_shutdown(void) {
+    for (int k = 0; k < RETAIN_SHARDS; ++k) {
+        struct retain_shard *s = &shards[k];
+        while (s->lru_head) shard_delete(s, s->lru_head);
+        free(s->table);
+        s->table = NULL;
+        s->cap = 0;
+        pthread_mutex_destroy(&s->lock);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef TINYIOT_RETAIN_H
+#define TINYIOT_RETAIN_H
+
+#include "msg.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct jfilter;
+
+/* Retained messages: the last frame published on every topic, handed to
+ * a new subscriber right after its SUB.
+ *
+ * The store keeps a reference to the frame built for fan-out, so a PUB
+ * costs a table lookup and a pointer swap, never a copy. Entries are
+ * split over RETAIN_SHARDS open-addressing tables, each with its own lock
+ * and LRU list, so PUBs from different reactors rarely meet. Every shard
+ * gets an equal slice of the byte cap and evicts its least recently
+ * updated topics to stay under it.
+ *
+ * A SUB takes a mark while it holds the topic index's write lock, and
+ * every entry records the mark current when it was stored. The snapshot
+ * is built after the lock is dropped and skips entries newer than the
+ * SUB's mark, since those frames were routed to the new subscriber live.
+ */
+
+#define RETAIN_SHARDS 16
+
+/* max_bytes caps frames plus entry overhead; 0 disables retention */
+int retain_init(size_t max_bytes);
+void retain_shutdown(void);
+int retain_enabled(void);
+
+/* make m the retained frame of topic (takes its own reference) */
+void retain_store(const char *topic, struct msg *m);
+
+/* new mark; under topic_lock's write side, as the subscription is added
+ * (retain_store runs under its read side) */
+uint64_t retain_mark(void);
+
+/* every retained frame matching filter (a topic or a wildcard filter),
+ * stored before mark and, unless where is NULL, whose payload satisfies
+ * where, concatenated into one message; NULL when none match or on OOM.
+ * Takes one shard lock at a time, never the topic index's. */
+struct msg *retain_snapshot(const char *filter, const struct jfilter *where, uint64_t mark);
+
+size_t retain_count(void);
+size_t retain_bytes(void);
+
+#endif
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define SHM_MAGIC 0x54495348u        /* "HSIT" */
+#define SHM_VERSION 1
+#define SHM_LIVE 1
+#define SHM_CLOSED 2
+#define SHM_REC_HDR 32
+#define SHM_REC_PAD 0x80000000u      /* filler up to the end of the ring */
+#define SHM_SPIN 2000                /* polls before a reader goes to sleep */
+
+/* first bytes of the mapping; rings[] follow, then the data areas */
+struct shm_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nrings;
+    uint32_t state;
+    uint64_t ring_size;
+    uint64_t data_off;
+    int32_t pid;                 /* broker, so readers notice a crash */
+    uint32_t doorbell;           /* futex, bumped when sleepers are woken */
+    uint32_t waiters;            /* readers asleep or about to be */
+    char pad[20];
+};
+
+/* producer positions, on their own cache lines: head is read by every
+ * reader on every poll, reserve only after a copy */
+struct shm_ctl {
+    uint64_t head;               /* bytes committed since the start */
+    uint64_t seq;                /* of the next record */
+    char pad1[48];
+    uint64_t reserve;            /* bytes that may be being overwritten */
+    char pad2[56];
+};
+
+struct shm_rec {
+    uint32_t len;                /* whole record, 8-aligned, or pad | SHM_REC_PAD */
+    uint16_t topic_len;
+    uint16_t flags;
+    uint32_t payload_len;
+    uint32_t pad;
+    uint64_t seq;
+    uint64_t ts_ns;
+    char data[];                 /* topic, then payload */
+};
+
+_Static_assert(sizeof(struct shm_hdr) == 64, "shm_hdr layout");
+_Static_assert(sizeof(struct shm_ctl) == 128, "shm_ctl layout");
+_Static_assert(sizeof(struct shm_rec) == SHM_REC_HDR, "shm_rec layout");
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts) {
+    return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static struct shm_ctl *ring_ctl(struct shm_hdr *h, int i) {
+    return (struct shm_ctl *)((char *)(h + 1) + (size_t)i * sizeof(struct shm_ctl));
+}
+
+static char *ring_data(struct shm_hdr *h, int i) {
+    return (char *)h + h->data_off + (size_t)i * h->ring_size;
+}
+
+static size_t map_len(size_t size, int nrings, uint64_t *data_off) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t ctl = sizeof(struct shm_hdr) + (size_t)nrings * sizeof(struct shm_ctl);
+    *data_off = (ctl + page - 1) & ~(page - 1);
+    return *data_off + (size_t)nrings * size;
+}
+
+static int broker_alive(pid_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* ---- broker side ---- */
+
+/* per-ring producer state, written by the owning reactor only */
+struct ring_state {
+    uint64_t head;
+    uint64_t seq;
+    char pad[48];
+};
+
+static struct shm_hdr *hdr;
+static size_t hdr_len;
+static struct ring_state *rs;
+static char shm_name[NAME_MAX];
+
+int shmring_enabled(void) {
+    return hdr != NULL;
+}
+
+/* refuse a name a running broker still writes to */
+static int shm_check_stale(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct shm_hdr old;
+    ssize_t r = pread(fd, &old, sizeof(old), 0);
+    close(fd);
+    if (r == (ssize_t)sizeof(old) && old.magic == SHM_MAGIC && old.state == SHM_LIVE &&
+        broker_alive(old.pid)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    return shm_unlink(name) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+int shmring_open(const char *name, size_t size, int nrings) {
+    if (size < SHM_RING_MIN || (size & (size - 1)) || nrings < 1 ||
+        snprintf(shm_name, sizeof(shm_name), "/%s", name) >= (int)sizeof(shm_name) || strchr(name, '/')) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shm_check_stale(shm_name) < 0) return -1;
+    uint64_t data_off;
+    size_t len = map_len(size, nrings, &data_off);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+    if (fd < 0) return -1;
+    /* readers write the waiter count, so the group may need write access */
+    fchmod(fd, 0660);
+    /* allocate it all now: a full /dev/shm is an error here, not a SIGBUS
+     * in a reactor later */
+    int e = posix_fallocate(fd, 0, (off_t)len);
+    void *map = e ? MAP_FAILED : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        if (!e) e = errno;
+        close(fd);
+        shm_unlink(shm_name);
+        errno = e;
+        return -1;
+    }
+    close(fd);
+    rs = calloc((size_t)nrings, sizeof(*rs));
+    if (!rs) {
+        munmap(map, len);
+        shm_unlink(shm_name);
+        errno = ENOMEM;
+        return -1;
+    }
+    struct shm_hdr *h = map;
+    h->version = SHM_VERSION;
+    h->nrings = (uint32_t)nrings;
+    h->ring_size = size;
+    h->data_off = data_off;
+    h->pid = getpid();
+    h->state = SHM_LIVE;
+    /* readers check the magic last */
+    __atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    hdr = h;
+    hdr_len = len;
+    return 0;
+}
+
+static void shm_wake(void) {
+    __atomic_add_fetch(&hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+    futex(&hdr->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+int shmring_write(int ring, const char *topic, size_t tlen, const char *payload, uint32_t len) {
+    if (!hdr) return 0;
+    struct ring_state *st = &rs[ring];
+    struct shm_ctl *ctl = ring_ctl(hdr, ring);
+    char *data = ring_data(hdr, ring);
+    size_t size = hdr->ring_size;
+    size_t need = (SHM_REC_HDR + tlen + len + 7) & ~(size_t)7;
+    if (need > size) return 0;
+    size_t off = st->head & (size - 1);
+    size_t pad = size - off < need ? size - off : 0;
+    uint64_t end = st->head + pad + need;
+
+    /* announce the overwrite before any byte of it lands */
+    __atomic_store_n(&ctl->reserve, end, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (pad) {
+        *(uint32_t *)(data + off) = (uint32_t)pad | SHM_REC_PAD;
+        off = 0;
+    }
+    struct shm_rec *r = (struct shm_rec *)(data + off);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->len = (uint32_t)need;
+    r->topic_len = (uint16_t)tlen;
+    r->flags = 0;
+    r->payload_len = len;
+    r->pad = 0;
+    r->seq = st->seq++;
+    r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    memcpy(r->data, topic, tlen);
+    memcpy(r->data + tlen, payload, len);
+    st->head = end;
+    __atomic_store_n(&ctl->seq, st->seq, __ATOMIC_RELAXED);
+    /* pairs with the reader raising waiters before its last look at head */
+    __atomic_store_n(&ctl->head, end, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+void shmring_flush(void) {
+    if (hdr && __atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST)) shm_wake();
+}
+
+void shmring_close(void) {
+    if (!hdr) return;
+    __atomic_store_n(&hdr->state, SHM_CLOSED, __ATOMIC_SEQ_CST);
+    shm_wake();
+    munmap(hdr, hdr_len);
+    shm_unlink(shm_name);
+    hdr = NULL;
+    free(rs);
+    rs = NULL;
+}
+
+/* ---- reader side ---- */
+
+struct shm_reader {
+    struct shm_hdr *hdr;
+    size_t len;
+    uint64_t *pos;               /* per ring */
+    uint64_t *seen;              /* per ring, seq of the next record expected */
+    int next;                    /* ring to look at first */
+    uint64_t lost;
+    char *buf;                   /* copy of the last record */
+};
+
+/* move ring i's cursor to the newest data, counting what it skips */
+static void ring_sync(struct shm_reader *r, int i) {
+    struct shm_ctl *ctl = ring_ctl(r->hdr, i);
+    uint64_t head, seq;
+    /* head and seq agree unless a write began in between */
+    do {
+        head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+        seq = __atomic_load_n(&ctl->seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&ctl->reserve, __ATOMIC_RELAXED) != head);
+    r->pos[i] = head;
+    r->lost += seq - r->seen[i];
+    r->seen[i] = seq;
+}
+
+struct shm_reader *shm_reader_open(const char *name) {
+    char path[NAME_MAX];
+    if (snprintf(path, sizeof(path), "/%s", name) >= (int)sizeof(path) || strchr(name, '/')) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    struct shm_hdr h;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        int e = errno;
+        close(fd);
+        errno = e ? e : EPROTO;
+        return NULL;
+    }
+    uint64_t data_off;
+    if (h.magic != SHM_MAGIC || h.version != SHM_VERSION || h.nrings < 1 ||
+        h.ring_size < SHM_RING_MIN || (h.ring_size & (h.ring_size - 1)) ||
+        map_len(h.ring_size, (int)h.nrings, &data_off) != (size_t)st.st_size || data_off != h.data_off) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    struct shm_reader *r = calloc(1, sizeof(*r));
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (!r || map == MAP_FAILED) {
+        free(r);
+        if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    r->hdr = map;
+    r->len = (size_t)st.st_size;
+    r->pos = calloc(h.nrings, sizeof(*r->pos));
+    r->seen = calloc(h.nrings, sizeof(*r->seen));
+    r->buf = malloc(SHM_RING_MIN);
+    if (!r->pos || !r->seen || !r->buf) {
+        shm_reader_close(r);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (uint32_t i = 0; i < h.nrings; ++i) ring_sync(r, (int)i);
+    r->lost = 0;
+    return r;
+}
+
+/* copy the next record of ring i into r->buf: 1 done, 0 ring drained */
+static int ring_take(struct shm_reader *r, int i, struct shm_msg *m) {
+    struct shm_hdr *h = r->hdr;
+    struct shm_ctl *ctl = ring_ctl(h, i);
+    const char *data = ring_data(h, i);
+    uint64_t size = h->ring_size;
+    for (;;) {
+        uint64_t pos = r->pos[i];
+        uint64_t head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+        if (pos == head) return 0;
+        if (head - pos > size) {
+            /* lapped: whatever was at pos is gone */
+            ring_sync(r, i);
+            continue;
+        }
+        size_t off = pos & (size - 1);
+        uint32_t len = *(const uint32_t *)(data + off);
+        size_t copy = 0;
+        int sane;
+        if (len & SHM_REC_PAD) {
+            len &= ~SHM_REC_PAD;
+            sane = len == size - off;
+        } else {
+            const struct shm_rec *rec = (const struct shm_rec *)(data + off);
+            memcpy(r->buf, rec, SHM_REC_HDR);
+            const struct shm_rec *c = (const struct shm_rec *)r->buf;
+            sane = len >= SHM_REC_HDR && len <= size - off && len <= SHM_RING_MIN &&
+                   SHM_REC_HDR + (size_t)c->topic_len + c->payload_len <= len;
+            if (sane) {
+                copy = SHM_REC_HDR + c->topic_len + c->payload_len;
+                memcpy(r->buf + SHM_REC_HDR, rec->data, copy - SHM_REC_HDR);
+            }
+        }
+        /* the copy is good only if the producer had not yet claimed it */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t reserve = __atomic_load_n(&ctl->reserve, __ATOMIC_RELAXED);
+        if (reserve - pos > size || !sane) {
+            ring_sync(r, i);
+            continue;
+        }
+        r->pos[i] = pos + len;
+        if (!copy) continue;
+        const struct shm_rec *c = (const struct shm_rec *)r->buf;
+        r->seen[i] = c->seq + 1;
+        m->topic = c->data;
+        m->topic_len = c->topic_len;
+        m->payload = c->data + c->topic_len;
+        m->len = c->payload_len;
+        m->seq = c->seq;
+        m->ts_ns = c->ts_ns;
+        m->ring = i;
+        return 1;
+    }
+}
+
+static int take_any(struct shm_reader *r, struct shm_msg *m) {
+    int n = (int)r->hdr->nrings;
+    for (int k = 0; k < n; ++k) {
+        int i = (r->next + k) % n;
+        if (ring_take(r, i, m)) {
+            r->next = (i + 1) % n;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int rings_moved(struct shm_reader *r) {
+    for (uint32_t i = 0; i < r->hdr->nrings; ++i)
+        if (__atomic_load_n(&ring_ctl(r->hdr, (int)i)->head, __ATOMIC_SEQ_CST) != r->pos[i]) return 1;
+    return 0;
+}
+
+static uint64_t mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int shm_reader_next(struct shm_reader *r, struct shm_msg *m, int timeout_ms) {
+    struct shm_hdr *h = r->hdr;
+    for (int spin = 0; spin < (timeout_ms ? SHM_SPIN : 1); ++spin) {
+        if (take_any(r, m)) return 1;
+        if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) != SHM_LIVE) return take_any(r, m) ? 1 : -1;
+    }
+    if (timeout_ms == 0) return 0;
+    uint64_t deadline = timeout_ms > 0 ? mono_ms() + (uint64_t)timeout_ms : UINT64_MAX;
+    for (;;) {
+        __atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t bell = __atomic_load_n(&h->doorbell, __ATOMIC_SEQ_CST);
+        int ready = rings_moved(r) || __atomic_load_n(&h->state, __ATOMIC_SEQ_CST) != SHM_LIVE;
+        uint64_t now = mono_ms();
+        if (!ready && now < deadline) {
+            /* wake at least once a second to notice a broker that died */
+            uint64_t wait = deadline - now < 1000 ? deadline - now : 1000;
+            struct timespec ts = { (time_t)(wait / 1000), (long)(wait % 1000) * 1000000 };
+            futex(&h->doorbell, FUTEX_WAIT, bell, &ts);
+        }
+        __atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+        if (take_any(r, m)) return 1;
+        if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) != SHM_LIVE || !broker_alive(h->pid)) return -1;
+        if (mono_ms() >= deadline) return 0;
+    }
+}
+
+uint64_t shm_reader_lost(const struct shm_reader *r) {
+    return r->lost;
+}
+
+void shm_reader_close(struct shm_reader *r) {
+    if (!r) return;
+    if (r->hdr) munmap(r->hdr, r->len);
+    free(r->pos);
+    free(r->seen);
+    free(r->buf);
+    free(r);
+}
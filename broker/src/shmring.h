@@ -0,0 +1,69 @@
+#ifndef TINYIOT_SHMRING_H
+#define TINYIOT_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared-memory transport for consumers on the same host (--shm NAME).
+ *
+ * brokerd creates /dev/shm/NAME holding one ring per reactor and writes
+ * every message published to it (locally or by a peer broker) into the
+ * ring of the reactor that routed it: topic, payload, a per-ring sequence
+ * number and the CLOCK_MONOTONIC time of the write. Each reactor is the
+ * only producer of its ring, so writing takes no lock and no syscall, and
+ * costs the same however many readers there are: readers keep their
+ * cursors in their own memory and the broker never looks at them.
+ *
+ * Readers map the file and copy records out. A reader that falls more
+ * than a ring behind has been overrun: the producer announces the bytes
+ * it is about to overwrite before touching them, so a reader notices when
+ * a record it copied may have been torn, skips to the newest data and
+ * counts the messages it lost from the sequence numbers. The producer
+ * wakes sleeping readers through a futex in the mapping, once per batch
+ * of messages and only when one is asleep. Order is kept per ring, so per publishing connection.
+ */
+
+#define SHM_RING_MIN (64 * 1024)     /* bytes per ring, also the smallest --shm-size */
+
+/* broker side. 0 ok, -1 with errno set. size is per ring, a power of two */
+int shmring_open(const char *name, size_t size, int nrings);
+
+/* into the calling reactor's ring; 1 written, 0 without --shm */
+int shmring_write(int ring, const char *topic, size_t tlen, const char *payload, uint32_t len);
+
+/* wake readers sleeping on the rings; after a batch of writes */
+void shmring_flush(void);
+
+int shmring_enabled(void);
+
+/* tell readers the broker is gone, then unmap and unlink */
+void shmring_close(void);
+
+/* reader side, for consumer processes (link src/shmring.o) */
+
+struct shm_msg {
+    const char *topic;           /* valid until the next shm_reader_next */
+    size_t topic_len;
+    const char *payload;
+    uint32_t len;
+    uint64_t seq;                /* per ring */
+    uint64_t ts_ns;              /* CLOCK_MONOTONIC when the broker wrote it */
+    int ring;
+};
+
+struct shm_reader;
+
+/* map /dev/shm/name and start at the newest message of every ring.
+ * NULL with errno set */
+struct shm_reader *shm_reader_open(const char *name);
+
+/* next message of any ring: 1 got one, 0 none within timeout_ms (0 polls,
+ * -1 waits forever), -1 the broker shut down */
+int shm_reader_next(struct shm_reader *r, struct shm_msg *m, int timeout_ms);
+
+/* messages this reader missed by being overrun */
+uint64_t shm_reader_lost(const struct shm_reader *r);
+
+void shm_reader_close(struct shm_reader *r);
+
+#endif
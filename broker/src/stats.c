@@ -0,0 +1,72 @@
+#include "stats.h"
+#include "log.h"
+#include "topics.h"
+#include "reactor.h"
+#include "retain.h"
+#include "journal.h"
+#include "qos.h"
+#include "inbuf.h"
+#include "bridge.h"
+#include <time.h>
+
+struct broker_stats stats;
+
+static uint64_t start_time;
+
+static uint64_t read_start_time(void) { return start_time; }
+static uint64_t read_log_dropped(void) { return log_dropped(); }
+
+static uint64_t read_retained(void) { return retain_count(); }
+static uint64_t read_retained_bytes(void) { return retain_bytes(); }
+
+static uint64_t read_journal_end(void) { return journal_end(); }
+static uint64_t read_journal_durable(void) { return journal_durable(); }
+static uint64_t read_journal_first(void) { return journal_first(); }
+
+static uint64_t read_qos_parked(void) { return qos_parked(); }
+static uint64_t read_inbufs(void) { return inbuf_in_use(); }
+static uint64_t read_bridge_links(void) { return bridge_links(); }
+
+static uint64_t read_queued_bytes(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < nreactors; ++i)
+        total += __atomic_load_n(&reactors[i].queued_bytes, __ATOMIC_RELAXED);
+    return total;
+}
+
+void stats_init(void) {
+    start_time = (uint64_t)time(NULL);
+    metric_func("tinyiot_broker_start_time_seconds", "Unix time brokerd started", METRIC_GAUGE, read_start_time);
+    stats.msgs_in = metric_new("tinyiot_broker_messages_in_total", "PUB messages received", METRIC_COUNTER);
+    stats.msgs_out = metric_new("tinyiot_broker_messages_out_total", "Messages queued to subscribers", METRIC_COUNTER);
+    stats.fanout = metric_new("tinyiot_broker_fanout", "Subscribers reached per PUB", METRIC_HISTOGRAM);
+    stats.outq_bytes = metric_new("tinyiot_broker_outbuf_bytes", "Pending output bytes per connection at flush", METRIC_HISTOGRAM);
+    stats.flush_latency = metric_new("tinyiot_broker_publish_to_flush_us", "Microseconds from PUB to fully written", METRIC_HISTOGRAM);
+    stats.connections = metric_new("tinyiot_broker_connections", "Open client connections", METRIC_GAUGE);
+    stats.epoll_ctl = metric_new("tinyiot_broker_epoll_ctl_total", "epoll_ctl calls on client sockets", METRIC_COUNTER);
+    stats.dropped_msgs = metric_new("tinyiot_broker_dropped_messages_total", "Messages shed by the slow-consumer policy", METRIC_COUNTER);
+    stats.dropped_bytes = metric_new("tinyiot_broker_dropped_bytes_total", "Bytes shed by the slow-consumer policy", METRIC_COUNTER);
+    stats.slow_disconnects = metric_new("tinyiot_broker_slow_disconnects_total", "Subscribers disconnected for falling behind", METRIC_COUNTER);
+    metric_func("tinyiot_broker_queued_bytes", "Bytes waiting in all output queues", METRIC_GAUGE, read_queued_bytes);
+    stats.retained_evicted = metric_new("tinyiot_broker_retained_evicted_total", "Retained topics evicted to stay under --retain-max", METRIC_COUNTER);
+    metric_func("tinyiot_broker_retained_topics", "Topics with a retained message", METRIC_GAUGE, read_retained);
+    metric_func("tinyiot_broker_retained_bytes", "Memory held by retained messages", METRIC_GAUGE, read_retained_bytes);
+    stats.journal_records = metric_new("tinyiot_broker_journal_records_total", "Messages appended to the journal", METRIC_COUNTER);
+    stats.journal_bytes = metric_new("tinyiot_broker_journal_bytes_total", "Bytes appended to the journal", METRIC_COUNTER);
+    stats.journal_sync_us = metric_new("tinyiot_broker_journal_sync_us", "Microseconds per journal group commit", METRIC_HISTOGRAM);
+    stats.replayed = metric_new("tinyiot_broker_replayed_total", "Journal records sent to SUB ... FROM subscribers", METRIC_COUNTER);
+    metric_func("tinyiot_broker_journal_end_offset", "Offset the next journal record will get", METRIC_GAUGE, read_journal_end);
+    metric_func("tinyiot_broker_journal_durable_offset", "Journal records below this offset are on disk", METRIC_GAUGE, read_journal_durable);
+    metric_func("tinyiot_broker_journal_first_offset", "Oldest journal record still kept", METRIC_GAUGE, read_journal_first);
+    stats.qos_acked = metric_new("tinyiot_broker_qos_acked_total", "QoS 1 messages acknowledged by subscribers", METRIC_COUNTER);
+    stats.qos_redelivered = metric_new("tinyiot_broker_qos_redelivered_total", "QoS 1 messages sent again after a timeout or reconnect", METRIC_COUNTER);
+    stats.timeouts = metric_new("tinyiot_broker_timeouts_total", "Connections closed for idling, a stalled frame or stalled output", METRIC_COUNTER);
+    stats.pings = metric_new("tinyiot_broker_keepalive_pings_total", "PINGs sent to KEEPALIVE connections", METRIC_COUNTER);
+    stats.bridge_forwarded = metric_new("tinyiot_broker_bridge_forwarded_total", "Messages forwarded to peer brokers", METRIC_COUNTER);
+    stats.where_skipped = metric_new("tinyiot_broker_where_skipped_total", "Payloads that failed a subscription's WHERE, once per distinct expression", METRIC_COUNTER);
+    stats.shm_records = metric_new("tinyiot_broker_shm_records_total", "Messages written to the shared-memory rings", METRIC_COUNTER);
+    metric_func("tinyiot_broker_bridge_links", "Established links with peer brokers", METRIC_GAUGE, read_bridge_links);
+    metric_func("tinyiot_broker_inbufs", "Pooled input buffers held by connections with a partial frame", METRIC_GAUGE, read_inbufs);
+    metric_func("tinyiot_broker_qos_parked_sessions", "Disconnected QoS 1 sessions holding unacked messages", METRIC_GAUGE, read_qos_parked);
+    metric_func("tinyiot_log_dropped_total", "Log records dropped because a ring was full", METRIC_COUNTER, read_log_dropped);
+}
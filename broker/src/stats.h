@@ -0,0 +1,36 @@
+#ifndef TINYIOT_STATS_H
+#define TINYIOT_STATS_H
+
+#include "metrics.h"
+
+/* brokerd metrics, registered by stats_init() before reactors start */
+struct broker_stats {
+    struct metric *msgs_in;          /* PUBs received */
+    struct metric *msgs_out;         /* message copies queued to subscribers */
+    struct metric *fanout;           /* subscribers per PUB */
+    struct metric *outq_bytes;       /* per-connection pending bytes at flush time */
+    struct metric *flush_latency;    /* publish to last byte written, microseconds */
+    struct metric *connections;
+    struct metric *epoll_ctl;        /* epoll_ctl calls on client fds */
+    struct metric *dropped_msgs;     /* messages shed by slow-consumer policy */
+    struct metric *dropped_bytes;
+    struct metric *slow_disconnects; /* conns closed by the disconnect policy */
+    struct metric *retained_evicted; /* retained topics dropped to stay under the cap */
+    struct metric *journal_records;  /* PUBs appended to the journal */
+    struct metric *journal_bytes;
+    struct metric *journal_sync_us;  /* one group commit, microseconds */
+    struct metric *replayed;         /* journal records sent by SUB ... FROM */
+    struct metric *qos_acked;        /* QoS 1 messages released by ACK */
+    struct metric *qos_redelivered;  /* QoS 1 messages written again */
+    struct metric *timeouts;         /* conns closed by a deadline */
+    struct metric *pings;            /* keepalive PINGs sent */
+    struct metric *bridge_forwarded; /* message copies sent to peer brokers */
+    struct metric *where_skipped;    /* WHERE evaluations a payload failed */
+    struct metric *shm_records;      /* messages written to the --shm rings */
+};
+
+extern struct broker_stats stats;
+
+void stats_init(void);
+
+#endif
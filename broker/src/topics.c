@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include "topics.h"
+#include "jfilter.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPIC_TABLE_MIN 64
+#define EDGE_TABLE_MIN 64
+
+static struct topic_entry **table = NULL;
+static size_t table_cap = 0;          /* power of two */
+static size_t table_used = 0;
+
+/* wildcard trie: one node per filter level. Literal children are found
+ * through a single edge table keyed by (parent, segment); the '+' child
+ * hangs directly off its parent. */
+struct trie_node {
+    struct trie_node *parent;
+    struct trie_node *plus;           /* child for a '+' level */
+    struct topic_entry *exact_f;      /* filter ending at this node */
+    struct topic_entry *multi_f;      /* filter "<this path>/#" */
+    uint32_t nchildren;               /* literal children + plus */
+    uint32_t seg_hash;
+    size_t seg_len;
+    char seg[];
+};
+
+static struct trie_node trie_root;
+static size_t trie_filters = 0;
+
+static struct trie_node **edges = NULL;
+static size_t edges_cap = 0;          /* power of two */
+static size_t edges_used = 0;
+
+/* FNV-1a */
+uint32_t topic_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t slot_of(const char *topic, size_t len, uint32_t h) {
+    size_t mask = table_cap - 1;
+    size_t i = h & mask;
+    while (table[i]) {
+        struct topic_entry *t = table[i];
+        if (t->hash == h && t->len == len && memcmp(t->topic, topic, len) == 0) return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int table_resize(size_t ncap) {
+    struct topic_entry **nt = calloc(ncap, sizeof(*nt));
+    if (!nt) return -1;
+    for (size_t i = 0; i < table_cap; ++i) {
+        struct topic_entry *t = table[i];
+        if (!t) continue;
+        size_t j = t->hash & (ncap - 1);
+        while (nt[j]) j = (j + 1) & (ncap - 1);
+        nt[j] = t;
+    }
+    free(table);
+    table = nt;
+    table_cap = ncap;
+    return 0;
+}
+
+static uint32_t edge_slot_hash(const struct trie_node *parent, uint32_t seg_hash) {
+    uintptr_t p = (uintptr_t)parent;
+    return seg_hash ^ (uint32_t)(p >> 4) ^ (uint32_t)(p >> 32);
+}
+
+static size_t edge_slot(const struct trie_node *parent, const char *seg, size_t len, uint32_t h) {
+    size_t mask = edges_cap - 1;
+    size_t i = edge_slot_hash(parent, h) & mask;
+    while (edges[i]) {
+        struct trie_node *n = edges[i];
+        if (n->parent == parent && n->seg_hash == h && n->seg_len == len &&
+            memcmp(n->seg, seg, len) == 0) return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static struct trie_node *edge_find(const struct trie_node *parent, const char *seg, size_t len) {
+    if (!edges_used) return NULL;
+    return edges[edge_slot(parent, seg, len, topic_hash(seg, len))];
+}
+
+static int edges_resize(size_t ncap) {
+    struct trie_node **ne = calloc(ncap, sizeof(*ne));
+    if (!ne) return -1;
+    for (size_t i = 0; i < edges_cap; ++i) {
+        struct trie_node *n = edges[i];
+        if (!n) continue;
+        size_t j = edge_slot_hash(n->parent, n->seg_hash) & (ncap - 1);
+        while (ne[j]) j = (j + 1) & (ncap - 1);
+        ne[j] = n;
+    }
+    free(edges);
+    edges = ne;
+    edges_cap = ncap;
+    return 0;
+}
+
+static void edge_delete(struct trie_node *n) {
+    size_t mask = edges_cap - 1;
+    size_t i = edge_slot_hash(n->parent, n->seg_hash) & mask;
+    while (edges[i] != n) i = (i + 1) & mask;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!edges[j]) break;
+        size_t home = edge_slot_hash(edges[j]->parent, edges[j]->seg_hash) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            edges[i] = edges[j];
+            i = j;
+        }
+    }
+    edges[i] = NULL;
+    edges_used--;
+}
+
+static struct trie_node *trie_child_get(struct trie_node *parent, const char *seg, size_t len) {
+    int plus = (len == 1 && seg[0] == '+');
+    struct trie_node *n = plus ? parent->plus : edge_find(parent, seg, len);
+    if (n) return n;
+    if (!plus && (edges_used + 1) * 10 > edges_cap * 7) {
+        if (edges_resize(edges_cap ? edges_cap * 2 : EDGE_TABLE_MIN) < 0) return NULL;
+    }
+    n = calloc(1, sizeof(*n) + len + 1);
+    if (!n) return NULL;
+    n->parent = parent;
+    n->seg_hash = topic_hash(seg, len);
+    n->seg_len = len;
+    memcpy(n->seg, seg, len);
+    if (plus) {
+        parent->plus = n;
+    } else {
+        edges[edge_slot(parent, seg, len, n->seg_hash)] = n;
+        edges_used++;
+    }
+    parent->nchildren++;
+    return n;
+}
+
+/* free empty nodes from n up towards the root */
+static void trie_prune(struct trie_node *n) {
+    while (n != &trie_root && !n->nchildren && !n->exact_f && !n->multi_f) {
+        struct trie_node *parent = n->parent;
+        if (parent->plus == n) parent->plus = NULL;
+        else edge_delete(n);
+        parent->nchildren--;
+        free(n);
+        n = parent;
+    }
+}
+
+static int trie_insert(struct topic_entry *t) {
+    struct trie_node *n = &trie_root;
+    const char *lvl = t->topic;
+    for (;;) {
+        const char *slash = strchr(lvl, '/');
+        size_t len = slash ? (size_t)(slash - lvl) : strlen(lvl);
+        if (!slash && len == 1 && lvl[0] == '#') {
+            n->multi_f = t;
+            break;
+        }
+        struct trie_node *child = trie_child_get(n, lvl, len);
+        if (!child) { trie_prune(n); return -1; }
+        n = child;
+        if (!slash) {
+            n->exact_f = t;
+            break;
+        }
+        lvl = slash + 1;
+    }
+    t->tnode = n;
+    trie_filters++;
+    return 0;
+}
+
+static void trie_remove(struct topic_entry *t) {
+    struct trie_node *n = t->tnode;
+    if (n->multi_f == t) n->multi_f = NULL;
+    else n->exact_f = NULL;
+    t->tnode = NULL;
+    trie_filters--;
+    trie_prune(n);
+}
+
+/* lvl is the start of the current level, or NULL once every level has
+ * been consumed. Wildcards at the first level never match '$' topics. */
+static void trie_walk(struct trie_node *n, const char *lvl, int first,
+                      void (*fn)(struct topic_entry *, void *), void *arg) {
+    int sys = first && lvl && lvl[0] == '$';
+    if (n->multi_f && !sys) fn(n->multi_f, arg);
+    if (!lvl) {
+        if (n->exact_f) fn(n->exact_f, arg);
+        return;
+    }
+    const char *slash = strchr(lvl, '/');
+    size_t len = slash ? (size_t)(slash - lvl) : strlen(lvl);
+    const char *next = slash ? slash + 1 : NULL;
+    struct trie_node *child = edge_find(n, lvl, len);
+    if (child) trie_walk(child, next, 0, fn, arg);
+    if (n->plus && !sys) trie_walk(n->plus, next, 0, fn, arg);
+}
+
+int topic_is_filter(const char *s) {
+    return strpbrk(s, "+#") != NULL;
+}
+
+int topic_is_shared(const char *s) {
+    return strncmp(s, TOPIC_SHARE_PREFIX, sizeof(TOPIC_SHARE_PREFIX) - 1) == 0;
+}
+
+/* "$share/<group>/<filter>" -> group (glen bytes) and filter */
+static const char *share_split(const char *s, size_t *glen) {
+    const char *g = s + sizeof(TOPIC_SHARE_PREFIX) - 1;
+    const char *slash = strchr(g, '/');
+    if (!slash) return NULL;
+    *glen = (size_t)(slash - g);
+    return slash + 1;
+}
+
+int topic_filter_valid(const char *s) {
+    if (topic_is_shared(s)) {
+        size_t glen;
+        const char *f = share_split(s, &glen);
+        const char *g = s + sizeof(TOPIC_SHARE_PREFIX) - 1;
+        if (!f || !glen || memchr(g, '+', glen) || memchr(g, '#', glen) || topic_is_shared(f)) return -1;
+        s = f;
+    }
+    if (!*s) return -1;
+    for (const char *p = s; *p; ++p) {
+        if (*p != '+' && *p != '#') continue;
+        int starts = (p == s || p[-1] == '/');
+        if (*p == '+' && (!starts || (p[1] && p[1] != '/'))) return -1;
+        if (*p == '#' && (!starts || p[1])) return -1;
+    }
+    return 0;
+}
+
+int topic_filter_match(const char *f, const char *t) {
+    if (t[0] == '$' && (f[0] == '+' || f[0] == '#')) return 0;
+    for (;;) {
+        if (f[0] == '#') return 1;      /* also matches the parent level */
+        const char *fs = strchr(f, '/');
+        const char *ts = strchr(t, '/');
+        size_t fl = fs ? (size_t)(fs - f) : strlen(f);
+        size_t tl = ts ? (size_t)(ts - t) : strlen(t);
+        int plus = (fl == 1 && f[0] == '+');
+        if (!plus && (fl != tl || memcmp(f, t, fl) != 0)) return 0;
+        if (!ts) return !fs || strcmp(fs + 1, "#") == 0;
+        if (!fs) return 0;
+        f = fs + 1;
+        t = ts + 1;
+    }
+}
+
+void topic_match(const char *topic, void (*fn)(struct topic_entry *t, void *arg), void *arg) {
+    struct topic_entry *t = topic_find(topic);
+    if (t) fn(t, arg);
+    if (trie_filters) trie_walk(&trie_root, topic, 1, fn, arg);
+}
+
+struct topic_entry *topic_find(const char *topic) {
+    if (!table_used) return NULL;
+    size_t len = strlen(topic);
+    return table[slot_of(topic, len, topic_hash(topic, len))];
+}
+
+static struct topic_entry *topic_intern(const char *topic) {
+    size_t len = strlen(topic);
+    uint32_t h = topic_hash(topic, len);
+    /* keep load factor under 0.7 */
+    if ((table_used + 1) * 10 > table_cap * 7) {
+        if (table_resize(table_cap ? table_cap * 2 : TOPIC_TABLE_MIN) < 0) return NULL;
+    }
+    size_t i = slot_of(topic, len, h);
+    if (table[i]) return table[i];
+    struct topic_entry *t = malloc(sizeof(*t) + len + 1);
+    if (!t) return NULL;
+    t->hash = h;
+    t->nsubs = 0;
+    t->nlocal = 0;
+    t->subs = NULL;
+    t->groups = NULL;
+    t->wheres = NULL;
+    t->len = len;
+    t->tnode = NULL;
+    memcpy(t->topic, topic, len + 1);
+    if (topic_is_filter(topic) && trie_insert(t) < 0) {
+        free(t);
+        return NULL;
+    }
+    table[i] = t;
+    table_used++;
+    return t;
+}
+
+/* delete an entry with backward shift so probe chains stay intact */
+static void topic_release(struct topic_entry *t) {
+    if (t->tnode) trie_remove(t);
+    size_t mask = table_cap - 1;
+    size_t i = t->hash & mask;
+    while (table[i] != t) i = (i + 1) & mask;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!table[j]) break;
+        size_t home = table[j]->hash & mask;
+        /* move table[j] into the hole unless its home lies in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = NULL;
+    table_used--;
+    free(t);
+}
+
+void (*topic_interest)(const struct topic_entry *t, int on);
+
+static int entry_unused(const struct topic_entry *t) {
+    return !t->subs && !t->groups && !t->wheres;
+}
+
+static struct content_filter *where_find(struct topic_entry *t, const char *text) {
+    for (struct content_filter *w = t->wheres; w; w = w->next)
+        if (strcmp(jfilter_text(w->pred), text) == 0) return w;
+    return NULL;
+}
+
+/* the content filter of t for pred, which it takes. NULL on OOM */
+static struct content_filter *where_get(struct topic_entry *t, struct jfilter *pred) {
+    struct content_filter *w = where_find(t, jfilter_text(pred));
+    if (w) {
+        jfilter_free(pred);
+        return w;
+    }
+    w = malloc(sizeof(*w));
+    if (!w) {
+        jfilter_free(pred);
+        return NULL;
+    }
+    w->pred = pred;
+    w->subs = NULL;
+    w->next = t->wheres;
+    t->wheres = w;
+    return w;
+}
+
+static void where_drop(struct topic_entry *t, struct content_filter *w) {
+    struct content_filter **pp = &t->wheres;
+    while (*pp != w) pp = &(*pp)->next;
+    *pp = w->next;
+    jfilter_free(w->pred);
+    free(w);
+}
+
+static struct share_group *share_find(struct topic_entry *t, const char *name, size_t len) {
+    for (struct share_group *g = t->groups; g; g = g->next)
+        if (strlen(g->name) == len && memcmp(g->name, name, len) == 0) return g;
+    return NULL;
+}
+
+/* put n in group name of t, creating it. 1 already a member, 0 added, -1 OOM */
+static int share_join(struct topic_entry *t, const char *name, size_t len, struct sub_node *n) {
+    struct share_group *g = share_find(t, name, len);
+    if (g) {
+        for (uint32_t i = 0; i < g->n; ++i) if (g->members[i]->c == n->c) return 1;
+    } else {
+        g = malloc(sizeof(*g) + len + 1);
+        if (!g) return -1;
+        g->members = NULL;
+        g->n = g->cap = 0;
+        g->rr = 0;
+        memcpy(g->name, name, len);
+        g->name[len] = '\0';
+        g->next = t->groups;
+        t->groups = g;
+    }
+    if (g->n == g->cap) {
+        uint32_t ncap = g->cap ? g->cap * 2 : 4;
+        struct sub_node **nm = realloc(g->members, ncap * sizeof(*nm));
+        if (!nm) {
+            if (!g->n) { t->groups = g->next; free(g); }
+            return -1;
+        }
+        g->members = nm;
+        g->cap = ncap;
+    }
+    n->group = g;
+    n->slot = g->n;
+    g->members[g->n++] = n;
+    return 0;
+}
+
+/* O(1): the last member takes n's slot */
+static void share_leave(struct topic_entry *t, struct sub_node *n) {
+    struct share_group *g = n->group;
+    struct sub_node *last = g->members[--g->n];
+    g->members[n->slot] = last;
+    last->slot = n->slot;
+    if (g->n) return;
+    struct share_group **pp = &t->groups;
+    while (*pp != g) pp = &(*pp)->next;
+    *pp = g->next;
+    free(g->members);
+    free(g);
+}
+
+int topic_subscribe(const char *topic, struct jfilter *where, struct conn *c, int remote,
+                    struct sub_node **conn_subs) {
+    const char *group = NULL;
+    size_t glen = 0;
+    if (topic_is_shared(topic)) {
+        group = topic + sizeof(TOPIC_SHARE_PREFIX) - 1;
+        if (where || !(topic = share_split(topic, &glen))) {
+            jfilter_free(where);
+            return -1;
+        }
+    }
+    struct topic_entry *t = topic_intern(topic);
+    if (!t) {
+        jfilter_free(where);
+        return -1;
+    }
+    struct content_filter *w = NULL;
+    if (where && !(w = where_get(t, where))) {
+        if (entry_unused(t)) topic_release(t);
+        return -1;
+    }
+    struct sub_node **head = w ? &w->subs : &t->subs;
+    if (!group) for (struct sub_node *n = *head; n; n = n->tnext) if (n->c == c) return 0;
+    struct sub_node *n = malloc(sizeof(*n));
+    if (!n) {
+        if (w && !w->subs) where_drop(t, w);
+        if (entry_unused(t)) topic_release(t);
+        return -1;
+    }
+    n->c = c;
+    n->t = t;
+    n->remote = remote;
+    n->group = NULL;
+    n->where = w;
+    n->tprev = n->tnext = NULL;
+    if (group) {
+        int j = share_join(t, group, glen, n);
+        if (j != 0) {
+            free(n);
+            if (entry_unused(t)) topic_release(t);
+            return j > 0 ? 0 : -1;
+        }
+    } else {
+        n->tnext = *head;
+        if (*head) (*head)->tprev = n;
+        *head = n;
+    }
+    t->nsubs++;
+    n->cprev = NULL; n->cnext = *conn_subs;
+    if (*conn_subs) (*conn_subs)->cprev = n;
+    *conn_subs = n;
+    if (!remote && t->nlocal++ == 0 && topic_interest) topic_interest(t, 1);
+    return 0;
+}
+
+void topic_remove_node(struct sub_node *n, struct sub_node **conn_subs) {
+    struct topic_entry *t = n->t;
+    if (n->group) {
+        share_leave(t, n);
+    } else {
+        struct sub_node **head = n->where ? &n->where->subs : &t->subs;
+        if (n->tprev) n->tprev->tnext = n->tnext; else *head = n->tnext;
+        if (n->tnext) n->tnext->tprev = n->tprev;
+        if (n->where && !n->where->subs) where_drop(t, n->where);
+    }
+    t->nsubs--;
+    if (n->cprev) n->cprev->cnext = n->cnext; else *conn_subs = n->cnext;
+    if (n->cnext) n->cnext->cprev = n->cprev;
+    if (!n->remote && --t->nlocal == 0 && topic_interest) topic_interest(t, 0);
+    free(n);
+    if (entry_unused(t)) topic_release(t);
+}
+
+int topic_unsubscribe(const char *topic, const char *where, struct conn *c, struct sub_node **conn_subs) {
+    if (topic_is_shared(topic)) {
+        size_t glen;
+        const char *group = topic + sizeof(TOPIC_SHARE_PREFIX) - 1;
+        const char *f = share_split(topic, &glen);
+        struct topic_entry *t = f ? topic_find(f) : NULL;
+        struct share_group *g = t ? share_find(t, group, glen) : NULL;
+        for (uint32_t i = 0; g && i < g->n; ++i) {
+            if (g->members[i]->c != c) continue;
+            topic_remove_node(g->members[i], conn_subs);
+            return 0;
+        }
+        return -1;
+    }
+    struct topic_entry *t = topic_find(topic);
+    struct content_filter *w = t && where ? where_find(t, where) : NULL;
+    if (!t || (where && !w)) return -1;
+    for (struct sub_node *n = w ? w->subs : t->subs; n; n = n->tnext) {
+        if (n->c == c) {
+            topic_remove_node(n, conn_subs);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void topic_unsubscribe_all(struct sub_node **conn_subs) {
+    while (*conn_subs) topic_remove_node(*conn_subs, conn_subs);
+}
+
+size_t topic_count(void) {
+    return table_used;
+}
+
+void topic_foreach(void (*fn)(struct topic_entry *t, void *arg), void *arg) {
+    for (size_t i = 0; i < table_cap; ++i)
+        if (table[i]) fn(table[i], arg);
+}
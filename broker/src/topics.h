@@ -0,0 +1,133 @@
+#ifndef TINYIOT_TOPICS_H
+#define TINYIOT_TOPICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Topic index.
+ * Topics live in an open-addressing hash table (linear probing, backward
+ * shift deletion) and their strings are interned inside the entry. Every
+ * subscription node is linked both into its topic and into the owning
+ * connection's list, so a disconnect only touches that client's
+ * subscriptions.
+ *
+ * Wildcard filters ('+' matches one level, '#' the rest) are interned the
+ * same way and additionally hung off a level-segmented trie, so matching a
+ * PUB costs time proportional to the topic depth rather than to the number
+ * of filters.
+ *
+ * Subscriptions held by peer brokers (bridge.h) are flagged remote; each
+ * entry counts the local ones so the bridge can tell peers when interest
+ * in a topic or filter starts and stops.
+ *
+ * A shared subscription "$share/<group>/<filter>" makes the connection a
+ * member of that group on filter's entry instead of a subscriber of it:
+ * every message matching the filter goes to one member of each group,
+ * picked by the caller (round robin or least queued). Members sit in an
+ * array and every node knows its slot, so joining and leaving are O(1)
+ * and a disconnect still only walks that client's own subscriptions.
+ *
+ * "SUB <filter> WHERE <expr>" (jfilter.h) hangs the subscriber off a
+ * content filter of filter's entry, one per distinct expression, so the
+ * caller evaluates each expression once per message however many
+ * connections share it.
+ */
+
+#define TOPIC_SHARE_PREFIX "$share/"
+
+struct topic_entry;
+struct trie_node;
+struct conn;
+struct share_group;
+struct content_filter;
+struct jfilter;
+
+struct sub_node {
+    struct conn *c;
+    struct topic_entry *t;
+    struct sub_node *tprev, *tnext;   /* topic's subscriber list */
+    struct sub_node *cprev, *cnext;   /* connection's subscription list */
+    struct share_group *group;        /* shared subscription, NULL if plain */
+    struct content_filter *where;     /* SUB ... WHERE, NULL if plain */
+    uint32_t slot;                    /* index in group->members */
+    int remote;                       /* held by a peer broker link */
+};
+
+struct share_group {
+    struct share_group *next;         /* entry's groups */
+    struct sub_node **members;
+    uint32_t n, cap;
+    uint32_t rr;                      /* next pick, bumped atomically by readers */
+    char name[];
+};
+
+struct content_filter {
+    struct content_filter *next;      /* entry's content filters */
+    struct jfilter *pred;
+    struct sub_node *subs;            /* linked through tprev/tnext */
+};
+
+struct topic_entry {
+    uint32_t hash;
+    uint32_t nsubs;
+    uint32_t nlocal;                  /* subs that are not remote */
+    struct sub_node *subs;
+    struct share_group *groups;       /* shared subscriptions */
+    struct content_filter *wheres;    /* subscriptions with a WHERE */
+    size_t len;
+    struct trie_node *tnode;          /* wildcard filters only */
+    char topic[];                     /* interned, NUL terminated */
+};
+
+uint32_t topic_hash(const char *s, size_t len);
+
+struct topic_entry *topic_find(const char *topic);
+
+/* 1 if s contains wildcard levels */
+int topic_is_filter(const char *s);
+
+/* 1 if s is a shared subscription "$share/<group>/<filter>" */
+int topic_is_shared(const char *s);
+
+/* check a SUB argument: '+' and '#' must fill a whole level and '#' must be
+ * last; a shared one needs a group without wildcards and a valid filter.
+ * 0 valid, -1 invalid */
+int topic_filter_valid(const char *s);
+
+/* 1 if topic matches filter under the same rules as topic_match */
+int topic_filter_match(const char *filter, const char *topic);
+
+/* call fn for the exact entry of topic and for every filter matching it.
+ * A subscriber holding several matching filters is reported once per
+ * entry; callers dedup per connection. */
+void topic_match(const char *topic, void (*fn)(struct topic_entry *t, void *arg), void *arg);
+
+/* subscribe c to topic (or filter, or shared subscription) and link the
+ * node into *conn_subs; remote: c is a peer broker. where, NULL or a
+ * compiled WHERE for a topic or filter, is owned by the index from here
+ * on (freed if an equal one is already there). 0 ok (also when already
+ * subscribed), -1 OOM */
+int topic_subscribe(const char *topic, struct jfilter *where, struct conn *c, int remote,
+                    struct sub_node **conn_subs);
+
+/* remove one subscription of this connection: the plain one, or the one
+ * whose WHERE has canonical text where. 0 removed, -1 not found */
+int topic_unsubscribe(const char *topic, const char *where, struct conn *c, struct sub_node **conn_subs);
+
+/* remove every subscription in *conn_subs (used on disconnect) */
+void topic_unsubscribe_all(struct sub_node **conn_subs);
+
+/* drop a single node (e.g. stale subscriber found while publishing) */
+void topic_remove_node(struct sub_node *n, struct sub_node **conn_subs);
+
+size_t topic_count(void);
+
+/* call fn for every topic and filter entry */
+void topic_foreach(void (*fn)(struct topic_entry *t, void *arg), void *arg);
+
+/* called when t gets its first local subscriber (on = 1) and when it
+ * loses its last one (on = 0), with the index locked for writing.
+ * NULL by default. */
+extern void (*topic_interest)(const struct topic_entry *t, int on);
+
+#endif
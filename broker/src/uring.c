@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "conn.h"
+#include "reactor.h"
+#include "log.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 256          /* provided recv buffers, power of two */
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+
+/* implemented in broker.c */
+void drain_mailbox(void);
+
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE };
+
+/* iovecs handed to the kernel for one in-flight send */
+struct iov_block {
+    struct iovec iov[OUTQ_IOV_MAX];
+    struct iov_block *next;
+};
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int sq_local;           /* next sqe slot to fill */
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_sz, cq_map_sz, sqes_sz;
+
+    struct io_uring_buf_ring *br;    /* provided buffer ring */
+    size_t br_sz;
+    char *bufs;
+    unsigned short br_tail;
+
+    struct iov_block *iov_free;
+    uint64_t wake_val;
+};
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                     unsigned int flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void ur_free(struct uring *u) {
+    if (u->bufs) free(u->bufs);
+    if (u->br) munmap(u->br, u->br_sz);
+    if (u->sqes) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_map && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_sz);
+    if (u->sq_map) munmap(u->sq_map, u->sq_map_sz);
+    if (u->fd >= 0) close(u->fd);
+    while (u->iov_free) {
+        struct iov_block *b = u->iov_free;
+        u->iov_free = b->next;
+        free(b);
+    }
+    free(u);
+}
+
+static void buf_recycle(struct uring *u, unsigned short bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static struct uring *ur_create(void) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    u->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    u->fd = sys_setup(URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd < 0) goto fail;
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    u->sq_entries = p.sq_entries;
+    u->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_sz > u->sq_map_sz) u->sq_map_sz = u->cq_map_sz;
+        u->cq_map_sz = u->sq_map_sz;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) { u->sq_map = NULL; goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) { u->cq_map = NULL; goto fail; }
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { u->sqes = NULL; goto fail; }
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->sq_local = *u->sq_tail;
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* provided buffer ring for multishot recv */
+    u->br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) { u->br = NULL; goto fail; }
+    u->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!u->bufs) goto fail;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for (unsigned short i = 0; i < URING_BUF_COUNT; ++i) buf_recycle(u, i);
+    return u;
+
+fail:
+    {
+        int e = errno;
+        ur_free(u);
+        errno = e;
+    }
+    return NULL;
+}
+
+int uring_probe(void) {
+    struct uring *u = ur_create();
+    if (!u) return -1;
+    ur_free(u);
+    return 0;
+}
+
+/* submit everything queued so far and optionally wait up to wait_ms for
+ * at least one completion */
+static int ur_enter(struct uring *u, int wait_ms) {
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+    unsigned int to_submit = u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (wait_ms < 0) {
+        if (!to_submit) return 0;
+        int r = sys_enter(u->fd, to_submit, 0, 0, NULL, 0);
+        return (r < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) ? -1 : 0;
+    }
+    struct __kernel_timespec ts;
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (long long)(wait_ms % 1000) * 1000000LL;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    int r = sys_enter(u->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) return -1;
+    return 0;
+}
+
+static struct io_uring_sqe *ur_get_sqe(struct uring *u) {
+    if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        /* ring full: hand what we have to the kernel first */
+        ur_enter(u, -1);
+        if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) return NULL;
+    }
+    unsigned int idx = u->sq_local & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local++;
+    return sqe;
+}
+
+/* user_data: op in bits 0-7, fd in bits 8-31, low 32 bits of gen above */
+static uint64_t ud_make(int op, int fd, uint64_t gen) {
+    return ((uint64_t)(uint32_t)gen << 32) | ((uint64_t)(uint32_t)fd << 8) | (uint64_t)op;
+}
+
+static struct conn *ud_conn(uint64_t ud) {
+    int fd = (int)((ud >> 8) & 0xffffff);
+    struct conn *c = conn_lookup(fd);
+    if (!c || (uint32_t)c->gen != (uint32_t)(ud >> 32)) return NULL;
+    return c;
+}
+
+/* multishot accept on a listener; the fd rides in user_data for re-arming */
+static int arm_accept(struct uring *u, int listen_fd) {
+    struct io_uring_sqe *sqe = ur_get_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ud_make(OP_ACCEPT, listen_fd, 0);
+    return 0;
+}
+
+static int arm_wake(struct uring *u, struct reactor *r) {
+    struct io_uring_sqe *sqe = ur_get_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->wake_val;
+    sqe->len = sizeof(u->wake_val);
+    sqe->user_data = ud_make(OP_WAKE, 0, 0);
+    return 0;
+}
+
+static int arm_recv(struct uring *u, struct conn *c) {
+    struct io_uring_sqe *sqe = ur_get_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = ud_make(OP_RECV, c->fd, c->gen);
+    c->recv_armed = 1;
+    c->io_inflight++;
+    return 0;
+}
+
+int uring_add(struct conn *c) {
+    return arm_recv(c->owner->ring, c);
+}
+
+/* destroy once the kernel holds no request for c */
+static void maybe_finalize(struct conn *c) {
+    if (!c->closing || c->io_inflight) return;
+    int fd = c->fd;
+    conn_destroy(c);
+    close(fd);
+}
+
+void uring_close(struct conn *c) {
+    if (c->closing) return;
+    c->closing = 1;
+    /* completes the multishot recv (EOF) and any in-flight send */
+    shutdown(c->fd, SHUT_RDWR);
+    maybe_finalize(c);
+}
+
+/* one writev per connection with pending output, all in the same batch */
+static void submit_sends(struct uring *u, struct reactor *r) {
+    struct conn *c, *retry = NULL;
+    while ((c = conn_next_dirty(r)) != NULL) {
+        if (c->evicted && !c->closing) {
+            log_warn("fd=%d disconnected as a slow consumer", c->fd);
+            close_connection(c->fd);
+            continue;
+        }
+        /* a replay that matched nothing last time refills here */
+        if (!c->closing && !c->send_iov && outq_empty(&c->outq)) conn_output_drained(c);
+        if (c->closing || c->send_iov || outq_empty(&c->outq)) continue;
+        struct iov_block *b = u->iov_free;
+        if (b) u->iov_free = b->next;
+        else b = malloc(sizeof(*b));
+        struct io_uring_sqe *sqe = b ? ur_get_sqe(u) : NULL;
+        if (!sqe) {
+            if (b) { b->next = u->iov_free; u->iov_free = b; }
+            /* retry with the next batch */
+            retry = c;
+            break;
+        }
+        metric_observe(stats.outq_bytes, c->outq.bytes);
+        int n = outq_iov(&c->outq, b->iov, OUTQ_IOV_MAX, NULL);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)b->iov;
+        sqe->len = (unsigned int)n;
+        sqe->user_data = ud_make(OP_SEND, c->fd, c->gen);
+        c->send_iov = b->iov;
+        c->outq.pinned = (unsigned int)n;   /* the kernel reads these */
+        c->io_inflight++;
+        conn_output_blocked(c, 0);
+    }
+    if (retry) conn_mark_dirty(retry);
+}
+
+static void on_accept(struct uring *u, const struct io_uring_cqe *cqe, int running) {
+    if (cqe->res >= 0) {
+        struct conn *c = conn_accepted(cqe->res, NULL);
+        if (c && arm_recv(u, c) < 0) close_connection(c->fd);
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        log_warn("uring accept: %s", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && running) arm_accept(u, (int)((cqe->user_data >> 8) & 0xffffff));
+}
+
+static void on_recv(struct uring *u, const struct io_uring_cqe *cqe) {
+    struct conn *c = ud_conn(cqe->user_data);
+    int has_buf = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!c) {
+        if (has_buf) buf_recycle(u, bid);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->io_inflight--;
+    }
+    int close_it = 0;
+    if (cqe->res > 0 && has_buf) {
+        if (!c->closing) {
+            int r = conn_input(c, u->bufs + (size_t)bid * URING_BUF_SIZE, (size_t)cqe->res);
+            if (r < 0) close_it = 1;
+        }
+        buf_recycle(u, bid);
+    } else if (cqe->res == 0) {
+        close_it = 1;
+    } else if (cqe->res != -ENOBUFS) {
+        close_it = 1;
+    }
+    int fd = c->fd;
+    if (close_it && !c->closing) {
+        close_connection(fd);
+        if (conn_lookup(fd) != c) return;        /* already destroyed */
+    }
+    if (!c->closing && !c->recv_armed && arm_recv(u, c) < 0) {
+        close_connection(fd);
+        if (conn_lookup(fd) != c) return;
+    }
+    maybe_finalize(c);
+}
+
+static void on_send(struct uring *u, const struct io_uring_cqe *cqe) {
+    struct conn *c = ud_conn(cqe->user_data);
+    if (!c) return;
+    struct iov_block *b = (struct iov_block *)c->send_iov;
+    b->next = u->iov_free;
+    u->iov_free = b;
+    c->send_iov = NULL;
+    c->outq.pinned = 0;
+    c->io_inflight--;
+    if (cqe->res < 0) {
+        if (!c->closing) {
+            int fd = c->fd;
+            log_warn("uring send fd=%d: %s", fd, strerror(-cqe->res));
+            close_connection(fd);
+            if (conn_lookup(fd) != c) return;
+        }
+        maybe_finalize(c);
+        return;
+    }
+    outq_consume(&c->outq, (size_t)cqe->res);
+    if (!outq_empty(&c->outq)) {
+        conn_mark_dirty(c);
+        conn_output_blocked(c, cqe->res > 0);
+    } else if (!c->closing) {
+        conn_output_drained(c);
+    }
+    maybe_finalize(c);
+}
+
+static void reap(struct uring *u, struct reactor *r, int running) {
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+        head++;
+        /* release the slot before handling: handlers may submit more */
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        switch (cqe.user_data & 0xff) {
+        case OP_ACCEPT: on_accept(u, &cqe, running); break;
+        case OP_RECV: on_recv(u, &cqe); break;
+        case OP_SEND: on_send(u, &cqe); break;
+        case OP_WAKE:
+            __atomic_store_n(&r->wake_pending, 0, __ATOMIC_RELEASE);
+            drain_mailbox();
+            if (running) arm_wake(u, r);
+            break;
+        default: break;
+        }
+        if (head == tail) tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static size_t live_conns(struct reactor *r) {
+    return r->conn_slab.in_use;
+}
+
+int uring_reactor_loop(struct reactor *r, volatile int *keep_running) {
+    struct uring *u = ur_create();
+    if (!u) { log_error("io_uring setup: %s", strerror(errno)); return -1; }
+    r->ring = u;
+    if (arm_accept(u, r->listen_fd) < 0 || (r->unix_fd >= 0 && arm_accept(u, r->unix_fd) < 0) ||
+        arm_wake(u, r) < 0) {
+        r->ring = NULL;
+        ur_free(u);
+        return -1;
+    }
+
+    while (__atomic_load_n(keep_running, __ATOMIC_RELAXED)) {
+        submit_sends(u, r);
+        if (ur_enter(u, broker_timeout_ms()) < 0) { log_error("io_uring_enter: %s", strerror(errno)); break; }
+        /* deadlines first: the completions below are stamped with this tick */
+        broker_tick();
+        reap(u, r, 1);
+    }
+
+    /* shut every connection down and wait (bounded) for the kernel to
+     * return their requests before freeing buffers they point into */
+    for (unsigned int i = 0; i < r->conns.size; ++i) if (r->conns.slot[i]) close_connection((int)i);
+    for (int tries = 0; tries < 100 && live_conns(r) > 0; ++tries) {
+        submit_sends(u, r);
+        if (ur_enter(u, 10) < 0) break;
+        reap(u, r, 0);
+    }
+    drain_mailbox();
+    r->ring = NULL;
+    ur_free(u);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef TINYIOT_URING_H
+#define TINYIOT_URING_H
+
+struct reactor;
+struct conn;
+
+/* io_uring event loop backend, selected with --backend uring.
+ * Accepts use multishot accept, reads use multishot recv into a provided
+ * buffer ring, and every connection with queued output gets one writev
+ * request per loop iteration, all submitted with a single io_uring_enter.
+ * Talks to the kernel through raw syscalls (no liburing).
+ */
+
+/* 0 if this kernel supports everything the backend needs */
+int uring_probe(void);
+
+/* run reactor r until *keep_running drops to 0. Returns -1 if the ring
+ * could not be set up. */
+int uring_reactor_loop(struct reactor *r, volatile int *keep_running);
+
+/* start receiving on c, a conn the calling reactor created itself
+ * (a dialed peer link). 0 ok, -1 no submission slot */
+int uring_add(struct conn *c);
+
+/* shut c down; it is destroyed once no request references it */
+void uring_close(struct conn *c);
+
+#endif
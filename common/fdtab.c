@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+#include "fdtab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/resource.h>
+
+unsigned int fd_limit_raise(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return FDTAB_INITIAL;
+    if (rl.rlim_cur < rl.rlim_max) {
+        struct rlimit want = { rl.rlim_max, rl.rlim_max };
+        if (setrlimit(RLIMIT_NOFILE, &want) == 0) rl.rlim_cur = rl.rlim_max;
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) return INT_MAX;
+    return (unsigned int)rl.rlim_cur;
+}
+
+int fdtab_init(struct fdtab *t, unsigned int limit) {
+    t->limit = limit;
+    t->size = limit < FDTAB_INITIAL ? limit : FDTAB_INITIAL;
+    t->slot = calloc(t->size ? t->size : 1, sizeof(*t->slot));
+    return t->slot ? 0 : -1;
+}
+
+static int fdtab_grow(struct fdtab *t, unsigned int need) {
+    unsigned int nsize = t->size ? t->size : FDTAB_INITIAL;
+    while (nsize < need) nsize = nsize > t->limit / 2 ? t->limit : nsize * 2;
+    void **ns = realloc(t->slot, (size_t)nsize * sizeof(*ns));
+    if (!ns) return -1;
+    memset(ns + t->size, 0, (size_t)(nsize - t->size) * sizeof(*ns));
+    t->slot = ns;
+    t->size = nsize;
+    return 0;
+}
+
+int fdtab_set(struct fdtab *t, int fd, void *p) {
+    if (fd < 0 || (unsigned int)fd >= t->limit) return -1;
+    if ((unsigned int)fd >= t->size) {
+        if (!p) return 0;
+        if (fdtab_grow(t, (unsigned int)fd + 1) < 0) return -1;
+    }
+    t->slot[fd] = p;
+    return 0;
+}
+
+void fdtab_free(struct fdtab *t) {
+    free(t->slot);
+    t->slot = NULL;
+    t->size = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef TINYIOT_FDTAB_H
+#define TINYIOT_FDTAB_H
+
+#include <stddef.h>
+
+/* fd -> object table that grows (doubling) as higher descriptors show
+ * up, up to the process's descriptor limit. Lookups of descriptors past
+ * the current size simply find nothing. Not thread safe: one owner. */
+struct fdtab {
+    void **slot;
+    unsigned int size;
+    unsigned int limit;
+};
+
+#define FDTAB_INITIAL 1024
+
+/* raise the soft RLIMIT_NOFILE to the hard one and return it: the
+ * largest table any fd of this process can need */
+unsigned int fd_limit_raise(void);
+
+/* empty table for fds below limit. 0 ok, -1 OOM */
+int fdtab_init(struct fdtab *t, unsigned int limit);
+
+static inline void *fdtab_get(const struct fdtab *t, int fd) {
+    return (fd >= 0 && (unsigned int)fd < t->size) ? t->slot[fd] : NULL;
+}
+
+/* store p (NULL to clear) at fd, growing the table when needed.
+ * 0 ok, -1 when fd is past the limit or growing failed */
+int fdtab_set(struct fdtab *t, int fd, void *p);
+
+void fdtab_free(struct fdtab *t);
+
+#endif
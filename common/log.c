@@ -0,0 +1,202 @@
+/* common/log.c -- per-thread log rings drained by a background thread */
+#define _GNU_SOURCE
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING_SLOTS 1024      /* per thread, power of two */
+#define LOG_LINE_MAX 256         /* longer records are truncated */
+#define LOG_BATCH 65536          /* bytes per write(2) from the drain thread */
+#define LOG_IDLE_NS 10000000L    /* drain thread poll interval when idle */
+
+struct log_rec {
+    unsigned char level;
+    unsigned short len;
+    char text[LOG_LINE_MAX];
+};
+
+/* single producer (the owning thread), single consumer (drain thread) */
+struct log_ring {
+    struct log_ring *next;       /* registration list, append only */
+    unsigned long tail;          /* written by the producer */
+    char pad[64];
+    unsigned long head;          /* written by the consumer */
+    unsigned long dropped;
+    struct log_rec rec[LOG_RING_SLOTS];
+};
+
+int log_level = LL_INFO;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DBG" };
+static const char *log_tag = NULL;
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_tid;
+static int running = 0;
+static int stop_drain = 0;
+static unsigned long dropped_reported = 0;
+static __thread struct log_ring *my_ring = NULL;
+
+int log_parse_level(const char *name) {
+    if (strcmp(name, "error") == 0) return LL_ERROR;
+    if (strcmp(name, "warn") == 0) return LL_WARN;
+    if (strcmp(name, "info") == 0) return LL_INFO;
+    if (strcmp(name, "debug") == 0) return LL_DEBUG;
+    return -1;
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+unsigned long log_dropped(void) {
+    unsigned long n = 0;
+    for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    return n;
+}
+
+static size_t format_line(char *dst, size_t cap, int level, const char *text, size_t len) {
+    int n;
+    if (log_tag) n = snprintf(dst, cap, "[%s] [%s] ", log_tag, level_names[level]);
+    else n = snprintf(dst, cap, "[%s] ", level_names[level]);
+    size_t off = (n < 0) ? 0 : (size_t)n;
+    if (off + len + 1 > cap) len = cap - off - 1;
+    memcpy(dst + off, text, len);
+    dst[off + len] = '\n';
+    return off + len + 1;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(STDERR_FILENO, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static struct log_ring *ring_get(void) {
+    if (my_ring) return my_ring;
+    struct log_ring *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    pthread_mutex_lock(&rings_lock);
+    /* prepend; the drain thread only ever walks from the published head */
+    r->next = rings;
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = r;
+    return r;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    struct log_ring *r = __atomic_load_n(&running, __ATOMIC_ACQUIRE) ? ring_get() : NULL;
+    if (!r) {
+        /* before log_init or out of memory: write synchronously */
+        char text[LOG_LINE_MAX], line[LOG_LINE_MAX + 32];
+        va_start(ap, fmt);
+        int n = vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        size_t len = (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1;
+        write_all(line, format_line(line, sizeof(line), level, text, len));
+        return;
+    }
+    unsigned long t = r->tail;
+    if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_rec *rec = &r->rec[t & (LOG_RING_SLOTS - 1)];
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    rec->len = (unsigned short)((size_t)n < sizeof(rec->text) ? (size_t)n : sizeof(rec->text) - 1);
+    rec->level = (unsigned char)level;
+    __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+}
+
+/* move everything currently queued to stderr; returns records written */
+static unsigned long drain_once(char *buf) {
+    size_t used = 0;
+    unsigned long count = 0;
+    for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long h = r->head;
+        unsigned long t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; h != t; ++h) {
+            struct log_rec *rec = &r->rec[h & (LOG_RING_SLOTS - 1)];
+            if (used + LOG_LINE_MAX + 64 > LOG_BATCH) {
+                write_all(buf, used);
+                used = 0;
+            }
+            used += format_line(buf + used, LOG_BATCH - used, rec->level, rec->text, rec->len);
+            count++;
+        }
+        __atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+    }
+    unsigned long dropped = log_dropped();
+    if (dropped != dropped_reported) {
+        char text[96];
+        int n = snprintf(text, sizeof(text), "log: %lu records dropped (ring full)",
+                         dropped - dropped_reported);
+        if (used + LOG_LINE_MAX + 64 > LOG_BATCH) {
+            write_all(buf, used);
+            used = 0;
+        }
+        used += format_line(buf + used, LOG_BATCH - used, LL_WARN, text, (size_t)n);
+        dropped_reported = dropped;
+    }
+    if (used) write_all(buf, used);
+    return count;
+}
+
+static void *drain_main(void *arg) {
+    char *buf = arg;
+    while (!__atomic_load_n(&stop_drain, __ATOMIC_ACQUIRE)) {
+        if (drain_once(buf) == 0) {
+            struct timespec ts = { 0, LOG_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    drain_once(buf);
+    return buf;
+}
+
+int log_init(const char *tag) {
+    log_tag = tag;
+    const char *env = getenv("TINYIOT_LOG");
+    if (env) {
+        int l = log_parse_level(env);
+        if (l >= 0) log_set_level(l);
+    }
+    char *buf = malloc(LOG_BATCH);
+    if (!buf) return -1;
+    stop_drain = 0;
+    if (pthread_create(&drain_tid, NULL, drain_main, buf) != 0) {
+        free(buf);
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+    /* later records from this point go out synchronously */
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stop_drain, 1, __ATOMIC_RELEASE);
+    void *buf = NULL;
+    pthread_join(drain_tid, &buf);
+    free(buf);
+}
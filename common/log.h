@@ -0,0 +1,50 @@
+#ifndef TINYIOT_LOG_H
+#define TINYIOT_LOG_H
+
+/* Asynchronous leveled logging shared by brokerd and gatewayd.
+ *
+ * Each thread formats its records into its own single-producer ring; a
+ * background thread drains every ring and writes them to stderr in
+ * batches. A full ring drops the record and counts it, so a log storm
+ * never blocks the event loop. Records above LOG_COMPILE_LEVEL are
+ * removed by the compiler; the rest cost one compare against the runtime
+ * level when disabled.
+ */
+
+enum log_level { LL_ERROR = 0, LL_WARN, LL_INFO, LL_DEBUG };
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LL_DEBUG
+#endif
+
+/* runtime threshold, LL_INFO unless changed by log_init/log_set_level */
+extern int log_level;
+
+#define log_at(lvl, ...) do { \
+    if ((lvl) <= LOG_COMPILE_LEVEL && (lvl) <= log_level) log_write((lvl), __VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_at(LL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LL_DEBUG, __VA_ARGS__)
+
+/* start the drain thread. tag, if not NULL, prefixes every line as
+ * "[tag] ". The TINYIOT_LOG environment variable (error, warn, info,
+ * debug) sets the initial level. Returns -1 if the thread cannot start;
+ * logging then stays synchronous. */
+int log_init(const char *tag);
+
+/* drain what is left and stop the drain thread */
+void log_shutdown(void);
+
+/* parse "error".."debug"; -1 if unknown */
+int log_parse_level(const char *name);
+void log_set_level(int level);
+
+/* records dropped because a ring was full, all threads */
+unsigned long log_dropped(void);
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,198 @@
+/* common/metrics.c -- sharded counters/histograms and the Prometheus listener */
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_RENDER_MAX (256 * 1024)
+
+__thread unsigned int metric_shard_id = 0;
+
+static struct metric *metrics_head = NULL, *metrics_tail = NULL;
+static unsigned int next_shard = 0;
+static int listen_fd = -1;
+static int stop_server = 0;
+static pthread_t server_tid;
+
+void metric_thread_init(void) {
+    metric_shard_id = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRIC_SHARDS;
+}
+
+struct metric *metric_new(const char *name, const char *help, enum metric_type type) {
+    struct metric *m = aligned_alloc(64, (sizeof(*m) + 63) & ~(size_t)63);
+    if (!m) {
+        log_error("metrics: cannot allocate %s", name);
+        abort();
+    }
+    memset(m, 0, sizeof(*m));
+    m->name = name;
+    m->help = help;
+    m->type = type;
+    /* keep registration order in the output */
+    if (metrics_tail) metrics_tail->next = m; else metrics_head = m;
+    metrics_tail = m;
+    return m;
+}
+
+struct metric *metric_func(const char *name, const char *help, enum metric_type type, uint64_t (*fn)(void)) {
+    struct metric *m = metric_new(name, help, type);
+    m->read = fn;
+    return m;
+}
+
+uint64_t metric_value(struct metric *m) {
+    if (m->read) return m->read();
+    if (m->type == METRIC_GAUGE) return (uint64_t)__atomic_load_n(&m->gauge, __ATOMIC_RELAXED);
+    uint64_t v = 0;
+    for (int i = 0; i < METRIC_SHARDS; ++i) v += __atomic_load_n(&m->shard[i].v, __ATOMIC_RELAXED);
+    return v;
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static const char *type_name(enum metric_type t) {
+    switch (t) {
+    case METRIC_COUNTER: return "counter";
+    case METRIC_GAUGE: return "gauge";
+    default: return "histogram";
+    }
+}
+
+/* append formatted text; keeps counting past cap so the caller learns the size */
+static void emit(char *buf, size_t cap, size_t *off, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+static void emit(char *buf, size_t cap, size_t *off, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(*off < cap ? buf + *off : NULL, *off < cap ? cap - *off : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0) *off += (size_t)n;
+}
+
+size_t metrics_render(char *buf, size_t cap) {
+    size_t off = 0;
+    for (struct metric *m = metrics_head; m; m = m->next) {
+        emit(buf, cap, &off, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type_name(m->type));
+        if (m->type == METRIC_GAUGE && !m->read) {
+            emit(buf, cap, &off, "%s %lld\n", m->name, (long long)__atomic_load_n(&m->gauge, __ATOMIC_RELAXED));
+            continue;
+        }
+        if (m->type != METRIC_HISTOGRAM) {
+            emit(buf, cap, &off, "%s %llu\n", m->name, (unsigned long long)metric_value(m));
+            continue;
+        }
+        uint64_t bucket[METRIC_BUCKETS + 1] = { 0 }, sum = 0;
+        for (int i = 0; i < METRIC_SHARDS; ++i) {
+            struct metric_shard *s = &m->shard[i];
+            for (int b = 0; b <= METRIC_BUCKETS; ++b) bucket[b] += __atomic_load_n(&s->bucket[b], __ATOMIC_RELAXED);
+            sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+        }
+        uint64_t cum = 0;
+        for (int b = 0; b < METRIC_BUCKETS; ++b) {
+            cum += bucket[b];
+            emit(buf, cap, &off, "%s_bucket{le=\"%llu\"} %llu\n", m->name, 1ull << b, (unsigned long long)cum);
+        }
+        /* shards are read one at a time, so +Inf is the sum of buckets,
+         * not the separately counted total */
+        cum += bucket[METRIC_BUCKETS];
+        emit(buf, cap, &off, "%s_bucket{le=\"+Inf\"} %llu\n", m->name, (unsigned long long)cum);
+        emit(buf, cap, &off, "%s_sum %llu\n%s_count %llu\n", m->name, (unsigned long long)sum,
+             m->name, (unsigned long long)cum);
+    }
+    return off;
+}
+
+static void serve_one(int fd, char *out) {
+    /* the request itself is not interpreted: every GET gets the metrics */
+    char req[1024];
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 1000) > 0) {
+        ssize_t r = read(fd, req, sizeof(req));
+        (void)r;
+    }
+    size_t len = metrics_render(out, METRICS_RENDER_MAX);
+    if (len > METRICS_RENDER_MAX) len = METRICS_RENDER_MAX;
+    char hdr[160];
+    int hn = snprintf(hdr, sizeof(hdr),
+                      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (write(fd, hdr, (size_t)hn) == hn) {
+        size_t off = 0;
+        while (off < len) {
+            ssize_t w = write(fd, out + off, len - off);
+            if (w <= 0) break;
+            off += (size_t)w;
+        }
+    }
+    close(fd);
+}
+
+static void *server_main(void *arg) {
+    char *out = arg;
+    metric_thread_init();
+    while (!__atomic_load_n(&stop_server, __ATOMIC_ACQUIRE)) {
+        struct pollfd p = { listen_fd, POLLIN, 0 };
+        if (poll(&p, 1, 500) <= 0) continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        /* a stalled scraper must not hold the thread forever */
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve_one(fd, out);
+    }
+    return out;
+}
+
+int metrics_listen(int port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char *out = malloc(METRICS_RENDER_MAX);
+    if (!out || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        int e = errno;
+        free(out);
+        close(listen_fd);
+        listen_fd = -1;
+        errno = e;
+        return -1;
+    }
+    stop_server = 0;
+    if (pthread_create(&server_tid, NULL, server_main, out) != 0) {
+        free(out);
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    log_info("metrics on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (listen_fd < 0) return;
+    __atomic_store_n(&stop_server, 1, __ATOMIC_RELEASE);
+    void *out = NULL;
+    pthread_join(server_tid, &out);
+    free(out);
+    close(listen_fd);
+    listen_fd = -1;
+}
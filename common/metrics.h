@@ -0,0 +1,90 @@
+#ifndef TINYIOT_METRICS_H
+#define TINYIOT_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Process metrics shared by brokerd and gatewayd.
+ *
+ * Counters and histograms are split into per-thread shards padded to a
+ * cache line, so updating them is one uncontended relaxed add; readers
+ * sum the shards when rendering. Histograms use power-of-two buckets.
+ * Everything renders in the Prometheus text exposition format, served by
+ * metrics_listen() and by the STATS protocol command.
+ */
+
+#define METRIC_SHARDS 16
+#define METRIC_BUCKETS 24        /* le=1,2,4..2^23 plus +Inf */
+
+enum metric_type { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+struct metric_shard {
+    uint64_t v;
+    uint64_t sum;
+    uint64_t bucket[METRIC_BUCKETS + 1];
+} __attribute__((aligned(64)));
+
+struct metric {
+    const char *name;
+    const char *help;
+    enum metric_type type;
+    uint64_t (*read)(void);      /* computed at render time, if set */
+    int64_t gauge;
+    struct metric *next;
+    struct metric_shard shard[METRIC_SHARDS];
+};
+
+/* register a metric; call during startup, before worker threads run */
+struct metric *metric_new(const char *name, const char *help, enum metric_type type);
+/* metric whose value is produced by fn when rendered */
+struct metric *metric_func(const char *name, const char *help, enum metric_type type, uint64_t (*fn)(void));
+
+/* shard of the calling thread */
+extern __thread unsigned int metric_shard_id;
+void metric_thread_init(void);
+
+static inline struct metric_shard *metric_my_shard(struct metric *m) {
+    return &m->shard[metric_shard_id];
+}
+
+static inline void metric_add(struct metric *m, uint64_t n) {
+    __atomic_fetch_add(&metric_my_shard(m)->v, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_inc(struct metric *m) {
+    metric_add(m, 1);
+}
+
+static inline void metric_gauge_add(struct metric *m, int64_t n) {
+    __atomic_fetch_add(&m->gauge, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_gauge_set(struct metric *m, int64_t v) {
+    __atomic_store_n(&m->gauge, v, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(struct metric *m, uint64_t v) {
+    struct metric_shard *s = metric_my_shard(m);
+    /* bucket b holds (2^(b-1), 2^b] */
+    unsigned int b = v > 1 ? 64 - (unsigned int)__builtin_clzll(v - 1) : 0;
+    if (b > METRIC_BUCKETS) b = METRIC_BUCKETS;
+    __atomic_fetch_add(&s->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->v, 1, __ATOMIC_RELAXED);
+}
+
+/* counter total across shards */
+uint64_t metric_value(struct metric *m);
+
+/* render every metric; returns the length, or the size needed if cap is
+ * too small (nothing is truncated mid-line) */
+size_t metrics_render(char *buf, size_t cap);
+
+/* serve GET /metrics on 127.0.0.1:port from a background thread */
+int metrics_listen(int port);
+void metrics_stop(void);
+
+/* monotonic microseconds, for latency metrics */
+uint64_t metrics_now_us(void);
+
+#endif
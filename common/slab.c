@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_LINE 64
+#define SLAB_CHUNK (64 * 1024)
+
+struct slab_chunk {
+    struct slab_chunk *next;
+};
+
+/* the chunk header takes the first cache line, objects follow */
+#define SLAB_HDR SLAB_LINE
+
+void slab_init(struct slab *s, size_t size) {
+    memset(s, 0, sizeof(*s));
+    if (size < sizeof(void *)) size = sizeof(void *);
+    s->size = (size + SLAB_LINE - 1) & ~(size_t)(SLAB_LINE - 1);
+    s->per_chunk = (unsigned int)((SLAB_CHUNK - SLAB_HDR) / s->size);
+    if (s->per_chunk == 0) s->per_chunk = 1;
+}
+
+static int slab_grow(struct slab *s) {
+    size_t bytes = SLAB_HDR + (size_t)s->per_chunk * s->size;
+    struct slab_chunk *ch = aligned_alloc(SLAB_LINE, bytes);
+    if (!ch) return -1;
+    ch->next = s->chunks;
+    s->chunks = ch;
+    /* push in reverse so allocations walk the chunk in address order */
+    char *base = (char *)ch + SLAB_HDR;
+    for (unsigned int i = s->per_chunk; i > 0; --i) {
+        void **obj = (void **)(base + (size_t)(i - 1) * s->size);
+        *obj = s->free;
+        s->free = obj;
+    }
+    return 0;
+}
+
+void *slab_alloc(struct slab *s) {
+    if (!s->free && slab_grow(s) < 0) return NULL;
+    void **obj = s->free;
+    s->free = *obj;
+    s->in_use++;
+    memset(obj, 0, s->size);
+    return obj;
+}
+
+void slab_free(struct slab *s, void *p) {
+    if (!p) return;
+    *(void **)p = s->free;
+    s->free = p;
+    s->in_use--;
+}
+
+void slab_destroy(struct slab *s) {
+    struct slab_chunk *ch = s->chunks;
+    while (ch) {
+        struct slab_chunk *next = ch->next;
+        free(ch);
+        ch = next;
+    }
+    s->chunks = NULL;
+    s->free = NULL;
+    s->in_use = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef TINYIOT_SLAB_H
+#define TINYIOT_SLAB_H
+
+#include <stddef.h>
+
+/* Fixed-size object allocator shared by brokerd and gatewayd.
+ *
+ * Objects are carved out of 64 KiB chunks, each rounded up to a cache
+ * line so neighbours never share one, and freed objects go on a free
+ * list for the next allocation. Chunks are only released by
+ * slab_destroy. Not thread safe: each event loop owns its own slab, so
+ * accepting connections never contends on the malloc arena.
+ */
+
+struct slab_chunk;
+
+struct slab {
+    size_t size;                 /* object size, cache line multiple */
+    unsigned int per_chunk;
+    void *free;                  /* free objects, linked through their first word */
+    struct slab_chunk *chunks;
+    size_t in_use;
+};
+
+/* objects of size bytes */
+void slab_init(struct slab *s, size_t size);
+
+/* a zeroed object, NULL when out of memory */
+void *slab_alloc(struct slab *s);
+
+void slab_free(struct slab *s, void *p);
+
+/* release every chunk; objects still in use become invalid */
+void slab_destroy(struct slab *s);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef TINYIOT_UNIXSOCK_H
+#define TINYIOT_UNIXSOCK_H
+
+/* AF_UNIX stream sockets for clients on the same host: the protocol is
+ * the same as over TCP, without the TCP/IP stack in between. */
+
+/* bind and listen at path, non-blocking. A socket file left behind by a
+ * daemon that is gone is replaced; one that still accepts connections is
+ * not (EADDRINUSE). fd, or -1 with errno set */
+int unix_listen(const char *path, int backlog);
+
+/* blocking connect to the socket at path. fd, or -1 with errno set */
+int unix_connect(const char *path);
+
+/* close a unix_listen socket and remove its file */
+void unix_unlisten(int fd, const char *path);
+
+#endif
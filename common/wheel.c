@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "wheel.h"
+#include <string.h>
+#include <time.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint32_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+uint64_t wheel_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+void wheel_init(struct wheel *w, wheel_fn expire) {
+    memset(w, 0, sizeof(*w));
+    w->expire = expire;
+    /* start at tick 1: callers may use 0 as "no stamp" */
+    w->now = 1;
+    w->base_ms = wheel_clock_ms() - WHEEL_TICK_MS;
+}
+
+/* put t in the slot for its expiry; already due goes in the current
+ * level-0 slot, which wheel_advance is about to fire */
+static void wheel_link(struct wheel *w, struct timer *t) {
+    uint32_t delta = t->expires - w->now;
+    if ((int32_t)delta < 0) { t->expires = w->now; delta = 0; }
+    if (delta >= WHEEL_SPAN) { t->expires = w->now + WHEEL_SPAN - 1; delta = WHEEL_SPAN - 1; }
+    int level = 0;
+    while (delta >= (uint32_t)1 << (WHEEL_BITS * (level + 1))) level++;
+    unsigned int idx = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct timer **head = &w->slot[level][idx];
+    t->next = *head;
+    if (*head) (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    w->used[level] |= (uint64_t)1 << idx;
+}
+
+static void wheel_unlink(struct wheel *w, struct timer *t) {
+    struct timer **pp = t->pprev;
+    *pp = t->next;
+    if (t->next) t->next->pprev = pp;
+    t->next = NULL;
+    t->pprev = NULL;
+    /* the last timer of a slot points back at the slot head itself */
+    struct timer **first = &w->slot[0][0];
+    if (!*pp && pp >= first && pp < first + WHEEL_LEVELS * WHEEL_SLOTS) {
+        size_t n = (size_t)(pp - first);
+        w->used[n / WHEEL_SLOTS] &= ~((uint64_t)1 << (n % WHEEL_SLOTS));
+    }
+}
+
+void timer_set(struct wheel *w, struct timer *t, uint32_t expires) {
+    if (timer_pending(t)) timer_del(w, t);
+    if (!tick_before(w->now, expires)) expires = w->now + 1;
+    t->expires = expires;
+    wheel_link(w, t);
+    w->pending++;
+}
+
+void timer_del(struct wheel *w, struct timer *t) {
+    if (!timer_pending(t)) return;
+    wheel_unlink(w, t);
+    w->pending--;
+}
+
+/* move a higher-level slot's timers down now that they are closer */
+static void wheel_cascade(struct wheel *w, int level, unsigned int idx) {
+    struct timer *t = w->slot[level][idx];
+    w->slot[level][idx] = NULL;
+    w->used[level] &= ~((uint64_t)1 << idx);
+    while (t) {
+        struct timer *next = t->next;
+        wheel_link(w, t);
+        t = next;
+    }
+}
+
+void wheel_advance(struct wheel *w) {
+    uint32_t target = (uint32_t)((wheel_clock_ms() - w->base_ms) / WHEEL_TICK_MS);
+    while (tick_before(w->now, target)) {
+        w->now++;
+        unsigned int idx = w->now & WHEEL_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; ++level) {
+                unsigned int li = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                wheel_cascade(w, level, li);
+                if (li) break;
+            }
+        }
+        struct timer *t;
+        while ((t = w->slot[0][idx]) != NULL) {
+            w->slot[0][idx] = t->next;
+            if (t->next) t->next->pprev = &w->slot[0][idx];
+            t->next = NULL;
+            t->pprev = NULL;
+            w->pending--;
+            w->expire(w, t);
+        }
+        w->used[0] &= ~((uint64_t)1 << idx);
+        if (!w->pending) {
+            /* nothing to fire on the way: jump */
+            w->now = target;
+            break;
+        }
+    }
+}
+
+int wheel_timeout_ms(const struct wheel *w, int max_ms) {
+    if (!w->pending) return max_ms;
+    unsigned int cur = w->now & WHEEL_MASK;
+    /* ticks to the next cascade, then to the next busy level-0 slot */
+    uint32_t ticks = WHEEL_SLOTS - cur;
+    uint64_t bits = w->used[0];
+    if (bits) {
+        unsigned int sh = (cur + 1) & WHEEL_MASK;
+        uint64_t rot = sh ? (bits >> sh) | (bits << (64 - sh)) : bits;
+        uint32_t t0 = (uint32_t)__builtin_ctzll(rot) + 1;
+        if (t0 < ticks) ticks = t0;
+    }
+    uint64_t due = w->base_ms + (uint64_t)(w->now + ticks) * WHEEL_TICK_MS;
+    uint64_t now = wheel_clock_ms();
+    if (due <= now) return 0;
+    return due - now < (uint64_t)max_ms ? (int)(due - now) : max_ms;
+}
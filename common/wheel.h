@@ -0,0 +1,70 @@
+#ifndef TINYIOT_WHEEL_H
+#define TINYIOT_WHEEL_H
+
+#include <stdint.h>
+
+/* Hierarchical timing wheel shared by brokerd and gatewayd.
+ *
+ * Time is counted in ticks of WHEEL_TICK_MS. Four levels of 64 slots
+ * cover 64, 64^2, 64^3 and 64^4 ticks ahead (about 46 hours); a timer
+ * further out is parked in the last level and fires early, which the
+ * owner's callback treats like any other check of its deadlines. Adding,
+ * moving and removing a timer are O(1); wheel_advance costs one step per
+ * elapsed tick plus the timers that fire or cascade down a level.
+ *
+ * Meant for lazy re-arming: keep one timer per object, record activity
+ * as a tick stamp, and let the callback compute the next deadline when
+ * the timer fires instead of moving it on every event. Not thread safe:
+ * each event loop owns its wheel.
+ */
+
+#define WHEEL_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct timer {
+    struct timer *next, **pprev; /* pprev NULL when not pending */
+    uint32_t expires;            /* tick */
+};
+
+struct wheel;
+typedef void (*wheel_fn)(struct wheel *w, struct timer *t);
+
+struct wheel {
+    uint32_t now;                /* current tick */
+    uint64_t base_ms;            /* monotonic ms of tick 0 */
+    wheel_fn expire;             /* called for every timer that fires */
+    uint64_t used[WHEEL_LEVELS]; /* bit per non-empty slot */
+    struct timer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long pending;
+};
+
+/* monotonic clock in ms (coarse: one read per loop iteration) */
+uint64_t wheel_clock_ms(void);
+
+void wheel_init(struct wheel *w, wheel_fn expire);
+
+static inline int timer_pending(const struct timer *t) { return t->pprev != 0; }
+
+/* ticks of a duration in seconds, at least 1 */
+static inline uint32_t wheel_ticks_s(unsigned int s) {
+    uint64_t t = (uint64_t)s * 1000 / WHEEL_TICK_MS;
+    return t ? (uint32_t)(t > UINT32_MAX / 2 ? UINT32_MAX / 2 : t) : 1;
+}
+
+/* (re)arm t to fire at tick expires (in the past fires on the next tick) */
+void timer_set(struct wheel *w, struct timer *t, uint32_t expires);
+
+void timer_del(struct wheel *w, struct timer *t);
+
+/* bring the wheel to the clock and fire what expired */
+void wheel_advance(struct wheel *w);
+
+/* ms until the wheel next needs wheel_advance, at most max_ms */
+int wheel_timeout_ms(const struct wheel *w, int max_ms);
+
+/* tick a is before b, wrap safe */
+static inline int tick_before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+#endif
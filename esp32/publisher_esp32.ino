@@ -3,6 +3,7 @@
  ESP32 (esp32dev) - FreeRTOS publisher that sends simulated sensor data
  - Simula temperatura y humedad (2 tareas)
  - Imprime payloads por Serial (ver en Wokwi)
+ - Las muestras acumuladas en la cola salen juntas en un solo MPUB
  - Intenta conectar y enviar al gateway público via ngrok (6.tcp.ngrok.io:14342)
  - Core: no librerías externas necesarias (WiFi.h viene con el core)
 */
@@ -25,6 +26,7 @@
 
 #define SAMPLE_QUEUE_LEN 8
 #define MAX_PAYLOAD 1024
+#define BATCH_BUF (SAMPLE_QUEUE_LEN * 256)  // registros MPUB: u16 + topic + u32 + payload
 
 typedef struct {
   unsigned long ts_ms;
@@ -33,6 +35,7 @@ typedef struct {
 } sample_t;
 
 static QueueHandle_t sampleQueue = NULL;
+static uint8_t batch_buf[BATCH_BUF];
 
 static void build_payload(char *buf, size_t buflen, const char *node_id, unsigned long ts_ms, float temp, float hum) {
   int n = snprintf(buf, buflen,
@@ -101,6 +104,7 @@ static void sender_task(void *pv) {
   WiFiClient client;
   char payload[MAX_PAYLOAD];
   char header[128];
+  const size_t topic_len = strlen(TOPIC);
   const bool try_send = true; // ACTIVADO: envia via ngrok -> gateway en Codespace
   while (1) {
     sample_t sample;
@@ -108,12 +112,27 @@ static void sender_task(void *pv) {
       vTaskDelay(pdMS_TO_TICKS(500));
       continue;
     }
-    unsigned long now_ms = (unsigned long)(esp_timer_get_time() / 1000ULL);
-    build_payload(payload, sizeof(payload), PUBLISHER_ID, now_ms, sample.temp, sample.hum);
-
-    // Mostrar en Serial siempre
-    Serial.print("[PAYLOAD] ");
-    Serial.println(payload);
+    // juntar la muestra recibida y las que ya esperan en la cola en un lote:
+    // registros u16 topic_len | topic | u32 len | payload
+    unsigned n = 0;
+    size_t blen = 0;
+    do {
+      unsigned long now_ms = (unsigned long)(esp_timer_get_time() / 1000ULL);
+      build_payload(payload, sizeof(payload), PUBLISHER_ID, now_ms, sample.temp, sample.hum);
+      size_t plen = strlen(payload);
+      if (blen + 2 + topic_len + 4 + plen > sizeof(batch_buf)) break;
+      uint16_t tbe = htons((uint16_t)topic_len);
+      uint32_t pbe = htonl((uint32_t)plen);
+      memcpy(batch_buf + blen, &tbe, 2); blen += 2;
+      memcpy(batch_buf + blen, TOPIC, topic_len); blen += topic_len;
+      memcpy(batch_buf + blen, &pbe, 4); blen += 4;
+      memcpy(batch_buf + blen, payload, plen); blen += plen;
+      n++;
+
+      // Mostrar en Serial siempre
+      Serial.print("[PAYLOAD] ");
+      Serial.println(payload);
+    } while (n < SAMPLE_QUEUE_LEN && xQueueReceive(sampleQueue, &sample, 0) == pdTRUE);
 
     if (!try_send) { vTaskDelay(pdMS_TO_TICKS(50)); continue; }
 
@@ -149,16 +168,26 @@ got_ok:
       continue;
     }
 
-    // enviar header PUB + 4B BE + payload
-    size_t len = strlen(payload);
-    int hn = snprintf(header, sizeof(header), "PUB %s %u\n", TOPIC, (unsigned)len);
+    // una muestra: header PUB + 4B BE + payload; varias: MPUB + 4B BE + registros
+    const uint8_t *body;
+    size_t len;
+    int hn;
+    if (n == 1) {
+      body = batch_buf + 2 + topic_len + 4;
+      len = blen - (2 + topic_len + 4);
+      hn = snprintf(header, sizeof(header), "PUB %s %u\n", TOPIC, (unsigned)len);
+    } else {
+      body = batch_buf;
+      len = blen;
+      hn = snprintf(header, sizeof(header), "MPUB %u %u\n", n, (unsigned)len);
+    }
     if (hn < 0) { Serial.println("[SENDER] header snprintf error"); client.stop(); vTaskDelay(pdMS_TO_TICKS(2000)); continue; }
     if (!send_all(client, (const uint8_t*)header, hn)) { Serial.println("[SENDER] header send failed"); client.stop(); vTaskDelay(pdMS_TO_TICKS(2000)); continue; }
     uint32_t be = htonl((uint32_t)len);
     if (!send_all(client, (const uint8_t*)&be, sizeof(be))) { Serial.println("[SENDER] len send failed"); client.stop(); vTaskDelay(pdMS_TO_TICKS(2000)); continue; }
-    if (!send_all(client, (const uint8_t*)payload, len)) { Serial.println("[SENDER] payload send failed"); client.stop(); vTaskDelay(pdMS_TO_TICKS(2000)); continue; }
+    if (!send_all(client, body, len)) { Serial.println("[SENDER] payload send failed"); client.stop(); vTaskDelay(pdMS_TO_TICKS(2000)); continue; }
 
-    Serial.printf("[SENDER] sent payload len=%u\n", (unsigned)len);
+    Serial.printf("[SENDER] sent %u sample(s) len=%u\n", n, (unsigned)len);
     // opcional: esperar OK del gateway
     unsigned long tq = millis();
     String okr = "";
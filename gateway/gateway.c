@@ -1,6 +1,8 @@
 /* gateway/gateway.c
    Gateway robusto: epoll non-blocking + queue for broker forwarding.
    Listens publishers on LISTEN_PORT and forwards PUB messages to broker (BROKER_HOST: BROKER_PORT).
+   --unix PATH also listens on an AF_UNIX socket; --broker-unix PATH reaches a
+   colocated broker through its --unix socket instead of TCP.
 */
 
 #define _GNU_SOURCE
@@ -12,12 +14,22 @@
 #include <signal.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <time.h>
+#include "log.h"
+#include "metrics.h"
+#include "slab.h"
+#include "fdtab.h"
+#include "wheel.h"
+#include "unixsock.h"
+#include <stddef.h>
+#include <getopt.h>
 
 #define LISTEN_PORT 6000
 #define BROKER_HOST "127.0.0.1"
@@ -26,8 +38,26 @@
 #define MAX_EVENTS 128
 #define MAX_LINE 1024
 #define MAX_PAYLOAD 8192
-#define MAX_CONN 10000
+#define LISTEN_BACKLOG 4096    /* capped by net.core.somaxconn */
+#define MAX_TOPIC 256          /* topic bytes, NUL included */
+#define INBUF_SIZE 16384       /* read buffer; pooled per conn while a frame is incomplete */
+#define INBUF_INLINE 48        /* shorter leftovers stay in the conn */
+#define INBUF_POOL_KEEP 64     /* free input buffers kept around */
 #define QUEUE_MAX_ITEMS 20000  /* global queue capacity to avoid unbounded memory use */
+#define OUT_CHUNK_SIZE 4096    /* reply bytes per output segment */
+#define OUT_IOV_MAX 64         /* segments gathered into one writev */
+
+/* broker binary protocol v2, see broker/src/proto.h */
+#define V2_HDR_LEN 8
+#define V2_ALIAS 1
+#define V2_PUB 2
+#define V2_MPUB 4
+#define V2_BODY_MAX (MAX_PAYLOAD + 4)  /* largest frame body the broker takes */
+#define GW_ALIASES 1024        /* topic alias slots used towards the broker */
+
+/* MPUB <n> <bytes> from publishers, limits as in the broker */
+#define MAX_BATCH 256
+#define MAX_BATCH_BYTES (64 * 1024)
 
 static volatile int keep_running = 1;
 void int_handler(int s) { (void)s; keep_running = 0; }
@@ -40,62 +70,162 @@ static int set_nonblocking(int fd) {
     return 0;
 }
 
-/* connection struct for each publisher */
+/* output segment: replies are appended into the tail segment until it is full */
+struct out_chunk {
+    struct out_chunk *next;
+    size_t len;                /* bytes used in data */
+    size_t sent;               /* bytes already written */
+    char data[OUT_CHUNK_SIZE];
+};
+
+/* connection struct for each publisher. Kept small for many idle
+ * devices: input is buffered per conn only while a frame is incomplete,
+ * the PUB topic lives in the payload buffer. */
 typedef enum { C_AWAIT_LINE=0, C_AWAIT_LEN, C_AWAIT_PAYLOAD } conn_state_t;
 struct conn {
     int fd;
-    char inbuf[16384];
-    size_t inbuf_len;
-
     conn_state_t state;
+
+    /* unparsed input: in inbuf (pooled) when set, else in inbuf_inline */
+    char *inbuf;
+    uint16_t inbuf_len;
+    char inbuf_inline[INBUF_INLINE];
+
     uint32_t expected_len;
-    char *payload_buf;
     uint32_t payload_received;
-    char current_topic[256];
+    char *payload_buf;         /* expected_len+1 bytes, then the topic */
+    char *current_topic;       /* PUB topic, inside payload_buf */
+    unsigned int batch;        /* MPUB: records in payload_buf, 0 for PUB */
 
-    /* outbuf for sending replies (OK / ERR etc) */
-    char *outbuf;
-    size_t outbuf_len;
-    size_t outbuf_sent;
+    /* segmented output queue for replies (OK / ERR etc) */
+    struct out_chunk *out_head;
+    struct out_chunk *out_tail;
+    int out_armed;             /* EPOLLOUT is in the interest set */
 
-    struct conn *next; /* for bookkeeping if needed */
+    /* deadlines, see struct conn_timeouts */
+    struct timer timer;
+    uint32_t last_in;          /* wheel tick of the last bytes received */
+    uint32_t frame_since;      /* wheel tick the pending frame began, 0 if none */
+    uint32_t stall_since;      /* wheel tick replies got stuck, 0 if flowing */
+    uint16_t keepalive;        /* KEEPALIVE seconds, 0 = no PINGs */
+    uint16_t pinged;           /* PING sent, nothing received since */
 };
 
-/* fd->conn map */
-static struct conn *fd_map[MAX_CONN];
+/* Connection deadlines in seconds, 0 = off; as in brokerd. idle:
+ * nothing received; frame: a PUB/MPUB line or body started but not
+ * complete; send: replies pending and no byte written. KEEPALIVE <s>
+ * adds a PING after s quiet seconds and a close after 2s. */
+static struct conn_timeouts {
+    unsigned int idle;
+    unsigned int frame;
+    unsigned int send;
+} timeouts = { .idle = 0, .frame = 30, .send = 60 };
+
+/* fd->conn map, grown up to the descriptor limit; conns from a slab
+ * (main thread only) */
+static struct fdtab conns;
+static struct slab conn_slab;
+static struct wheel wheel;     /* one timer per conn, re-armed lazily */
+
+/* arm c's timer to fire by tick at the latest */
+static void conn_timer_want(struct conn *c, uint32_t tick) {
+    if (!timer_pending(&c->timer) || tick_before(tick, c->timer.expires))
+        timer_set(&wheel, &c->timer, tick);
+}
+
+/* input buffers: reads land in scratch and are parsed there; only the
+ * tail of an incomplete frame is kept by the conn (main thread only) */
+static char inbuf_scratch[INBUF_SIZE];
+static char *inbuf_free;
+static unsigned int inbuf_nfree;
+
+static char *inbuf_get(void) {
+    char *b = inbuf_free;
+    if (!b) return malloc(INBUF_SIZE);
+    inbuf_free = *(char **)b;
+    inbuf_nfree--;
+    return b;
+}
+
+static void inbuf_put(char *b) {
+    if (inbuf_nfree >= INBUF_POOL_KEEP) { free(b); return; }
+    *(char **)b = inbuf_free;
+    inbuf_free = b;
+    inbuf_nfree++;
+}
 
 /* allocate/destroy connection */
 static struct conn *conn_create(int fd) {
-    struct conn *c = calloc(1, sizeof(*c));
+    struct conn *c = slab_alloc(&conn_slab);
     if (!c) return NULL;
+    if (fdtab_set(&conns, fd, c) < 0) { slab_free(&conn_slab, c); return NULL; }
     c->fd = fd;
+    c->last_in = wheel.now;
+    if (timeouts.idle) conn_timer_want(c, c->last_in + wheel_ticks_s(timeouts.idle));
     c->inbuf_len = 0;
     c->state = C_AWAIT_LINE;
     c->expected_len = 0;
     c->payload_buf = NULL;
     c->payload_received = 0;
-    c->current_topic[0] = '\0';
-    c->outbuf = NULL;
-    c->outbuf_len = 0;
-    c->outbuf_sent = 0;
-    if (fd >= 0 && fd < MAX_CONN) fd_map[fd] = c;
+    c->current_topic = NULL;
+    c->out_head = NULL;
+    c->out_tail = NULL;
     return c;
 }
 
 static void conn_destroy(struct conn *c) {
     if (!c) return;
+    timer_del(&wheel, &c->timer);
     if (c->payload_buf) free(c->payload_buf);
-    if (c->outbuf) free(c->outbuf);
-    int fd = c->fd;
-    if (fd >= 0 && fd < MAX_CONN) fd_map[fd] = NULL;
-    free(c);
+    if (c->inbuf) inbuf_put(c->inbuf);
+    while (c->out_head) {
+        struct out_chunk *ch = c->out_head;
+        c->out_head = ch->next;
+        free(ch);
+    }
+    fdtab_set(&conns, c->fd, NULL);
+    slab_free(&conn_slab, c);
 }
 
-/* Broker queue item */
+/* gatewayd metrics; STATS and the metrics listener render them */
+static struct gateway_stats {
+    struct metric *msgs_in;          /* PUBs accepted from publishers */
+    struct metric *msgs_out;         /* PUBs written to the broker */
+    struct metric *queue_depth;      /* msg_queue.count */
+    struct metric *queue_dropped;    /* oldest items dropped at QUEUE_MAX_ITEMS */
+    struct metric *send_dropped;     /* items lost on a broker write error */
+    struct metric *queue_latency;    /* enqueue to written to broker, microseconds */
+    struct metric *batch_size;       /* messages per write to the broker */
+    struct metric *outbuf_bytes;     /* pending reply bytes per connection at flush */
+    struct metric *connections;
+    struct metric *timeouts;         /* conns closed by a deadline */
+    struct metric *epoll_ctl;        /* epoll_ctl calls on publisher fds */
+} stats;
+
+static uint64_t read_log_dropped(void) { return log_dropped(); }
+
+static void stats_init(void) {
+    stats.msgs_in = metric_new("tinyiot_gateway_messages_in_total", "PUB messages accepted from publishers", METRIC_COUNTER);
+    stats.msgs_out = metric_new("tinyiot_gateway_messages_out_total", "PUB messages forwarded to the broker", METRIC_COUNTER);
+    stats.queue_depth = metric_new("tinyiot_gateway_queue_depth", "Messages waiting for the broker sender", METRIC_GAUGE);
+    stats.queue_dropped = metric_new("tinyiot_gateway_queue_dropped_total", "Oldest messages dropped because the queue was full", METRIC_COUNTER);
+    stats.send_dropped = metric_new("tinyiot_gateway_send_dropped_total", "Messages lost on a broker write error", METRIC_COUNTER);
+    stats.queue_latency = metric_new("tinyiot_gateway_queue_latency_us", "Microseconds from enqueue to written to the broker", METRIC_HISTOGRAM);
+    stats.batch_size = metric_new("tinyiot_gateway_batch_size", "Messages sent to the broker per write", METRIC_HISTOGRAM);
+    stats.outbuf_bytes = metric_new("tinyiot_gateway_outbuf_bytes", "Pending reply bytes per connection at flush", METRIC_HISTOGRAM);
+    stats.connections = metric_new("tinyiot_gateway_connections", "Open publisher connections", METRIC_GAUGE);
+    stats.timeouts = metric_new("tinyiot_gateway_timeouts_total", "Connections closed for idling, a stalled frame or stalled replies", METRIC_COUNTER);
+    stats.epoll_ctl = metric_new("tinyiot_gateway_epoll_ctl_total", "epoll_ctl calls on publisher sockets", METRIC_COUNTER);
+    metric_func("tinyiot_log_dropped_total", "Log records dropped because a ring was full", METRIC_COUNTER, read_log_dropped);
+}
+
+/* Broker queue item, one allocation with its bytes */
 struct mq_item {
-    char *buf;     /* header + 4-byte + payload packed as contiguous bytes */
     size_t len;
+    size_t hdr_len; /* the "PUB <topic> <len>\n" part of buf */
+    uint64_t ts_us; /* enqueue time */
     struct mq_item *next;
+    char buf[];     /* header + 4-byte + payload packed as contiguous bytes */
 };
 
 /* simple thread-safe queue (FIFO) */
@@ -108,10 +238,9 @@ struct mq {
 } msg_queue = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
 /* enqueue with limit */
-static int mq_enqueue(char *buf, size_t len) {
-    struct mq_item *it = malloc(sizeof(*it));
-    if (!it) { free(buf); return -1; }
-    it->buf = buf; it->len = len; it->next = NULL;
+static void mq_enqueue(struct mq_item *it) {
+    it->next = NULL;
+    it->ts_us = metrics_now_us();
     pthread_mutex_lock(&msg_queue.lock);
     if (msg_queue.count >= QUEUE_MAX_ITEMS) {
         /* queue full: drop oldest to make space (or drop this new) - choose drop oldest */
@@ -120,147 +249,315 @@ static int mq_enqueue(char *buf, size_t len) {
             msg_queue.head = old->next;
             if (!msg_queue.head) msg_queue.tail = NULL;
             msg_queue.count--;
-            free(old->buf);
             free(old);
+            metric_inc(stats.queue_dropped);
         }
     }
     if (!msg_queue.tail) { msg_queue.head = it; msg_queue.tail = it; }
     else { msg_queue.tail->next = it; msg_queue.tail = it; }
     msg_queue.count++;
+    metric_gauge_set(stats.queue_depth, (int64_t)msg_queue.count);
     pthread_cond_signal(&msg_queue.nonempty);
     pthread_mutex_unlock(&msg_queue.lock);
-    return 0;
 }
 
-static struct mq_item *mq_dequeue_block() {
+/* wait for items and take up to max of them; 0 on shutdown */
+static int mq_dequeue_batch(struct mq_item **out, int max) {
     pthread_mutex_lock(&msg_queue.lock);
     while (msg_queue.count == 0 && keep_running) pthread_cond_wait(&msg_queue.nonempty, &msg_queue.lock);
-    if (!keep_running && msg_queue.count == 0) { pthread_mutex_unlock(&msg_queue.lock); return NULL; }
-    struct mq_item *it = msg_queue.head;
-    if (it) {
+    int n = 0;
+    while (n < max && msg_queue.head) {
+        struct mq_item *it = msg_queue.head;
         msg_queue.head = it->next;
-        if (!msg_queue.head) msg_queue.tail = NULL;
         msg_queue.count--;
+        out[n++] = it;
     }
+    if (!msg_queue.head) msg_queue.tail = NULL;
+    metric_gauge_set(stats.queue_depth, (int64_t)msg_queue.count);
     pthread_mutex_unlock(&msg_queue.lock);
-    return it;
+    return n;
+}
+
+/* queue one message for the broker as "PUB <topic> <len>\n" + 4-byte len + payload,
+ * copied once into a single allocation */
+static int enqueue_pub(const char *topic, size_t tlen, const char *payload, uint32_t len) {
+    char header[MAX_LINE];
+    int hn = snprintf(header, sizeof(header), "PUB %.*s %u\n", (int)tlen, topic, len);
+    if (hn < 0 || (size_t)hn >= sizeof(header)) return -1;
+    size_t total = (size_t)hn + sizeof(uint32_t) + len;
+    struct mq_item *it = malloc(sizeof(*it) + total);
+    if (!it) return -1;
+    uint32_t be = htonl(len);
+    memcpy(it->buf, header, (size_t)hn);
+    memcpy(it->buf + hn, &be, sizeof(be));
+    memcpy(it->buf + hn + sizeof(be), payload, len);
+    it->len = total;
+    it->hdr_len = (size_t)hn;
+    mq_enqueue(it);
+    metric_inc(stats.msgs_in);
+    return 0;
+}
+
+struct pub_rec {
+    const char *topic;
+    size_t tlen;
+    const char *payload;
+    uint32_t len;
+};
+
+/* split an MPUB body ("u16 topic_len | topic | u32 len | payload" each);
+ * record count or -1 when malformed */
+static int parse_records(const char *p, uint32_t len, struct pub_rec *out) {
+    int n = 0;
+    uint32_t pos = 0;
+    while (pos < len) {
+        uint16_t tl;
+        uint32_t be;
+        if (n == MAX_BATCH || len - pos < sizeof(tl)) return -1;
+        memcpy(&tl, p + pos, sizeof(tl));
+        tl = ntohs(tl);
+        pos += sizeof(tl);
+        if (tl == 0 || tl >= MAX_TOPIC || len - pos < tl + sizeof(be)) return -1;
+        out[n].topic = p + pos;
+        out[n].tlen = tl;
+        pos += tl;
+        memcpy(&be, p + pos, sizeof(be));
+        pos += sizeof(be);
+        out[n].len = ntohl(be);
+        if (out[n].len == 0 || out[n].len > MAX_PAYLOAD || len - pos < out[n].len) return -1;
+        out[n].payload = p + pos;
+        pos += out[n].len;
+        n++;
+    }
+    return n;
 }
 
 /* epoll fd and listen fd globals */
 static int epoll_fd = -1;
 static int listen_fd = -1;
+static int unix_fd = -1;          /* --unix listener */
+static const char *broker_unix;   /* --broker-unix path, NULL for TCP */
 
-/* utility: modify epoll flags for fd (add/remove EPOLLOUT) */
-static int epoll_modify(int fd, int want_out) {
+/* every epoll_ctl on a publisher fd is counted: epoll_ctl / messages_in
+ * shows whether steady-state replies cost any */
+static int conn_epoll_ctl(int op, int fd, uint32_t events) {
     struct epoll_event ev;
     ev.data.fd = fd;
-    ev.events = EPOLLIN;
-    if (want_out) ev.events |= EPOLLOUT;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-        if (errno == ENOENT) {
-            ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-                perror("epoll_ctl ADD");
-                return -1;
-            }
-            return 0;
-        }
-        perror("epoll_ctl MOD");
+    ev.events = events;
+    metric_inc(stats.epoll_ctl);
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+/* add/remove EPOLLOUT only when the interest actually changes */
+static int conn_set_out(struct conn *c, int want_out) {
+    if (c->out_armed == want_out) return 0;
+    if (conn_epoll_ctl(EPOLL_CTL_MOD, c->fd, want_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN) == -1) {
+        log_error("epoll_ctl MOD fd=%d: %s", c->fd, strerror(errno));
         return -1;
     }
+    c->out_armed = want_out;
+    return 0;
+}
+
+/* replies are waiting on a full socket; progress: some were just
+ * written. Starts (or restarts) the send deadline. */
+static void conn_output_blocked(struct conn *c, int progress) {
+    if (c->stall_since && !progress) return;
+    c->stall_since = wheel.now;
+    if (timeouts.send) conn_timer_want(c, c->stall_since + wheel_ticks_s(timeouts.send));
+}
+
+/* append bytes to the output segment chain: O(1), copies only the new bytes */
+static int out_append(struct conn *c, const char *s, size_t len) {
+    while (len > 0) {
+        struct out_chunk *t = c->out_tail;
+        if (!t || t->len == OUT_CHUNK_SIZE) {
+            t = malloc(sizeof(*t));
+            if (!t) return -1;
+            t->next = NULL; t->len = 0; t->sent = 0;
+            if (c->out_tail) c->out_tail->next = t; else c->out_head = t;
+            c->out_tail = t;
+        }
+        size_t room = OUT_CHUNK_SIZE - t->len;
+        size_t n = (len < room) ? len : room;
+        memcpy(t->data + t->len, s, n);
+        t->len += n; s += n; len -= n;
+    }
     return 0;
 }
 
-/* flush outbuf for connection: tries to write pending bytes, handles EAGAIN */
+/* flush output segments for connection with writev; handles EAGAIN */
 static int flush_outbuf(struct conn *c) {
     if (!c) return -1;
-    if (!c->outbuf || c->outbuf_len == 0) {
+    if (!c->out_head) {
         /* nothing */
         return 0;
     }
-    while (c->outbuf_sent < c->outbuf_len) {
-        ssize_t w = write(c->fd, c->outbuf + c->outbuf_sent, c->outbuf_len - c->outbuf_sent);
+    size_t pending = 0;
+    for (struct out_chunk *ch = c->out_head; ch; ch = ch->next) pending += ch->len - ch->sent;
+    metric_observe(stats.outbuf_bytes, pending);
+    int wrote = 0;
+    while (c->out_head) {
+        struct iovec iov[OUT_IOV_MAX];
+        int n = 0;
+        for (struct out_chunk *ch = c->out_head; ch && n < OUT_IOV_MAX; ch = ch->next, ++n) {
+            iov[n].iov_base = ch->data + ch->sent;
+            iov[n].iov_len = ch->len - ch->sent;
+        }
+        ssize_t w = writev(c->fd, iov, n);
         if (w < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                epoll_modify(c->fd, 1);
+                if (conn_set_out(c, 1) < 0) return -1;
+                conn_output_blocked(c, wrote);
                 return 1; /* pending */
             }
             if (errno == EINTR) continue;
-            perror("write to publisher");
+            log_error("write to publisher fd=%d: %s", c->fd, strerror(errno));
             return -1;
         }
-        c->outbuf_sent += (size_t)w;
+        size_t left = (size_t)w;
+        wrote = 1;
+        while (left > 0 && c->out_head) {
+            struct out_chunk *ch = c->out_head;
+            size_t rem = ch->len - ch->sent;
+            if (left < rem) { ch->sent += left; break; }
+            left -= rem;
+            c->out_head = ch->next;
+            if (!c->out_head) c->out_tail = NULL;
+            free(ch);
+        }
     }
     /* all sent */
-    free(c->outbuf);
-    c->outbuf = NULL;
-    c->outbuf_len = 0;
-    c->outbuf_sent = 0;
-    epoll_modify(c->fd, 0);
+    c->stall_since = 0;
+    if (conn_set_out(c, 0) < 0) return -1;
     return 0;
 }
 
 /* queue reply (OK/ERR) to publisher connection */
 static int conn_queue_reply(struct conn *c, const char *s) {
-    size_t len = strlen(s);
     if (!c) return -1;
     if (!s) return -1;
-    /* if there's no pending outbuf simply try to write immediately */
-    if ((!c->outbuf || c->outbuf_len == 0) ) {
+    size_t len = strlen(s);
+    /* if there's nothing pending simply try to write immediately */
+    if (!c->out_head) {
         ssize_t w = write(c->fd, s, len);
         if (w == (ssize_t)len) return 0;
-        if (w >= 0) {
-            /* partial write: allocate remainder */
-            size_t rem = len - (size_t)w;
-            char *nb = malloc(rem);
-            if (!nb) return -1;
-            memcpy(nb, s + w, rem);
-            c->outbuf = nb; c->outbuf_len = rem; c->outbuf_sent = 0;
-            epoll_modify(c->fd, 1);
-            return 0;
-        } else {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                /* allocate full buffer */
-                char *nb = malloc(len);
-                if (!nb) return -1;
-                memcpy(nb, s, len);
-                c->outbuf = nb; c->outbuf_len = len; c->outbuf_sent = 0;
-                epoll_modify(c->fd, 1);
-                return 0;
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("write immediate reply fd=%d: %s", c->fd, strerror(errno));
+                return -1;
             }
-            perror("write immediate reply");
+            w = 0;
+        }
+        /* partial write or would block: queue the remainder */
+        if (out_append(c, s + w, len - (size_t)w) < 0) return -1;
+        conn_output_blocked(c, w > 0);
+        return conn_set_out(c, 1);
+    }
+    /* append to existing segments; EPOLLOUT is already armed */
+    if (out_append(c, s, len) < 0) return -1;
+    return 0;
+}
+
+/* STATS: "STATS <len>\n" followed by len bytes of Prometheus text */
+static int reply_stats(struct conn *c) {
+    size_t cap = metrics_render(NULL, 0) + 4096;
+    char *text = malloc(cap);
+    if (!text) return conn_queue_reply(c, "ERR INTERNAL\n");
+    size_t len = metrics_render(text, cap);
+    if (len >= cap) len = cap - 1;   /* grew meanwhile: cut at the last full line */
+    while (len > 0 && text[len - 1] != '\n') len--;
+    text[len] = '\0';
+    char hdr[32];
+    snprintf(hdr, sizeof(hdr), "STATS %zu\n", len);
+    int r = conn_queue_reply(c, hdr);
+    if (r == 0) r = conn_queue_reply(c, text);
+    free(text);
+    return r;
+}
+
+/* PUB/MPUB header read: the body follows as "<4-byte len><bytes>".
+ * topic (NULL for MPUB) points into the command line, which
+ * process_input keeps until the body is routed in place or staged. */
+static void expect_body(struct conn *c, long len, char *topic) {
+    c->state = C_AWAIT_LEN;
+    c->expected_len = (uint32_t)len;
+    c->current_topic = topic;
+    c->payload_received = 0;
+}
+
+/* the body is split across reads: copy what arrives into payload_buf,
+ * with the PUB topic kept after it in the same allocation */
+static int stage_body(struct conn *c) {
+    const char *topic = c->current_topic;
+    size_t tlen = topic ? strnlen(topic, MAX_TOPIC - 1) : 0;
+    /* payload (at least the 4 length bytes), NUL, topic, NUL */
+    size_t off = (c->expected_len > sizeof(uint32_t) ? c->expected_len : sizeof(uint32_t)) + 1;
+    c->payload_buf = malloc(off + tlen + 1);
+    if (!c->payload_buf) { conn_queue_reply(c, "ERR INTERNAL\n"); return -1; }
+    c->current_topic = NULL;
+    if (topic) {
+        c->current_topic = c->payload_buf + off;
+        memcpy(c->current_topic, topic, tlen);
+        c->current_topic[tlen] = '\0';
+    }
+    return 0;
+}
+
+/* queue a complete PUB/MPUB body (expected_len bytes) for the broker,
+ * answer OK and go back to reading lines */
+static int finish_body(struct conn *c, const char *body) {
+    if (c->batch) {
+        struct pub_rec recs[MAX_BATCH];
+        int n = parse_records(body, c->expected_len, recs);
+        if (n != (int)c->batch) {
+            log_error("fd=%d: MPUB body does not hold %u records", c->fd, c->batch);
+            conn_queue_reply(c, "ERR PROTO\n");
             return -1;
         }
+        for (int i = 0; i < n; ++i) {
+            if (enqueue_pub(recs[i].topic, recs[i].tlen, recs[i].payload, recs[i].len) < 0) {
+                conn_queue_reply(c, "ERR QUEUE\n");
+                return -1;
+            }
+        }
+        log_debug("queued %d messages from fd=%d", n, c->fd);
+        c->batch = 0;
     } else {
-        /* append to existing outbuf */
-        size_t remaining = c->outbuf_len - c->outbuf_sent;
-        char *nb = malloc(remaining + len);
-        if (!nb) return -1;
-        memcpy(nb, c->outbuf + c->outbuf_sent, remaining);
-        memcpy(nb + remaining, s, len);
-        free(c->outbuf);
-        c->outbuf = nb;
-        c->outbuf_len = remaining + len;
-        c->outbuf_sent = 0;
-        epoll_modify(c->fd, 1);
-        return 0;
+        if (enqueue_pub(c->current_topic, strlen(c->current_topic), body, c->expected_len) < 0) {
+            conn_queue_reply(c, "ERR QUEUE\n");
+            return -1;
+        }
+        log_debug("queued topic=%s len=%u from fd=%d", c->current_topic, c->expected_len, c->fd);
     }
+    /* reply OK to publisher (enqueue or immediate), one per PUB or MPUB */
+    conn_queue_reply(c, "OK\n");
+    /* reset state */
+    c->frame_since = 0;
+    free(c->payload_buf); c->payload_buf = NULL;
+    c->expected_len = 0;
+    c->payload_received = 0;
+    c->current_topic = NULL;
+    c->state = C_AWAIT_LINE;
+    return 0;
 }
 
-/* process incoming bytes in conn->inbuf (very similar to broker parsing) */
-static int process_conn_incoming(struct conn *c) {
-    if (!c) return -1;
+/* process incoming bytes in buf (very similar to broker parsing);
+ * *used gets the bytes consumed */
+static int process_input(struct conn *c, char *buf, size_t buflen, size_t *used) {
     size_t pos = 0;
-    while (pos < c->inbuf_len) {
+    char line[MAX_LINE];       /* holds the PUB topic until its body is routed or staged */
+    *used = 0;
+    while (pos < buflen) {
         if (c->state == C_AWAIT_LINE) {
-            char *nl = memchr(c->inbuf + pos, '\n', c->inbuf_len - pos);
+            char *nl = memchr(buf + pos, '\n', buflen - pos);
             if (!nl) break;
-            size_t linelen = (size_t)(nl - (c->inbuf + pos));
-            if (linelen >= MAX_LINE) { fprintf(stderr, "[G] line too long\n"); return -1; }
-            char line[MAX_LINE];
-            memcpy(line, c->inbuf + pos, linelen);
+            size_t linelen = (size_t)(nl - (buf + pos));
+            if (linelen >= MAX_LINE) { log_error("fd=%d: line too long", c->fd); return -1; }
+            memcpy(line, buf + pos, linelen);
             line[linelen] = '\0';
             pos += linelen + 1;
+            c->frame_since = 0;
             /* parse */
             char *save = NULL;
             char *tok = strtok_r(line, " ", &save);
@@ -269,39 +566,77 @@ static int process_conn_incoming(struct conn *c) {
                 /* reply OK */
                 conn_queue_reply(c, "OK\n");
                 continue;
+            } else if (strcmp(tok, "STATS") == 0) {
+                if (reply_stats(c) < 0) return -1;
+                continue;
+            } else if (strcmp(tok, "PONG") == 0) {
+                /* answer to a keepalive PING: receiving it was the point */
+                continue;
+            } else if (strcmp(tok, "KEEPALIVE") == 0) {
+                char *secs = strtok_r(NULL, " ", &save);
+                char *end = NULL;
+                unsigned long s = secs ? strtoul(secs, &end, 10) : 0;
+                if (!secs || *end || s > UINT16_MAX) { conn_queue_reply(c, "ERR PROTO\n"); return -1; }
+                c->keepalive = (uint16_t)s;
+                if (s) conn_timer_want(c, c->last_in + wheel_ticks_s((unsigned int)s));
+                conn_queue_reply(c, "OK\n");
+                continue;
             } else if (strcmp(tok, "PUB") == 0) {
                 char *topic = strtok_r(NULL, " ", &save);
                 char *lenstr = strtok_r(NULL, " ", &save);
                 if (!topic || !lenstr) { conn_queue_reply(c, "ERR PROTO\n"); return -1; }
                 long len = strtol(lenstr, NULL, 10);
                 if (len <= 0 || len > MAX_PAYLOAD) { conn_queue_reply(c, "ERR OVERFLOW\n"); return -1; }
-                c->state = C_AWAIT_LEN;
-                c->expected_len = (uint32_t)len;
-                if (c->payload_buf) { free(c->payload_buf); c->payload_buf = NULL; }
-                c->payload_buf = malloc(c->expected_len + 1 + sizeof(uint32_t));
-                if (!c->payload_buf) { conn_queue_reply(c, "ERR INTERNAL\n"); return -1; }
-                c->payload_received = 0;
-                strncpy(c->current_topic, topic, sizeof(c->current_topic)-1);
-                c->current_topic[sizeof(c->current_topic)-1] = '\0';
-                /* log */
-                fprintf(stderr, "[G] fd=%d PUB header topic=%s expected_len=%u\n", c->fd, c->current_topic, c->expected_len);
+                expect_body(c, len, topic);
+                c->batch = 0;
+                log_debug("fd=%d PUB header topic=%s expected_len=%u", c->fd, c->current_topic, c->expected_len);
+                continue;
+            } else if (strcmp(tok, "MPUB") == 0) {
+                /* MPUB <n> <bytes>: n records, one OK for all of them */
+                char *nstr = strtok_r(NULL, " ", &save);
+                char *lenstr = strtok_r(NULL, " ", &save);
+                if (!nstr || !lenstr) { conn_queue_reply(c, "ERR PROTO\n"); return -1; }
+                long n = strtol(nstr, NULL, 10);
+                long len = strtol(lenstr, NULL, 10);
+                if (n <= 0 || n > MAX_BATCH || len <= 0 || len > MAX_BATCH_BYTES) { conn_queue_reply(c, "ERR OVERFLOW\n"); return -1; }
+                expect_body(c, len, NULL);
+                c->batch = (unsigned int)n;
+                log_debug("fd=%d MPUB header n=%u expected_len=%u", c->fd, c->batch, c->expected_len);
                 continue;
             } else {
                 conn_queue_reply(c, "ERR PROTO\n");
                 continue;
             }
         } else if (c->state == C_AWAIT_LEN) {
+            if (!c->payload_buf) {
+                /* the whole body is here (the common case for small
+                 * readings): queue it straight from buf */
+                uint32_t len = c->expected_len;
+                if (buflen - pos >= sizeof(uint32_t) + len) {
+                    uint32_t be;
+                    memcpy(&be, buf + pos, sizeof(be));
+                    if (ntohl(be) != len) {
+                        log_error("fd=%d: declared len mismatch %u != %u", c->fd, ntohl(be), len);
+                        conn_queue_reply(c, "ERR LEN\n");
+                        return -1;
+                    }
+                    if (finish_body(c, buf + pos + sizeof(be)) < 0) return -1;
+                    pos += sizeof(be) + len;
+                    continue;
+                }
+                if (stage_body(c) < 0) return -1;
+            }
             size_t need = sizeof(uint32_t) - c->payload_received;
-            size_t avail = c->inbuf_len - pos;
+            size_t avail = buflen - pos;
             size_t to_copy = (avail < need) ? avail : need;
-            memcpy(c->payload_buf + c->payload_received, c->inbuf + pos, to_copy);
+            memcpy(c->payload_buf + c->payload_received, buf + pos, to_copy);
             c->payload_received += to_copy;
             pos += to_copy;
             if (c->payload_received < sizeof(uint32_t)) break;
             uint32_t be = 0; memcpy(&be, c->payload_buf, sizeof(uint32_t));
             uint32_t declared = ntohl(be);
             if (declared != c->expected_len) {
-                fprintf(stderr, "[G] declared len mismatch %u != %u\n", declared, c->expected_len);
+                log_error("fd=%d: declared len mismatch %u != %u", c->fd, declared, c->expected_len);
                 conn_queue_reply(c, "ERR LEN\n");
                 return -1;
             }
@@ -310,120 +645,180 @@ static int process_conn_incoming(struct conn *c) {
             continue;
         } else if (c->state == C_AWAIT_PAYLOAD) {
             size_t need = c->expected_len - c->payload_received;
-            size_t avail = c->inbuf_len - pos;
+            size_t avail = buflen - pos;
             size_t to_copy = (avail < need) ? avail : need;
-            memcpy(c->payload_buf + c->payload_received, c->inbuf + pos, to_copy);
+            memcpy(c->payload_buf + c->payload_received, buf + pos, to_copy);
             c->payload_received += to_copy;
             pos += to_copy;
             if (c->payload_received < c->expected_len) break;
-            /* full payload ready; enqueue to broker queue as contiguous buffer: 4-byte BE + payload */
+            /* full payload ready; enqueue to broker queue */
             c->payload_buf[c->expected_len] = '\0';
-            size_t total = sizeof(uint32_t) + c->expected_len;
-            char *pack = malloc(total);
-            if (!pack) { conn_queue_reply(c, "ERR INTERNAL\n"); return -1; }
-            uint32_t be = htonl(c->expected_len);
-            memcpy(pack, &be, sizeof(uint32_t));
-            memcpy(pack + sizeof(uint32_t), c->payload_buf, c->expected_len);
-            /* We also need the header "PUB <topic> <len>\n" sent to broker BEFORE the 4-byte+payload.
-             * Create header and combine into a single malloced buffer: header + body
-             */
-            char header[MAX_LINE];
-            int hn = snprintf(header, sizeof(header), "PUB %s %u\n", c->current_topic, c->expected_len);
-            if (hn < 0) { free(pack); conn_queue_reply(c, "ERR INTERNAL\n"); return -1; }
-            size_t header_len = (size_t)hn;
-            char *full = malloc(header_len + total);
-            if (!full) { free(pack); conn_queue_reply(c, "ERR INTERNAL\n"); return -1; }
-            memcpy(full, header, header_len);
-            memcpy(full + header_len, pack, total);
-            free(pack);
-            /* enqueue to global queue */
-            if (mq_enqueue(full, header_len + total) < 0) {
-                free(full);
-                conn_queue_reply(c, "ERR QUEUE\n");
-                return -1;
-            }
-            /* reply OK to publisher (enqueue or immediate) */
-            conn_queue_reply(c, "OK\n");
-            fprintf(stderr, "[G] queued topic=%s len=%u from fd=%d\n", c->current_topic, c->expected_len, c->fd);
-            /* reset state */
-            free(c->payload_buf); c->payload_buf = NULL;
-            c->expected_len = 0;
-            c->payload_received = 0;
-            c->current_topic[0] = '\0';
-            c->state = C_AWAIT_LINE;
+            if (finish_body(c, c->payload_buf) < 0) return -1;
             continue;
         }
     }
-    /* shift remaining bytes */
-    if (pos > 0) {
-        if (pos < c->inbuf_len) memmove(c->inbuf, c->inbuf + pos, c->inbuf_len - pos);
-        c->inbuf_len -= pos;
+    /* a PUB line ended the input: its topic must outlive line */
+    if (c->state == C_AWAIT_LEN && !c->payload_buf && stage_body(c) < 0) return -1;
+    *used = pos;
+    return 0;
+}
+
+/* keep the unparsed tail of an incomplete frame: inline when it is
+ * short, else in a pooled buffer; none at all when nothing is left */
+static int conn_keep_input(struct conn *c, const char *rest, size_t n) {
+    if (n > INBUF_INLINE) {
+        if (!c->inbuf && !(c->inbuf = inbuf_get())) return -1;
+        if (rest != c->inbuf) memmove(c->inbuf, rest, n);
+    } else {
+        if (n) memmove(c->inbuf_inline, rest, n);
+        if (c->inbuf) { inbuf_put(c->inbuf); c->inbuf = NULL; }
     }
+    c->inbuf_len = (uint16_t)n;
     return 0;
 }
 
-/* read into conn non-blocking */
-static int read_into_conn(struct conn *c) {
-    if (!c) return -1;
-    char tmp[4096];
-    while (1) {
-        ssize_t r = read(c->fd, tmp, sizeof(tmp));
-        if (r == 0) return -2;
+/* read what is available after the pending input and process it all.
+ * Reads stop at INBUF_SIZE (epoll is level-triggered, the rest comes on
+ * the next wakeup). 0 ok, -1 error, -2 peer closed */
+static int conn_read_input(struct conn *c) {
+    char *buf = inbuf_scratch;
+    size_t len = c->inbuf_len;
+    if (len) {
+        /* pending input: continue it in the pooled buffer */
+        if (!c->inbuf) {
+            if (!(c->inbuf = inbuf_get())) return -1;
+            memcpy(c->inbuf, c->inbuf_inline, len);
+        }
+        buf = c->inbuf;
+    }
+    if (len == INBUF_SIZE) {
+        log_error("inbuf overflow fd=%d", c->fd);
+        return -1;
+    }
+    int eof = 0;
+    while (len < INBUF_SIZE) {
+        ssize_t r = read(c->fd, buf + len, INBUF_SIZE - len);
+        if (r == 0) { eof = 1; break; }
         if (r < 0) {
             if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("read publisher");
+            log_error("read publisher fd=%d: %s", c->fd, strerror(errno));
             return -1;
         }
-        if (c->inbuf_len + (size_t)r > sizeof(c->inbuf)) {
-            fprintf(stderr, "[G] inbuf overflow fd=%d\n", c->fd);
-            return -1;
+        len += (size_t)r;
+    }
+    /* on EOF, process what was buffered before closing */
+    size_t used;
+    c->last_in = wheel.now;
+    c->pinged = 0;
+    if (process_input(c, buf, len, &used) < 0) return -1;
+    if (conn_keep_input(c, buf + used, len - used) < 0) return -1;
+    /* a frame left incomplete has timeouts.frame to finish */
+    if (c->inbuf_len || c->state != C_AWAIT_LINE) {
+        if (!c->frame_since && timeouts.frame) {
+            c->frame_since = wheel.now;
+            conn_timer_want(c, wheel.now + wheel_ticks_s(timeouts.frame));
         }
-        memcpy(c->inbuf + c->inbuf_len, tmp, (size_t)r);
-        c->inbuf_len += (size_t)r;
+    } else {
+        c->frame_since = 0;
     }
-    return 0;
+    return eof ? -2 : 0;
 }
 
 /* close and cleanup connection */
 static void close_conn_fd(int fd) {
-    if (fd < 0 || fd >= MAX_CONN) return;
-    struct conn *c = fd_map[fd];
+    struct conn *c = fdtab_get(&conns, fd);
     if (!c) return;
-    fprintf(stderr, "[G] closing fd=%d\n", fd);
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-        if (errno != ENOENT) perror("epoll del conn");
+    log_info("closing fd=%d", fd);
+    metric_gauge_add(stats.connections, -1);
+    if (conn_epoll_ctl(EPOLL_CTL_DEL, fd, 0) == -1) {
+        if (errno != ENOENT) log_error("epoll del fd=%d: %s", fd, strerror(errno));
     }
     close(fd);
     conn_destroy(c);
 }
 
+static uint32_t earliest(uint32_t best, uint32_t at) {
+    return (!best || tick_before(at, best)) ? at : best;
+}
+
+/* c's timer fired: close it if a deadline passed, else re-arm for the
+ * earliest one left (activity only moves stamps, so it often fires
+ * early and just goes back on the wheel) */
+static void conn_timer_fire(struct wheel *w, struct timer *t) {
+    struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+    uint32_t now = w->now, next = 0, at;
+    const char *why = NULL;
+    if (timeouts.frame && c->frame_since) {
+        at = c->frame_since + wheel_ticks_s(timeouts.frame);
+        if (!tick_before(now, at)) why = "frame incomplete";
+        next = earliest(next, at);
+    }
+    if (timeouts.send && c->stall_since && c->out_head) {
+        at = c->stall_since + wheel_ticks_s(timeouts.send);
+        if (!tick_before(now, at)) why = "output stalled";
+        next = earliest(next, at);
+    }
+    if (timeouts.idle) {
+        at = c->last_in + wheel_ticks_s(timeouts.idle);
+        if (!tick_before(now, at)) why = "idle";
+        next = earliest(next, at);
+    }
+    if (c->keepalive) {
+        uint32_t k = wheel_ticks_s(c->keepalive);
+        if (!tick_before(now, c->last_in + 2 * k)) {
+            why = "no answer to PING";
+        } else if (!tick_before(now, c->last_in + k)) {
+            if (!c->pinged) {
+                c->pinged = 1;
+                if (conn_queue_reply(c, "PING\n") < 0) why = "PING failed";
+            }
+            next = earliest(next, c->last_in + 2 * k);
+        } else {
+            next = earliest(next, c->last_in + k);
+        }
+    }
+    if (why) {
+        log_info("fd=%d timed out: %s", c->fd, why);
+        metric_inc(stats.timeouts);
+        close_conn_fd(c->fd);
+        return;
+    }
+    if (next) timer_set(w, t, next);
+}
+
 /* accept loop */
 static int accept_new(int listen_fd) {
     while (1) {
-        struct sockaddr_in addr;
+        struct sockaddr_storage addr;
         socklen_t alen = sizeof(addr);
         int client = accept(listen_fd, (struct sockaddr *)&addr, &alen);
         if (client < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             if (errno == EINTR) continue;
-            perror("accept");
+            log_error("accept: %s", strerror(errno));
             return -1;
         }
-        if (client >= MAX_CONN) { close(client); continue; }
-        if (set_nonblocking(client) == -1) { perror("set_nonblocking"); close(client); continue; }
+        if (set_nonblocking(client) == -1) { log_error("set_nonblocking fd=%d: %s", client, strerror(errno)); close(client); continue; }
         struct conn *c = conn_create(client);
-        if (!c) { close(client); continue; }
-        struct epoll_event ev;
-        ev.data.fd = client;
-        ev.events = EPOLLIN;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev) == -1) {
-            perror("epoll add client");
+        if (!c) {
+            log_warn("fd=%d refused: no memory for the connection", client);
+            close(client);
+            continue;
+        }
+        if (conn_epoll_ctl(EPOLL_CTL_ADD, client, EPOLLIN) == -1) {
+            log_error("epoll add fd=%d: %s", client, strerror(errno));
             close(client); conn_destroy(c); continue;
         }
-        char addrbuf[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &addr.sin_addr, addrbuf, sizeof(addrbuf));
-        fprintf(stderr, "[G] accepted fd=%d from %s:%d\n", client, addrbuf, ntohs(addr.sin_port));
+        metric_gauge_add(stats.connections, 1);
+        if (addr.ss_family == AF_INET) {
+            const struct sockaddr_in *in = (const struct sockaddr_in *)&addr;
+            char addrbuf[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &in->sin_addr, addrbuf, sizeof(addrbuf));
+            log_info("accepted fd=%d from %s:%d", client, addrbuf, ntohs(in->sin_port));
+        } else {
+            log_info("accepted fd=%d on the unix socket", client);
+        }
     }
     return 0;
 }
@@ -433,6 +828,7 @@ static int broker_fd = -1;
 static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int connect_to_broker(void) {
+    if (broker_unix) return unix_connect(broker_unix);
     struct sockaddr_in addr;
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s < 0) return -1;
@@ -442,6 +838,34 @@ static int connect_to_broker(void) {
     return s;
 }
 
+/* ask for protocol v2; 1 if the broker speaks it, 0 for text, -1 error */
+static int broker_hello(int fd) {
+    static const char hello[] = "HELLO GATEWAY gateway V2\n";
+    if (write(fd, hello, sizeof(hello) - 1) != (ssize_t)(sizeof(hello) - 1)) return -1;
+    struct timeval tv = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char reply[32];
+    size_t n = 0;
+    char ch;
+    while (n < sizeof(reply) - 1) {
+        if (read(fd, &ch, 1) != 1) return -1;
+        if (ch == '\n') break;
+        reply[n++] = ch;
+    }
+    reply[n] = '\0';
+    if (strncmp(reply, "OK", 2) != 0) return -1;
+    return strcmp(reply, "OK V2") == 0;
+}
+
+static void v2_header(char *h, uint8_t op, uint16_t id, uint32_t len) {
+    h[0] = (char)op;
+    h[1] = 0;
+    h[2] = (char)(id >> 8);
+    h[3] = (char)id;
+    uint32_t be = htonl(len);
+    memcpy(h + 4, &be, sizeof(be));
+}
+
 static int send_all_block(int fd, const void *buf, size_t len) {
     size_t sent = 0;
     const char *p = buf;
@@ -456,50 +880,231 @@ static int send_all_block(int fd, const void *buf, size_t len) {
     return 0;
 }
 
+/* v2 topic aliases towards the broker, direct mapped by topic hash: a
+ * topic taking an occupied slot re-registers it, so any number of topics
+ * works and only the hot ones stay registered */
+static int broker_v2;
+static char *alias_topic[GW_ALIASES + 1];
+
+static void alias_reset(void) {
+    for (int i = 0; i <= GW_ALIASES; ++i) { free(alias_topic[i]); alias_topic[i] = NULL; }
+}
+
+/* growable byte buffer for assembling frames */
+struct wbuf {
+    char *p;
+    size_t len, cap;
+};
+
+static int wbuf_put(struct wbuf *b, const void *d, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t ncap = b->cap ? b->cap : 4096;
+        while (ncap < b->len + n) ncap *= 2;
+        char *np = realloc(b->p, ncap);
+        if (!np) return -1;
+        b->p = np;
+        b->cap = ncap;
+    }
+    memcpy(b->p + b->len, d, n);
+    b->len += n;
+    return 0;
+}
+
+static struct wbuf v2_out, v2_pre, v2_body;
+
+/* move pending alias registrations and the MPUB frame into v2_out */
+static int v2_close_frame(void) {
+    if (!v2_body.len) return 0;
+    char h[V2_HDR_LEN];
+    v2_header(h, V2_MPUB, 0, (uint32_t)v2_body.len);
+    int r = wbuf_put(&v2_out, v2_pre.p, v2_pre.len) | wbuf_put(&v2_out, h, sizeof(h)) |
+            wbuf_put(&v2_out, v2_body.p, v2_body.len);
+    v2_pre.len = v2_body.len = 0;
+    return r;
+}
+
+/* send items as V2_MPUB frames: one write for the lot. A topic that has
+ * to take over an alias slot closes the current frame first, so records
+ * already in it keep the topic they were written with. A record too large
+ * for an MPUB of its own (6 + payload over V2_BODY_MAX) goes out as a
+ * V2_PUB frame, whose body is the bare payload. */
+static int send_v2_batch(int fd, struct mq_item **items, int n) {
+    v2_out.len = v2_pre.len = v2_body.len = 0;
+    for (int i = 0; i < n; ++i) {
+        const struct mq_item *it = items[i];
+        /* buf is "PUB <topic> <len>\n" + 4-byte len + payload */
+        const char *topic = it->buf + 4;
+        const char *sp = memrchr(it->buf, ' ', it->hdr_len);
+        if (!sp || sp < topic) return -1;
+        size_t tlen = (size_t)(sp - topic);
+        size_t body = it->hdr_len + sizeof(uint32_t);
+        uint32_t plen = (uint32_t)(it->len - body);
+        uint32_t h = 2166136261u;
+        for (size_t k = 0; k < tlen; ++k) h = (h ^ (unsigned char)topic[k]) * 16777619u;
+        uint16_t id = (uint16_t)(h % GW_ALIASES + 1);
+        char *cur = alias_topic[id];
+        int same = cur && strlen(cur) == tlen && memcmp(cur, topic, tlen) == 0;
+        int single = 6 + plen > V2_BODY_MAX;
+        if ((cur && !same) || single || v2_body.len + 6 + plen > V2_BODY_MAX) {
+            if (v2_close_frame() < 0) return -1;
+        }
+        if (!same) {
+            char *t = strndup(topic, tlen);
+            if (!t) return -1;
+            free(cur);
+            alias_topic[id] = t;
+            char ah[V2_HDR_LEN];
+            v2_header(ah, V2_ALIAS, id, (uint32_t)tlen);
+            if (wbuf_put(&v2_pre, ah, sizeof(ah)) < 0 || wbuf_put(&v2_pre, t, tlen) < 0) return -1;
+        }
+        if (single) {
+            char ph[V2_HDR_LEN];
+            v2_header(ph, V2_PUB, id, plen);
+            int r = wbuf_put(&v2_out, v2_pre.p, v2_pre.len) | wbuf_put(&v2_out, ph, sizeof(ph)) |
+                    wbuf_put(&v2_out, it->buf + body, plen);
+            v2_pre.len = 0;
+            if (r < 0) return -1;
+            continue;
+        }
+        uint16_t ida = htons(id);
+        uint32_t be = htonl(plen);
+        if (wbuf_put(&v2_body, &ida, sizeof(ida)) < 0 || wbuf_put(&v2_body, &be, sizeof(be)) < 0 ||
+            wbuf_put(&v2_body, it->buf + body, plen) < 0) return -1;
+    }
+    if (v2_close_frame() < 0) return -1;
+    return send_all_block(fd, v2_out.p, v2_out.len);
+}
+
+/* read whatever the broker sent us: it only writes to the gateway to
+ * report an error, usually right before closing the link. -1 once the
+ * link is gone, so it gets reopened before the next write instead of
+ * writing into a dead socket */
+static int broker_link_check(int fd) {
+    char buf[512];
+    for (;;) {
+        ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (r > 0) {
+            log_warn("broker: %.*s", (int)(buf[r - 1] == '\n' ? r - 1 : r), buf);
+            continue;
+        }
+        if (r == 0) return -1;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
 static void *broker_sender(void *arg) {
     (void)arg;
+    metric_thread_init();
+    struct mq_item *items[MAX_BATCH];
     while (keep_running) {
-        struct mq_item *it = mq_dequeue_block();
-        if (!it) break; /* shutdown */
+        int n = mq_dequeue_batch(items, MAX_BATCH);
+        if (!n) break; /* shutdown */
         /* ensure broker connected */
         while (keep_running) {
+            if (broker_fd >= 0 && broker_link_check(broker_fd) < 0) {
+                log_warn("broker closed the link fd=%d, reconnecting", broker_fd);
+                pthread_mutex_lock(&broker_lock);
+                close(broker_fd); broker_fd = -1;
+                pthread_mutex_unlock(&broker_lock);
+            }
             if (broker_fd >= 0) break;
             int s = connect_to_broker();
-            if (s >= 0) {
+            int v2 = s >= 0 ? broker_hello(s) : -1;
+            if (v2 >= 0) {
                 broker_fd = s;
-                fprintf(stderr, "[G] connected to broker %s:%d fd=%d\n", BROKER_HOST, BROKER_PORT, broker_fd);
+                broker_v2 = v2;
+                alias_reset();
+                if (broker_unix)
+                    log_info("connected to broker %s fd=%d (%s protocol)", broker_unix, broker_fd, v2 ? "v2" : "text");
+                else
+                    log_info("connected to broker %s:%d fd=%d (%s protocol)", BROKER_HOST, BROKER_PORT, broker_fd, v2 ? "v2" : "text");
                 break;
             }
-            fprintf(stderr, "[G] cannot connect to broker, retrying in 1s\n");
+            if (s >= 0) close(s);
+            log_warn("cannot connect to broker, retrying in 1s");
             sleep(1);
         }
-        if (!keep_running) { free(it->buf); free(it); break; }
-        /* send item to broker (blocking single writer) */
+        /* send items to broker (blocking single writer); v2 batches
+         * everything queued meanwhile into MPUB frames */
         pthread_mutex_lock(&broker_lock);
-        if (broker_fd >= 0) {
-            if (send_all_block(broker_fd, it->buf, it->len) < 0) {
-                perror("send to broker");
-                close(broker_fd); broker_fd = -1;
-                /* re-enqueue the item at head? simple policy: drop it and continue */
-                fprintf(stderr, "[G] dropped a message due to broker send error\n");
+        if (broker_fd >= 0 && keep_running) {
+            int sr = 0, sent = 0;
+            if (broker_v2) {
+                sr = send_v2_batch(broker_fd, items, n);
+                if (sr == 0) sent = n;
             } else {
-                /* optionally read OK line from broker (non-blocking with short timeout) */
-                /* we skip reading to keep throughput; broker responds OK to publishers not to gateway */
+                for (; sent < n && sr == 0; ++sent) sr = send_all_block(broker_fd, items[sent]->buf, items[sent]->len);
+                if (sr < 0) sent--;
+            }
+            if (sr < 0) {
+                log_error("send to broker: %s", strerror(errno));
+                close(broker_fd); broker_fd = -1;
+                /* re-enqueue the items at head? simple policy: drop them and continue */
+                log_warn("dropped %d messages due to broker send error", n - sent);
+                metric_add(stats.send_dropped, (uint64_t)(n - sent));
+            }
+            /* we skip reading replies to keep throughput; broker responds OK to publishers not to gateway */
+            if (sent) {
+                uint64_t now = metrics_now_us();
+                metric_add(stats.msgs_out, (uint64_t)sent);
+                metric_observe(stats.batch_size, (uint64_t)(broker_v2 ? sent : 1));
+                for (int i = 0; i < sent; ++i) metric_observe(stats.queue_latency, now - items[i]->ts_us);
             }
         }
         pthread_mutex_unlock(&broker_lock);
-        free(it->buf);
-        free(it);
+        for (int i = 0; i < n; ++i) {
+            free(items[i]);
+        }
     }
     /* cleanup broker fd */
     if (broker_fd >= 0) { close(broker_fd); broker_fd = -1; }
+    alias_reset();
+    free(v2_out.p); free(v2_pre.p); free(v2_body.p);
     return NULL;
 }
 
 int main(int argc, char **argv) {
-    (void)argc; (void)argv;
+    int metrics_port = 0;
+    const char *unix_path = NULL;
+    static const struct option opts[] = {
+        { "metrics-port", required_argument, NULL, 'm' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "frame-timeout", required_argument, NULL, 'f' },
+        { "send-timeout", required_argument, NULL, 's' },
+        { "unix",         required_argument, NULL, 'u' },
+        { "broker-unix",  required_argument, NULL, 'B' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int o;
+    while ((o = getopt_long(argc, argv, "m:i:f:s:u:B:h", opts, NULL)) != -1) {
+        if (o == 'm' && (metrics_port = atoi(optarg)) > 0 && metrics_port <= 65535) continue;
+        if (o == 'u') { unix_path = optarg; continue; }
+        if (o == 'B') { broker_unix = optarg; continue; }
+        if ((o == 'i' || o == 'f' || o == 's') && atoi(optarg) >= 0) {
+            unsigned int v = (unsigned int)atoi(optarg);
+            if (o == 'i') timeouts.idle = v;
+            else if (o == 'f') timeouts.frame = v;
+            else timeouts.send = v;
+            continue;
+        }
+        fprintf(stderr, "usage: %s [--metrics-port P] [--idle-timeout S] [--frame-timeout S] [--send-timeout S]\n"
+                        "       [--unix PATH] [--broker-unix PATH]\n", argv[0]);
+        return o == 'h' ? 0 : 1;
+    }
     signal(SIGINT, int_handler);
     signal(SIGTERM, int_handler);
+    if (log_init("G") < 0) fprintf(stderr, "[G] log thread unavailable, logging synchronously\n");
+    unsigned int fd_limit = fd_limit_raise();
+    log_info("descriptor limit %u", fd_limit);
+    if (fdtab_init(&conns, fd_limit) < 0) { perror("conn table"); return 1; }
+    slab_init(&conn_slab, sizeof(struct conn));
+    wheel_init(&wheel, conn_timer_fire);
+    stats_init();
+    metric_thread_init();
+    if (metrics_port && metrics_listen(metrics_port) < 0)
+        log_warn("metrics listener on port %d: %s", metrics_port, strerror(errno));
 
     /* create listening socket */
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -510,7 +1115,7 @@ int main(int argc, char **argv) {
     memset(&addr,0,sizeof(addr));
     addr.sin_family = AF_INET; addr.sin_addr.s_addr = INADDR_ANY; addr.sin_port = htons(LISTEN_PORT);
     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(listen_fd, 128) < 0) { perror("listen"); return 1; }
+    if (listen(listen_fd, LISTEN_BACKLOG) < 0) { perror("listen"); return 1; }
     if (set_nonblocking(listen_fd) < 0) { perror("set_nonblocking listen"); return 1; }
 
     epoll_fd = epoll_create1(0);
@@ -518,6 +1123,12 @@ int main(int argc, char **argv) {
     struct epoll_event ev;
     ev.data.fd = listen_fd; ev.events = EPOLLIN;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) { perror("epoll_ctl add listen"); return 1; }
+    if (unix_path) {
+        unix_fd = unix_listen(unix_path, LISTEN_BACKLOG);
+        if (unix_fd < 0) { log_error("--unix %s: %s", unix_path, strerror(errno)); log_shutdown(); return 1; }
+        ev.data.fd = unix_fd; ev.events = EPOLLIN;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_fd, &ev) == -1) { perror("epoll_ctl add unix listen"); return 1; }
+    }
 
     /* start broker sender thread */
     pthread_t broker_tid;
@@ -526,28 +1137,29 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    fprintf(stderr, "[G] listening publishers on port %d\n", LISTEN_PORT);
+    log_info("listening publishers on port %d%s%s", LISTEN_PORT, unix_path ? " and " : "", unix_path ? unix_path : "");
 
     struct epoll_event events[MAX_EVENTS];
 
     while (keep_running) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, wheel_timeout_ms(&wheel, 1000));
         if (n < 0) {
             if (errno == EINTR) continue;
-            perror("epoll_wait");
+            log_error("epoll_wait: %s", strerror(errno));
             break;
         }
+        /* deadlines first: the events below are stamped with this tick */
+        wheel_advance(&wheel);
         for (int i = 0; i < n; ++i) {
             int fd = events[i].data.fd;
             uint32_t evs = events[i].events;
-            if (fd == listen_fd) {
-                accept_new(listen_fd);
+            if (fd == listen_fd || fd == unix_fd) {
+                accept_new(fd);
                 continue;
             }
-            struct conn *c = NULL;
-            if (fd >= 0 && fd < MAX_CONN) c = fd_map[fd];
+            struct conn *c = fdtab_get(&conns, fd);
             if (!c) {
-                fprintf(stderr, "[G] event for unknown fd=%d\n", fd);
+                log_warn("event for unknown fd=%d", fd);
                 if (evs & (EPOLLHUP|EPOLLERR)) { if (fd >= 0) close(fd); }
                 continue;
             }
@@ -556,16 +1168,10 @@ int main(int argc, char **argv) {
                 continue;
             }
             if (evs & EPOLLIN) {
-                int rr = read_into_conn(c);
-                if (rr == -2) { /* peer closed */
-                    close_conn_fd(fd);
-                    continue;
-                } else if (rr < 0) {
+                if (conn_read_input(c) < 0) { /* error or peer closed */
                     close_conn_fd(fd);
                     continue;
                 }
-                int pr = process_conn_incoming(c);
-                if (pr < 0) { close_conn_fd(fd); continue; }
             }
             if (evs & EPOLLOUT) {
                 if (flush_outbuf(c) < 0) { close_conn_fd(fd); continue; }
@@ -574,7 +1180,11 @@ int main(int argc, char **argv) {
     }
 
     /* shutdown */
-    fprintf(stderr, "[G] shutting down\n");
+    metrics_stop();
+    uint64_t ctl = metric_value(stats.epoll_ctl), pubs = metric_value(stats.msgs_in);
+    log_info("%llu epoll_ctl calls for %llu PUBs (%.4f per message)",
+             (unsigned long long)ctl, (unsigned long long)pubs, pubs ? (double)ctl / pubs : 0.0);
+    log_info("shutting down");
     /* wake broker thread to finish */
     pthread_mutex_lock(&msg_queue.lock);
     keep_running = 0;
@@ -582,9 +1192,13 @@ int main(int argc, char **argv) {
     pthread_mutex_unlock(&msg_queue.lock);
     pthread_join(broker_tid, NULL);
 
+    /* close all conns */
+    for (unsigned int i = 0; i < conns.size; i++) if (conns.slot[i]) close_conn_fd((int)i);
+    fdtab_free(&conns);
+    slab_destroy(&conn_slab);
     if (listen_fd >= 0) close(listen_fd);
+    unix_unlisten(unix_fd, unix_path);
     if (epoll_fd >= 0) close(epoll_fd);
-    /* close all conns */
-    for (int i=0;i<MAX_CONN;i++) if (fd_map[i]) close_conn_fd(i);
+    log_shutdown();
     return 0;
 }
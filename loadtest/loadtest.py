@@ -11,6 +11,10 @@ Los publishers usan el protocolo:
   PUB <topic> <len>\n
   [4-byte BE len][payload JSON bytes]
 
+Con -b/--batch N agrupan N mensajes en un solo MPUB (un OK por lote):
+  MPUB <n> <bytes>\n
+  [4-byte BE bytes][n x (u16 topic_len, topic, u32 len, payload)]
+
 El payload JSON contiene campo "ts" en milisegundos (epoch ms) para medir latencia.
 """
 import argparse
@@ -53,7 +57,34 @@ def read_line(sock, timeout=5.0):
         return None
     return data.decode().strip()
 
-def publisher_thread(thread_id, host, port, messages, interval, results):
+def make_payload(node_id, thread_id, i):
+    payload = {
+        "node": node_id,
+        "ts": int(time.time() * 1000),
+        "topic": TOPIC,
+        "data": {"temp": 20 + (thread_id % 10), "hum": 30 + (i % 50)}
+    }
+    return json.dumps(payload, separators=(',', ':')).encode()
+
+def send_batches(s, thread_id, node_id, messages, batch, interval, results):
+    topic = TOPIC.encode()
+    for first in range(0, messages, batch):
+        n = min(batch, messages - first)
+        body = b''.join(struct.pack('!H', len(topic)) + topic + struct.pack('!I', len(pl)) + pl
+                        for pl in (make_payload(node_id, thread_id, i) for i in range(first, first + n)))
+        frame = f"MPUB {n} {len(body)}\n".encode() + struct.pack('!I', len(body)) + body
+        if not send_all(s, frame):
+            print(f"[P{thread_id}] send MPUB failed at msg {first}")
+            results['send_fail'] += 1
+            break
+        ok = read_line(s, timeout=1.0)
+        if ok != "OK":
+            print(f"[P{thread_id}] MPUB sin OK: {ok}")
+        results['sent'] += n
+        if interval > 0:
+            time.sleep(interval)
+
+def publisher_thread(thread_id, host, port, messages, interval, batch, results):
     node_id = f"lt-{thread_id}"
     try:
         s = socket.create_connection((host, port), timeout=5)
@@ -71,15 +102,11 @@ def publisher_thread(thread_id, host, port, messages, interval, results):
         print(f"[P{thread_id}] HELLO no OK: {resp}")
         s.close(); results['connect_fail'] += 1; return
     results['connected'] += 1
+    if batch > 1:
+        send_batches(s, thread_id, node_id, messages, batch, interval, results)
+        messages = 0
     for i in range(messages):
-        ts_ms = int(time.time() * 1000)
-        payload = {
-            "node": node_id,
-            "ts": ts_ms,
-            "topic": TOPIC,
-            "data": {"temp": 20 + (thread_id % 10), "hum": 30 + (i % 50)}
-        }
-        pl = json.dumps(payload, separators=(',', ':')).encode()
+        pl = make_payload(node_id, thread_id, i)
         header = f"PUB {TOPIC} {len(pl)}\n".encode()
         # send header
         if not send_all(s, header):
@@ -115,15 +142,18 @@ def main():
     parser.add_argument("-n", "--num", type=int, default=10, help="Número de publishers (hilos)")
     parser.add_argument("-m", "--msgs", type=int, default=10, help="Mensajes por publisher")
     parser.add_argument("-i", "--interval", type=float, default=0.1, help="Intervalo entre mensajes (s)")
+    parser.add_argument("-b", "--batch", type=int, default=1, help="Mensajes por MPUB (1 = PUB individual, máx. 256)")
     parser.add_argument("--host", type=str, default="127.0.0.1", help="Gateway host")
     parser.add_argument("--port", type=int, default=6000, help="Gateway port")
     args = parser.parse_args()
+    if not 1 <= args.batch <= 256:
+        parser.error("--batch debe estar entre 1 y 256")
 
     results = {'connected':0, 'connect_fail':0, 'sent':0, 'send_fail':0}
     threads = []
     start = time.time()
     for t in range(args.num):
-        th = threading.Thread(target=publisher_thread, args=(t, args.host, args.port, args.msgs, args.interval, results), daemon=True)
+        th = threading.Thread(target=publisher_thread, args=(t, args.host, args.port, args.msgs, args.interval, args.batch, results), daemon=True)
         th.start()
         threads.append(th)
         time.sleep(0.01)  # small stagger to avoid SYN bursts
@@ -133,7 +163,7 @@ def main():
 
     dur = time.time() - start
     print("=== Test finished ===")
-    print(f"Threads: {args.num}, Msgs/thread: {args.msgs}, interval: {args.interval}s")
+    print(f"Threads: {args.num}, Msgs/thread: {args.msgs}, interval: {args.interval}s, batch: {args.batch}")
     print(f"Connected: {results['connected']}, connect_fail: {results['connect_fail']}")
     print(f"Sent messages: {results['sent']}, send_fail: {results['send_fail']}")
     print(f"Duration: {dur:.2f}s, throughput (msg/s): {results['sent']/dur:.2f}")
@@ -0,0 +1,645 @@
+#!/usr/bin/env python3
+# tests/scripts/check_broker.py
+# Starts its own brokerd on PORT (and PORT+1 when a check needs two) and
+# checks, one case per feature, what goes beyond a plain SUB/PUB. Prints
+# one line per check and exits 1 if any failed.
+#
+#   python3 check_broker.py [check ...]      (default: all)
+#   BROKERD=/path/to/brokerd BROKERD_ARGS="--backend uring" python3 check_broker.py
+import os, sys, socket, struct, json, time, ctypes, signal, shutil, subprocess, tempfile
+
+HOST = '127.0.0.1'
+PORT = 5100
+HERE = os.path.dirname(os.path.abspath(__file__))
+BROKERD = os.environ.get('BROKERD', os.path.join(HERE, '..', '..', 'broker', 'brokerd'))
+BROKERD_ARGS = os.environ.get('BROKERD_ARGS', '').split()
+TIMEOUT = 3.0
+
+
+# --- broker process and wire helpers ---
+
+def start_broker(*args, port=PORT):
+    log = open(os.path.join(tempfile.gettempdir(), 'check_broker.log'), 'a')
+    p = subprocess.Popen([BROKERD, *BROKERD_ARGS, *[str(a) for a in args], str(port)], stdout=log, stderr=log)
+    for _ in range(100):
+        try:
+            socket.create_connection((HOST, port)).close()
+            return p
+        except OSError:
+            if p.poll() is not None:
+                raise RuntimeError(f'brokerd exited with {p.returncode}')
+            time.sleep(0.05)
+    p.kill()
+    raise RuntimeError('brokerd did not start listening')
+
+def stop_broker(p):
+    p.send_signal(signal.SIGINT)
+    try:
+        p.wait(5)
+    except subprocess.TimeoutExpired:
+        p.kill()
+        p.wait()
+
+def connect(port=PORT):
+    s = socket.create_connection((HOST, port))
+    s.settimeout(TIMEOUT)
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return s
+
+def read_nbytes(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise ConnectionError("peer closed")
+        data += chunk
+    return data
+
+def read_line(sock):
+    data = b''
+    while not data.endswith(b'\n'):
+        c = sock.recv(1)
+        if not c:
+            raise ConnectionError("peer closed while reading line")
+        data += c
+    return data.decode(errors='replace').rstrip('\r\n')
+
+def expect(sock, want):
+    got = read_line(sock)
+    if got != want:
+        raise AssertionError(f'expected {want!r}, got {got!r}')
+
+def read_msg(sock):
+    (n,) = struct.unpack('!I', read_nbytes(sock, 4))
+    return read_nbytes(sock, n)
+
+def quiet(sock, wait=0.3):
+    """True if nothing arrives on sock within wait seconds"""
+    sock.settimeout(wait)
+    try:
+        return not sock.recv(1)
+    except socket.timeout:
+        return True
+    finally:
+        sock.settimeout(TIMEOUT)
+
+def drain(sock, wait=0.3):
+    out = []
+    sock.settimeout(wait)
+    try:
+        while True:
+            out.append(read_msg(sock))
+    except socket.timeout:
+        pass
+    finally:
+        sock.settimeout(TIMEOUT)
+    return out
+
+def pub(topic, payload, pid=None):
+    if isinstance(payload, str):
+        payload = payload.encode()
+    hdr = f'PUB {topic} {len(payload)}' + ('' if pid is None else f' {pid}') + '\n'
+    return hdr.encode() + struct.pack('!I', len(payload)) + payload
+
+def publisher(name='check-pub', port=PORT):
+    s = connect(port)
+    s.sendall(f'HELLO PUBLISHER {name}\n'.encode())
+    expect(s, 'OK')
+    return s
+
+def subscriber(filt, name='check-sub', port=PORT):
+    s = connect(port)
+    s.sendall(f'HELLO SUBSCRIBER {name}\nSUB {filt}\n'.encode())
+    expect(s, 'OK')
+    expect(s, 'OK')
+    return s
+
+def stats(port=PORT):
+    """the broker's metrics as {name: value}, through the STATS command"""
+    s = connect(port)
+    s.sendall(b'STATS\n')
+    n = int(read_line(s).split()[1])
+    text = read_nbytes(s, n).decode()
+    s.close()
+    out = {}
+    for l in text.splitlines():
+        if l and not l.startswith('#') and '{' not in l:
+            name, value = l.split()[:2]
+            out[name] = float(value)
+    return out
+
+def wait_for(cond, secs=5.0):
+    end = time.time() + secs
+    while time.time() < end:
+        if cond():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+# --- checks, in the order of the features; each runs its own broker ---
+
+CHECKS = {}
+
+def check(fn):
+    CHECKS[fn.__name__[len('check_'):]] = fn
+    return fn
+
+
+# slow consumers: outq watermarks and the per-subscriber POLICY
+
+def slow_reader(filt, policy):
+    # a tiny receive buffer so the broker's queue fills up fast
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    s.connect((HOST, PORT))
+    s.settimeout(TIMEOUT)
+    s.sendall(f'HELLO SUBSCRIBER check-slow\nPOLICY {policy}\nSUB {filt}\n'.encode())
+    for _ in range(3):
+        expect(s, 'OK')
+    return s
+
+def read_numbered(sock):
+    got = []
+    sock.settimeout(0.5)
+    try:
+        while True:
+            got.append(int(read_msg(sock).split(b':')[0]))
+    except (socket.timeout, ConnectionError):
+        pass
+    finally:
+        sock.settimeout(TIMEOUT)
+    return got
+
+@check
+def check_slow_consumer():
+    b = start_broker('--outq-high', '256k', '--outq-low', '128k')
+    try:
+        slow = {pol: slow_reader('t', pol) for pol in ('disconnect', 'drop-newest', 'drop-oldest')}
+        fast = subscriber('t')
+        p = publisher()
+        n, pad = 8000, 'x' * 1000
+        for k in range(0, n, 100):
+            p.sendall(b''.join(pub('t', f'{i}:{pad}') for i in range(k, k + 100)))
+            # a subscriber that keeps up loses nothing
+            for i in range(k, k + 100):
+                assert read_msg(fast).startswith(f'{i}:'.encode()), i
+        time.sleep(0.3)
+        got = {pol: read_numbered(s) for pol, s in slow.items()}
+        for pol, g in got.items():
+            assert g == sorted(g) and len(g) < n, (pol, len(g))
+        assert got['drop-newest'][0] == 0
+        assert got['drop-oldest'][-1] == n - 1
+        # dropping keeps the connection, disconnect closes it
+        for pol in ('drop-newest', 'drop-oldest'):
+            slow[pol].sendall(b'PING\n')
+            expect(slow[pol], 'PONG')
+        st = stats()
+        assert st['tinyiot_broker_slow_disconnects_total'] == 1, st
+        assert st['tinyiot_broker_dropped_messages_total'] > 0, st
+    finally:
+        stop_broker(b)
+
+
+# retained: the last value of every matching topic right after SUB
+
+@check
+def check_retained():
+    b = start_broker()
+    try:
+        p = publisher()
+        p.sendall(pub('home/1/t', 'old') + pub('home/1/t', '21') + pub('home/2/t', '19') +
+                  pub('office/t', '25') + b'PING\n')
+        expect(p, 'PONG')
+        s = subscriber('home/1/t')
+        assert drain(s) == [b'21']
+        w = subscriber('home/+/t')
+        assert sorted(drain(w)) == [b'19', b'21']
+        a = subscriber('#')
+        assert sorted(drain(a)) == [b'19', b'21', b'25']
+        # then live, once
+        p.sendall(pub('home/2/t', '20'))
+        assert read_msg(w) == b'20' and read_msg(a) == b'20'
+        assert quiet(s) and quiet(w)
+    finally:
+        stop_broker(b)
+    b = start_broker('--retain-max', '0')
+    try:
+        p = publisher()
+        p.sendall(pub('home/1/t', '21') + b'PING\n')
+        expect(p, 'PONG')
+        assert quiet(subscriber('home/#'))
+    finally:
+        stop_broker(b)
+
+
+# journal: FROM replay across a restart, segment retention
+
+@check
+def check_journal_replay():
+    d = tempfile.mkdtemp(prefix='check-journal-')
+    args = ('--journal', d, '--journal-segment', '64k')
+    try:
+        b = start_broker(*args)
+        try:
+            p = publisher()
+            p.sendall(b''.join(pub(f'j/{i % 3}', f'r{i}') for i in range(1000)))
+            p.sendall(pub('j/0', 'last', pid=1))
+            expect(p, 'PUBACK 1')
+            s = subscriber('j/1 FROM 0')
+            want = [f'r{i}'.encode() for i in range(1000) if i % 3 == 1]
+            assert [read_msg(s) for _ in range(len(want))] == want
+            # history, then live without a gap
+            p.sendall(pub('j/1', 'live'))
+            assert read_msg(s) == b'live'
+            assert quiet(s)
+        finally:
+            stop_broker(b)
+        # the log survives a restart; offsets keep counting
+        b = start_broker(*args)
+        try:
+            s = subscriber('j/# FROM 998')
+            assert [read_msg(s) for _ in range(4)] == [b'r998', b'r999', b'last', b'live']
+            p = publisher()
+            p.sendall(pub('j/2', 'again'))
+            assert read_msg(s) == b'again'
+        finally:
+            stop_broker(b)
+    finally:
+        shutil.rmtree(d, ignore_errors=True)
+
+@check
+def check_journal_retain():
+    d = tempfile.mkdtemp(prefix='check-journal-')
+    try:
+        b = start_broker('--journal', d, '--journal-segment', '64k', '--journal-retain', '128k',
+                         '--journal-sync-ms', '5')
+        try:
+            p = publisher()
+            pad = 'x' * 200
+            n = 3000
+            for k in range(0, n, 100):
+                p.sendall(b''.join(pub('r/a', f'{i}:{pad}') for i in range(k, k + 100)))
+            p.sendall(pub('r/a', 'end', pid=1))
+            expect(p, 'PUBACK 1')
+            time.sleep(0.3)
+            segs = sorted(os.listdir(d))
+            assert segs[0] != '%020d.log' % 0, segs
+            oldest = int(segs[0][:-4])
+            # FROM below the oldest retained offset starts there
+            s = subscriber('r/a FROM 0')
+            first = read_msg(s)
+            assert int(first.split(b':')[0]) == oldest, (first[:16], oldest)
+        finally:
+            stop_broker(b)
+    finally:
+        shutil.rmtree(d, ignore_errors=True)
+
+
+# QoS 1: packet ids, ACK, redelivery after a reconnect; PUB ... ID
+
+def read_qos_msg(sock):
+    # QoS 1 delivery: 4-byte packet id, then the usual length + payload
+    (pid,) = struct.unpack('!I', read_nbytes(sock, 4))
+    return pid, read_msg(sock)
+
+@check
+def check_qos_redelivery():
+    b = start_broker('--qos-window', '8', '--retain-max', '0')
+    try:
+        s = connect()
+        s.sendall(b'HELLO SUBSCRIBER check-q1\nQOS 1\nSUB q/#\n')
+        for _ in range(3):
+            expect(s, 'OK')
+        p = publisher()
+        p.sendall(b''.join(pub('q/a', f'm{i}') for i in range(5)))
+        got = [read_qos_msg(s) for _ in range(5)]
+        assert [g[0] for g in got] == [1, 2, 3, 4, 5], got
+        s.sendall(b'ACK 2\n')      # cumulative: releases 1 and 2
+        time.sleep(0.1)
+        s.close()
+        time.sleep(0.2)
+        # same node id: the parked session resends what was not acked;
+        # subscriptions are not kept, so SUB again for new messages
+        s = connect()
+        s.sendall(b'HELLO SUBSCRIBER check-q1\nQOS 1\n')
+        expect(s, 'OK')
+        expect(s, 'OK')
+        got = [read_qos_msg(s) for _ in range(3)]
+        assert got == [(3, b'm2'), (4, b'm3'), (5, b'm4')], got
+        s.sendall(b'ACK 5\nSUB q/#\n')
+        expect(s, 'OK')
+        p.sendall(pub('q/a', 'after'))
+        got = read_qos_msg(s)
+        assert got == (6, b'after'), got
+        assert quiet(s)
+    finally:
+        stop_broker(b)
+
+@check
+def check_qos_session_ttl():
+    b = start_broker('--qos-session-ttl', '1')
+    try:
+        s = connect()
+        s.sendall(b'HELLO SUBSCRIBER check-q2\nQOS 1\nSUB q/#\n')
+        for _ in range(3):
+            expect(s, 'OK')
+        p = publisher()
+        p.sendall(pub('q/a', 'unacked'))
+        assert read_qos_msg(s) == (1, b'unacked')
+        s.close()
+        assert wait_for(lambda: stats().get('tinyiot_broker_qos_parked_sessions') == 1, 2)
+        # nothing else parks or claims a session: the tick expires it
+        assert wait_for(lambda: stats().get('tinyiot_broker_qos_parked_sessions') == 0, 4)
+    finally:
+        stop_broker(b)
+
+@check
+def check_puback():
+    b = start_broker()
+    try:
+        s = subscriber('ack/#')
+        p = publisher()
+        p.sendall(pub('ack/x', 'hello', pid=77))
+        expect(p, 'PUBACK 77')
+        assert read_msg(s) == b'hello'
+    finally:
+        stop_broker(b)
+
+
+# MPUB and the v2 binary framing
+
+def mpub(records, pid=None):
+    body = b''
+    for topic, payload in records:
+        t, p = topic.encode(), payload.encode()
+        body += struct.pack('!H', len(t)) + t + struct.pack('!I', len(p)) + p
+    hdr = f'MPUB {len(records)} {len(body)}' + ('' if pid is None else f' {pid}') + '\n'
+    return hdr.encode() + struct.pack('!I', len(body)) + body
+
+def v2_frame(op, ident, body, flags=0):
+    # 8-byte header: op, flags, alias/id, body length
+    return struct.pack('!BBHI', op, flags, ident, len(body)) + body
+
+V2_ALIAS, V2_PUB, V2_CMD, V2_MPUB = 1, 2, 3, 4
+V2_F_ACK = 1
+
+@check
+def check_mpub():
+    b = start_broker()
+    try:
+        s = subscriber('m/#')
+        p = publisher()
+        recs = [('m/a', '1'), ('m/b', '2'), ('x/y', '3'), ('m/a', '4')]
+        p.sendall(pub('m/z', 'before') + mpub(recs, pid=9) + pub('m/z', 'after'))
+        expect(p, 'PUBACK 9')
+        got = [read_msg(s) for _ in range(5)]
+        assert got == [b'before', b'1', b'2', b'4', b'after'], got
+        e = connect()
+        e.sendall(mpub([('m/+', 'x')]))       # a filter is not a topic
+        assert read_line(e).startswith('ERR')
+    finally:
+        stop_broker(b)
+
+@check
+def check_v2():
+    b = start_broker()
+    try:
+        s = subscriber('t/#')
+        c = connect()
+        c.sendall(b'HELLO PUBLISHER check-v2 V2\n' +
+                  v2_frame(V2_ALIAS, 7, b't/a') + v2_frame(V2_ALIAS, 8, b't/b'))
+        expect(c, 'OK V2')
+        c.sendall(v2_frame(V2_PUB, 7, b'one') + v2_frame(V2_PUB, 8, b'two') +
+                  v2_frame(V2_PUB, 7, struct.pack('!I', 42) + b'three', V2_F_ACK))
+        assert [read_msg(s) for _ in range(3)] == [b'one', b'two', b'three']
+        expect(c, 'PUBACK 42')
+        body = struct.pack('!HI', 7, 2) + b'aa' + struct.pack('!HI', 8, 2) + b'bb'
+        c.sendall(v2_frame(V2_MPUB, 0, struct.pack('!I', 5) + body, V2_F_ACK))
+        expect(c, 'PUBACK 5')
+        assert [read_msg(s) for _ in range(2)] == [b'aa', b'bb']
+        c.sendall(v2_frame(V2_CMD, 0, b'PING'))
+        expect(c, 'PONG')
+        c.sendall(v2_frame(V2_PUB, 99, b'x'))  # alias never registered
+        assert read_line(c).startswith('ERR')
+    finally:
+        stop_broker(b)
+
+
+# per-connection timeouts and KEEPALIVE
+
+def closed_after(sock, secs):
+    """seconds until the broker closes sock, or None if it stays open"""
+    sock.settimeout(secs)
+    t0 = time.time()
+    try:
+        while sock.recv(4096):
+            pass
+        return time.time() - t0
+    except ConnectionResetError:
+        return time.time() - t0
+    except socket.timeout:
+        return None
+    finally:
+        sock.settimeout(TIMEOUT)
+
+@check
+def check_timeouts():
+    b = start_broker('--frame-timeout', '1', '--idle-timeout', '2')
+    try:
+        # a PUB whose body never completes
+        s = publisher()
+        s.sendall(b'PUB x/y 10\n' + struct.pack('!I', 10) + b'ab')
+        t = closed_after(s, 3)
+        assert t is not None and 0.7 < t < 2, t
+        # nothing at all after HELLO
+        s = publisher()
+        t = closed_after(s, 4)
+        assert t is not None and 1.5 < t < 3, t
+        # KEEPALIVE: a PING after a quiet second, closed if unanswered
+        s = connect()
+        s.sendall(b'HELLO SUBSCRIBER check-k\nKEEPALIVE 1\n')
+        expect(s, 'OK')
+        expect(s, 'OK')
+        expect(s, 'PING')
+        s.sendall(b'PONG\n')
+        expect(s, 'PING')
+        t = closed_after(s, 3)
+        assert t is not None and t < 1.5, t
+    finally:
+        stop_broker(b)
+
+
+# two brokers bridged on localhost
+
+@check
+def check_bridge():
+    a = start_broker('--node', 'check-a')
+    try:
+        b = start_broker('--node', 'check-b', '--peer', f'{HOST}:{PORT}', port=PORT + 1)
+        try:
+            assert wait_for(lambda: stats(PORT)['tinyiot_broker_bridge_links'] == 1 and
+                                    stats(PORT + 1)['tinyiot_broker_bridge_links'] == 1)
+            sa = subscriber('site/#', port=PORT)
+            sb = subscriber('site/+/x', port=PORT + 1)
+            time.sleep(0.3)            # let each SUB reach the other side
+            pa = publisher(port=PORT)
+            pb = publisher(port=PORT + 1)
+            pa.sendall(pub('site/a/x', 'from-a'))
+            pb.sendall(pub('site/b/x', 'from-b'))
+            # every message once on each side, none looped back
+            assert sorted(drain(sa)) == [b'from-a', b'from-b']
+            assert sorted(drain(sb)) == [b'from-a', b'from-b']
+            # no interest on A for other/#: B keeps it
+            sent = stats(PORT + 1)['tinyiot_broker_bridge_forwarded_total']
+            pb.sendall(pub('other/t', 'local') + b'PING\n')
+            expect(pb, 'PONG')
+            assert stats(PORT + 1)['tinyiot_broker_bridge_forwarded_total'] == sent
+        finally:
+            stop_broker(b)
+    finally:
+        stop_broker(a)
+
+
+# $share groups
+
+@check
+def check_shared():
+    b = start_broker('--share-policy', 'round-robin')
+    try:
+        members = [subscriber('$share/g/s/#', f'check-m{i}') for i in range(2)]
+        plain = subscriber('s/#')
+        p = publisher()
+        n = 40
+        p.sendall(b''.join(pub('s/t', f'v{i}') for i in range(n)))
+        want = [f'v{i}'.encode() for i in range(n)]
+        assert [read_msg(plain) for _ in range(n)] == want
+        got = [drain(m) for m in members]
+        # every message to exactly one member, split by turn
+        assert sorted(got[0] + got[1], key=want.index) == want, got
+        assert len(got[0]) == len(got[1]) == n // 2, [len(g) for g in got]
+    finally:
+        stop_broker(b)
+
+
+# WHERE content filters
+
+@check
+def check_where():
+    b = start_broker()
+    try:
+        hot = subscriber('sensors/+/t WHERE data.temp > 35')
+        p = publisher()
+        for temp in (20, 50, 36, 35):
+            p.sendall(pub('sensors/a/t', json.dumps({"data": {"temp": temp}})))
+        p.sendall(pub('sensors/a/t', 'not json'))
+        got = [json.loads(m)['data']['temp'] for m in drain(hot)]
+        assert got == [50, 36], got
+    finally:
+        stop_broker(b)
+
+
+# the AF_UNIX listener next to TCP
+
+def connect_unix(path):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    s.settimeout(TIMEOUT)
+    return s
+
+@check
+def check_unix():
+    d = tempfile.mkdtemp(prefix='check-unix-')
+    path = os.path.join(d, 'check.sock')
+    try:
+        b = start_broker('--unix', path)
+        try:
+            u = connect_unix(path)
+            u.sendall(b'HELLO SUBSCRIBER check-u\nSUB u/#\n')
+            expect(u, 'OK')
+            expect(u, 'OK')
+            p = publisher()
+            p.sendall(pub('u/a', 'tcp->unix'))
+            assert read_msg(u) == b'tcp->unix'
+            s = subscriber('v/#')
+            up = connect_unix(path)
+            up.sendall(b'HELLO PUBLISHER check-up\n')
+            expect(up, 'OK')
+            up.sendall(pub('v/a', 'unix->tcp'))
+            assert read_msg(s) == b'unix->tcp'
+        finally:
+            stop_broker(b)
+        assert not os.path.exists(path)
+    finally:
+        shutil.rmtree(d, ignore_errors=True)
+
+
+# shared-memory rings, read through shmring.c's reader API
+
+class ShmMsg(ctypes.Structure):
+    _fields_ = [('topic', ctypes.c_void_p), ('topic_len', ctypes.c_size_t),
+                ('payload', ctypes.c_void_p), ('len', ctypes.c_uint32),
+                ('seq', ctypes.c_uint64), ('ts_ns', ctypes.c_uint64), ('ring', ctypes.c_int)]
+
+def shm_lib(d):
+    # shmring.c only needs libc: build the reader into a .so for ctypes
+    so = os.path.join(d, 'shmring.so')
+    subprocess.check_call(['gcc', '-shared', '-fPIC', '-O2', '-pthread', '-o', so,
+                           os.path.join(HERE, '..', '..', 'broker', 'src', 'shmring.c')])
+    lib = ctypes.CDLL(so)
+    lib.shm_reader_open.restype = ctypes.c_void_p
+    lib.shm_reader_open.argtypes = [ctypes.c_char_p]
+    lib.shm_reader_next.argtypes = [ctypes.c_void_p, ctypes.POINTER(ShmMsg), ctypes.c_int]
+    lib.shm_reader_close.argtypes = [ctypes.c_void_p]
+    return lib
+
+@check
+def check_shm():
+    d = tempfile.mkdtemp(prefix='check-shm-')
+    name = f'check-shm-{os.getpid()}'
+    try:
+        lib = shm_lib(d)
+        b = start_broker('--shm', name, '--shm-size', '64k')
+        try:
+            r = lib.shm_reader_open(name.encode())
+            assert r, 'shm_reader_open failed'
+            p = publisher()
+            sent = [('a/b', b'one'), ('z/nobody', b'two'), ('a/c', b'{"t":3}')]
+            p.sendall(b''.join(pub(t, v) for t, v in sent))
+            m, got, seqs = ShmMsg(), [], []
+            for _ in sent:
+                assert lib.shm_reader_next(r, ctypes.byref(m), 1000) == 1
+                got.append((ctypes.string_at(m.topic, m.topic_len).decode(),
+                            ctypes.string_at(m.payload, m.len)))
+                seqs.append(m.seq)
+            # every message, subscribed or not, in order
+            assert got == sent, got
+            assert seqs == sorted(seqs) and len(set(seqs)) == 3, seqs
+        finally:
+            stop_broker(b)
+        # the broker is gone: the reader is told so
+        assert lib.shm_reader_next(r, ctypes.byref(m), 1000) == -1
+        lib.shm_reader_close(r)
+    finally:
+        shutil.rmtree(d, ignore_errors=True)
+
+
+
+
+def main():
+    names = sys.argv[1:] or list(CHECKS)
+    failed = 0
+    for name in names:
+        if name not in CHECKS:
+            print(f'unknown check {name}; have: {" ".join(CHECKS)}')
+            return 2
+        try:
+            CHECKS[name]()
+            print(f'ok   {name}')
+        except Exception as e:
+            failed += 1
+            print(f'FAIL {name}: {type(e).__name__}: {e}')
+    return 1 if failed else 0
+
+if __name__ == "__main__":
+    sys.exit(main())